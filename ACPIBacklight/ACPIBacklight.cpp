@@ -23,12 +23,18 @@
 #include <IOKit/IOService.h>
 #include <IOKit/pci/IOPCIDevice.h>
 #include <libkern/version.h>
+#include <libkern/OSAtomic.h>
 
 #include <IOKit/IONVRAM.h>
 #include <IOKit/IOLib.h>
+#include <IOKit/pwr_mgt/IOPM.h>
+#include <mach/thread_policy.h>
 #include "ACPIBacklight.h"
 #include "Debug.h"
 
+// exported to kexts through com.apple.kpi.unsupported, but not declared in Kernel.framework
+extern "C" kern_return_t thread_policy_set(thread_t thread, thread_policy_flavor_t flavor, thread_policy_t policy_info, mach_msg_type_number_t count);
+
 //REVIEW: avoids problem with Xcode 5.1.0 where -dead_strip eliminates these required symbols
 #include <libkern/OSKextLib.h>
 void* _org_rehabman_dontstrip_[] =
@@ -40,7 +46,9 @@ void* _org_rehabman_dontstrip_[] =
 
 OSDefineMetaClassAndStructors(ACPIBacklightPanel, IODisplayParameterHandler)
 
-#define kACPIBacklightLevel "acpi-backlight-level"
+#define kACPIBacklightLevel "acpi-backlight-level"   // level only, still written for older versions
+#define kACPIBacklightState "acpi-backlight-state"
+#define kStateVersion 1
 #define kRawBrightness "RawBrightness"
 
 #define kBacklightLevelMin  0
@@ -50,24 +58,131 @@ OSDefineMetaClassAndStructors(ACPIBacklightPanel, IODisplayParameterHandler)
 #define kSmoothStep "SmoothStep%d"
 #define kSmoothTimeout "SmoothTimeout%d"
 #define kSmoothBufSize 16
+#define kSmoothEasing "SmoothEasing"
+#define kSmoothMode "SmoothMode"
+#define kSpringOmega "SpringOmega"
+#define kSmoothPacing "SmoothPacing"
+#define kFramePeriod "FramePeriod"
+
+#define kBrightnessTarget "BrightnessTarget"
+
+#define kProfileUp "Profile%sUp"
+#define kProfileDown "Profile%sDown"
+#define kProfileMin "Profile%sMin"
+#define kProfileEasing "Profile%sEasing"
+#define kProfileBufSize 32
+#define kEasingDefault 0xFF
+#define kProfileTimeMax 60000           // ms, keeps (t << 16) in buildTrajectory and the timer's us argument in range
+
+// requests closer than this are a slider drag, and requests within kWakeWindow after wake use the wake profile
+#define kSliderInterval 150000000ULL    // ns
+#define kWakeWindow 2000000000ULL       // ns
+#define kPersistInterval "PersistInterval"
+#define kPersistIntervalMax 3600000     // ms, keeps the timer's us argument within 32 bits
+
+// spring limits: omega range, integration substeps small enough to stay stable at any
+// tick (frame paced or long SmoothTimeout0), and a transition is forced to its target
+// after kSpringMaxTime
+#define kSpringOmegaMin 1
+#define kSpringOmegaMax 50
+#define kSpringMaxTime 2000000      // us
+#define kSpringStepMax 500000       // w*dt (rad/s * us) per substep, i.e. w*dt <= 0.5
+
+#define kWorkLoopPriority "WorkLoopPriority"
+
+#define kBackendProbe "Backend Probe"
+#define kNVRAMRead "NVRAM Read"
+#define kProbeIterations 4
 
 #define countof(x) (sizeof(x)/sizeof(x[0]))
 #define abs(x) ((x) < 0 ? -(x) : (x));
 
-struct SmoothData
+// easing curves, t and result are 16.16 fixed point in [0,1]
+static UInt32 ease(UInt32 easing, UInt32 t)
 {
-    int delta;
-    int step;
-    int timeout;
-};
+    switch (easing)
+    {
+        case 1: // ease-in-out (smoothstep)
+            return (UInt32)(((UInt64)t * t * (3*0x10000 - 2*t)) >> 32);
+
+        case 2: // exponential ease-out: (1 - 2^(-10t)) / (1 - 2^-10)
+        {
+            // 2^(-i/16) for i = 0..16, 16.16
+            static const UInt32 pow2[] =
+            {
+                0x10000, 0xf525, 0xeac1, 0xe0cd, 0xd745, 0xce25, 0xc567, 0xbd09,
+                0xb505, 0xad58, 0xa5ff, 0x9ef5, 0x9838, 0x91c4, 0x8b96, 0x85ab, 0x8000,
+            };
+            UInt32 x = 10 * t;  // exponent, 16.16
+            UInt32 i = x >> 16, f = x & 0xFFFF;
+            UInt32 j = f >> 12, r = f & 0xFFF;
+            UInt32 p = pow2[j] - (((pow2[j] - pow2[j+1]) * r) >> 12);
+            p >>= i;
+            return (UInt32)(((UInt64)(0x10000 - p) << 16) / (0x10000 - (0x10000 >> 10)));
+        }
+    }
+    return t; // linear
+}
+
+static inline UInt64 uptimeNS()
+{
+    UInt64 abstime, ns;
+    clock_get_uptime(&abstime);
+    absolutetime_to_nanoseconds(abstime, &ns);
+    return ns;
+}
+
+// CRC-32 (IEEE, reflected), bitwise: only ever run over a few bytes
+static UInt32 crc32(const void* buf, size_t len)
+{
+    const UInt8* p = (const UInt8*)buf;
+    UInt32 crc = 0xFFFFFFFF;
+    while (len--)
+    {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
 
-struct SmoothData smoothData[] =
+// default tiers, each panel works from its own copy in PanelConfig
+static const SmoothData smoothData[] =
 {
     0x10,   1,  10000,
     0x40,   4,  10000,
     0xFFFF, 16, 10000,
 };
 
+// indexed by ACPIBacklightPanel::kSite*
+static const char* siteNames[] =
+{
+    "doIntegerSet", "setDisplay", "doUpdate", "setBrightnessLevelSmooth",
+    "onSmoothTimer", "scheduleWork", "processWorkQueue", "setProperties",
+    "commit", "powerSourceChanged", "powerInterest", "setBrightnessDeadline",
+};
+
+
+#ifdef DEBUG
+// indexed by ACPIBacklightPanel::kInvariant*
+static const char* invariantNames[] =
+{
+    "Out Of Range", "Overshoot", "Trajectory",
+};
+#endif
+
+// indexed by ACPIBacklightPanel::kProfile*
+static const char* profileNames[] = { "Key", "Slider", "Restore", "Wake", "Power", };
+
+static const SmoothProfile defaultProfiles[] =
+{
+    { 1000, 1600, 100, kEasingDefault },    // Key: quick, but dimming slower than brightening
+    { 300,  300,  0,   0 },                 // Slider: follow the drag closely (linear)
+    { 0,    0,    0,   kEasingDefault },    // Restore: original smoothData tiers
+    { 50,   50,   0,   kEasingDefault },    // Wake: near-instant
+    { 2000, 2000, 500, 1 },                 // Power: long ease-in-out fade
+};
+
 #pragma mark -
 #pragma mark IOService functions override
 #pragma mark -
@@ -88,12 +203,73 @@ bool ACPIBacklightPanel::init()
     _workSource = NULL;
     _smoothTimer = NULL;
     _cmdGate = NULL;
+    _workLoop = NULL;
+    _signalLock = IOLockAlloc();
+    if (!_signalLock)
+        return false;
+    _workLoopPriority = 0;
+    bzero(&_commandDelay, sizeof(_commandDelay));
+    bzero(&_timerDelay, sizeof(_timerDelay));
+    bzero(_siteStats, sizeof(_siteStats));
+    _amlMethod = NULL;
+    _amlTime = 0;
+    _workScheduled = 0;
+    _siteStatsPublished = 0;
+    _persistTimer = NULL;
+    _persistDirty = 0;
+    bzero(&_persistedRecord, sizeof(_persistedRecord));
+    _restoredBackend = -1;
+    _restoredFingerprint = 0;
+    _migrateLevel = false;
+    _saved_value = -1;
+    _persistedSAVE = 0xFFFFFFFF;
+    _persistedLevel = 0xFFFFFFFF;
+    _lastFlush = 0;
+    _persistArmed = false;
+    _persistFlushes = _persistForced = _nvramWrites = _saveWrites = _persistSkipped = 0;
 
     _extended = false;
-    _options = 0;
-    _lock = NULL;
+    _commands = NULL;
+    _ready = false;
+    _lastTarget = 0;
+    _posted = _applied = 0;
+    _requestsAccepted = _requestsCoalesced = _requestsApplied = 0;
+    _backendWrites = 0;
+    _stateSeq = 0;
+    _rawValue = 0;
+    bzero(&_state, sizeof(_state));
+    _trajectoryCount = _trajectoryIndex = 0;
+    _trajectoryFrom = 0;
+#ifdef DEBUG
+    bzero(_invariantViolations, sizeof(_invariantViolations));
+#endif
+    _smoothWakeups = _smoothWrites = _smoothRetargets = 0;
+    _springPos = _springVel = 0;
+    _springTicks = 0;
+    _lastWriteFrame = 0;
+    _frameDoubles = _frameGaps = 0;
+    _activeProfile = kProfileKey;
+    _lastRequest = _wakeTime = 0;
+    _sleepWakeNotifier = NULL;
+    _powerSourceNotifier = NULL;
+    _powerSourceInterest = NULL;
+    _onAC = -1;
+    _sourceLevels[0] = _sourceLevels[1] = -1;
+    _writeCost = 0;
+    _deadline = 0;
+    _deadlinesMet = _deadlinesMissed = 0;
+    _deadlineLateness = 0;
 
     _backlightHandler = NULL;
+    _backend = kBackendHandler;
+
+    _options = 0;
+    bzero(&_handlerParams, sizeof(_handlerParams));
+    _retired = NULL;
+    _config = copyConfig(NULL);
+    if (!_config)
+        return false;
+    _framePeriod = _config->framePeriod * 1000ULL;
 
 	return super::init();
 }
@@ -126,10 +302,6 @@ bool ACPIBacklightPanel::start( IOService * provider )
     _provider->retain();
 #endif
 
-    _lock = IORecursiveLockAlloc();
-    if (!_lock)
-        return false;
-    
     findDevices(provider);
 
     getDeviceControl();
@@ -142,28 +314,42 @@ bool ACPIBacklightPanel::start( IOService * provider )
         return false;
     }
 
+    // private workloop for the event sources below (getWorkLoop returns it)
+    _workLoop = IOWorkLoop::workLoop();
+    if (!_workLoop)
+        return false;
+    if (OSNumber* num = OSDynamicCast(OSNumber, getProperty(kWorkLoopPriority)))
+        _workLoopPriority = (SInt32)num->unsigned32BitValue();
+    if (_workLoopPriority)
+    {
+        thread_precedence_policy_data_t policy = { _workLoopPriority };
+        kern_return_t kr = thread_policy_set(_workLoop->getThread(), THREAD_PRECEDENCE_POLICY, (thread_policy_t)&policy, THREAD_PRECEDENCE_POLICY_COUNT);
+        if (KERN_SUCCESS != kr)
+            IOLog("ACPIBacklight: unable to set workloop priority %d (%d)\n", (int)_workLoopPriority, kr);
+    }
+    setProperty(kWorkLoopPriority, _workLoopPriority, 32);
+
     // add interrupt source for delayed actions...
     _workSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &ACPIBacklightPanel::processWorkQueue));
     if (!_workSource)
         return false;
     IOWorkLoop* workLoop = getWorkLoop();
-    if (!workLoop)
-    {
-        _workSource->release();
-        _workSource = NULL;
-        return false;
-    }
     workLoop->addEventSource(_workSource);
     _workPending = 0;
 
     // add timer for smooth fade ins
-    if (_extended && !(_options & kDisableSmooth))
+    // (_BCM only panels step through the _BCL levels, paced by the measured _BCM cost)
+    if (!(_options & kDisableSmooth))
     {
         _smoothTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ACPIBacklightPanel::onSmoothTimer));
         if (_smoothTimer)
             workLoop->addEventSource(_smoothTimer);
     }
 
+    _persistTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ACPIBacklightPanel::onPersistTimer));
+    if (_persistTimer)
+        workLoop->addEventSource(_persistTimer);
+
     _cmdGate = IOCommandGate::commandGate(this);
     if (_cmdGate)
         workLoop->addEventSource(_cmdGate);
@@ -172,25 +358,43 @@ bool ACPIBacklightPanel::start( IOService * provider )
     OSDictionary* dict = getPropertyTable();
     setPropertiesGated(dict);
 
-    // write current values from smoothData
-    for (int i = 0; i < countof(smoothData); i++)
+    // write current values from the panel config
+    const PanelConfig* config = _config;
+    for (int i = 0; i < kSmoothTiers; i++)
     {
         char buf[kSmoothBufSize];
         snprintf(buf, sizeof(buf), kSmoothDelta, i);
-        setProperty(buf, smoothData[i].delta, 32);
+        setProperty(buf, config->tiers[i].delta, 32);
         snprintf(buf, sizeof(buf), kSmoothStep, i);
-        setProperty(buf, smoothData[i].step, 32);
+        setProperty(buf, config->tiers[i].step, 32);
         snprintf(buf, sizeof(buf), kSmoothTimeout, i);
-        setProperty(buf, smoothData[i].timeout, 32);
+        setProperty(buf, config->tiers[i].timeout, 32);
+    }
+    setProperty(kSmoothEasing, config->easing, 32);
+    setProperty(kSmoothMode, config->smoothMode, 32);
+    setProperty(kSpringOmega, config->springOmega, 32);
+    setProperty(kSmoothPacing, config->pacing, 32);
+    setProperty(kFramePeriod, config->framePeriod, 32);
+    setProperty(kPersistInterval, config->persistInterval, 32);
+    for (int i = 0; i < kProfileCount; i++)
+    {
+        char buf[kProfileBufSize];
+        snprintf(buf, sizeof(buf), kProfileUp, profileNames[i]);
+        setProperty(buf, config->profiles[i].up, 32);
+        snprintf(buf, sizeof(buf), kProfileDown, profileNames[i]);
+        setProperty(buf, config->profiles[i].down, 32);
+        snprintf(buf, sizeof(buf), kProfileMin, profileNames[i]);
+        setProperty(buf, config->profiles[i].min, 32);
+        snprintf(buf, sizeof(buf), kProfileEasing, profileNames[i]);
+        setProperty(buf, config->profiles[i].easing, 32);
     }
 #ifdef DEBUG
     setProperty("CycleTest", 1, 32);
     setProperty("KLVX", 1, 32);
 #endif
 
-    IORecursiveLockLock(_lock);
-
     // make the service available for clients like 'ioio'...
+    // (requests arriving before the initial state is set up wait in the command queue)
     registerService();
 
     // load and set default brightness level
@@ -204,25 +408,18 @@ bool ACPIBacklightPanel::start( IOService * provider )
         waitForService(serviceMatching("BacklightHandler"));
     }
 
-    // after backlight handler is in place, now we can manipulate backlight level
-    UInt32 current = queryACPICurentBrightnessLevel();
-    setProperty(kRawBrightness, current, 32);
-#if 0
-    _provider->setProperty("AppleBacklightAtBoot", current, 32);
-    _provider->setProperty("AppleMaxBrightness", BCLlevels[BCLlevelsCount-1], 32);
-#endif
+    if (_cmdGate)
+        _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ACPIBacklightPanel::startGated), (void*)(uintptr_t)value);
+    else
+        startGated((void*)(uintptr_t)value);
 
-    _committed_value = _value = _from_value = levelForValue(current);
-    DbgLog("%s: current brightness: %d (%d)\n", this->getName(), _from_value, current);
-    if (-1 != value)
+    // wake and power source changes select their own transition profiles
+    _sleepWakeNotifier = registerPrioritySleepWakeInterest(&ACPIBacklightPanel::powerInterest, this);
+    if (OSDictionary* matching = serviceMatching("IOPMPowerSource"))
     {
-        _committed_value = value;
-        DbgLog("%s: setting to value from nvram %d\n", this->getName(), value);
-        setBrightnessLevelSmooth(value);
+        _powerSourceNotifier = addMatchingNotification(gIOFirstPublishNotification, matching, &ACPIBacklightPanel::powerSourcePublished, this);
+        matching->release();
     }
-    _saved_value = _committed_value;
-
-    IORecursiveLockUnlock(_lock);
 
     DbgLog("%s: min = %u, max = %u\n", this->getName(), min, max);
 
@@ -243,18 +440,90 @@ bool ACPIBacklightPanel::start( IOService * provider )
 	return true;
 }
 
+IOReturn ACPIBacklightPanel::startGated(void* nvramValue)
+{
+    UInt32 value = (UInt32)(uintptr_t)nvramValue;
+
+    // with both XBCM and native handler available, pick the faster one
+    if (useBacklightHandler())
+        probeBackends();
+
+    // after backlight handler is in place, now we can manipulate backlight level
+    UInt32 current = queryACPICurentBrightnessLevel();
+    _rawValue = current;
+#if 0
+    _provider->setProperty("AppleBacklightAtBoot", current, 32);
+    _provider->setProperty("AppleMaxBrightness", BCLlevels[BCLlevelsCount-1], 32);
+#endif
+
+    _committed_value = _value = _from_value = levelForValue(current);
+    _lastTarget = _value;
+    DbgLog("%s: current brightness: %d (%d)\n", this->getName(), _from_value, current);
+    if (-1 != value)
+    {
+        _committed_value = _lastTarget = value;
+        DbgLog("%s: setting to value from nvram %d\n", this->getName(), value);
+        setBrightnessLevelSmooth(value, kProfileRestore);
+    }
+    if (-1 == _saved_value)
+        _saved_value = _committed_value;
+    // level from before StateRecord: write it as a record
+    if (_migrateLevel)
+    {
+        markDirty(kPersistNVRAM);
+        _migrateLevel = false;
+    }
+    publishState();
+
+    // run anything posted while starting
+    _ready = true;
+    signalWork();
+
+    return kIOReturnSuccess;
+}
+
 void ACPIBacklightPanel::stop( IOService * provider )
 {
     DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
 
+    if (_sleepWakeNotifier)
+    {
+        _sleepWakeNotifier->remove();
+        _sleepWakeNotifier = NULL;
+    }
+    if (_powerSourceNotifier)
+    {
+        _powerSourceNotifier->remove();
+        _powerSourceNotifier = NULL;
+    }
+    if (_powerSourceInterest)
+    {
+        _powerSourceInterest->remove();
+        _powerSourceInterest = NULL;
+    }
+
+    // last chance for a level still waiting on the flush interval
+    if (_cmdGate && _ready)
+        _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ACPIBacklightPanel::flushGated));
+
+    // no more signals: a postCommand already signaling finishes first, later ones
+    // only queue (released below, or in free)
+    IOInterruptEventSource* workSource = NULL;
+    if (_signalLock)
+    {
+        IOLockLock(_signalLock);
+        workSource = _workSource;
+        _workSource = NULL;
+        IOLockUnlock(_signalLock);
+    }
+
     IOWorkLoop* workLoop = getWorkLoop();
     if (workLoop)
     {
-        if (_workSource)
+        if (workSource)
         {
-            workLoop->removeEventSource(_workSource);
-            _workSource->release();
-            _workSource = NULL;
+            workLoop->removeEventSource(workSource);
+            workSource->release();
         }
         if (_smoothTimer)
         {
@@ -262,6 +531,12 @@ void ACPIBacklightPanel::stop( IOService * provider )
             _smoothTimer->release();
             _smoothTimer = NULL;
         }
+        if (_persistTimer)
+        {
+            workLoop->removeEventSource(_persistTimer);
+            _persistTimer->release();
+            _persistTimer = NULL;
+        }
         if (_cmdGate)
         {
             workLoop->removeEventSource(_cmdGate);
@@ -271,11 +546,9 @@ void ACPIBacklightPanel::stop( IOService * provider )
     }
     _extended = false;
 
-    if (_lock)
-    {
-        IORecursiveLockFree(_lock);
-        _lock = NULL;
-    }
+    // nothing left to run them, release what is still queued
+    _ready = false;
+    freeCommands(takeCommands());
 
 #if 0
     OSSafeReleaseNULL(_provider);
@@ -307,6 +580,27 @@ void ACPIBacklightPanel::free()
 		delete[] BCLlevels;
         BCLlevels = NULL;
     }
+
+    reclaimConfigs();
+    if (_config)
+    {
+        IOFree(_config, sizeof(PanelConfig));
+        _config = NULL;
+    }
+
+    // anything posted after stop
+    freeCommands(takeCommands());
+    if (_signalLock)
+    {
+        IOLockFree(_signalLock);
+        _signalLock = NULL;
+    }
+
+    if (_workLoop)
+    {
+        _workLoop->release();
+        _workLoop = NULL;
+    }
 	
     if (_display)
     {
@@ -332,16 +626,107 @@ bool ACPIBacklightPanel::setBacklightHandler(BacklightHandler *handler, Backligh
 bool ACPIBacklightPanel::useBacklightHandler()
 {
     // do not allow setBacklightHandler with old PNLF patches
-    if (!(_options & kWaitForHandler))
+    UInt32 options = _options;
+    if (!(options & kWaitForHandler))
         return false;
 
     // do not allow setBacklightHandler on versions prior to 10.11 unless kForceUseHandler is set
-    if (version_major < 15 && !(_options & kForceUseHandler))
+    if (version_major < 15 && !(options & kForceUseHandler))
         return false;
 
     return true;
 }
 
+UInt64 ACPIBacklightPanel::probeBackend(UInt32 backend, UInt32 level, bool* correct)
+{
+    // write the level back several times and keep the best time
+    UInt64 best = ~0ULL;
+    *correct = true;
+    for (int i = 0; i < kProbeIterations; i++)
+    {
+        UInt64 start = uptimeNS();
+        bool ok = setBackendLevel(backend, level);
+        UInt64 elapsed = uptimeNS() - start;
+        if (elapsed < best)
+            best = elapsed;
+        // read-back must reflect what was written
+        if (!ok || queryBackendLevel(backend) != level)
+            *correct = false;
+    }
+    return best;
+}
+
+void ACPIBacklightPanel::probeBackends()
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    // only meaningful when XBCM and the native handler can both set the level
+    if (!_extended || !_backlightHandler || (_options & kDisableProbe))
+        return;
+
+    // current level is written back through each backend, so no visible change
+    UInt32 level = queryBackendLevel(kBackendHandler);
+    bool acpiOk = false, handlerOk = false;
+    UInt64 acpiTime = 0, handlerTime = 0;
+
+    // same _BCL, methods and native handler as when the state record was written:
+    // reuse its choice, only timing that backend (write cost paces transitions)
+    bool restored = -1 != _restoredBackend && _restoredFingerprint == stateFingerprint();
+    if (restored)
+        _backend = _restoredBackend;
+    if (!restored || kBackendACPI == _backend)
+        acpiTime = probeBackend(kBackendACPI, level, &acpiOk);
+    if (!restored || kBackendHandler == _backend)
+        handlerTime = probeBackend(kBackendHandler, level, &handlerOk);
+
+    // prefer a correct backend, then the faster one (handler if neither is correct)
+    if (!restored)
+    {
+        if (acpiOk && (!handlerOk || acpiTime < handlerTime))
+            _backend = kBackendACPI;
+        else
+            _backend = kBackendHandler;
+    }
+    _writeCost = kBackendACPI == _backend ? acpiTime : handlerTime;
+
+    if (OSDictionary* dict = OSDictionary::withCapacity(6))
+    {
+        if (!restored || kBackendACPI == _backend)
+        {
+            if (OSNumber* num = OSNumber::withNumber(acpiTime, 64))
+            {
+                dict->setObject("ACPI ns", num);
+                num->release();
+            }
+            dict->setObject("ACPI correct", acpiOk ? kOSBooleanTrue : kOSBooleanFalse);
+        }
+        if (!restored || kBackendHandler == _backend)
+        {
+            if (OSNumber* num = OSNumber::withNumber(handlerTime, 64))
+            {
+                dict->setObject("Handler ns", num);
+                num->release();
+            }
+            dict->setObject("Handler correct", handlerOk ? kOSBooleanTrue : kOSBooleanFalse);
+        }
+        if (OSString* str = OSString::withCString(kBackendACPI == _backend ? "ACPI" : "Handler"))
+        {
+            dict->setObject("Selected", str);
+            str->release();
+        }
+        dict->setObject("From NVRAM", restored ? kOSBooleanTrue : kOSBooleanFalse);
+        setProperty(kBackendProbe, dict);
+        dict->release();
+    }
+    if (restored)
+        IOLog("ACPIBacklight: using %s backend (from NVRAM, %lluns)\n",
+              kBackendACPI == _backend ? "ACPI" : "Handler", _writeCost);
+    else
+        IOLog("ACPIBacklight: using %s backend (ACPI %lluns%s, Handler %lluns%s)\n",
+              kBackendACPI == _backend ? "ACPI" : "Handler",
+              acpiTime, acpiOk ? "" : " incorrect", handlerTime, handlerOk ? "" : " incorrect");
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 #pragma mark -
 #pragma mark IODisplayParameterHandler functions override
@@ -386,13 +771,24 @@ bool ACPIBacklightPanel::setDisplay( IODisplay * display )
 {    
     DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
 
-    IORecursiveLockLock(_lock);
-
     // retain new display (also allow setting to same instance as previous)
     if (display)
         display->retain();
+    if (!postCommand(kCmdDisplay, 0, display))
+        OSSafeRelease(display);
+
+    return true;
+}
+
+void ACPIBacklightPanel::displayCommand(IODisplay* display)
+{
+    // reference from setDisplay is handed over to _display
     OSSafeRelease(_display);
     _display = display;
+    updateFramePeriod();
+    // display came or went (mode set, display sleep): registers behind the handler may be reset
+    if (_backlightHandler)
+        _backlightHandler->invalidateState();
     if (_display)
     {
         // automatically commit a non-zero value on display change
@@ -401,10 +797,6 @@ bool ACPIBacklightPanel::setDisplay( IODisplay * display )
         // update brightness levels
         doUpdate();
     }
-
-    IORecursiveLockUnlock(_lock);
-
-    return true;
 }
 
 
@@ -412,56 +804,71 @@ bool ACPIBacklightPanel::doIntegerSet( OSDictionary * params, const OSSymbol * p
 {
     bool result = true;
 
-    IORecursiveLockLock(_lock);
-    
     DbgLog("%s::%s(\"%s\", %d)\n", this->getName(), __FUNCTION__, paramName->getCStringNoCopy(), value);
     if ( gIODisplayBrightnessKey->isEqualTo(paramName))
     {   
-        //DbgLog("%s::%s(%s) map %d -> %d\n", this->getName(),__FUNCTION__, paramName->getCStringNoCopy(), value, indexForLevel(value));
-        //REVIEW: workaround for Yosemite DP...
-        if (value < 5 && _value > 5)
-        {
-            //REVIEW: copied from commit case below...
-            // setting to zero automatically commits prior value
-            UInt32 index = indexForLevel(_value);
-            _committed_value = _value;
-            // save to NVRAM in work loop
-            scheduleWork(kWorkSave|kWorkSetBrightness);
-            // save to BIOS nvram via ACPI
-            if (hasSaveMethod)
-                saveACPIBrightnessLevel(BCLlevels[index]);
-        }
+        // applied on the workloop, so the caller never waits on _BCM
         if (0xFF == value)
-        {
-            setBrightnessLevelSmooth(_saved_value);
             result = false;
-        }
         else
-        {
-            //REVIEW: end workaround...
-            setBrightnessLevelSmooth(value);
-            if (value > 5) // more hacks for Yosemite (don't save really low values)
-                _saved_value = value;
-        }
+            __atomic_store_n(&_lastTarget, value, __ATOMIC_RELAXED);
+        OSIncrementAtomic((volatile SInt32*)&_posted);
+        postCommand(kCmdBrightness, value);
     }
     else if (gIODisplayParametersCommitKey->isEqualTo(paramName))
     {
-        UInt32 index = indexForLevel(_value);
-        //DbgLog("%s::%s(%s) map %d -> %d\n", this->getName(),__FUNCTION__, paramName->getCStringNoCopy(), value, index);
-        _committed_value = _value;
-        IODisplay::setParameter(params, gIODisplayBrightnessKey, _committed_value);
-        // save to NVRAM in work loop
-        scheduleWork(kWorkSave|kWorkSetBrightness);
-        // save to BIOS nvram via ACPI
-        if (hasSaveMethod)
-            saveACPIBrightnessLevel(BCLlevels[index]);
+        // once every posted request is applied the snapshot is exact (covers 0xFF restore)
+        PanelState state;
+        readState(&state);
+        UInt32 posted = __atomic_load_n(&_posted, __ATOMIC_RELAXED);
+        UInt32 target = state.applied == posted ? state.target : __atomic_load_n(&_lastTarget, __ATOMIC_RELAXED);
+        IODisplay::setParameter(params, gIODisplayBrightnessKey, target);
+        postCommand(kCmdCommit);
     }
 
-    IORecursiveLockUnlock(_lock);
-
     return result;
 }
 
+void ACPIBacklightPanel::brightnessCommand(UInt32 value, UInt64 time)
+{
+    ++_applied;
+    //DbgLog("%s::%s(%d) map %d -> %d\n", this->getName(),__FUNCTION__, value, indexForLevel(value));
+    //REVIEW: workaround for Yosemite DP...
+    if (value < 5 && _value > 5)
+    {
+        //REVIEW: copied from commit case below...
+        // setting to zero automatically commits prior value
+        _committed_value = _value;
+        scheduleWork(kWorkSetBrightness);
+        // NVRAM and BIOS nvram (SAVE) are written behind
+        markDirty(kPersistNVRAM|kPersistSAVE);
+    }
+    UInt32 profile = profileForRequest(time);
+    if (0xFF == value)
+        setBrightnessLevelSmooth(_saved_value, kProfileRestore);
+    else
+    {
+        //REVIEW: end workaround...
+        setBrightnessLevelSmooth(value, profile);
+        if (value > 5) // more hacks for Yosemite (don't save really low values)
+            _saved_value = value;
+    }
+}
+
+void ACPIBacklightPanel::commitCommand(bool merged)
+{
+    //DbgLog("%s::%s() %d\n", this->getName(),__FUNCTION__, _value);
+    _committed_value = _value;
+    // caller replied with the last posted target; publish the real one if that differed
+    if (_display && _committed_value != __atomic_load_n(&_lastTarget, __ATOMIC_RELAXED))
+        doUpdate();
+    // merged with the brightness just applied: its transition already ends on this value
+    if (!merged)
+        scheduleWork(kWorkSetBrightness);
+    // NVRAM and BIOS nvram (SAVE) are written behind, not on the interactive path
+    markDirty(kPersistNVRAM|kPersistSAVE);
+}
+
 
 bool ACPIBacklightPanel::doDataSet( const OSSymbol * paramName, OSData * value )
 {
@@ -474,8 +881,8 @@ bool ACPIBacklightPanel::doUpdate( void )
 {
     DbgLog("enter %s::%s()\n", this->getName(),__FUNCTION__);
     bool result = false;
-
-    IORecursiveLockLock(_lock);
+    Hold hold;
+    beginHold(&hold, kSiteUpdate);
 
     OSDictionary* newDict = 0;
 	OSDictionary* allParams = OSDynamicCast(OSDictionary, _display->copyProperty(gIODisplayParametersKey));
@@ -527,8 +934,7 @@ bool ACPIBacklightPanel::doUpdate( void )
         result = true;
 	}
 
-    IORecursiveLockUnlock(_lock);
-
+    endHold(&hold);
     DbgLog("exit %s::%s()\n", this->getName(),__FUNCTION__);
     return result;
 }
@@ -687,16 +1093,17 @@ bool ACPIBacklightPanel::hasBacklightMethods(IOACPIPlatformDevice * acpiDevice)
         // get additional paramaters from ACPI PNLF device methods
         _options = 0;
         acpiDevice->evaluateInteger("XOPT", &_options);
-        _handlerParams._xrgl = -1;
-        acpiDevice->evaluateInteger("XRGL", &_handlerParams._xrgl);
-        _handlerParams._xrgh = -1;
-        acpiDevice->evaluateInteger("XRGH", &_handlerParams._xrgh);
-        _handlerParams._klvx = -1;
-        acpiDevice->evaluateInteger("KLVX", &_handlerParams._klvx);
-        _handlerParams._lmax = -1;
-        acpiDevice->evaluateInteger("LMAX", &_handlerParams._lmax);
-        _handlerParams._kpch = -1;
-        acpiDevice->evaluateInteger("KPCH", &_handlerParams._kpch);
+        BacklightHandlerParams* params = &_handlerParams;
+        params->_xrgl = -1;
+        acpiDevice->evaluateInteger("XRGL", &params->_xrgl);
+        params->_xrgh = -1;
+        acpiDevice->evaluateInteger("XRGH", &params->_xrgh);
+        params->_klvx = -1;
+        acpiDevice->evaluateInteger("KLVX", &params->_klvx);
+        params->_lmax = -1;
+        acpiDevice->evaluateInteger("LMAX", &params->_lmax);
+        params->_kpch = -1;
+        acpiDevice->evaluateInteger("KPCH", &params->_kpch);
     }
 
     if (!_extended)
@@ -785,7 +1192,9 @@ OSArray * ACPIBacklightPanel::queryACPISupportedBrightnessLevels()
     DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
     
 	OSObject * ret;
+    UInt64 start = uptimeNS();
 	backLightDevice->evaluateObject("_BCL", &ret);
+    noteAML("_BCL", start);
 	OSArray * data = OSDynamicCast(OSArray, ret);
 	if (data)
 	{
@@ -805,43 +1214,66 @@ void ACPIBacklightPanel::setACPIBrightnessLevel(UInt32 level)
 {
     //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
 
-    if (_backlightHandler)
+    UInt32 backend = _backlightHandler ? _backend : kBackendACPI;
+    UInt64 start = uptimeNS();
+    bool ok = setBackendLevel(backend, level);
+    ++_backendWrites;
+    // running average of write cost, used to pace deadline transitions
+    UInt64 elapsed = uptimeNS() - start;
+    _writeCost = _writeCost ? (_writeCost * 7 + elapsed) / 8 : elapsed;
+    if (ok)
+    {
+        // RawBrightness is refreshed from the state snapshot, no read back per write
+        _rawValue = level;
+#ifdef DEBUG
+        UInt32 current = queryBackendLevel(backend);
+        if (current != level)
+            DbgLog("%s: wrote %u, reads back %u\n", this->getName(), level, current);
+#endif
+#if 0
+        if (_provider)
+            _provider->setProperty("ApplePanelRawBrightness", current, 32);
+#endif
+    }
+}
+
+bool ACPIBacklightPanel::setBackendLevel(UInt32 backend, UInt32 level)
+{
+    if (kBackendHandler == backend)
     {
         //set backlight via native handler instead of ACPI...
         _backlightHandler->setBacklightLevel(level);
-
-        // just FYI... set RawBrightness property to actual current level
-        setProperty(kRawBrightness, queryACPICurentBrightnessLevel(), 32);
-        return;
+        return true;
     }
 
+    bool result = false;
 	OSObject * ret = NULL;
 	OSNumber * number = OSNumber::withNumber(level, 32);
     const char* method = _extended ? "XBCM" : "_BCM";
 
+    UInt64 start = uptimeNS();
 	if (number && kIOReturnSuccess == backLightDevice->evaluateObject(method, &ret, (OSObject**)&number, 1))
     {
+        noteAML(method, start);
         OSSafeRelease(ret);
-
-        ////DbgLog("%s: setACPIBrightnessLevel %s(%u)\n", this->getName(), method, level);
-
-        // just FYI... set RawBrightness property to actual current level
-        UInt32 current = queryACPICurentBrightnessLevel();
-        setProperty(kRawBrightness, current, 32);
-#if 0
-        if (_provider)
-            _provider->setProperty("ApplePanelRawBrightness", current, 32);
-#endif
+        ////DbgLog("%s: setBackendLevel %s(%u)\n", this->getName(), method, level);
+        result = true;
     }
     else
         IOLog("ACPIBacklight: Error in setACPIBrightnessLevel %s(%u)\n",  method, level);
     OSSafeRelease(number);
+    return result;
 }
 
 void ACPIBacklightPanel::setBrightnessLevel(UInt32 level)
 {
     //DbgLog("%s::%s(%d)\n", this->getName(), __FUNCTION__, level);
 
+    setACPIBrightnessLevel(rawForLevel(level));
+}
+
+UInt32 ACPIBacklightPanel::rawForLevel(UInt32 level)
+{
     UInt32 rem;
     UInt32 index = indexForLevel(level, &rem);
     UInt32 value = BCLlevels[index];
@@ -858,81 +1290,516 @@ void ACPIBacklightPanel::setBrightnessLevel(UInt32 level)
             //DbgLog("%s: diff=%d, rem=%d, value=%d\n", this->getName(), diff, rem, value);
         }
     }
-    setACPIBrightnessLevel(value);
+    return value;
+}
+
+UInt64 ACPIBacklightPanel::smoothDuration(int from, int to)
+{
+    int diff = abs(to - from);
+
+    // profile with explicit timing: full range time scaled by distance
+    const PanelConfig* config = _config;
+    const SmoothProfile* profile = &config->profiles[_activeProfile];
+    UInt32 full = to > from ? profile->up : profile->down;
+    if (full)
+    {
+        UInt64 ms = (UInt64)full * diff / kBacklightLevelMax;
+        if (ms < profile->min)
+            ms = profile->min;
+        return ms * 1000000ULL;
+    }
+
+    // otherwise total time the SmoothDelta/Step/Timeout tiers allot to move from -> to
+    const SmoothData* tiers = config->tiers;
+    int index = kSmoothTiers-1; // defensive
+    for (int i = 0; i < kSmoothTiers; i++)
+    {
+        if (diff <= tiers[i].delta)
+        {
+            index = i;
+            break;
+        }
+    }
+    UInt64 duration = 0;
+    for (; index >= 0 && diff > 0; index--)
+    {
+        // number of steps taken in this tier before dropping to the next
+        const SmoothData* data = &tiers[index];
+        int lower = index > 0 ? tiers[index-1].delta : 0;
+        int step = data->step > 0 ? data->step : 1;
+        int steps = (diff - lower + step - 1) / step;
+        if (steps < 0)
+            steps = 0;
+        diff -= steps * step;
+        duration += (UInt64)steps * data->timeout * 1000;
+    }
+    return duration;
+}
+
+void ACPIBacklightPanel::buildTrajectory(UInt64 start, UInt64 duration, UInt64 minSpacing)
+{
+    // sample the curve once per tick, but keep only points where the raw value changes
+    int from = _from_value;
+    _trajectoryFrom = from;
+    UInt64 tick = smoothTick();
+    UInt64 spacing = tick;
+    if (_writeCost > spacing)
+    {
+        // no point sampling faster than the backend can write (slow _BCM on
+        // EC backed panels; native handler writes are well under a tick)
+        spacing = _writeCost;
+        if (tick)
+            spacing = (spacing + tick - 1) / tick * tick;
+    }
+    if (minSpacing > spacing)
+    {
+        // deadline requests: no more points than the deadline needs
+        spacing = minSpacing;
+        if (tick)
+            spacing = (spacing + tick - 1) / tick * tick;
+    }
+    if (spacing * kTrajectoryMax < duration)
+    {
+        // whole number of ticks, so frame paced points still land one per frame
+        spacing = (duration + kTrajectoryMax - 1) / kTrajectoryMax;
+        if (tick)
+            spacing = (spacing + tick - 1) / tick * tick;
+    }
+    if (!spacing)
+        spacing = 1;
+    const PanelConfig* config = _config;
+    UInt32 easing = config->profiles[_activeProfile].easing;
+    if (easing >= kEasingCount)
+        easing = config->easing;
+
+    int count = 0;
+    UInt32 lastRaw = rawForLevel(from);
+    for (UInt64 t = spacing; count < kTrajectoryMax; t += spacing)
+    {
+        if (t > duration)
+            t = duration;
+        int level = _value;
+        if (t < duration)
+        {
+            SInt64 delta = (SInt64)(_value - from) * ease(easing, (UInt32)((t << 16) / duration));
+            level = from + (int)(delta / 0x10000);
+        }
+        UInt32 raw = rawForLevel(level);
+        if (raw != lastRaw)
+        {
+            TrajectoryPoint* point = &_trajectory[count++];
+            point->deadline = alignToFrame(start + t);
+            point->level = level;
+            point->raw = lastRaw = raw;
+        }
+        if (t >= duration)
+            break;
+    }
+    if (!count)
+    {
+        // no visible change on the way, still need to land on target
+        _trajectory[0].deadline = alignToFrame(start + spacing);
+        count = 1;
+    }
+    // make sure transition ends exactly at target
+    _trajectory[count-1].level = _value;
+    _trajectory[count-1].raw = rawForLevel(_value);
+    _trajectoryCount = count;
+    _trajectoryIndex = 0;
+}
+
+void ACPIBacklightPanel::armSmoothTimer()
+{
+    UInt64 now = uptimeNS();
+    UInt64 deadline = _trajectory[_trajectoryIndex].deadline;
+    _smoothTimer->setTimeoutUS(deadline > now ? (UInt32)((deadline - now) / 1000) : 0);
 }
 
-void ACPIBacklightPanel::setBrightnessLevelSmooth(UInt32 level)
+void ACPIBacklightPanel::setBrightnessLevelSmooth(UInt32 level, UInt32 profile)
 {
-    DbgLog("%s::%s(%d)\n", this->getName(), __FUNCTION__, level);
+    DbgLog("%s::%s(%d, %d)\n", this->getName(), __FUNCTION__, level, profile);
 
     //DbgLog("%s: _from_value=%d, _value=%d\n", this->getName(), _from_value, _value);
 
+    Hold hold;
+    beginHold(&hold, kSiteSmooth);
     if (_smoothTimer)
     {
-        IORecursiveLockLock(_lock);
-
-        if (level != _value)
+        if (level != _value && kSmoothModeSpring == _config->smoothMode)
         {
-            // find appropriate movemement params in smoothData
-            int diff = abs((int)level - _from_value);
-            _smoothIndex = countof(smoothData)-1; // defensive
-            for (int i = 0; i < countof(smoothData); i++)
+            // retarget keeps position and velocity, so speed stays continuous
+            bool start = (_from_value == _value);
+            _value = level;
+            _activeProfile = profile;
+            if (_deadline)
+                finishDeadline(false); // superseded
+            _springTicks = 0;
+            if (start)
             {
-                if (diff <= smoothData[i].delta)
-                {
-                    _smoothIndex = i;
-                    break;
-                }
+                startSmoothStats();
+                _springPos = (SInt64)_from_value << 16;
+                _springVel = 0;
+                onSmoothTimer();
             }
-            // kick off timer if not already started
+        }
+        else if (level != _value)
+        {
             bool start = (_from_value == _value);
             _value = level;
+            _activeProfile = profile;
+            if (_deadline)
+                finishDeadline(false); // superseded
+            UInt64 now = uptimeNS();
             if (start)
+            {
+                startSmoothStats();
+                // first step is taken immediately, as if one tick had passed
+                buildTrajectory(now - smoothTick(), smoothDuration(_from_value, _value));
                 onSmoothTimer();
+            }
+            else
+            {
+                // retarget: rebuild from current position, dropping the superseded target
+                UInt64 pending = _trajectoryIndex < _trajectoryCount ? _trajectory[_trajectoryIndex].deadline : now;
+                ++_smoothRetargets;
+                buildTrajectory(now, smoothDuration(_from_value, _value));
+                // keep the wakeup already due, so a stream of retargets (slider drag) still writes
+                if (pending < _trajectory[0].deadline)
+                    _trajectory[0].deadline = pending;
+                _smoothTimer->cancelTimeout();
+                armSmoothTimer();
+            }
         }
         else if (_from_value == _value)
         {
             // in the case of already set to that value, set it for sure
             setBrightnessLevel(_value);
         }
-
-        IORecursiveLockUnlock(_lock);
     }
     else
     {
         _from_value = _value = level;
         setBrightnessLevel(_value);
     }
+    endHold(&hold);
 }
 
 void ACPIBacklightPanel::onSmoothTimer()
 {
     //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
 
-    IORecursiveLockLock(_lock);
-
-    ////DbgLog("%s::%s(): _from_value=%d, _value=%d, _smoothIndex=%d\n", this->getName(), __FUNCTION__, _from_value, _value, _smoothIndex);
-
-    // adjust smooth index based on current delta
-    int diff = abs(_value - _from_value);
-    if (_smoothIndex > 0 && diff <= smoothData[_smoothIndex-1].delta)
-        --_smoothIndex;
-
-    // move _from_value in the direction of _value
-    SmoothData* data = &smoothData[_smoothIndex];
-    if (_value > _from_value)
-        _from_value = min(_value, _from_value + data->step);
+    // wait is measured from the deadline the timer was armed for
+    Hold hold;
+    bool armed = kSmoothModeCurve == _config->smoothMode && _trajectoryIndex < _trajectoryCount;
+    beginHold(&hold, kSiteTimer, armed ? _trajectory[_trajectoryIndex].deadline : 0);
+    if (kSmoothModeSpring == _config->smoothMode)
+        stepSpring();
+    else if (_trajectoryIndex < _trajectoryCount)
+    {
+        // a late timer skips ahead to the latest point already due
+        UInt64 now = uptimeNS();
+        if (now > _trajectory[_trajectoryIndex].deadline)
+            noteDelay(&_timerDelay, now - _trajectory[_trajectoryIndex].deadline);
+        while (_trajectoryIndex+1 < _trajectoryCount && _trajectory[_trajectoryIndex+1].deadline <= now)
+            ++_trajectoryIndex;
+
+        TrajectoryPoint* point = &_trajectory[_trajectoryIndex++];
+        ////DbgLog("%s::%s(): level=%d, raw=%d\n", this->getName(), __FUNCTION__, point->level, point->raw);
+        ++_smoothWakeups;
+        _from_value = point->level;
+        setACPIBrightnessLevel(point->raw);
+        noteSmoothWrite();
+        // set new timer if not reached desired brightness previously set
+        if (_trajectoryIndex < _trajectoryCount)
+            armSmoothTimer();
+        else
+        {
+            if (_deadline)
+            {
+                _deadlineLateness = (SInt64)(uptimeNS() - _deadline);
+                finishDeadline(_deadlineLateness <= 0);
+            }
+            publishSmoothStats();
+        }
+    }
+    publishState();
+#ifdef DEBUG
+    checkInvariants();
+#endif
+    endHold(&hold);
+}
+
+IOReturn ACPIBacklightPanel::setBrightnessDeadline(UInt32 level, UInt64 deadline)
+{
+    DbgLog("%s::%s(%d, %llu)\n", this->getName(), __FUNCTION__, level, deadline);
+
+    if (level > kBacklightLevelMax)
+        return kIOReturnBadArgument;
+    // spring mode has no fixed completion time
+    if (kSmoothModeSpring == _config->smoothMode)
+        return kIOReturnUnsupported;
+
+    Hold hold;
+    beginHold(&hold, kSiteDeadline);
+    IOReturn result = kIOReturnSuccess;
+    UInt64 now = uptimeNS();
+    if (_deadline)
+        finishDeadline(false); // superseded
+    if (!_smoothTimer || (int)level == _from_value)
+    {
+        _trajectoryCount = _trajectoryIndex = 0;
+        if (_smoothTimer)
+            _smoothTimer->cancelTimeout();
+        _from_value = _value = level;
+        setBrightnessLevel(_value);
+        if (uptimeNS() > deadline)
+            result = kIOReturnTimeout;
+        finishDeadline(kIOReturnSuccess == result);
+    }
+    else
+    {
+        // last write has to start one write cost before the deadline
+        UInt64 cost = _writeCost;
+        if (deadline < now + cost)
+        {
+            // cannot be met, get there as soon as possible
+            result = kIOReturnTimeout;
+            deadline = now + cost;
+        }
+        // fewest writes: one per distinct raw value on the way, fewer if the
+        // backend can't write that many before the deadline
+        UInt64 span = deadline - cost - now;
+        UInt64 steps = rawSteps(_from_value, level);
+        if (cost && span / cost < steps)
+            steps = span / cost;
+        if (!steps)
+            steps = 1;
+        bool start = (_from_value == _value);
+        _value = level;
+        _deadline = deadline;
+        if (start)
+            startSmoothStats();
+        buildTrajectory(now, span, span / steps);
+        _smoothTimer->cancelTimeout();
+        armSmoothTimer();
+    }
+    endHold(&hold);
+
+    return result;
+}
+
+UInt32 ACPIBacklightPanel::rawSteps(int from, int to)
+{
+    // distinct raw values passed going from -> to (not counting from itself)
+    int dir = to > from ? 1 : -1;
+    UInt32 steps = 0;
+    UInt32 raw = rawForLevel(from);
+    for (int level = from; level != to; )
+    {
+        level += dir;
+        UInt32 next = rawForLevel(level);
+        if (next != raw)
+            ++steps;
+        raw = next;
+    }
+    return steps;
+}
+
+void ACPIBacklightPanel::finishDeadline(bool met)
+{
+    _deadline = 0;
+    if (met)
+        ++_deadlinesMet;
     else
-        _from_value = max(_value, _from_value - data->step);
+        ++_deadlinesMissed;
 
-    // set new brigthness level
-    //DbgLog("%s::%s(): _from_value=%d, _value=%d\n", this->getName(), __FUNCTION__, _from_value, _value);
-    setBrightnessLevel(_from_value);
-    // set new timer if not reached desired brightness previously set
+    if (OSDictionary* dict = OSDictionary::withCapacity(3))
+    {
+        if (OSNumber* num = OSNumber::withNumber(_deadlinesMet, 32))
+        {
+            dict->setObject("Met", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_deadlinesMissed, 32))
+        {
+            dict->setObject("Missed", num);
+            num->release();
+        }
+        UInt64 late = _deadlineLateness > 0 ? _deadlineLateness / 1000 : 0;
+        if (OSNumber* num = OSNumber::withNumber(late, 64))
+        {
+            dict->setObject("Last Late us", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_writeCost / 1000, 64))
+        {
+            dict->setObject("Write Cost us", num);
+            num->release();
+        }
+        setProperty("Deadline Stats", dict);
+        dict->release();
+    }
+}
+
+void ACPIBacklightPanel::stepSpring()
+{
+    // semi-implicit Euler: a = w^2 (target - x) - 2 w v, one tick per call; only
+    // stable while w*dt stays below 1, so long ticks are split into substeps
+    SInt64 dt = smoothTick() / 1000;
+    SInt64 w = _config->springOmega;
+    SInt64 target = (SInt64)_value << 16;
+    if (dt > 0)
+    {
+        SInt64 substeps = (w * dt + kSpringStepMax - 1) / kSpringStepMax;
+        if (substeps < 1)
+            substeps = 1;
+        for (SInt64 i = 0; i < substeps; i++)
+        {
+            SInt64 h = dt * (i+1) / substeps - dt * i / substeps;
+            SInt64 accel = w * w * (target - _springPos) - 2 * w * _springVel;
+            _springVel += accel * h / 1000000;
+            _springPos += _springVel * h / 1000000;
+        }
+    }
+    ++_springTicks;
+
+    int level;
+    SInt64 dist = abs(target - _springPos);
+    SInt64 speed = abs(_springVel);
+    if ((dist < 0x8000 && speed < (8 << 16)) || _springTicks * dt >= kSpringMaxTime || dt <= 0)
+    {
+        // settled (or out of time, or no tick to step by): land exactly on target
+        _springPos = target;
+        _springVel = 0;
+        level = _value;
+    }
+    else
+    {
+        level = (int)((_springPos + 0x8000) >> 16);
+        if (level < kBacklightLevelMin)
+            level = kBacklightLevelMin;
+        if (level > kBacklightLevelMax)
+            level = kBacklightLevelMax;
+    }
+
+    ++_smoothWakeups;
+    UInt32 raw = rawForLevel(level);
+    if (raw != rawForLevel(_from_value))
+    {
+        setACPIBrightnessLevel(raw);
+        noteSmoothWrite();
+    }
+    _from_value = level;
     if (_from_value != _value)
-        _smoothTimer->setTimeoutUS(data->timeout);
+    {
+        UInt64 now = uptimeNS();
+        UInt64 next = alignToFrame(now + dt * 1000);
+        _smoothTimer->setTimeoutUS((UInt32)((next - now) / 1000));
+    }
+    else
+        publishSmoothStats();
+}
+
+void ACPIBacklightPanel::updateFramePeriod()
+{
+    // refresh period from the framebuffer behind the display (IODisplayConnect's provider)
+    _framePeriod = _config->framePeriod * 1000ULL;
+    if (!_display || !_display->getProvider())
+        return;
+    IOService* fb = _display->getProvider()->getProvider();
+    if (!fb)
+        return;
+    OSNumber* clock = OSDynamicCast(OSNumber, fb->getProperty("IOFBCurrentPixelClock"));
+    OSNumber* pixels = OSDynamicCast(OSNumber, fb->getProperty("IOFBCurrentPixelCount"));
+    if (clock && pixels && clock->unsigned64BitValue())
+    {
+        _framePeriod = pixels->unsigned64BitValue() * 1000000000ULL / clock->unsigned64BitValue();
+        DbgLog("%s: frame period from framebuffer %lluns\n", this->getName(), _framePeriod);
+    }
+}
+
+UInt64 ACPIBacklightPanel::smoothTick()
+{
+    const PanelConfig* config = _config;
+    if (kPacingFrame == config->pacing && _framePeriod)
+        return _framePeriod;
+    return config->tiers[0].timeout * 1000ULL;
+}
+
+UInt64 ACPIBacklightPanel::alignToFrame(UInt64 t)
+{
+    // round up to the next frame boundary.  The grid is uptime in multiples of
+    // the frame period, not the display's refresh: nothing ties it to vblank, so
+    // writes land one per frame period at a fixed but arbitrary phase within the
+    // real frame (tools/framesim measures that against an unaligned vblank)
+    if (kPacingFrame != _config->pacing || !_framePeriod)
+        return t;
+    return (t + _framePeriod - 1) / _framePeriod * _framePeriod;
+}
+
+void ACPIBacklightPanel::startSmoothStats()
+{
+    _smoothWakeups = _smoothWrites = _smoothRetargets = 0;
+    _frameDoubles = _frameGaps = 0;
+    _lastWriteFrame = 0;
+}
+
+void ACPIBacklightPanel::noteSmoothWrite()
+{
+    ++_smoothWrites;
+
+    // how evenly writes land per frame: more than one in a frame, or frames skipped.
+    // Counted on the same uptime grid alignToFrame uses, so this shows timer
+    // lateness against that grid, not evenness against the display's vblank
+    if (!_framePeriod)
+        return;
+    UInt64 frame = uptimeNS() / _framePeriod;
+    if (_lastWriteFrame)
+    {
+        if (frame == _lastWriteFrame)
+            ++_frameDoubles;
+        else if (frame > _lastWriteFrame+1)
+            _frameGaps += (UInt32)(frame - _lastWriteFrame - 1);
+    }
+    _lastWriteFrame = frame;
+}
 
-    IORecursiveLockUnlock(_lock);
+void ACPIBacklightPanel::publishSmoothStats()
+{
+    if (OSDictionary* dict = OSDictionary::withCapacity(4))
+    {
+        // a curve only wakes for points that change the raw value, so only the
+        // spring (one wakeup per tick) has wakeups that differ from writes
+        OSNumber* num = kSmoothModeSpring == _config->smoothMode ? OSNumber::withNumber(_smoothWakeups, 32) : NULL;
+        if (num)
+        {
+            dict->setObject("Wakeups", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_smoothWrites, 32))
+        {
+            dict->setObject("Writes", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_smoothRetargets, 32))
+        {
+            dict->setObject("Retargets", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_frameDoubles, 32))
+        {
+            dict->setObject("Frame Doubles", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_frameGaps, 32))
+        {
+            dict->setObject("Frame Gaps", num);
+            num->release();
+        }
+        setProperty("Smooth Stats", dict);
+        dict->release();
+    }
+    publishWorkLoopStats();
 }
 
 void ACPIBacklightPanel::saveACPIBrightnessLevel(UInt32 level)
@@ -942,8 +1809,10 @@ void ACPIBacklightPanel::saveACPIBrightnessLevel(UInt32 level)
 	OSObject * ret = NULL;
 	OSNumber * number = OSNumber::withNumber(level, 32);
     
+    UInt64 start = uptimeNS();
 	if (number && kIOReturnSuccess == backLightDevice->evaluateObject("SAVE", &ret, (OSObject**)&number,1))
     {
+        noteAML("SAVE", start);
         OSSafeRelease(ret);
 
         //DbgLog("%s: saveACPIBrightnessLevel SAVE(%u)\n", this->getName(), (unsigned int) level);
@@ -953,18 +1822,76 @@ void ACPIBacklightPanel::saveACPIBrightnessLevel(UInt32 level)
     OSSafeRelease(number);
 }
 
-void ACPIBacklightPanel::saveACPIBrightnessLevelNVRAM(UInt32 level1)
+UInt32 ACPIBacklightPanel::stateFingerprint()
+{
+    // FNV-1a over the _BCL table, whether XBCM/XBQC are present, and the native
+    // handler: its generation and the XRGL/XRGH/KLVX/LMAX/KPCH it was given
+    UInt32 hash = 2166136261U;
+    for (UInt32 i = 0; i < BCLlevelsCount; i++)
+    {
+        UInt32 level = BCLlevels[i];
+        for (int b = 0; b < 4; b++, level >>= 8)
+            hash = (hash ^ (level & 0xFF)) * 16777619U;
+    }
+    hash = (hash ^ BCLlevelsCount) * 16777619U;
+    hash = (hash ^ (_extended ? 1 : 0)) * 16777619U;
+    if (_backlightHandler)
+    {
+        UInt32 fbtype = 0;
+        if (OSNumber* num = OSDynamicCast(OSNumber, _backlightHandler->getProperty("kFrameBufferType")))
+            fbtype = num->unsigned32BitValue();
+        const UInt8* p = (const UInt8*)&_handlerParams;
+        hash = (hash ^ fbtype) * 16777619U;
+        for (size_t i = 0; i < sizeof(BacklightHandlerParams); i++)
+            hash = (hash ^ p[i]) * 16777619U;
+    }
+    return hash;
+}
+
+void ACPIBacklightPanel::fillStateRecord(StateRecord* record)
+{
+    bzero(record, sizeof(*record));
+    record->version = kStateVersion;
+    record->backend = (UInt8)_backend;
+    record->committed = (UInt16)_committed_value;
+    record->saved = (UInt16)_saved_value;
+    for (int i = 0; i < 2; i++)
+        record->sourceLevels[i] = -1 == _sourceLevels[i] ? 0xFFFF : (UInt16)_sourceLevels[i];
+    record->fingerprint = stateFingerprint();
+    record->crc = crc32(record, offsetof(StateRecord, crc));
+}
+
+void ACPIBacklightPanel::saveStateNVRAM(const StateRecord* record)
 {
-    //DbgLog("%s::%s(): level=%d\n", this->getName(),__FUNCTION__, level1);
+    //DbgLog("%s::%s(): level=%d\n", this->getName(),__FUNCTION__, record->committed);
+
+    if (IORegistryEntry *nvram = OSDynamicCast(IORegistryEntry, fromPath("/options", gIODTPlane)))
+    {
+        if (const OSSymbol* symbol = OSSymbol::withCString(kACPIBacklightState))
+        {
+            if (OSData* data = OSData::withBytes(record, sizeof(*record)))
+            {
+                if (!nvram->setProperty(symbol, data))
+                {
+                    DbgLog("%s: nvram->setProperty failed\n", this->getName());
+                }
+                data->release();
+            }
+            symbol->release();
+        }
+        nvram->release();
+    }
+}
 
-    UInt16 level = (UInt16)level1;
+void ACPIBacklightPanel::saveLevelNVRAM(UInt16 level)
+{
+    // the bare level, so going back to an older version keeps it
     if (IORegistryEntry *nvram = OSDynamicCast(IORegistryEntry, fromPath("/options", gIODTPlane)))
     {
         if (const OSSymbol* symbol = OSSymbol::withCString(kACPIBacklightLevel))
         {
             if (OSData* number = OSData::withBytes(&level, sizeof(level)))
             {
-                //DbgLog("%s: saveACPIBrightnessLevelNVRAM got nvram %p\n", this->getName(), nvram);
                 if (!nvram->setProperty(symbol, number))
                 {
                     DbgLog("%s: nvram->setProperty failed\n", this->getName());
@@ -977,6 +1904,137 @@ void ACPIBacklightPanel::saveACPIBrightnessLevelNVRAM(UInt32 level1)
     }
 }
 
+void ACPIBacklightPanel::markDirty(unsigned what)
+{
+    _persistDirty |= what;
+    if (_persistArmed)
+        return;
+    if (!_persistTimer)
+    {
+        flushPersist(true);
+        return;
+    }
+    // first change after a quiet period goes out right away, the rest within the interval
+    UInt64 now = uptimeNS();
+    UInt64 due = _lastFlush ? _lastFlush + _config->persistInterval * 1000000ULL : now;
+    _persistTimer->setTimeoutUS(due > now ? (UInt32)((due - now) / 1000) : 0);
+    _persistArmed = true;
+}
+
+void ACPIBacklightPanel::onPersistTimer()
+{
+    _persistArmed = false;
+    flushPersist(false);
+}
+
+IOReturn ACPIBacklightPanel::flushGated()
+{
+    // commands still queued may carry a commit
+    processWorkQueue(NULL, 0);
+    if (_persistArmed)
+    {
+        _persistTimer->cancelTimeout();
+        _persistArmed = false;
+    }
+    if (_persistDirty)
+    {
+        ++_persistForced;
+        flushPersist(true);
+    }
+    // only older versions read the bare level: once per stop/sleep/shutdown, if changed
+    if (_committed_value >= 0 && (UInt32)_committed_value != _persistedLevel)
+    {
+        saveLevelNVRAM((UInt16)_committed_value);
+        _persistedLevel = _committed_value;
+        ++_nvramWrites;
+        publishPersistStats();
+    }
+    return kIOReturnSuccess;
+}
+
+void ACPIBacklightPanel::flushPersist(bool force)
+{
+    if (!_persistDirty)
+        return;
+    UInt64 now = uptimeNS();
+    UInt64 due = _lastFlush + _config->persistInterval * 1000000ULL;
+    if (!force && _lastFlush && due > now)
+    {
+        // interval shortened or lengthened meanwhile
+        _persistTimer->setTimeoutUS((UInt32)((due - now) / 1000));
+        _persistArmed = true;
+        return;
+    }
+    unsigned dirty = _persistDirty;
+    _persistDirty = 0;
+    _lastFlush = now;
+    ++_persistFlushes;
+
+    Hold hold;
+    beginHold(&hold, kSiteWork);
+    if (dirty & kPersistNVRAM)
+    {
+        StateRecord record;
+        fillStateRecord(&record);
+        if (memcmp(&record, &_persistedRecord, sizeof(record)))
+        {
+            saveStateNVRAM(&record);
+            _persistedRecord = record;
+            ++_nvramWrites;
+        }
+        else
+            ++_persistSkipped;
+    }
+    if ((dirty & kPersistSAVE) && hasSaveMethod)
+    {
+        UInt32 raw = BCLlevels[indexForLevel(_committed_value)];
+        if (raw != _persistedSAVE)
+        {
+            saveACPIBrightnessLevel(raw);
+            _persistedSAVE = raw;
+            ++_saveWrites;
+        }
+        else
+            ++_persistSkipped;
+    }
+    endHold(&hold);
+    publishPersistStats();
+}
+
+void ACPIBacklightPanel::publishPersistStats()
+{
+    if (OSDictionary* dict = OSDictionary::withCapacity(5))
+    {
+        if (OSNumber* num = OSNumber::withNumber(_persistFlushes, 32))
+        {
+            dict->setObject("Flushes", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_persistForced, 32))
+        {
+            dict->setObject("Forced", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_nvramWrites, 32))
+        {
+            dict->setObject("NVRAM Writes", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_saveWrites, 32))
+        {
+            dict->setObject("SAVE Writes", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_persistSkipped, 32))
+        {
+            dict->setObject("Unchanged", num);
+            num->release();
+        }
+        setProperty("Persist Stats", dict);
+        dict->release();
+    }
+}
+
 UInt32 ACPIBacklightPanel::loadFromNVRAM(void)
 {
     DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
@@ -995,44 +2053,142 @@ UInt32 ACPIBacklightPanel::loadFromNVRAM(void)
     else DbgLog("%s: have nvram from /chosen/nvram\n", this->getName());
     UInt32 val = -1;
     if (nvram)
+    {
+        if (OSData* data = copyNVRAMData(nvram, kACPIBacklightState))
+        {
+            StateRecord record;
+            if (data->getLength() == sizeof(record))
+                memcpy(&record, data->getBytesNoCopy(), sizeof(record));
+            else
+                bzero(&record, sizeof(record));
+            if (kStateVersion == record.version && crc32(&record, offsetof(StateRecord, crc)) == record.crc &&
+                record.committed <= kBacklightLevelMax && record.saved <= kBacklightLevelMax)
+            {
+                val = record.committed;
+                _saved_value = record.saved;
+                for (int i = 0; i < 2; i++)
+                    _sourceLevels[i] = record.sourceLevels[i] <= kBacklightLevelMax ? record.sourceLevels[i] : -1;
+                // backend choice depends on the methods and handler found, levels do not
+                // (the handler is not known yet, probeBackends compares the fingerprint)
+                if (record.backend <= kBackendHandler)
+                {
+                    _restoredBackend = record.backend;
+                    _restoredFingerprint = record.fingerprint;
+                }
+                _persistedRecord = record;
+                DbgLog("%s: read state from nvram, level = %d, saved = %d\n", this->getName(), val, _saved_value);
+            }
+            else
+                IOLog("ACPIBacklight: ignoring invalid %s in nvram (%u bytes)\n", kACPIBacklightState, data->getLength());
+            data->release();
+        }
+        else DbgLog("%s: no acpi-backlight-state in nvram\n", this->getName());
+
+        // older versions stored only the level
+        if (-1 == val)
+        {
+            if (OSData* number = copyNVRAMData(nvram, kACPIBacklightLevel))
+            {
+                val = 0;
+                unsigned l = number->getLength();
+                if (l <= sizeof(val))
+                    memcpy(&val, number->getBytesNoCopy(), l);
+                _persistedLevel = val;
+                _migrateLevel = true;
+                DbgLog("%s: read level from nvram = %d\n", this->getName(), val);
+                number->release();
+            }
+            else DbgLog("%s: no acpi-backlight-level in nvram\n", this->getName());
+        }
+        nvram->release();
+    }
+    return val;
+}
+
+OSData* ACPIBacklightPanel::copyNVRAMData(IORegistryEntry* nvram, const char* key)
+{
+    UInt64 start = uptimeNS();
+    const char* path = "Direct";
+    // the entry handed in first; only IODTNVRAM itself answers for every key, so
+    // only there a miss is final (legacy loaders publish /chosen/nvram, /options is empty)
+    bool authoritative = NULL != OSDynamicCast(IODTNVRAM, nvram);
+    OSObject* obj = nvram->copyProperty(key);
+    if (!obj && !authoritative)
+    {
+        if (IORegistryEntry* options = IORegistryEntry::fromPath("/options", gIODTPlane))
+        {
+            if (OSDynamicCast(IODTNVRAM, options))
+            {
+                path = "Options";
+                obj = options->copyProperty(key);
+            }
+            options->release();
+        }
+    }
+    OSData* data = OSDynamicCast(OSData, obj);
+    if (!data)
+        OSSafeRelease(obj);
+    if (!data && !authoritative)
     {
         // need to serialize as getProperty on nvram does not work
+        path = "Serialized";
         if (OSSerialize* serial = OSSerialize::withCapacity(0))
         {
             nvram->serializeProperties(serial);
             if (OSDictionary* props = OSDynamicCast(OSDictionary, OSUnserializeXML(serial->text())))
             {
-                if (OSData* number = OSDynamicCast(OSData, props->getObject(kACPIBacklightLevel)))
-                {
-                    val = 0;
-                    unsigned l = number->getLength();
-                    if (l <= sizeof(val))
-                        memcpy(&val, number->getBytesNoCopy(), l);
-                    DbgLog("%s: read level from nvram = %d\n", this->getName(), val);
-                    //number->release();
-                }
-                else DbgLog("%s: no acpi-backlight-level in nvram\n", this->getName());
+                data = OSDynamicCast(OSData, props->getObject(key));
+                if (data)
+                    data->retain();
                 props->release();
             }
             serial->release();
         }
-        nvram->release();
     }
-    return val;
+    // which path boot took, and what it cost, per key read
+    OSDictionary* reads = OSDynamicCast(OSDictionary, getProperty(kNVRAMRead));
+    reads = reads ? OSDictionary::withDictionary(reads) : OSDictionary::withCapacity(2);
+    OSDictionary* dict = OSDictionary::withCapacity(2);
+    if (reads && dict)
+    {
+        if (OSString* str = OSString::withCString(path))
+        {
+            dict->setObject("Path", str);
+            str->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(uptimeNS() - start, 64))
+        {
+            dict->setObject("Time", num);
+            num->release();
+        }
+        reads->setObject(key, dict);
+        setProperty(kNVRAMRead, reads);
+    }
+    OSSafeRelease(dict);
+    OSSafeRelease(reads);
+    return data;
 }
 
 UInt32 ACPIBacklightPanel::queryACPICurentBrightnessLevel()
 {
     //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
 
-    if (_backlightHandler)
+    return queryBackendLevel(_backlightHandler ? _backend : kBackendACPI);
+}
+
+UInt32 ACPIBacklightPanel::queryBackendLevel(UInt32 backend)
+{
+    if (kBackendHandler == backend)
         return _backlightHandler->getBacklightLevel();
-    
+
     UInt32 level = minAC;
     const char* method = _extended ? "XBQC" : "_BQC";
-	if (kIOReturnSuccess == backLightDevice->evaluateInteger(method, &level))
+    UInt64 start = uptimeNS();
+    IOReturn result = backLightDevice->evaluateInteger(method, &level);
+    noteAML(method, start);
+	if (kIOReturnSuccess == result)
 	{
-		//DbgLog("%s: queryACPICurentBrightnessLevel %s = %d\n", this->getName(), method, level);
+		//DbgLog("%s: queryBackendLevel %s = %d\n", this->getName(), method, level);
         
         OSBoolean * useIdx = OSDynamicCast(OSBoolean, getProperty("BQC use index"));
         if (useIdx && useIdx->isTrue())
@@ -1046,7 +2202,7 @@ UInt32 ACPIBacklightPanel::queryACPICurentBrightnessLevel()
                 levels->release();
             }
         }
-        //DbgLog("%s: queryACPICurentBrightnessLevel returning %d\n", this->getName(), level);
+        //DbgLog("%s: queryBackendLevel returning %d\n", this->getName(), level);
 	}
 	else {
 		IOLog("ACPIBacklight: Error in queryACPICurentBrightnessLevel %s\n", method);
@@ -1212,64 +2368,807 @@ bool ACPIBacklightPanel::getACStatus()
 }
 
 
-void ACPIBacklightPanel::processWorkQueue(IOInterruptEventSource *, int)
+UInt32 ACPIBacklightPanel::profileForRequest(UInt64 now)
 {
-    DbgLog("%s::%s() _workPending=%x\n", this->getName(),__FUNCTION__, _workPending);
-    
-    IORecursiveLockLock(_lock);
-    if (_workPending & kWorkSave)
-        saveACPIBrightnessLevelNVRAM(_committed_value);
-    if (_workPending & kWorkSetBrightness)
-        setBrightnessLevel(_committed_value);
-    _workPending = 0;
-    IORecursiveLockUnlock(_lock);
+    // shortly after wake, or requests arriving in quick succession (slider drag)
+    UInt32 profile = kProfileKey;
+    if (_wakeTime && now - _wakeTime < kWakeWindow)
+        profile = kProfileWake;
+    else if (_lastRequest && now - _lastRequest < kSliderInterval)
+        profile = kProfileSlider;
+    _lastRequest = now;
+    return profile;
 }
 
-void ACPIBacklightPanel::scheduleWork(unsigned newWork)
+IOReturn ACPIBacklightPanel::powerInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize)
 {
-    IORecursiveLockLock(_lock);
-    _workPending |= newWork;
-    _workSource->interruptOccurred(0, 0, 0);
-    IORecursiveLockUnlock(_lock);
+    ACPIBacklightPanel* self = OSDynamicCast(ACPIBacklightPanel, (OSObject*)target);
+    if (!self)
+        return kIOReturnSuccess;
+    switch (messageType)
+    {
+        case kIOMessageSystemHasPoweredOn:
+            self->postCommand(kCmdWake);
+            break;
+        case kIOMessageSystemWillSleep:
+            self->postCommand(kCmdSleep);
+            // fall through
+        case kIOMessageSystemWillRestart:
+        case kIOMessageSystemWillPowerOff:
+            // NVRAM may not survive if the machine never wakes, write it out now
+            // (the panel is not in the PM tree, so systemWillShutdown never comes)
+            if (self->_cmdGate && self->_ready)
+                self->_cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, self, &ACPIBacklightPanel::flushGated));
+            break;
+    }
+    return kIOReturnSuccess;
 }
 
-IOReturn ACPIBacklightPanel::setPropertiesGated(OSObject* props)
+bool ACPIBacklightPanel::powerSourcePublished(void* target, void* refCon, IOService* newService, IONotifier* notifier)
 {
-    //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
-
-    OSDictionary* dict = OSDynamicCast(OSDictionary, props);
-    if (!dict)
-        return kIOReturnSuccess;
-
-    // set brightness
-	if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kRawBrightness)))
+    ACPIBacklightPanel* self = OSDynamicCast(ACPIBacklightPanel, (OSObject*)target);
+    if (self && !self->_powerSourceInterest)
     {
-		UInt32 raw = (int)num->unsigned32BitValue();
-        setACPIBrightnessLevel(raw);
-        setProperty(kRawBrightness, queryACPICurentBrightnessLevel(), 32);
+        self->_powerSourceInterest = newService->registerInterest(gIOGeneralInterest, &ACPIBacklightPanel::powerSourceInterest, self);
+        self->postCommand(kCmdPowerSource);
     }
+    return true;
+}
+
+IOReturn ACPIBacklightPanel::powerSourceInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize)
+{
+    ACPIBacklightPanel* self = OSDynamicCast(ACPIBacklightPanel, (OSObject*)target);
+    if (self && kIOPMMessageBatteryStatusHasChanged == messageType)
+        self->postCommand(kCmdPowerSource);
+    return kIOReturnSuccess;
+}
 
-    for (int i = 0; i < countof(smoothData); i++)
+void ACPIBacklightPanel::powerSourceChanged()
+{
+    int onAC = getACStatus() ? 1 : 0;
+    if (onAC != _onAC)
     {
-        char buf[kSmoothBufSize];
-        snprintf(buf, sizeof(buf), kSmoothDelta, i);
-        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        DbgLog("%s: power source changed, AC=%d\n", this->getName(), onAC);
+        if (-1 != _onAC && (_options & kPerSourceLevels))
         {
-            smoothData[i].delta = (int)num->unsigned32BitValue();
-            setProperty(buf, smoothData[i].delta, 32);
+            // remember level for the old source, fade to the one for the new source
+            _sourceLevels[_onAC] = _committed_value;
+            if (-1 != _sourceLevels[onAC])
+            {
+                _saved_value = _committed_value = _sourceLevels[onAC];
+                setBrightnessLevelSmooth(_committed_value, kProfilePower);
+                if (_display)
+                    doUpdate();
+            }
+            markDirty(kPersistNVRAM);
         }
-        snprintf(buf, sizeof(buf), kSmoothStep, i);
+        _onAC = onAC;
+    }
+}
+
+bool ACPIBacklightPanel::postCommand(UInt32 type, UInt32 arg, IODisplay* display)
+{
+    Command* cmd = (Command*)IOMalloc(sizeof(Command));
+    if (!cmd)
+    {
+        IOLog("ACPIBacklight: no memory for command %u\n", (unsigned)type);
+        return false;
+    }
+    cmd->type = type;
+    cmd->arg = arg;
+    cmd->time = uptimeNS();
+    cmd->display = display;
+
+    // lock-free push; the workloop takes the whole list at once, so no ABA
+    Command* head;
+    do
+    {
+        head = __atomic_load_n(&_commands, __ATOMIC_RELAXED);
+        cmd->next = head;
+    } while (!OSCompareAndSwapPtr(head, cmd, (void* volatile*)&_commands));
+
+    // only the post that finds the queue empty signals; the workloop takes the whole
+    // list, so later ones ride on that signal (a slider drag signals once per pass)
+    if (!head)
+        signalWork();
+    return true;
+}
+
+void ACPIBacklightPanel::signalWork()
+{
+    IOLockLock(_signalLock);
+    if (_workSource)
+        _workSource->interruptOccurred(0, 0, 0);
+    IOLockUnlock(_signalLock);
+}
+
+ACPIBacklightPanel::Command* ACPIBacklightPanel::takeCommands()
+{
+    Command* head;
+    do
+        head = __atomic_load_n(&_commands, __ATOMIC_RELAXED);
+    while (head && !OSCompareAndSwapPtr(head, NULL, (void* volatile*)&_commands));
+
+    // pushed newest first, reverse to run in posting order
+    Command* list = NULL;
+    while (head)
+    {
+        Command* next = head->next;
+        head->next = list;
+        list = head;
+        head = next;
+    }
+    return list;
+}
+
+void ACPIBacklightPanel::runCommand(Command* cmd)
+{
+    noteDelay(&_commandDelay, uptimeNS() - cmd->time);
+    Hold hold;
+    // each command type under its own site, indexed by kCmd*
+    static const UInt32 sites[] = { kSiteIntegerSet, kSiteCommit, kSiteSetDisplay, kSitePowerSource, kSitePower, kSitePower, };
+    beginHold(&hold, sites[cmd->type], cmd->time);
+    switch (cmd->type)
+    {
+        case kCmdBrightness:
+            brightnessCommand(cmd->arg, cmd->time);
+            break;
+        case kCmdCommit:
+            commitCommand(0 != cmd->arg);
+            break;
+        case kCmdDisplay:
+            displayCommand(cmd->display);
+            cmd->display = NULL;
+            break;
+        case kCmdPowerSource:
+            powerSourceChanged();
+            break;
+        case kCmdWake:
+            _wakeTime = cmd->time;
+            // fall through
+        case kCmdSleep:
+            // registers behind the native handler do not survive sleep
+            if (_backlightHandler)
+                _backlightHandler->invalidateState();
+            break;
+    }
+    endHold(&hold);
+}
+
+void ACPIBacklightPanel::freeCommands(Command* cmd)
+{
+    while (cmd)
+    {
+        Command* next = cmd->next;
+        OSSafeRelease(cmd->display);
+        IOFree(cmd, sizeof(Command));
+        cmd = next;
+    }
+}
+
+void ACPIBacklightPanel::processWorkQueue(IOInterruptEventSource *, int)
+{
+    DbgLog("%s::%s() _workPending=%x\n", this->getName(),__FUNCTION__, _workPending);
+
+    if (!_ready)
+        return;
+
+    // commands first, so work they schedule is done in the same pass
+    Command* cmd = coalesceCommands(takeCommands());
+    bool ran = NULL != cmd;
+    Hold hold;
+    beginHold(&hold, kSiteQueue, cmd ? cmd->time : 0);
+    while (cmd)
+    {
+        Command* next = cmd->next;
+        cmd->next = NULL;
+        if (kCmdBrightness == cmd->type || kCmdCommit == cmd->type)
+            ++_requestsApplied;
+        runCommand(cmd);
+        freeCommands(cmd);
+        cmd = next;
+    }
+
+    unsigned work = _workPending;
+    _workPending = 0;
+    if (work)
+    {
+        Hold workHold;
+        beginHold(&workHold, kSiteWork, _workScheduled);
+        _workScheduled = 0;
+        if (work & kWorkSetBrightness)
+            setBrightnessLevel(_committed_value);
+        endHold(&workHold);
+    }
+    publishState();
+#ifdef DEBUG
+    checkInvariants();
+#endif
+    endHold(&hold);
+    if (ran)
+    {
+        publishWorkLoopStats();
+        publishRequestStats();
+    }
+}
+
+ACPIBacklightPanel::Command* ACPIBacklightPanel::coalesceCommands(Command* list)
+{
+    // only neighbours merge, any other command in between keeps its ordering
+    Command** link = &list;
+    while (Command* cmd = *link)
+    {
+        Command* next = cmd->next;
+        if (kCmdBrightness == cmd->type || kCmdCommit == cmd->type)
+            ++_requestsAccepted;
+        bool drop = false;
+        if (next && kCmdBrightness == cmd->type && kCmdBrightness == next->type)
+        {
+            // superseded target, unless either is one of the special values: low
+            // values re-apply the committed level, 0xFF restores the saved level
+            // (which this one may set), neither is a plain target to replace
+            drop = cmd->arg > 5 && 0xFF != cmd->arg && next->arg > 5 && 0xFF != next->arg;
+        }
+        else if (next && kCmdCommit == cmd->type && kCmdCommit == next->type)
+        {
+            // repeated commit, keep the last (and whether it follows a brightness)
+            next->arg |= cmd->arg;
+            drop = true;
+        }
+        else if (next && kCmdBrightness == cmd->type && kCmdCommit == next->type)
+        {
+            // brightness and commit together: one transition, no extra jump to target
+            next->arg = 1;
+        }
+        if (drop)
+        {
+            // a superseded brightness still counts as applied, or doIntegerSet's
+            // snapshot would never catch up with _posted again
+            if (kCmdBrightness == cmd->type)
+                ++_applied;
+            ++_requestsCoalesced;
+            *link = next;
+            cmd->next = NULL;
+            freeCommands(cmd);
+            continue;
+        }
+        link = &cmd->next;
+    }
+    return list;
+}
+
+void ACPIBacklightPanel::publishRequestStats()
+{
+    if (OSDictionary* dict = OSDictionary::withCapacity(4))
+    {
+        if (OSNumber* num = OSNumber::withNumber(_requestsAccepted, 32))
+        {
+            dict->setObject("Accepted", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_requestsCoalesced, 32))
+        {
+            dict->setObject("Coalesced", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_requestsApplied, 32))
+        {
+            dict->setObject("Applied", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_backendWrites, 32))
+        {
+            dict->setObject("Hardware Writes", num);
+            num->release();
+        }
+        setProperty("Request Stats", dict);
+        dict->release();
+    }
+}
+
+void ACPIBacklightPanel::noteDelay(DelayStats* stats, UInt64 delay)
+{
+    ++stats->count;
+    stats->total += delay;
+    if (delay > stats->max)
+        stats->max = delay;
+}
+
+void ACPIBacklightPanel::publishWorkLoopStats()
+{
+    if (OSDictionary* dict = OSDictionary::withCapacity(5))
+    {
+        struct { const char* name; DelayStats* stats; } delays[] =
+        {
+            { "Command", &_commandDelay },
+            { "Timer", &_timerDelay },
+        };
+        for (int i = 0; i < countof(delays); i++)
+        {
+            char buf[32];
+            DelayStats* stats = delays[i].stats;
+            snprintf(buf, sizeof(buf), "%s Count", delays[i].name);
+            if (OSNumber* num = OSNumber::withNumber(stats->count, 32))
+            {
+                dict->setObject(buf, num);
+                num->release();
+            }
+            snprintf(buf, sizeof(buf), "%s Avg us", delays[i].name);
+            if (OSNumber* num = OSNumber::withNumber(stats->count ? stats->total / stats->count / 1000 : 0, 64))
+            {
+                dict->setObject(buf, num);
+                num->release();
+            }
+            snprintf(buf, sizeof(buf), "%s Max us", delays[i].name);
+            if (OSNumber* num = OSNumber::withNumber(stats->max / 1000, 64))
+            {
+                dict->setObject(buf, num);
+                num->release();
+            }
+        }
+        setProperty("WorkLoop Stats", dict);
+        dict->release();
+    }
+    publishSiteStats();
+}
+
+int ACPIBacklightPanel::histBucket(UInt64 ns)
+{
+    // power of two buckets in us, the last one open ended
+    UInt64 us = ns / 1000;
+    int bucket = 0;
+    while (us > 1 && bucket < kHistBuckets-1)
+    {
+        us >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+void ACPIBacklightPanel::beginHold(Hold* hold, UInt32 site, UInt64 posted)
+{
+    UInt64 now = uptimeNS();
+    if (posted && now > posted)
+        ++_siteStats[site].wait[histBucket(now - posted)];
+    // nested holds track their own slowest AML method, endHold folds it back
+    hold->site = site;
+    hold->method = _amlMethod;
+    hold->amlTime = _amlTime;
+    _amlMethod = NULL;
+    _amlTime = 0;
+    hold->start = now;
+}
+
+void ACPIBacklightPanel::endHold(Hold* hold)
+{
+    UInt64 held = uptimeNS() - hold->start;
+    SiteStats* stats = &_siteStats[hold->site];
+    ++stats->hold[histBucket(held)];
+    if (held > stats->maxHold)
+    {
+        stats->maxHold = held;
+        stats->maxMethod = _amlMethod;
+    }
+    if (hold->amlTime > _amlTime)
+    {
+        _amlMethod = hold->method;
+        _amlTime = hold->amlTime;
+    }
+}
+
+void ACPIBacklightPanel::noteAML(const char* method, UInt64 start)
+{
+    UInt64 elapsed = uptimeNS() - start;
+    if (elapsed > _amlTime)
+    {
+        _amlMethod = method;
+        _amlTime = elapsed;
+    }
+}
+
+#ifdef DEBUG
+void ACPIBacklightPanel::checkInvariants()
+{
+    if (_value < kBacklightLevelMin || _value > kBacklightLevelMax ||
+        _from_value < kBacklightLevelMin || _from_value > kBacklightLevelMax ||
+        _committed_value < kBacklightLevelMin || _committed_value > kBacklightLevelMax)
+        invariantFailed(kInvariantRange);
+
+    // a curve transition stays between where it started and the target
+    if (kSmoothModeCurve == _config->smoothMode && _trajectoryIndex < _trajectoryCount)
+    {
+        int lo = _trajectoryFrom < _value ? _trajectoryFrom : _value;
+        int hi = _trajectoryFrom < _value ? _value : _trajectoryFrom;
+        if (_from_value < lo || _from_value > hi)
+            invariantFailed(kInvariantOvershoot);
+    }
+
+    if (_trajectoryIndex > _trajectoryCount || _trajectoryCount > kTrajectoryMax)
+        invariantFailed(kInvariantTrajectory);
+    else
+    {
+        for (int i = 1; i < _trajectoryCount; i++)
+        {
+            if (_trajectory[i].deadline < _trajectory[i-1].deadline)
+            {
+                invariantFailed(kInvariantTrajectory);
+                break;
+            }
+        }
+    }
+}
+
+void ACPIBacklightPanel::invariantFailed(UInt32 which)
+{
+    if (!_invariantViolations[which]++)
+        IOLog("ACPIBacklight: invariant '%s' violated (value=%d, from=%d, committed=%d)\n",
+              invariantNames[which], _value, _from_value, _committed_value);
+}
+#endif
+
+void ACPIBacklightPanel::publishSiteStats()
+{
+    // histograms are many objects, at most once a second
+    UInt64 now = uptimeNS();
+    if (_siteStatsPublished && now - _siteStatsPublished < 1000000000ULL)
+        return;
+    _siteStatsPublished = now;
+
+    OSDictionary* dict = OSDictionary::withCapacity(kSiteCount);
+    if (!dict)
+        return;
+    for (int i = 0; i < kSiteCount; i++)
+    {
+        SiteStats* stats = &_siteStats[i];
+        OSDictionary* site = OSDictionary::withCapacity(4);
+        OSArray* wait = OSArray::withCapacity(kHistBuckets);
+        OSArray* hold = OSArray::withCapacity(kHistBuckets);
+        if (site && wait && hold)
+        {
+            for (int j = 0; j < kHistBuckets; j++)
+            {
+                if (OSNumber* num = OSNumber::withNumber(stats->wait[j], 32))
+                {
+                    wait->setObject(num);
+                    num->release();
+                }
+                if (OSNumber* num = OSNumber::withNumber(stats->hold[j], 32))
+                {
+                    hold->setObject(num);
+                    num->release();
+                }
+            }
+            site->setObject("Wait", wait);
+            site->setObject("Hold", hold);
+            if (OSNumber* num = OSNumber::withNumber(stats->maxHold / 1000, 64))
+            {
+                site->setObject("Max Hold us", num);
+                num->release();
+            }
+            if (OSString* str = OSString::withCString(stats->maxMethod ? stats->maxMethod : "none"))
+            {
+                site->setObject("Max Hold AML", str);
+                str->release();
+            }
+            dict->setObject(siteNames[i], site);
+        }
+        OSSafeRelease(site);
+        OSSafeRelease(wait);
+        OSSafeRelease(hold);
+    }
+    setProperty("Gate Stats", dict);
+    dict->release();
+
+#ifdef DEBUG
+    if (OSDictionary* dict = OSDictionary::withCapacity(kInvariantCount))
+    {
+        for (int i = 0; i < kInvariantCount; i++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(_invariantViolations[i], 32))
+            {
+                dict->setObject(invariantNames[i], num);
+                num->release();
+            }
+        }
+        setProperty("Invariant Violations", dict);
+        dict->release();
+    }
+#endif
+}
+
+void ACPIBacklightPanel::publishState()
+{
+    // single writer (the workloop); readers retry while the sequence is odd or moved.
+    // every field is a word-sized atomic access, so a reader racing this sees old or
+    // new values (and retries), never a compiler-split or cached one
+    bool rawChanged = _state.raw != _rawValue;
+    UInt32 seq = _stateSeq;
+    __atomic_store_n(&_stateSeq, seq + 1, __ATOMIC_RELAXED);
+    __sync_synchronize();
+    __atomic_store_n(&_state.target, (UInt32)_value, __ATOMIC_RELAXED);
+    __atomic_store_n(&_state.current, (UInt32)_from_value, __ATOMIC_RELAXED);
+    __atomic_store_n(&_state.committed, (UInt32)_committed_value, __ATOMIC_RELAXED);
+    __atomic_store_n(&_state.raw, _rawValue, __ATOMIC_RELAXED);
+    __atomic_store_n(&_state.backend, _backlightHandler ? _backend : (UInt32)kBackendACPI, __ATOMIC_RELAXED);
+    __atomic_store_n(&_state.applied, _applied, __ATOMIC_RELAXED);
+    __sync_synchronize();
+    __atomic_store_n(&_stateSeq, seq + 2, __ATOMIC_RELAXED);
+
+    // just FYI... RawBrightness property follows the level last written
+    if (rawChanged || !getProperty(kRawBrightness))
+        setProperty(kRawBrightness, _rawValue, 32);
+}
+
+void ACPIBacklightPanel::readState(PanelState* state)
+{
+    UInt32 seq;
+    do
+    {
+        // writer never does I/O with the sequence odd, so this spin is short
+        while ((seq = __atomic_load_n(&_stateSeq, __ATOMIC_RELAXED)) & 1)
+            ;
+        __sync_synchronize();
+        state->target = __atomic_load_n(&_state.target, __ATOMIC_RELAXED);
+        state->current = __atomic_load_n(&_state.current, __ATOMIC_RELAXED);
+        state->committed = __atomic_load_n(&_state.committed, __ATOMIC_RELAXED);
+        state->raw = __atomic_load_n(&_state.raw, __ATOMIC_RELAXED);
+        state->backend = __atomic_load_n(&_state.backend, __ATOMIC_RELAXED);
+        state->applied = __atomic_load_n(&_state.applied, __ATOMIC_RELAXED);
+        __sync_synchronize();
+    } while (seq != __atomic_load_n(&_stateSeq, __ATOMIC_RELAXED));
+}
+
+void ACPIBacklightPanel::scheduleWork(unsigned newWork)
+{
+    // only called on the workloop
+    if (!_workPending)
+        _workScheduled = uptimeNS();
+    _workPending |= newWork;
+    signalWork();
+}
+
+ACPIBacklightPanel::PanelConfig* ACPIBacklightPanel::copyConfig(const PanelConfig* from)
+{
+    PanelConfig* config = (PanelConfig*)IOMalloc(sizeof(PanelConfig));
+    if (!config)
+        return NULL;
+    if (from)
+        bcopy(from, config, sizeof(PanelConfig)); // padding too, publishConfig compares bytes
+    else
+    {
+        // defaults
+        bzero(config, sizeof(PanelConfig));
+        for (int i = 0; i < kSmoothTiers; i++)
+            config->tiers[i] = smoothData[i];
+        for (int i = 0; i < kProfileCount; i++)
+            config->profiles[i] = defaultProfiles[i];
+        config->easing = kEasingLinear;
+        config->smoothMode = kSmoothModeCurve;
+        config->springOmega = 20;
+        config->pacing = kPacingTimer;
+        config->framePeriod = 16667;
+        config->persistInterval = 2000;
+    }
+    config->retired = NULL;
+    return config;
+}
+
+void ACPIBacklightPanel::publishConfig(PanelConfig* config)
+{
+    // only called on the workloop, so there is a single writer
+    PanelConfig* old = _config;
+    if (!memcmp(config, old, offsetof(PanelConfig, retired)))
+    {
+        IOFree(config, sizeof(PanelConfig));
+        return;
+    }
+    // contents must be visible before the pointer is
+    __sync_synchronize();
+    _config = config;
+
+    // the caller may still look at the old one, freed when its pass is done
+    old->retired = _retired;
+    _retired = old;
+}
+
+void ACPIBacklightPanel::reclaimConfigs()
+{
+    PanelConfig* config = _retired;
+    _retired = NULL;
+    while (config)
+    {
+        PanelConfig* next = config->retired;
+        IOFree(config, sizeof(PanelConfig));
+        config = next;
+    }
+}
+
+IOReturn ACPIBacklightPanel::setPropertiesGated(OSObject* props)
+{
+    //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    OSDictionary* dict = OSDynamicCast(OSDictionary, props);
+    if (!dict)
+        return kIOReturnSuccess;
+    Hold hold;
+    beginHold(&hold, kSiteProperties);
+
+    // set brightness
+	if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kRawBrightness)))
+    {
+		UInt32 raw = (int)num->unsigned32BitValue();
+        setACPIBrightnessLevel(raw);
+        // explicit request, so report what the hardware actually took
+        _rawValue = queryACPICurentBrightnessLevel();
+    }
+
+    // tuning goes into a private copy, published with a single pointer swap below
+    PanelConfig* config = copyConfig(_config);
+    if (!config)
+    {
+        endHold(&hold);
+        return kIOReturnNoMemory;
+    }
+    for (int i = 0; i < kSmoothTiers; i++)
+    {
+        char buf[kSmoothBufSize];
+        snprintf(buf, sizeof(buf), kSmoothDelta, i);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            config->tiers[i].delta = (int)num->unsigned32BitValue();
+            setProperty(buf, config->tiers[i].delta, 32);
+        }
+        snprintf(buf, sizeof(buf), kSmoothStep, i);
         if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
         {
-            smoothData[i].step = (int)num->unsigned32BitValue();
-            setProperty(buf, smoothData[i].step, 32);
+            int step = (int)num->unsigned32BitValue();
+            if (step > 0)
+                config->tiers[i].step = step;
+            setProperty(buf, config->tiers[i].step, 32);
         }
         snprintf(buf, sizeof(buf), kSmoothTimeout, i);
         if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
         {
-            smoothData[i].timeout = (int)num->unsigned32BitValue();
-            setProperty(buf, smoothData[i].timeout, 32);
+            // zero would be a zero tick (and a divide by zero sampling the curve)
+            int timeout = (int)num->unsigned32BitValue();
+            if (timeout > 0)
+                config->tiers[i].timeout = timeout;
+            setProperty(buf, config->tiers[i].timeout, 32);
+        }
+    }
+    // tiers are searched in order, so deltas must increase; otherwise keep the old ones
+    bool ordered = config->tiers[0].delta > 0;
+    for (int i = 1; i < kSmoothTiers; i++)
+        ordered = ordered && config->tiers[i].delta > config->tiers[i-1].delta;
+    if (!ordered)
+    {
+        IOLog("%s: SmoothDelta%d..%d must be increasing, ignored\n", this->getName(), 0, kSmoothTiers-1);
+        for (int i = 0; i < kSmoothTiers; i++)
+        {
+            char buf[kSmoothBufSize];
+            config->tiers[i].delta = _config->tiers[i].delta;
+            snprintf(buf, sizeof(buf), kSmoothDelta, i);
+            setProperty(buf, config->tiers[i].delta, 32);
+        }
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSmoothEasing)))
+    {
+        UInt32 easing = num->unsigned32BitValue();
+        if (easing < kEasingCount)
+            config->easing = easing;
+        setProperty(kSmoothEasing, config->easing, 32);
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSmoothMode)))
+    {
+        UInt32 mode = num->unsigned32BitValue();
+        if (mode < kSmoothModeCount)
+            config->smoothMode = mode;
+        setProperty(kSmoothMode, config->smoothMode, 32);
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSpringOmega)))
+    {
+        UInt32 omega = num->unsigned32BitValue();
+        if (omega >= kSpringOmegaMin && omega <= kSpringOmegaMax)
+            config->springOmega = omega;
+        setProperty(kSpringOmega, config->springOmega, 32);
+    }
+    for (int i = 0; i < kProfileCount; i++)
+    {
+        char buf[kProfileBufSize];
+        SmoothProfile* profile = &config->profiles[i];
+        snprintf(buf, sizeof(buf), kProfileUp, profileNames[i]);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            UInt32 ms = num->unsigned32BitValue();
+            profile->up = ms < kProfileTimeMax ? ms : kProfileTimeMax;
+            setProperty(buf, profile->up, 32);
+        }
+        snprintf(buf, sizeof(buf), kProfileDown, profileNames[i]);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            UInt32 ms = num->unsigned32BitValue();
+            profile->down = ms < kProfileTimeMax ? ms : kProfileTimeMax;
+            setProperty(buf, profile->down, 32);
+        }
+        snprintf(buf, sizeof(buf), kProfileMin, profileNames[i]);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            UInt32 ms = num->unsigned32BitValue();
+            profile->min = ms < kProfileTimeMax ? ms : kProfileTimeMax;
+            setProperty(buf, profile->min, 32);
         }
+        snprintf(buf, sizeof(buf), kProfileEasing, profileNames[i]);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            UInt32 easing = num->unsigned32BitValue();
+            profile->easing = easing < kEasingCount ? easing : kEasingDefault;
+            setProperty(buf, profile->easing, 32);
+        }
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSmoothPacing)))
+    {
+        UInt32 pacing = num->unsigned32BitValue();
+        if (pacing < kPacingCount)
+            config->pacing = pacing;
+        setProperty(kSmoothPacing, config->pacing, 32);
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kFramePeriod)))
+    {
+        UInt32 period = num->unsigned32BitValue();
+        if (period)
+            config->framePeriod = period;
+        setProperty(kFramePeriod, config->framePeriod, 32);
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kPersistInterval)))
+    {
+        UInt32 interval = num->unsigned32BitValue();
+        config->persistInterval = interval < kPersistIntervalMax ? interval : kPersistIntervalMax;
+        setProperty(kPersistInterval, config->persistInterval, 32);
+    }
+
+    const PanelConfig* old = _config;
+    bool modeChanged = config->smoothMode != old->smoothMode;
+    bool periodChanged = config->framePeriod != old->framePeriod;
+    publishConfig(config);
+    if (periodChanged)
+        updateFramePeriod();
+    if (modeChanged)
+    {
+        // transition in flight continues in the new mode from where it is
+        _trajectoryCount = _trajectoryIndex = 0;
+        _springPos = (SInt64)_from_value << 16;
+        _springVel = 0;
+        _springTicks = 0;
+        if (kSmoothModeCurve == _config->smoothMode && _smoothTimer && _from_value != _value)
+        {
+            buildTrajectory(uptimeNS(), smoothDuration(_from_value, _value));
+            _smoothTimer->cancelTimeout();
+            armSmoothTimer();
+        }
+    }
+
+    // deadline request: { Level, WithinMS | AtMS (uptime), Commit }
+    IOReturn result = kIOReturnSuccess;
+    if (OSDictionary* target = OSDynamicCast(OSDictionary, dict->getObject(kBrightnessTarget)))
+    {
+        OSNumber* level = OSDynamicCast(OSNumber, target->getObject("Level"));
+        OSNumber* within = OSDynamicCast(OSNumber, target->getObject("WithinMS"));
+        OSNumber* at = OSDynamicCast(OSNumber, target->getObject("AtMS"));
+        if (level && (within || at))
+        {
+            UInt64 deadline = at ? at->unsigned64BitValue() * 1000000ULL : uptimeNS() + within->unsigned64BitValue() * 1000000ULL;
+            result = setBrightnessDeadline(level->unsigned32BitValue(), deadline);
+            OSBoolean* commit = OSDynamicCast(OSBoolean, target->getObject("Commit"));
+            if (commit && commit->isTrue() && kIOReturnBadArgument != result && kIOReturnUnsupported != result)
+            {
+                // as a posted brightness + commit: the transition already ends on _value
+                if (_value > 5)
+                    _saved_value = _value;
+                commitCommand(true);
+            }
+        }
+        else
+            result = kIOReturnBadArgument;
     }
     
 #ifdef DEBUG
@@ -1299,7 +3198,12 @@ IOReturn ACPIBacklightPanel::setPropertiesGated(OSObject* props)
         setProperty("KLVX", raw, 32);
     }
 #endif
-    return kIOReturnSuccess;
+    if (_ready)
+        publishState();
+    // nothing looks at a replaced config past this pass
+    reclaimConfigs();
+    endHold(&hold);
+    return result;
 }
 
 #ifdef DEBUG
@@ -1321,6 +3225,14 @@ void ACPIBacklightPanel::setKLVX(UInt32 levx)
 }
 #endif
 
+IOWorkLoop* ACPIBacklightPanel::getWorkLoop() const
+{
+    // private one once start has created it
+    if (_workLoop)
+        return _workLoop;
+    return super::getWorkLoop();
+}
+
 IOReturn ACPIBacklightPanel::setProperties(OSObject* props)
 {
     //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
@@ -1350,8 +3262,127 @@ UInt32 BacklightHandler::getBacklightLevel()
     return -1;
 }
 
+void BacklightHandler::invalidateState()
+{
+    // no implementation
+}
+
 OSDefineMetaClassAndStructors(IntelBacklightHandler, BacklightHandler)
 
+// host builds (tools/host) route these to a simulated BAR
+#ifndef MMIO_READ32
+#define MMIO_READ32(address)        (*(volatile UInt32*)(address))
+#define MMIO_WRITE32(address,value) (*(volatile UInt32*)(address) = (value))
+#endif
+
+#ifdef DEBUG
+#define REG32_READ(offset)          (++_mmioReads, MMIO_READ32((UInt8*)_baseAddr+(offset)))
+#define REG32_WRITE(offset,value)   (++_mmioWrites, MMIO_WRITE32((UInt8*)_baseAddr+(offset), (value)))
+#else
+#define REG32_READ(offset)          MMIO_READ32((UInt8*)_baseAddr+(offset))
+#define REG32_WRITE(offset,value)   MMIO_WRITE32((UInt8*)_baseAddr+(offset), (value))
+#endif
+
+#define LEV2 0x48250
+#define LEVL 0x48254
+#define LEVW 0xc8250
+#define LEVX 0xc8254
+#define PCHL 0xe1180
+#define LEVD 0xc8258    // PCH PWM duty cycle (Coffee Lake and later)
+
+// enable bit in kEnableReg, cleared to gate the PWM output at zero level
+#define kPWMEnable 0x80000000
+
+// re-read kEnableReg every so many writes to catch external changes (eg. after sleep)
+#define kDriftCheckInterval 32
+
+// register initialization step, value comes from BacklightHandlerParams unless kParamNone
+enum { kParamNone, kParamKLVX, kParamKPCH, kParamLMAX, };
+
+// BacklightHandlerParams value when PNLF does not provide the method
+#define kParamMissing 0xFFFFFFFF
+
+struct RegInit
+{
+    UInt32 offset;
+    UInt32 value;
+    int param;
+    bool optional;  // skip if the param was not provided by PNLF (-1)
+};
+
+static inline UInt32 initValue(const RegInit& reg, const BacklightHandlerParams& params)
+{
+    switch (reg.param)
+    {
+        case kParamKLVX: return params._klvx;
+        case kParamKPCH: return params._kpch;
+        case kParamLMAX: return params._lmax;
+    }
+    return reg.value;
+}
+
+// Register layout per framebuffer generation.  kLevelReg holds the level as
+// packed by pack(), init[] is replayed after sleep, and kEnableReg holds the PWM
+// output enable bit (also what the drift check re-reads: when anything resets the
+// PWM block, the output goes off).  kDefaultMax is the PWM max used when PNLF does
+// not provide LMAX (0 to leave as is).
+
+struct IvySandyRegs
+{
+    enum { kLevelReg = LEVL, kEnableReg = LEV2, kInitCount = 4, kDefaultMax = 0, };
+    static const RegInit init[kInitCount];
+    static inline UInt32 pack(const BacklightHandlerParams&, UInt32 level) { return level; }
+    static inline UInt32 unpack(UInt32 reg) { return reg; }
+};
+
+const RegInit IvySandyRegs::init[kInitCount] =
+{
+    { PCHL, 0, kParamKPCH, true },
+    { LEVW, 0x80000000, kParamNone, false },
+    { LEVX, 0, kParamKLVX, false },
+    { LEV2, 0x80000000, kParamNone, false },
+};
+
+struct HaswellBroadwellRegs
+{
+    enum { kLevelReg = LEVX, kEnableReg = LEVW, kInitCount = 0, kDefaultMax = 0, };
+    static const RegInit* const init;
+    // store new backlight level and restore max
+    static inline UInt32 pack(const BacklightHandlerParams& params, UInt32 level) { return (params._lmax<<16) | level; }
+    static inline UInt32 unpack(UInt32 reg) { return reg & 0xFFFF; }
+};
+
+const RegInit* const HaswellBroadwellRegs::init = NULL;
+
+// Skylake/Kaby Lake (SPT PCH): frequency and duty share LEVX, LEVW must be enabled
+struct SkylakeKabyLakeRegs
+{
+    enum { kLevelReg = LEVX, kEnableReg = LEVW, kInitCount = 1, kDefaultMax = 0x56c, };
+    static const RegInit init[kInitCount];
+    static inline UInt32 pack(const BacklightHandlerParams& params, UInt32 level) { return (params._lmax<<16) | level; }
+    static inline UInt32 unpack(UInt32 reg) { return reg & 0xFFFF; }
+};
+
+const RegInit SkylakeKabyLakeRegs::init[kInitCount] =
+{
+    { LEVW, 0x80000000, kParamNone, false },
+};
+
+// Coffee Lake (CNP PCH): frequency in LEVX, duty cycle in its own register
+struct CoffeeLakeRegs
+{
+    enum { kLevelReg = LEVD, kEnableReg = LEVW, kInitCount = 2, kDefaultMax = 0xffff, };
+    static const RegInit init[kInitCount];
+    static inline UInt32 pack(const BacklightHandlerParams&, UInt32 level) { return level; }
+    static inline UInt32 unpack(UInt32 reg) { return reg; }
+};
+
+const RegInit CoffeeLakeRegs::init[kInitCount] =
+{
+    { LEVX, 0, kParamLMAX, false },
+    { LEVW, 0x80000000, kParamNone, false },
+};
+
 bool IntelBacklightHandler::init()
 {
     if (!super::init())
@@ -1361,7 +3392,18 @@ bool IntelBacklightHandler::init()
     _baseAddr = NULL;
     _panel = NULL;
     _fbtype = 0;
+    _setLevel = NULL;
+    _getLevel = NULL;
     memset(&_params, 0, sizeof(_params));
+    _shadowValid = 0;
+    _driftTicks = 0;
+    _gated = false;
+    _gatedSince = _gatedNS = 0;
+    _gatedCount = 0;
+#ifdef DEBUG
+    _mmioReads = _mmioWrites = _levelChanges = 0;
+    _levelChangeNS = 0;
+#endif
 
     return true;
 }
@@ -1414,6 +3456,31 @@ bool IntelBacklightHandler::start(IOService *provider)
     }
     _fbtype = num->unsigned32BitValue();
 
+    // register access for this generation, selected once instead of per call
+    void (IntelBacklightHandler::*selectRegs)() = NULL;
+    switch (_fbtype)
+    {
+        case kFBTypeIvySandy:
+            selectRegs = &IntelBacklightHandler::selectRegs<IvySandyRegs>;
+            break;
+
+        case kFBTypeHaswellBroadwell:
+            selectRegs = &IntelBacklightHandler::selectRegs<HaswellBroadwellRegs>;
+            break;
+
+        case kFBTypeSkylakeKabyLake:
+            selectRegs = &IntelBacklightHandler::selectRegs<SkylakeKabyLakeRegs>;
+            break;
+
+        case kFBTypeCoffeeLake:
+            selectRegs = &IntelBacklightHandler::selectRegs<CoffeeLakeRegs>;
+            break;
+
+        default:
+            IOLog("unsupported framebuffer type %u\n", _fbtype);
+            return false;
+    }
+
     // now register with ACPIBacklight
     if (!panel->setBacklightHandler(this, &_params))
     {
@@ -1424,6 +3491,11 @@ bool IntelBacklightHandler::start(IOService *provider)
     _panel = panel;
     panel->retain();
 
+    (this->*selectRegs)();
+
+    // registers are clobbered across sleep: the panel calls invalidateState on its
+    // workloop (where all register access happens) for sleep, wake and display changes
+
     // register service so ACPIBacklightPanel can proceed...
     registerService();
 
@@ -1444,78 +3516,225 @@ void IntelBacklightHandler::stop(IOService * provider)
     super::stop(provider);
 }
 
-#define REG32_READ(offset)          (*(volatile UInt32*)((UInt8*)_baseAddr+(offset)))
-#define REG32_WRITE(offset,value)   ((*(volatile UInt32*)((UInt8*)_baseAddr+(offset))) = (value))
+#ifdef DEBUG
+#define kStatsInterval 16
 
-#define LEV2 0x48250
-#define LEVL 0x48254
-#define LEVW 0xc8250
-#define LEVX 0xc8254
-#define PCHL 0xe1180
+void IntelBacklightHandler::publishStats()
+{
+    if (OSDictionary* dict = OSDictionary::withCapacity(4))
+    {
+        UInt64 values[] = { _mmioReads, _mmioWrites, _levelChanges, _levelChangeNS };
+        const char* keys[] = { "Reads", "Writes", "Level Changes", "Level Change ns" };
+        for (size_t i = 0; i < countof(values); i++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(values[i], 64))
+            {
+                dict->setObject(keys[i], num);
+                num->release();
+            }
+        }
+        setProperty("MMIO Stats", dict);
+        dict->release();
+    }
+}
+#endif
 
-void IntelBacklightHandler::setBacklightLevel(UInt32 level)
+template <class Regs>
+void IntelBacklightHandler::selectRegs()
 {
-    if (!_baseAddr)
-        return;
+    // PWM frequency must be programmed on newer generations, even without LMAX
+    if (0 != Regs::kDefaultMax && kParamMissing == _params._lmax)
+        _params._lmax = Regs::kDefaultMax;
+
+    // without XRGL/XRGH (or with limits that can't bite) skip the clamp entirely
+    if (kParamMissing == _params._xrgl)
+        _params._xrgl = 0;
+    if (_params._xrgl <= 1 && kParamMissing == _params._xrgh)
+    {
+        _setLevel = &IntelBacklightHandler::setLevel<Regs, false>;
+        _getLevel = &IntelBacklightHandler::getLevel<Regs, false>;
+    }
+    else
+    {
+        _setLevel = &IntelBacklightHandler::setLevel<Regs, true>;
+        _getLevel = &IntelBacklightHandler::getLevel<Regs, true>;
+    }
+}
 
-    // adjust level to within limits set by XRGL and XRGH
-    if (level > _params._xrgh)
-        level = _params._xrgh;
-    if (level && level < _params._xrgl)
-        level = _params._xrgl;
+template <class Regs>
+void IntelBacklightHandler::initRegisters()
+{
+    // initialize for consistent backlight level before/after sleep
+    for (int i = 0; i < Regs::kInitCount; i++)
+    {
+        if (_shadowValid & (1<<i))
+            continue;
+        const RegInit& reg = Regs::init[i];
+        UInt32 value = initValue(reg, _params);
+        if (reg.optional && kParamMissing == value)
+            continue;
+        if (REG32_READ(reg.offset) != value)
+            REG32_WRITE(reg.offset, value);
+    }
+    // and the PWM output on (init[] covers it on Ivy/Sandy, nothing does on Haswell)
+    UInt32 enable = REG32_READ(Regs::kEnableReg);
+    if (!(enable & kPWMEnable))
+        REG32_WRITE(Regs::kEnableReg, enable | kPWMEnable);
+    _shadowValid = (1<<(Regs::kInitCount+1))-1;
+    _driftTicks = 0;
+}
 
-    // write backlight level
-    switch (_fbtype)
+void IntelBacklightHandler::invalidateState()
+{
+    invalidateShadow();
+}
+
+void IntelBacklightHandler::publishGating()
+{
+    // only when the gate changes, on the panel's workloop: total covers finished
+    // periods, the one in progress started at "Since ms" (uptime)
+    if (OSDictionary* dict = OSDictionary::withCapacity(4))
     {
-        case kFBTypeHaswellBroadwell:
+        if (OSNumber* num = OSNumber::withNumber(_gatedCount, 32))
         {
-            // store new backlight level and restore max
-            REG32_WRITE(LEVX, (_params._lmax<<16) | level);
-            break;
+            dict->setObject("Count", num);
+            num->release();
         }
-
-        case kFBTypeIvySandy:
+        if (OSNumber* num = OSNumber::withNumber(_gatedNS / 1000000, 64))
         {
-            // initialize for consistent backlight level before/after sleep\n
-            if (_params._kpch != -1 && REG32_READ(PCHL) != _params._kpch)
-                REG32_WRITE(PCHL, _params._kpch);
-            if (REG32_READ(LEVW) != 0x80000000)
-                REG32_WRITE(LEVW, 0x80000000);
-            if (REG32_READ(LEVX) != _params._klvx)
-                REG32_WRITE(LEVX, _params._klvx);
-            // store new backlight level
-            if (REG32_READ(LEV2) != 0x80000000)
-                REG32_WRITE(LEV2, 0x80000000);
-            REG32_WRITE(LEVL, level);
-            break;
+            dict->setObject("Total ms", num);
+            num->release();
+        }
+        if (_gated)
+        {
+            if (OSNumber* num = OSNumber::withNumber(_gatedSince / 1000000, 64))
+            {
+                dict->setObject("Since ms", num);
+                num->release();
+            }
         }
+        dict->setObject("Gated", _gated ? kOSBooleanTrue : kOSBooleanFalse);
+        setProperty("PWM Gating", dict);
+        dict->release();
     }
 }
 
-UInt32 IntelBacklightHandler::getBacklightLevel()
+template <class Regs>
+void IntelBacklightHandler::gatePWM()
 {
-    if (!_baseAddr)
-        return -1;
+    // zero duty cycle, then turn off PWM output
+    REG32_WRITE(Regs::kLevelReg, Regs::pack(_params, 0));
+    REG32_WRITE(Regs::kEnableReg, REG32_READ(Regs::kEnableReg) & ~kPWMEnable);
+    if (_gated)
+        return; // again after wake, same gated period
+    _gated = true;
+    _gatedSince = uptimeNS();
+    ++_gatedCount;
+    publishGating();
+}
 
-    // read backlight level
-    UInt32 result = -1;
-    switch (_fbtype)
+template <class Regs>
+void IntelBacklightHandler::ungatePWM(UInt32 level)
+{
+    // latch new duty cycle before PWM output is enabled again, so no flash
+    REG32_WRITE(Regs::kLevelReg, Regs::pack(_params, level));
+    if (!_shadowValid)
+        initRegisters<Regs>(); // turns the output on as well
+    else
+        REG32_WRITE(Regs::kEnableReg, REG32_READ(Regs::kEnableReg) | kPWMEnable);
+    _gated = false;
+    _gatedNS += uptimeNS() - _gatedSince;
+    publishGating();
+}
+
+template <class Regs>
+void IntelBacklightHandler::checkDrift()
+{
+    // low-rate drift check: replay init only if something turned the PWM output off
+    if (_shadowValid && ++_driftTicks >= kDriftCheckInterval)
     {
-        case kFBTypeHaswellBroadwell:
-            result = REG32_READ(LEVX) & 0xFFFF;
-            break;
+        _driftTicks = 0;
+        if (!(REG32_READ(Regs::kEnableReg) & kPWMEnable))
+            invalidateShadow();
+    }
+}
 
-        case kFBTypeIvySandy:
-            result = REG32_READ(LEVL);
-            break;
+template <class Regs, bool clamp>
+void IntelBacklightHandler::setLevel(UInt32 level)
+{
+    // adjust level to within limits set by XRGL and XRGH
+    if (clamp)
+    {
+        if (level > _params._xrgh)
+            level = _params._xrgh;
+        if (level && level < _params._xrgl)
+            level = _params._xrgl;
     }
 
+    if (!level)
+    {
+        // after sleep the hardware may have come back on by itself, so gate again
+        if (!_gated || !_shadowValid)
+            gatePWM<Regs>();
+        return;
+    }
+    if (_gated)
+    {
+        ungatePWM<Regs>(level);
+        return;
+    }
+
+    checkDrift<Regs>();
+
+    // store new backlight level, before init turns the output on (on Haswell
+    // and later this also latches the PWM period, so the output never comes on
+    // without one)
+    REG32_WRITE(Regs::kLevelReg, Regs::pack(_params, level));
+    if (!_shadowValid)
+        initRegisters<Regs>();
+}
+
+template <class Regs, bool clamp>
+UInt32 IntelBacklightHandler::getLevel()
+{
+    // read backlight level
+    UInt32 result = Regs::unpack(REG32_READ(Regs::kLevelReg));
+
     // adjust result to be within limits set by XRGL and XRGH
-    if (result > _params._xrgh)
-        result = _params._xrgh;
-    if (result && result < _params._xrgl)
-        result = _params._xrgl;
+    if (clamp)
+    {
+        if (result > _params._xrgh)
+            result = _params._xrgh;
+        if (result && result < _params._xrgl)
+            result = _params._xrgl;
+    }
 
     return result;
 }
 
+void IntelBacklightHandler::setBacklightLevel(UInt32 level)
+{
+    if (!_baseAddr)
+        return;
+
+#ifdef DEBUG
+    UInt64 start = uptimeNS();
+#endif
+
+    (this->*_setLevel)(level);
+
+#ifdef DEBUG
+    _levelChangeNS += uptimeNS() - start;
+    if (0 == ++_levelChanges % kStatsInterval)
+        publishStats();
+#endif
+}
+
+UInt32 IntelBacklightHandler::getBacklightLevel()
+{
+    if (!_baseAddr)
+        return -1;
+
+    return (this->*_getLevel)();
+}
+
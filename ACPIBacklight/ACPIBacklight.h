@@ -29,6 +29,7 @@
 #include <IOKit/IOTimerEventSource.h>
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOWorkLoop.h>
 #include <IOKit/IOLocks.h>
 
 #define NOINLINE __attribute__((noinline))
@@ -42,6 +43,30 @@ struct BacklightHandlerParams
     UInt32 _xrgl, _xrgh, _klvx, _lmax, _kpch;
 };
 
+struct SmoothData
+{
+    int delta;
+    int step;
+    int timeout;
+};
+
+struct SmoothProfile
+{
+    UInt32 up, down;    // ms for a full range change, 0 to use the SmoothDelta/Step/Timeout tiers
+    UInt32 min;         // ms, lower bound for short changes
+    UInt32 easing;      // SmoothEasing value, or kEasingDefault to use SmoothEasing
+};
+
+struct PanelState
+{
+    UInt32 target;      // _value
+    UInt32 current;     // _from_value
+    UInt32 committed;   // _committed_value
+    UInt32 raw;         // last level written to the backend
+    UInt32 backend;
+    UInt32 applied;     // brightness requests applied so far
+};
+
 class EXPORT BacklightHandler : public IOService
 {
     OSDeclareDefaultStructors(BacklightHandler)
@@ -51,6 +76,9 @@ public:
     // BacklightHandler
     virtual void setBacklightLevel(UInt32 level);
     virtual UInt32 getBacklightLevel();
+    // hardware state may have been changed behind the handler (sleep/wake, display
+    // change); called on the panel's workloop like setBacklightLevel
+    virtual void invalidateState();
 };
 
 class EXPORT IntelBacklightHandler : public BacklightHandler
@@ -65,7 +93,38 @@ private:
     UInt32 _fbtype;
     BacklightHandlerParams _params;
 
-    enum { kFBTypeIvySandy = 1, kFBTypeHaswellBroadwell = 2, };
+    enum { kFBTypeIvySandy = 1, kFBTypeHaswellBroadwell = 2, kFBTypeSkylakeKabyLake = 3, kFBTypeCoffeeLake = 4, };
+
+    // per generation register access, and whether XRGL/XRGH limit the level at
+    // all, selected once in start()
+    void (IntelBacklightHandler::*_setLevel)(UInt32 level);
+    UInt32 (IntelBacklightHandler::*_getLevel)();
+    template <class Regs> PRIVATE void selectRegs();
+    template <class Regs, bool clamp> PRIVATE void setLevel(UInt32 level);
+    template <class Regs, bool clamp> PRIVATE UInt32 getLevel();
+
+    // registers that only need to be (re)initialized after sleep (one valid bit each,
+    // plus one for the PWM enable bit in kEnableReg)
+    UInt32 _shadowValid;
+    UInt32 _driftTicks;
+    template <class Regs> PRIVATE void initRegisters();
+    template <class Regs> PRIVATE void checkDrift();
+    PRIVATE void invalidateShadow() { _shadowValid = 0; }
+    // PWM output is disabled while the level is zero; kept across sleep, so the
+    // first non-zero level after wake still goes through ungatePWM
+    bool _gated;
+    UInt64 _gatedSince, _gatedNS;
+    UInt32 _gatedCount;
+    template <class Regs> PRIVATE void gatePWM();
+    template <class Regs> PRIVATE void ungatePWM(UInt32 level);
+    PRIVATE void publishGating();
+
+#ifdef DEBUG
+    // MMIO access accounting, published as "MMIO Stats"
+    UInt32 _mmioReads, _mmioWrites, _levelChanges;
+    UInt64 _levelChangeNS;
+    PRIVATE void publishStats();
+#endif
 
 public:
     // IOService
@@ -76,6 +135,7 @@ public:
     // BacklightHandler
     virtual void setBacklightLevel(UInt32 level);
     virtual UInt32 getBacklightLevel();
+    virtual void invalidateState();
 };
 
 class EXPORT ACPIBacklightPanel : public IODisplayParameterHandler
@@ -91,6 +151,7 @@ public:
     virtual void stop( IOService * provider );
     virtual void free();
     virtual IOReturn setProperties(OSObject* props);
+    virtual IOWorkLoop* getWorkLoop() const;
 
     // IODisplayParameterHandler
     virtual bool setDisplay( IODisplay * display );
@@ -101,6 +162,8 @@ public:
 
     // ACPIBacklightPanel
     virtual bool setBacklightHandler(BacklightHandler* handler, BacklightHandlerParams* params);
+    // consistent copy of the panel state from any thread, never waits on the backend
+    void readState(PanelState* state);
     
 private:
     BacklightHandler* _backlightHandler;
@@ -112,15 +175,236 @@ private:
     IOACPIPlatformDevice *  gpuDevice, * backLightDevice;
 
     IOInterruptEventSource* _workSource;
-    enum { kWorkSave = 0x01, kWorkSetBrightness = 0x02 };
+    enum { kWorkSetBrightness = 0x02 };
     unsigned _workPending;
     PRIVATE void scheduleWork(unsigned newWork);
+    // interruptOccurred is meant for a single interrupt context: concurrent callers can
+    // lose an update of its producer count (and the wakeup with it), so signaling from
+    // threads is serialized, and stop clears _workSource under the same lock
+    IOLock* _signalLock;
+    PRIVATE void signalWork();
+
+    // write-behind persistence of _committed_value to NVRAM and the BIOS (SAVE):
+    // at most one flush per PersistInterval, unchanged values are not written again,
+    // sleep/restart/shutdown flush whatever is still dirty (and the legacy level key,
+    // which only changes there)
+    enum { kPersistNVRAM = 0x01, kPersistSAVE = 0x02 };
+    unsigned _persistDirty;
+    UInt32 _persistedSAVE;      // last raw value passed to SAVE, 0xFFFFFFFF for none
+    UInt32 _persistedLevel;     // acpi-backlight-level as read or last written, 0xFFFFFFFF if not known
+    UInt64 _lastFlush;          // uptime ns
+    bool _persistArmed;
+    IOTimerEventSource* _persistTimer;
+    UInt32 _persistFlushes, _persistForced, _nvramWrites, _saveWrites, _persistSkipped;
+    PRIVATE void markDirty(unsigned what);
+    PRIVATE void flushPersist(bool force);
+    PRIVATE void onPersistTimer();
+    PRIVATE IOReturn flushGated();
+    PRIVATE void publishPersistStats();
+
+    // everything restored at start, one NVRAM variable (kACPIBacklightState);
+    // the bare level is kept next to it for older versions
+    struct StateRecord
+    {
+        UInt8 version;
+        UInt8 backend;
+        UInt16 committed;
+        UInt16 saved;               // level 0xFF restores (before dimming)
+        UInt16 sourceLevels[2];     // [battery, AC], 0xFFFF for none
+        UInt32 fingerprint;         // _BCL, XBCM and handler, the backend is only reused if it matches
+        UInt32 crc;                 // CRC-32 of the fields above
+    } __attribute__((packed));
+    StateRecord _persistedRecord;   // last read or written, unchanged records are not written
+    int _restoredBackend;           // -1 unless a valid record chose one
+    UInt32 _restoredFingerprint;    // of that record, reused only if this boot matches
+    bool _migrateLevel;             // level came from acpi-backlight-level, no record yet
+    PRIVATE UInt32 stateFingerprint();
+    PRIVATE void fillStateRecord(StateRecord* record);
     
+    // state changes are posted from any thread and run in order on the workloop,
+    // which owns _value/_from_value/_committed_value/_saved_value exclusively
+    struct Command
+    {
+        Command* next;
+        UInt32 type;
+        UInt32 arg;
+        UInt64 time;        // uptime (ns) when posted
+        IODisplay* display; // retained, for kCmdDisplay
+    };
+    enum { kCmdBrightness, kCmdCommit, kCmdDisplay, kCmdPowerSource, kCmdWake, kCmdSleep, };
+    Command* volatile _commands;
+    bool _ready;            // initial state set up, commands may run
+    UInt32 _lastTarget;     // last brightness posted, for the synchronous commit reply
+    volatile UInt32 _posted;    // brightness requests posted
+
+    // seqlock protected copy of the state for readers off the workloop
+    volatile UInt32 _stateSeq;  // odd while the workloop is updating _state
+    PanelState _state;
+    UInt32 _rawValue, _applied;
+    PRIVATE void publishState();
+    PRIVATE bool postCommand(UInt32 type, UInt32 arg = 0, IODisplay* display = NULL);
+    PRIVATE Command* takeCommands();
+    PRIVATE void runCommand(Command* cmd);
+    PRIVATE void freeCommands(Command* cmd);
+    PRIVATE void brightnessCommand(UInt32 value, UInt64 time);
+    PRIVATE void commitCommand(bool merged);
+
+    // slider drags post far more requests than need to reach the hardware
+    UInt32 _requestsAccepted, _requestsCoalesced, _requestsApplied;
+    UInt32 _backendWrites;
+    PRIVATE Command* coalesceCommands(Command* list);
+    PRIVATE void publishRequestStats();
+    PRIVATE void displayCommand(IODisplay* display);
+    PRIVATE IOReturn startGated(void* nvramValue);
+
     IOTimerEventSource* _smoothTimer;
     IOCommandGate* _cmdGate;
-    IORecursiveLock* _lock;
     bool _extended;
-    int _smoothIndex;
+
+    // own workloop, so backlight I/O does not queue behind the provider's ACPI work
+    IOWorkLoop* _workLoop;
+    SInt32 _workLoopPriority;   // thread precedence importance, 0 leaves the default
+    struct DelayStats
+    {
+        UInt32 count;
+        UInt64 total, max;      // ns
+    };
+    DelayStats _commandDelay;   // posted until run on the workloop
+    DelayStats _timerDelay;     // smooth timer deadline until it fired
+    PRIVATE static void noteDelay(DelayStats* stats, UInt64 delay);
+    PRIVATE void publishWorkLoopStats();
+
+    // wait and hold time on the workloop per call site (the places the old panel lock
+    // was taken), as power of two histograms in us, plus the longest hold and the
+    // slowest AML method evaluated during it
+    enum { kSiteIntegerSet, kSiteSetDisplay, kSiteUpdate, kSiteSmooth, kSiteTimer, kSiteWork, kSiteQueue, kSiteProperties,
+        kSiteCommit, kSitePowerSource, kSitePower, kSiteDeadline, kSiteCount };
+    enum { kHistBuckets = 16 };
+    struct SiteStats
+    {
+        UInt32 wait[kHistBuckets];
+        UInt32 hold[kHistBuckets];
+        UInt64 maxHold;         // ns
+        const char* maxMethod;
+    };
+    struct Hold
+    {
+        UInt32 site;
+        UInt64 start;
+        const char* method;     // enclosing hold's slowest AML method so far
+        UInt64 amlTime;
+    };
+    SiteStats _siteStats[kSiteCount];
+    const char* _amlMethod;     // slowest AML method in the current hold
+    UInt64 _amlTime;
+    UInt64 _workScheduled;      // uptime of the first scheduleWork not yet run
+    UInt64 _siteStatsPublished;
+    PRIVATE static int histBucket(UInt64 ns);
+    PRIVATE void beginHold(Hold* hold, UInt32 site, UInt64 posted = 0);
+    PRIVATE void endHold(Hold* hold);
+    PRIVATE void noteAML(const char* method, UInt64 start);
+    PRIVATE void publishSiteStats();
+
+#ifdef DEBUG
+    // state machine invariants, checked after every workloop pass in debug builds
+    // (release builds are checked from outside by the host stress harness, tools/panelstress)
+    enum { kInvariantRange, kInvariantOvershoot, kInvariantTrajectory, kInvariantCount };
+    UInt32 _invariantViolations[kInvariantCount];
+    PRIVATE void checkInvariants();
+    PRIVATE void invariantFailed(UInt32 which);
+#endif
+
+    // time based transition from _from_value to _value
+    enum { kEasingLinear = 0, kEasingInOut = 1, kEasingExponential = 2, kEasingCount };
+    PRIVATE UInt64 smoothDuration(int from, int to);
+
+    // transition precomputed when a new target is accepted, timer just walks it
+    struct TrajectoryPoint
+    {
+        UInt64 deadline;    // uptime ns
+        UInt32 raw;         // value for setACPIBrightnessLevel
+        int level;          // OS X level, becomes _from_value
+    };
+    enum { kTrajectoryMax = 128 };
+    TrajectoryPoint _trajectory[kTrajectoryMax];
+    int _trajectoryCount;
+    int _trajectoryIndex;
+    int _trajectoryFrom;        // level the current trajectory started at
+    UInt32 _smoothWakeups, _smoothWrites, _smoothRetargets;
+    PRIVATE void buildTrajectory(UInt64 start, UInt64 duration, UInt64 minSpacing = 0);
+    PRIVATE void armSmoothTimer();
+    PRIVATE void publishSmoothStats();
+
+    // optional critically damped spring, integrated per tick (16.16 levels, levels/s)
+    enum { kSmoothModeCurve = 0, kSmoothModeSpring = 1, kSmoothModeCount };
+    SInt64 _springPos, _springVel;
+    UInt32 _springTicks;        // since last retarget
+    PRIVATE void stepSpring();
+
+    // optional pacing of transition ticks to the display refresh
+    enum { kPacingTimer = 0, kPacingFrame = 1, kPacingCount };
+    UInt64 _framePeriod;        // ns
+    UInt64 _lastWriteFrame;
+    UInt32 _frameDoubles, _frameGaps;
+    PRIVATE void updateFramePeriod();
+    PRIVATE UInt64 smoothTick();
+    PRIVATE UInt64 alignToFrame(UInt64 t);
+    PRIVATE void startSmoothStats();
+    PRIVATE void noteSmoothWrite();
+
+    // deadline requests: reach a level by a given uptime, paced by measured write cost
+    UInt64 _writeCost;          // ns, running average of one backend write
+    UInt64 _deadline;           // ns, 0 when no deadline transition is active
+    UInt32 _deadlinesMet, _deadlinesMissed;
+    SInt64 _deadlineLateness;   // ns, last completed deadline (negative if early)
+    PRIVATE IOReturn setBrightnessDeadline(UInt32 level, UInt64 deadline);
+    PRIVATE UInt32 rawSteps(int from, int to);
+    PRIVATE void finishDeadline(bool met);
+
+    // transition profiles, selected by the source of the request
+    enum { kProfileKey, kProfileSlider, kProfileRestore, kProfileWake, kProfilePower, kProfileCount };
+    UInt32 _activeProfile;
+    UInt64 _lastRequest, _wakeTime;     // uptime ns
+    PRIVATE UInt32 profileForRequest(UInt64 now);
+
+    // XOPT and handler params: read once by findDevices before the panel is
+    // registered and never changed after, so setBacklightHandler reads them ungated
+    UInt32 _options;
+    BacklightHandlerParams _handlerParams;
+
+    // tuning, immutable once published: setProperties fills in a copy and swaps
+    // the pointer; every reader is on the workloop, so the replaced copy is freed
+    // at the end of the setProperties pass
+    enum { kSmoothTiers = 3 };
+    struct PanelConfig
+    {
+        SmoothData tiers[kSmoothTiers];
+        SmoothProfile profiles[kProfileCount];
+        UInt32 easing;
+        UInt32 smoothMode;
+        UInt32 springOmega;             // rad/s
+        UInt32 pacing;
+        UInt32 framePeriod;             // us, when the framebuffer does not tell
+        UInt32 persistInterval;         // ms, minimum time between NVRAM/SAVE flushes
+        // not configuration: links retired copies until the pass ends
+        PanelConfig* retired;
+    };
+    PanelConfig* volatile _config;
+    PanelConfig* _retired;
+    PRIVATE PanelConfig* copyConfig(const PanelConfig* from);
+    PRIVATE void publishConfig(PanelConfig* config);
+    PRIVATE void reclaimConfigs();
+
+    // sleep/wake and power source tracking
+    IONotifier* _sleepWakeNotifier;
+    IONotifier* _powerSourceNotifier;
+    IONotifier* _powerSourceInterest;
+    int _onAC;                          // -1 until known
+    int _sourceLevels[2];               // last level on [battery, AC], -1 for none
+    PRIVATE void powerSourceChanged();
+    static IOReturn powerInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize);
+    static bool powerSourcePublished(void* target, void* refCon, IOService* newService, IONotifier* notifier);
+    static IOReturn powerSourceInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize);
 
     PRIVATE bool findDevices(IOService * provider);
     PRIVATE IOACPIPlatformDevice *  getGPU();
@@ -137,8 +421,9 @@ private:
 	PRIVATE void setACPIBrightnessLevel(UInt32 level);
     PRIVATE void saveACPIBrightnessLevel(UInt32 level);
 	PRIVATE UInt32 queryACPICurentBrightnessLevel();
+    PRIVATE UInt32 rawForLevel(UInt32 level);
     PRIVATE void setBrightnessLevel(UInt32 level);
-    PRIVATE void setBrightnessLevelSmooth(UInt32 level);
+    PRIVATE void setBrightnessLevelSmooth(UInt32 level, UInt32 profile = kProfileKey);
 	
 	PRIVATE UInt32 setupIndexedLevels();
 	PRIVATE UInt32 findIndexForLevel(UInt32 BCLvalue);
@@ -147,11 +432,16 @@ private:
 	UInt32 BCLlevelsCount;
 	UInt32 minAC, maxBat, min, max;
     
-    UInt32 _options;
-    enum { kDisableSmooth = 0x01, kWaitForHandler = 0x02, kForceUseHandler = 0x04, };
-    BacklightHandlerParams _handlerParams;
+    enum { kDisableSmooth = 0x01, kWaitForHandler = 0x02, kForceUseHandler = 0x04, kDisableProbe = 0x08, kPerSourceLevels = 0x10, };
     PRIVATE bool useBacklightHandler();
 
+    enum { kBackendACPI = 0, kBackendHandler = 1, };
+    UInt32 _backend;
+    PRIVATE void probeBackends();
+    PRIVATE UInt64 probeBackend(UInt32 backend, UInt32 level, bool* correct);
+    PRIVATE bool setBackendLevel(UInt32 backend, UInt32 level);
+    PRIVATE UInt32 queryBackendLevel(UInt32 backend);
+
 	bool hasSaveMethod;
     int _value;  // osx value
     int _from_value; // current value working towards _value
@@ -165,8 +455,10 @@ private:
 
     PRIVATE void  processWorkQueue(IOInterruptEventSource *, int);
     PRIVATE void  onSmoothTimer(void);
-    PRIVATE void saveACPIBrightnessLevelNVRAM(UInt32 level);
+    PRIVATE void saveStateNVRAM(const StateRecord* record);
+    PRIVATE void saveLevelNVRAM(UInt16 level);
     PRIVATE UInt32 loadFromNVRAM(void);
+    PRIVATE OSData* copyNVRAMData(IORegistryEntry* nvram, const char* key);
     PRIVATE NOINLINE UInt32 indexForLevel(UInt32 value, UInt32* rem = NULL);
     PRIVATE NOINLINE UInt32 levelForIndex(UInt32 level);
     PRIVATE UInt32 levelForValue(UInt32 value);
@@ -0,0 +1,177 @@
+//
+//  contention.cpp
+//  ACPIBacklight
+//
+//  Host benchmark for concurrent brightness callers.  Several threads call
+//  doIntegerSet (what IODisplay does for every slider/key event) on the real
+//  panel over a PNLF whose _BCM takes a configurable time, and the tool
+//  reports how long callers are held up, how many requests go through, and
+//  how often callers had to wait for each other.
+//
+//  The same source builds twice: against the current kext (requests go into
+//  the workloop command queue, callers never wait for _BCM) and, as
+//  contention-old, against tools/legacy: a pinned copy of the panel source
+//  from the last revision that still had the panel's IORecursiveLock (held by
+//  callers across AML evaluation).  Run both with the same arguments to compare.
+//
+//  Build: make contention
+//  Usage: contention [-l bcm_latency_us] [-i interval_us] [-t seconds] [-v]
+//      -l  _BCM/XBCM evaluation time (default 2000)
+//      -i  pause between one caller's requests (default 1000, 0 for none)
+//      -t  seconds per row (default 1)
+//
+
+#include "hostrig.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <thread>
+#include <unistd.h>
+
+#ifdef HOST_LEGACY_PANEL
+#define kDesign "old: IORecursiveLock held across _BCM"
+#else
+#define kDesign "new: workloop command queue"
+#endif
+
+#define kInfoPlist "ACPIBacklight/ACPIBacklight-Info.plist"
+#define kXOPTNoSmooth 0x09  // no smoothing, no backend probe
+
+static UInt64 latencyUS = 2000, intervalUS = 1000;
+static double seconds = 1;
+
+struct Row
+{
+    UInt64 requests;
+    std::vector<UInt64> latency;    // ns per doIntegerSet
+    UInt64 writes;
+    HostGateStats lock;
+    UInt64 overlapped;
+};
+
+static void caller(HostRig* rig, unsigned seed, UInt64 end, std::vector<UInt64>* latency)
+{
+    OSDictionary* params = rig->newParams();
+    while (hostUptimeNS() < end)
+    {
+        seed = seed * 1103515245 + 12345;
+        UInt32 level = 64 + (seed >> 16) % 960;
+        UInt64 start = hostUptimeNS();
+        rig->post(level, params);
+        latency->push_back(hostUptimeNS() - start);
+        if (intervalUS)
+            usleep((useconds_t)intervalUS);
+    }
+    params->release();
+}
+
+static HostGateStats minus(const HostGateStats& a, const HostGateStats& b)
+{
+    HostGateStats d;
+    d.acquisitions = a.acquisitions - b.acquisitions;
+    d.contended = a.contended - b.contended;
+    d.waitNS = a.waitNS - b.waitNS;
+    d.maxWaitNS = a.maxWaitNS;
+    return d;
+}
+
+static Row run(UInt32 xopt, int threads)
+{
+    HostRig rig;
+    rig.acpi->extended = true;
+    rig.acpi->bcl.push_back(1000);
+    rig.acpi->bcl.push_back(500);
+    for (int i = 0; i <= 100; i++)
+        rig.acpi->bcl.push_back(i * 10);
+    rig.acpi->setInteger("XOPT", xopt);
+    if (!rig.start(kInfoPlist))
+    {
+        fprintf(stderr, "contention: panel start failed\n");
+        exit(1);
+    }
+    rig.attachDisplay();
+    rig.post(512);
+    rig.settle();
+    rig.acpi->setLatencyNS = latencyUS * 1000;
+    // _BCM waiting on the EC sleeps; spinning would take the CPU from the callers on a small machine
+    rig.acpi->latencySleeps = true;
+
+    UInt64 writes = rig.acpi->sets, overlapped = rig.acpi->overlapped;
+    HostGateStats lock = hostRecursiveLockStats();
+    std::vector<std::vector<UInt64> > latency(threads);
+    std::vector<std::thread> callers;
+    UInt64 end = hostUptimeNS() + (UInt64)(seconds * 1e9);
+    for (int i = 0; i < threads; i++)
+        callers.push_back(std::thread(caller, &rig, 1 + i, end, &latency[i]));
+    for (int i = 0; i < threads; i++)
+        callers[i].join();
+
+    Row row;
+    row.latency.clear();
+    for (int i = 0; i < threads; i++)
+        row.latency.insert(row.latency.end(), latency[i].begin(), latency[i].end());
+    row.requests = row.latency.size();
+    row.writes = rig.acpi->sets - writes;
+    row.lock = minus(hostRecursiveLockStats(), lock);
+    row.overlapped = rig.acpi->overlapped - overlapped;
+    rig.acpi->setLatencyNS = 0;
+    rig.stop();
+    return row;
+}
+
+static double percentile(std::vector<UInt64>& v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return (double)v[(size_t)(p * (v.size() - 1))] / 1000.0;
+}
+
+int main(int argc, char* argv[])
+{
+    bool verbose = false;
+    int c;
+    while ((c = getopt(argc, argv, "l:i:t:v")) != -1)
+    {
+        switch (c)
+        {
+            case 'l': latencyUS = strtoull(optarg, NULL, 0); break;
+            case 'i': intervalUS = strtoull(optarg, NULL, 0); break;
+            case 't': seconds = atof(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: contention [-l bcm_latency_us] [-i interval_us] [-t seconds] [-v]\n");
+                return 2;
+        }
+    }
+    hostSetLogging(verbose);
+
+    printf("%s\n_BCM %lluus, %lluus between one caller's requests, %.1fs per row\n", kDesign, latencyUS, intervalUS, seconds);
+    static const struct { const char* name; UInt32 xopt; } modes[] =
+    {
+        { "smoothing off", kXOPTNoSmooth },
+        { "smoothing on", 0x08 },
+    };
+    static const int threads[] = { 1, 2, 4, 8 };
+    for (size_t m = 0; m < sizeof(modes)/sizeof(modes[0]); m++)
+    {
+        printf("\n%s\n", modes[m].name);
+        printf("  %7s %10s %10s %10s %10s %10s %10s %10s %12s %10s\n", "callers", "req/s", "p50 us", "p99 us", "max us",
+               "held", "_BCM/s", "lock waits", "lock wait ms", "AML overlap");
+        for (size_t t = 0; t < sizeof(threads)/sizeof(threads[0]); t++)
+        {
+            Row row = run(modes[m].xopt, threads[t]);
+            double p50 = percentile(row.latency, 0.5);
+            double p99 = percentile(row.latency, 0.99);
+            double max = percentile(row.latency, 1.0);
+            // callers that sat through (at least half) a _BCM
+            UInt64 held = 0;
+            for (size_t i = 0; i < row.latency.size(); i++)
+                held += row.latency[i] >= latencyUS * 500;
+            printf("  %7d %10.0f %10.1f %10.1f %10.1f %10llu %10.0f %10llu %12.1f %10llu\n", threads[t],
+                   row.requests / seconds, p50, p99, max, held, row.writes / seconds,
+                   row.lock.contended, row.lock.waitNS / 1e6, row.overlapped);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,267 @@
+//
+//  framesim.cpp
+//  ACPIBacklight
+//
+//  Host tool that measures how evenly smooth transitions put backlight writes
+//  into display frames.  The kext's frame pacing (SmoothPacing 1) aligns
+//  trajectory points to an uptime grid with the frame period; it has no vblank
+//  to lock to, and its own "Frame Doubles"/"Frame Gaps" stats are counted on the
+//  same grid.  Here the real panel runs smooth transitions over a PNLF with
+//  _BCM latency, every write is timestamped where the mock ACPI method
+//  completes, and the writes are then binned by simulated vblanks that are NOT
+//  aligned to uptime: a phase offset, a refresh that differs slightly from
+//  what the framebuffer reports (59.94 vs 60 Hz), and vblank jitter.
+//
+//  Reported per vblank model: writes, doubles (a second write in the same
+//  frame), gaps (frames skipped between two writes of a transition) and where
+//  in the frame the writes land.  The "uptime grid" row is the kext's own
+//  model and must match its Smooth Stats.
+//
+//  Build: make framesim
+//  Usage: framesim [-l bcm_latency_us] [-n transitions] [-v]
+//
+
+#include "hostrig.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define kInfoPlist "ACPIBacklight/ACPIBacklight-Info.plist"
+
+// 1920x1080@60 CEA timing: 2200x1125 total at 148.5 MHz, 16.667 ms
+#define kPixelClock 148500000ULL
+#define kPixelCount (2200ULL * 1125ULL)
+#define kFrameNS    (kPixelCount * 1000000000ULL / kPixelClock)
+
+class FramePNLF : public HostACPIDevice
+{
+public:
+    std::mutex lock;
+    std::vector<UInt64> writes;
+
+    virtual void levelWritten(UInt32 raw, UInt64 when)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        writes.push_back(when);
+    }
+};
+
+struct Transition
+{
+    std::vector<UInt64> writes;     // ns uptime, in order
+    UInt32 doubles, gaps;           // as the kext reported them
+};
+
+// a display's vblanks: phase + k*period, each moved by up to +-jitter
+struct VBlank
+{
+    const char* name;
+    double period;                  // ns
+    double phase;                   // fraction of the period after uptime 0
+    double jitter;                  // ns
+
+    double at(SInt64 k) const
+    {
+        // fixed pseudo random jitter per frame, so every write sees the same vblank
+        UInt64 h = (UInt64)k * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+        double u = (double)(h % 1000001) / 1000000.0 * 2 - 1;
+        return phase * period + (double)k * period + u * jitter;
+    }
+
+    SInt64 frameOf(UInt64 t, double* into) const
+    {
+        SInt64 k = (SInt64)floor(((double)t - phase * period) / period);
+        while ((double)t < at(k))
+            --k;
+        while ((double)t >= at(k + 1))
+            ++k;
+        *into = ((double)t - at(k)) / period;
+        return k;
+    }
+};
+
+static void collect(UInt32 pacing, UInt64 latencyUS, int n, std::vector<Transition>* out)
+{
+    FramePNLF* pnlf = new FramePNLF;
+    HostRig rig(pnlf);
+    // extended _BCL over a wide raw range, so (nearly) every frame has a new raw value
+    rig.acpi->extended = true;
+    rig.acpi->bcl.push_back(10000);
+    rig.acpi->bcl.push_back(5000);
+    for (int i = 0; i <= 100; i++)
+        rig.acpi->bcl.push_back(i * 100);
+    rig.acpi->setLatencyNS = latencyUS * 1000;
+
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    OSNumber* num = OSNumber::withNumber(pacing, 32);
+    properties->setObject("SmoothPacing", num);
+    num->release();
+    bool started = rig.start(kInfoPlist, properties);
+    properties->release();
+    if (!started)
+    {
+        fprintf(stderr, "framesim: panel start failed\n");
+        exit(1);
+    }
+    rig.attachDisplay(kPixelClock, kPixelCount);
+    rig.post(64);
+    rig.settle();
+
+    for (int i = 0; i < n; i++)
+    {
+        {
+            std::lock_guard<std::mutex> guard(pnlf->lock);
+            pnlf->writes.clear();
+        }
+        rig.post(i & 1 ? 64 : 1024);
+        rig.settle();
+
+        Transition t;
+        {
+            std::lock_guard<std::mutex> guard(pnlf->lock);
+            t.writes = pnlf->writes;
+        }
+        t.doubles = t.gaps = 0;
+        OSDictionary* stats = OSDynamicCast(OSDictionary, rig.panel->getProperty("Smooth Stats"));
+        if (OSNumber* value = stats ? OSDynamicCast(OSNumber, stats->getObject("Frame Doubles")) : NULL)
+            t.doubles = value->unsigned32BitValue();
+        if (OSNumber* value = stats ? OSDynamicCast(OSNumber, stats->getObject("Frame Gaps")) : NULL)
+            t.gaps = value->unsigned32BitValue();
+        out->push_back(t);
+    }
+    rig.stop();
+}
+
+static double percentile(std::vector<double> v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t)(p * (v.size() - 1))];
+}
+
+static void report(const char* title, const std::vector<Transition>& transitions)
+{
+    const double P = (double)kFrameNS;
+
+    // where on the uptime grid the writes land (timer wakeup plus _BCM latency)
+    std::vector<double> phases;
+    for (size_t i = 0; i < transitions.size(); i++)
+        for (size_t j = 0; j < transitions[i].writes.size(); j++)
+            phases.push_back(fmod((double)transitions[i].writes[j], P) / P);
+    double landing = percentile(phases, 0.5);
+
+    const VBlank models[] =
+    {
+        { "uptime grid (what the kext counts)", P, 0.0, 0 },
+        { "60 Hz, vblank at 1/2 frame", P, 0.5, 0 },
+        { "60 Hz, vblank just after the grid", P, 0.002, 0 },
+        { "60 Hz, vblank at 1/2 frame, 200us jitter", P, 0.5, 200000 },
+        { "60 Hz, vblank just after, 200us jitter", P, 0.002, 200000 },
+        { "60 Hz, vblank where writes land, 200us", P, landing, 200000 },
+        { "59.94 Hz (framebuffer says 60), 1/2", P * 1.001, 0.5, 0 },
+        { "59.94 Hz (framebuffer says 60), 1/4", P * 1.001, 0.25, 0 },
+    };
+
+    UInt32 kextDoubles = 0, kextGaps = 0;
+    size_t writes = 0;
+    for (size_t i = 0; i < transitions.size(); i++)
+    {
+        kextDoubles += transitions[i].doubles;
+        kextGaps += transitions[i].gaps;
+        writes += transitions[i].writes.size();
+    }
+    printf("%s: %zu transitions, %zu writes, kext Smooth Stats: %u doubles, %u gaps\n",
+           title, transitions.size(), writes, kextDoubles, kextGaps);
+    printf("  %-42s %8s %8s %8s   %s\n", "vblank", "frames", "doubles", "gaps", "write lands in frame (p5 / p50 / p95)");
+    for (size_t m = 0; m < sizeof(models)/sizeof(models[0]); m++)
+    {
+        const VBlank& vb = models[m];
+        UInt32 doubles = 0, gaps = 0;
+        UInt64 frames = 0;
+        std::vector<double> into;
+        for (size_t i = 0; i < transitions.size(); i++)
+        {
+            const std::vector<UInt64>& w = transitions[i].writes;
+            SInt64 first = 0, last = 0;
+            for (size_t j = 0; j < w.size(); j++)
+            {
+                double f;
+                SInt64 k = vb.frameOf(w[j], &f);
+                into.push_back(f);
+                if (j)
+                {
+                    if (k == last)
+                        ++doubles;
+                    else if (k > last + 1)
+                        gaps += (UInt32)(k - last - 1);
+                }
+                else
+                    first = k;
+                last = k;
+            }
+            if (!w.empty())
+                frames += (UInt64)(last - first + 1);
+        }
+        printf("  %-42s %8llu %8u %8u   %.3f / %.3f / %.3f\n", vb.name, frames, doubles, gaps,
+               percentile(into, 0.05), percentile(into, 0.5), percentile(into, 0.95));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    UInt64 latencyUS = 300;
+    int n = 6;
+    bool verbose = false;
+    int c;
+    while ((c = getopt(argc, argv, "l:n:v")) != -1)
+    {
+        switch (c)
+        {
+            case 'l': latencyUS = strtoull(optarg, NULL, 0); break;
+            case 'n': n = atoi(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: framesim [-l bcm_latency_us] [-n transitions] [-v]\n");
+                return 2;
+        }
+    }
+    hostSetLogging(verbose);
+
+    printf("frame %.3f ms, _BCM latency %llu us\n\n", kFrameNS / 1e6, latencyUS);
+    std::vector<Transition> frame, timer;
+    collect(1, latencyUS, n, &frame);
+    report("SmoothPacing 1 (frame)", frame);
+    printf("\n");
+    collect(0, latencyUS, n, &timer);
+    report("SmoothPacing 0 (timer)", timer);
+
+    // the kext's own numbers are the uptime grid row by construction
+    UInt32 doubles = 0, gaps = 0;
+    const VBlank grid = { "", (double)kFrameNS, 0.0, 0 };
+    int mismatches = 0;
+    for (size_t i = 0; i < frame.size(); i++)
+    {
+        doubles = gaps = 0;
+        const std::vector<UInt64>& w = frame[i].writes;
+        SInt64 last = 0;
+        for (size_t j = 0; j < w.size(); j++)
+        {
+            double f;
+            SInt64 k = grid.frameOf(w[j], &f);
+            if (j && k == last)
+                ++doubles;
+            else if (j && k > last + 1)
+                gaps += (UInt32)(k - last - 1);
+            last = k;
+        }
+        if (doubles != frame[i].doubles || gaps != frame[i].gaps)
+            ++mismatches;
+    }
+    if (mismatches)
+        printf("\n%d transition(s) where the kext's Smooth Stats differ from the uptime grid\n", mismatches);
+    return mismatches ? 1 : 0;
+}
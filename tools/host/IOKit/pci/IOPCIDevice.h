@@ -0,0 +1,2 @@
+// host build: see tools/host/hostkit.h
+#include <hostkit.h>
@@ -0,0 +1,2275 @@
+//
+//  hostkit.cpp
+//  ACPIBacklight
+//
+//  libkern/IOKit subset for host builds, see hostkit.h.  Semantics follow the
+//  kernel where the kext depends on them: retain counts, the workloop gate is
+//  a recursive lock held while event source actions run, timers fire on the
+//  workloop thread, runAction from any thread runs inside the gate, and
+//  waitForService consumes its matching dictionary.
+//
+
+#include "hostmock.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <thread>
+
+////////////////////////////////////////////////////////////////
+// kernel services
+
+static std::atomic<bool> gLogging(true);
+
+bool hostSetLogging(bool enabled)
+{
+    return gLogging.exchange(enabled);
+}
+
+void IOLog(const char* format, ...)
+{
+    if (!gLogging)
+        return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+static std::atomic<bool> gVirtualClock(false);
+static std::atomic<UInt64> gVirtualNS(0);
+
+static UInt64 monotonicNS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UInt64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+UInt64 hostUptimeNS()
+{
+    return gVirtualClock ? gVirtualNS.load() : monotonicNS();
+}
+
+void hostUseVirtualClock(bool enabled)
+{
+    // continues from the real uptime, so nothing armed before goes backwards
+    if (enabled)
+        gVirtualNS = monotonicNS();
+    gVirtualClock = enabled;
+}
+
+bool hostVirtualClock()
+{
+    return gVirtualClock;
+}
+
+void hostAdvanceClock(UInt64 ns)
+{
+    gVirtualNS += ns;
+}
+
+void hostSpinNS(UInt64 ns)
+{
+    UInt64 end = hostUptimeNS() + ns;
+    while (hostUptimeNS() < end)
+        ;
+}
+
+void IOSleep(unsigned ms)
+{
+    if (gVirtualClock)
+        hostAdvanceClock(ms * 1000000ULL);
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void IODelay(unsigned us)
+{
+    hostSpinNS(us * 1000ULL);
+}
+
+void* IOMalloc(vm_size_t size)
+{
+    return malloc(size);
+}
+
+void IOFree(void* address, vm_size_t)
+{
+    free(address);
+}
+
+void clock_get_uptime(UInt64* result)
+{
+    *result = hostUptimeNS();
+}
+
+void absolutetime_to_nanoseconds(UInt64 abstime, UInt64* result)
+{
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(UInt64 ns, UInt64* result)
+{
+    *result = ns;
+}
+
+void clock_interval_to_deadline(UInt32 interval, UInt32 scale, UInt64* result)
+{
+    *result = hostUptimeNS() + (UInt64)interval * scale;
+}
+
+SInt32 OSAddAtomic(SInt32 amount, volatile SInt32* address)
+{
+    return __sync_fetch_and_add(address, amount);
+}
+
+SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64* address)
+{
+    return __sync_fetch_and_add(address, amount);
+}
+
+SInt32 OSIncrementAtomic(volatile SInt32* address)
+{
+    return __sync_fetch_and_add(address, 1);
+}
+
+SInt32 OSDecrementAtomic(volatile SInt32* address)
+{
+    return __sync_fetch_and_sub(address, 1);
+}
+
+bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32* address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+bool OSCompareAndSwapPtr(void* oldValue, void* newValue, void* volatile* address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+UInt32 OSBitOrAtomic(UInt32 mask, volatile UInt32* address)
+{
+    return __sync_fetch_and_or(address, mask);
+}
+
+UInt32 OSBitAndAtomic(UInt32 mask, volatile UInt32* address)
+{
+    return __sync_fetch_and_and(address, mask);
+}
+
+void OSMemoryBarrier()
+{
+    __sync_synchronize();
+}
+
+extern const int version_major = 15;
+extern const int version_minor = 0;
+
+kmod_info_t kmod_info = { "com.darwin.driver.ACPIBacklight", "host" };
+
+const char* OSKextGetCurrentIdentifier()
+{
+    return kmod_info.name;
+}
+
+UInt32 OSKextGetCurrentLoadTag()
+{
+    return 1;
+}
+
+const char* OSKextGetCurrentVersionString()
+{
+    return kmod_info.version;
+}
+
+extern "C" kern_return_t thread_policy_set(thread_t, thread_policy_flavor_t, thread_policy_t, mach_msg_type_number_t)
+{
+    return KERN_SUCCESS;
+}
+
+struct IOLock
+{
+    std::mutex mutex;
+};
+
+IOLock* IOLockAlloc()
+{
+    return new IOLock;
+}
+
+void IOLockFree(IOLock* lock)
+{
+    delete lock;
+}
+
+void IOLockLock(IOLock* lock)
+{
+    lock->mutex.lock();
+}
+
+void IOLockUnlock(IOLock* lock)
+{
+    lock->mutex.unlock();
+}
+
+bool IOLockTryLock(IOLock* lock)
+{
+    return lock->mutex.try_lock();
+}
+
+struct IORecursiveLock
+{
+    std::recursive_mutex mutex;
+};
+
+IORecursiveLock* IORecursiveLockAlloc()
+{
+    return new IORecursiveLock;
+}
+
+void IORecursiveLockFree(IORecursiveLock* lock)
+{
+    delete lock;
+}
+
+// all recursive locks together, same meaning as HostGateStats
+static std::atomic<UInt64> gLockAcquisitions, gLockContended, gLockWaitNS, gLockMaxWaitNS;
+
+void IORecursiveLockLock(IORecursiveLock* lock)
+{
+    ++gLockAcquisitions;
+    if (lock->mutex.try_lock())
+        return;
+    UInt64 start = hostUptimeNS();
+    lock->mutex.lock();
+    UInt64 wait = hostUptimeNS() - start;
+    ++gLockContended;
+    gLockWaitNS += wait;
+    UInt64 max = gLockMaxWaitNS;
+    while (wait > max && !gLockMaxWaitNS.compare_exchange_weak(max, wait))
+        ;
+}
+
+HostGateStats hostRecursiveLockStats()
+{
+    HostGateStats stats;
+    stats.acquisitions = gLockAcquisitions;
+    stats.contended = gLockContended;
+    stats.waitNS = gLockWaitNS;
+    stats.maxWaitNS = gLockMaxWaitNS;
+    return stats;
+}
+
+void IORecursiveLockUnlock(IORecursiveLock* lock)
+{
+    lock->mutex.unlock();
+}
+
+bool IORecursiveLockTryLock(IORecursiveLock* lock)
+{
+    return lock->mutex.try_lock();
+}
+
+////////////////////////////////////////////////////////////////
+// OSObject and the containers
+
+OSMetaClass::OSMetaClass(const char* name, const OSMetaClass* super) : _name(name), _super(super)
+{
+}
+
+bool OSMetaClass::isKindOf(const char* name) const
+{
+    for (const OSMetaClass* meta = this; meta; meta = meta->_super)
+    {
+        if (!strcmp(meta->_name, name))
+            return true;
+    }
+    return false;
+}
+
+const OSMetaClass OSObject::gMetaClass("OSObject", NULL);
+
+OSObject::OSObject() : _retainCount(1)
+{
+}
+
+OSObject::~OSObject()
+{
+}
+
+void* OSObject::operator new(size_t size)
+{
+    void* mem = ::operator new(size);
+    memset(mem, 0, size);
+    return mem;
+}
+
+void OSObject::operator delete(void* mem)
+{
+    ::operator delete(mem);
+}
+
+void OSObject::retain() const
+{
+    __sync_fetch_and_add(&_retainCount, 1);
+}
+
+void OSObject::release() const
+{
+    if (1 == __sync_fetch_and_sub(&_retainCount, 1))
+        const_cast<OSObject*>(this)->free();
+}
+
+int OSObject::getRetainCount() const
+{
+    return _retainCount;
+}
+
+bool OSObject::init()
+{
+    return true;
+}
+
+void OSObject::free()
+{
+    delete this;
+}
+
+OSObject* OSObject::metaCast(const char* className) const
+{
+    return getMetaClass()->isKindOf(className) ? const_cast<OSObject*>(this) : NULL;
+}
+
+bool OSObject::serialize(OSSerialize*) const
+{
+    return false;
+}
+
+bool OSObject::isEqualTo(const OSObject* other) const
+{
+    return this == other;
+}
+
+OSDefineMetaClassAndStructors(OSString, OSObject)
+
+OSString* OSString::withCString(const char* cString)
+{
+    OSString* string = new OSString;
+    if (!string->initWithCString(cString))
+    {
+        string->release();
+        return NULL;
+    }
+    return string;
+}
+
+OSString* OSString::withCStringNoCopy(const char* cString)
+{
+    return withCString(cString);
+}
+
+bool OSString::initWithCString(const char* cString)
+{
+    _string = NULL;
+    if (!cString || !OSObject::init())
+        return false;
+    _length = (unsigned)strlen(cString);
+    _string = (char*)malloc(_length + 1);
+    if (!_string)
+        return false;
+    memcpy(_string, cString, _length + 1);
+    return true;
+}
+
+void OSString::free()
+{
+    ::free(_string);
+    OSObject::free();
+}
+
+bool OSString::isEqualTo(const char* cString) const
+{
+    return cString && !strcmp(_string, cString);
+}
+
+bool OSString::isEqualTo(const OSObject* other) const
+{
+    const OSString* string = OSDynamicCast(OSString, other);
+    return string && !strcmp(_string, string->_string);
+}
+
+bool OSString::serialize(OSSerialize* s) const
+{
+    return s->addString("<string>") && s->addXMLEscaped(_string, _length) && s->addString("</string>");
+}
+
+OSDefineMetaClassAndStructors(OSSymbol, OSString)
+
+const OSSymbol* OSSymbol::withCString(const char* cString)
+{
+    OSSymbol* symbol = new OSSymbol;
+    if (!symbol->initWithCString(cString))
+    {
+        symbol->release();
+        return NULL;
+    }
+    return symbol;
+}
+
+const OSSymbol* OSSymbol::withCStringNoCopy(const char* cString)
+{
+    return withCString(cString);
+}
+
+OSDefineMetaClassAndStructors(OSNumber, OSObject)
+
+OSNumber* OSNumber::withNumber(unsigned long long value, unsigned numberOfBits)
+{
+    OSNumber* number = new OSNumber;
+    number->_size = numberOfBits;
+    number->setValue(value);
+    return number;
+}
+
+void OSNumber::setValue(unsigned long long value)
+{
+    _value = _size < 64 ? value & ((1ULL << _size) - 1) : value;
+}
+
+bool OSNumber::isEqualTo(const OSObject* other) const
+{
+    const OSNumber* number = OSDynamicCast(OSNumber, other);
+    return number && number->_value == _value;
+}
+
+bool OSNumber::serialize(OSSerialize* s) const
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "<integer size=\"%u\">0x%llx</integer>", _size, _value);
+    return s->addString(buf);
+}
+
+OSDefineMetaClassAndStructors(OSBoolean, OSObject)
+
+OSBoolean* OSBoolean::hostWithValue(bool value)
+{
+    OSBoolean* boolean = new OSBoolean;
+    boolean->_value = value;
+    return boolean;
+}
+
+bool OSBoolean::serialize(OSSerialize* s) const
+{
+    return s->addString(_value ? "<true/>" : "<false/>");
+}
+
+OSBoolean* kOSBooleanTrue = OSBoolean::hostWithValue(true);
+OSBoolean* kOSBooleanFalse = OSBoolean::hostWithValue(false);
+
+OSDefineMetaClassAndStructors(OSData, OSObject)
+
+OSData* OSData::withCapacity(unsigned capacity)
+{
+    OSData* data = new OSData;
+    data->_length = 0;
+    data->_capacity = capacity;
+    data->_bytes = capacity ? (UInt8*)malloc(capacity) : NULL;
+    if (capacity && !data->_bytes)
+    {
+        data->release();
+        return NULL;
+    }
+    return data;
+}
+
+OSData* OSData::withBytes(const void* bytes, unsigned length)
+{
+    OSData* data = withCapacity(length);
+    if (data && !data->appendBytes(bytes, length))
+    {
+        data->release();
+        return NULL;
+    }
+    return data;
+}
+
+void OSData::free()
+{
+    ::free(_bytes);
+    OSObject::free();
+}
+
+const void* OSData::getBytesNoCopy(unsigned start, unsigned length) const
+{
+    if (!length || start + length > _length)
+        return NULL;
+    return _bytes + start;
+}
+
+bool OSData::appendBytes(const void* bytes, unsigned length)
+{
+    if (_length + length > _capacity)
+    {
+        unsigned capacity = _capacity ? _capacity : 16;
+        while (capacity < _length + length)
+            capacity *= 2;
+        UInt8* grown = (UInt8*)realloc(_bytes, capacity);
+        if (!grown)
+            return false;
+        _bytes = grown;
+        _capacity = capacity;
+    }
+    if (bytes)
+        memcpy(_bytes + _length, bytes, length);
+    else
+        memset(_bytes + _length, 0, length);
+    _length += length;
+    return true;
+}
+
+bool OSData::isEqualTo(const OSObject* other) const
+{
+    const OSData* data = OSDynamicCast(OSData, other);
+    return data && data->_length == _length && !memcmp(data->_bytes, _bytes, _length);
+}
+
+static const char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+bool OSData::serialize(OSSerialize* s) const
+{
+    if (!s->addString("<data>"))
+        return false;
+    char quad[4];
+    for (unsigned i = 0; i < _length; i += 3)
+    {
+        UInt32 v = _bytes[i] << 16;
+        if (i+1 < _length)
+            v |= _bytes[i+1] << 8;
+        if (i+2 < _length)
+            v |= _bytes[i+2];
+        quad[0] = base64Chars[(v >> 18) & 63];
+        quad[1] = base64Chars[(v >> 12) & 63];
+        quad[2] = i+1 < _length ? base64Chars[(v >> 6) & 63] : '=';
+        quad[3] = i+2 < _length ? base64Chars[v & 63] : '=';
+        if (!s->addBytes(quad, 4))
+            return false;
+    }
+    return s->addString("</data>");
+}
+
+OSDefineMetaClassAndStructors(OSCollection, OSObject)
+OSDefineMetaClassAndStructors(OSIterator, OSObject)
+
+OSObject* OSIterator::getNextObject()
+{
+    return NULL;
+}
+
+OSDefineMetaClassAndStructors(OSArray, OSCollection)
+
+OSArray* OSArray::withCapacity(unsigned capacity)
+{
+    OSArray* array = new OSArray;
+    array->_count = 0;
+    array->_capacity = capacity ? capacity : 1;
+    array->_array = (OSObject**)malloc(array->_capacity * sizeof(OSObject*));
+    if (!array->_array)
+    {
+        array->release();
+        return NULL;
+    }
+    return array;
+}
+
+void OSArray::free()
+{
+    for (unsigned i = 0; i < _count; i++)
+        _array[i]->release();
+    ::free(_array);
+    OSObject::free();
+}
+
+bool OSArray::setObject(const OSObject* object)
+{
+    if (!object)
+        return false;
+    if (_count == _capacity)
+    {
+        OSObject** grown = (OSObject**)realloc(_array, 2 * _capacity * sizeof(OSObject*));
+        if (!grown)
+            return false;
+        _array = grown;
+        _capacity *= 2;
+    }
+    object->retain();
+    _array[_count++] = const_cast<OSObject*>(object);
+    return true;
+}
+
+bool OSArray::serialize(OSSerialize* s) const
+{
+    if (!s->addString("<array>"))
+        return false;
+    for (unsigned i = 0; i < _count; i++)
+    {
+        if (!_array[i]->serialize(s))
+            return false;
+    }
+    return s->addString("</array>");
+}
+
+OSDefineMetaClassAndStructors(OSDictionary, OSCollection)
+
+OSDictionary* OSDictionary::withCapacity(unsigned capacity)
+{
+    OSDictionary* dict = new OSDictionary;
+    dict->_count = 0;
+    dict->_capacity = capacity ? capacity : 1;
+    dict->_entries = (Entry*)malloc(dict->_capacity * sizeof(Entry));
+    if (!dict->_entries)
+    {
+        dict->release();
+        return NULL;
+    }
+    return dict;
+}
+
+OSDictionary* OSDictionary::withDictionary(const OSDictionary* from, unsigned capacity)
+{
+    if (!from)
+        return NULL;
+    OSDictionary* dict = withCapacity(capacity > from->_count ? capacity : from->_count);
+    if (dict)
+        dict->merge(from);
+    return dict;
+}
+
+void OSDictionary::free()
+{
+    for (unsigned i = 0; i < _count; i++)
+    {
+        _entries[i].key->release();
+        _entries[i].value->release();
+    }
+    ::free(_entries);
+    OSObject::free();
+}
+
+// linear, like the kernel's (which compares interned symbol pointers instead)
+int OSDictionary::find(const char* key) const
+{
+    for (unsigned i = 0; i < _count; i++)
+    {
+        if (!strcmp(_entries[i].key->getCStringNoCopy(), key))
+            return (int)i;
+    }
+    return -1;
+}
+
+OSObject* OSDictionary::getObject(const char* key) const
+{
+    int i = key ? find(key) : -1;
+    return i < 0 ? NULL : _entries[i].value;
+}
+
+OSObject* OSDictionary::getObject(const OSString* key) const
+{
+    return key ? getObject(key->getCStringNoCopy()) : NULL;
+}
+
+bool OSDictionary::setObject(const char* key, const OSObject* object)
+{
+    if (!key || !object)
+        return false;
+    int i = find(key);
+    if (i >= 0)
+    {
+        object->retain();
+        _entries[i].value->release();
+        _entries[i].value = const_cast<OSObject*>(object);
+        return true;
+    }
+    const OSSymbol* symbol = OSSymbol::withCString(key);
+    if (!symbol)
+        return false;
+    if (_count == _capacity)
+    {
+        Entry* grown = (Entry*)realloc(_entries, 2 * _capacity * sizeof(Entry));
+        if (!grown)
+        {
+            symbol->release();
+            return false;
+        }
+        _entries = grown;
+        _capacity *= 2;
+    }
+    object->retain();
+    _entries[_count].key = symbol;
+    _entries[_count].value = const_cast<OSObject*>(object);
+    ++_count;
+    return true;
+}
+
+bool OSDictionary::setObject(const OSString* key, const OSObject* object)
+{
+    return key && setObject(key->getCStringNoCopy(), object);
+}
+
+void OSDictionary::removeObject(const char* key)
+{
+    int i = find(key);
+    if (i < 0)
+        return;
+    _entries[i].key->release();
+    _entries[i].value->release();
+    memmove(&_entries[i], &_entries[i+1], (_count - i - 1) * sizeof(Entry));
+    --_count;
+}
+
+bool OSDictionary::merge(const OSDictionary* other)
+{
+    if (!other)
+        return false;
+    for (unsigned i = 0; i < other->_count; i++)
+    {
+        if (!setObject(other->_entries[i].key->getCStringNoCopy(), other->_entries[i].value))
+            return false;
+    }
+    return true;
+}
+
+bool OSDictionary::serialize(OSSerialize* s) const
+{
+    if (!s->addString("<dict>"))
+        return false;
+    for (unsigned i = 0; i < _count; i++)
+    {
+        const OSSymbol* key = _entries[i].key;
+        unsigned mark = s->getLength();
+        if (!s->addString("<key>") || !s->addXMLEscaped(key->getCStringNoCopy(), key->getLength()) || !s->addString("</key>"))
+            return false;
+        // values that don't serialize (services, notifiers) are left out with their key
+        if (!_entries[i].value->serialize(s))
+            s->hostTruncate(mark);
+    }
+    return s->addString("</dict>");
+}
+
+OSDefineMetaClassAndStructors(OSSerialize, OSObject)
+
+OSSerialize* OSSerialize::withCapacity(unsigned capacity)
+{
+    OSSerialize* s = new OSSerialize;
+    s->_length = 0;
+    s->_capacity = capacity ? capacity : 4096;
+    s->_text = (char*)malloc(s->_capacity);
+    if (!s->_text)
+    {
+        s->release();
+        return NULL;
+    }
+    s->_text[0] = 0;
+    return s;
+}
+
+void OSSerialize::free()
+{
+    ::free(_text);
+    OSObject::free();
+}
+
+bool OSSerialize::addBytes(const char* bytes, unsigned length)
+{
+    if (_length + length + 1 > _capacity)
+    {
+        unsigned capacity = _capacity;
+        while (capacity < _length + length + 1)
+            capacity *= 2;
+        char* grown = (char*)realloc(_text, capacity);
+        if (!grown)
+            return false;
+        _text = grown;
+        _capacity = capacity;
+    }
+    memcpy(_text + _length, bytes, length);
+    _length += length;
+    _text[_length] = 0;
+    return true;
+}
+
+bool OSSerialize::addString(const char* s)
+{
+    return addBytes(s, (unsigned)strlen(s));
+}
+
+bool OSSerialize::addXMLEscaped(const char* s, unsigned length)
+{
+    unsigned start = 0;
+    for (unsigned i = 0; i < length; i++)
+    {
+        const char* entity = NULL;
+        switch (s[i])
+        {
+            case '<': entity = "&lt;"; break;
+            case '>': entity = "&gt;"; break;
+            case '&': entity = "&amp;"; break;
+        }
+        if (entity)
+        {
+            if (!addBytes(s + start, i - start) || !addString(entity))
+                return false;
+            start = i+1;
+        }
+    }
+    return addBytes(s + start, length - start);
+}
+
+// recursive descent over what serialize() produces
+namespace {
+
+struct XMLParser
+{
+    const char* p;
+    const char* error;
+
+    void skipSpace()
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+            ++p;
+    }
+
+    // <name attrs>, <name attrs/>, sets empty for the latter
+    bool openTag(std::string* name, bool* empty)
+    {
+        skipSpace();
+        if (*p != '<')
+            return false;
+        const char* start = ++p;
+        while (*p && *p != '>' && *p != ' ' && *p != '/')
+            ++p;
+        name->assign(start, p - start);
+        while (*p && *p != '>')
+            ++p;
+        if (!*p)
+            return false;
+        *empty = p[-1] == '/';
+        ++p;
+        return true;
+    }
+
+    bool closeTag(const char* name)
+    {
+        skipSpace();
+        size_t n = strlen(name);
+        if (strncmp(p, "</", 2) || strncmp(p+2, name, n) || p[2+n] != '>')
+            return false;
+        p += 3 + n;
+        return true;
+    }
+
+    bool text(std::string* out)
+    {
+        out->clear();
+        while (*p && *p != '<')
+        {
+            if (*p == '&')
+            {
+                static const struct { const char* entity; char c; } entities[] =
+                {
+                    { "&lt;", '<' }, { "&gt;", '>' }, { "&amp;", '&' }, { "&quot;", '"' }, { "&apos;", '\'' },
+                };
+                bool found = false;
+                for (size_t i = 0; i < sizeof(entities)/sizeof(entities[0]); i++)
+                {
+                    size_t n = strlen(entities[i].entity);
+                    if (!strncmp(p, entities[i].entity, n))
+                    {
+                        out->push_back(entities[i].c);
+                        p += n;
+                        found = true;
+                        break;
+                    }
+                }
+                if (!found)
+                    return false;
+            }
+            else
+                out->push_back(*p++);
+        }
+        return *p == '<';
+    }
+
+    OSObject* fail(const char* message)
+    {
+        if (!error)
+            error = message;
+        return NULL;
+    }
+
+    OSObject* value()
+    {
+        std::string tag, body;
+        bool empty;
+        if (!openTag(&tag, &empty))
+            return fail("expected element");
+        if (tag == "dict")
+        {
+            OSDictionary* dict = OSDictionary::withCapacity(8);
+            while (!empty)
+            {
+                skipSpace();
+                if (!strncmp(p, "</dict>", 7))
+                {
+                    p += 7;
+                    break;
+                }
+                std::string keyTag;
+                bool keyEmpty;
+                if (!openTag(&keyTag, &keyEmpty) || keyTag != "key" || keyEmpty || !text(&body) || !closeTag("key"))
+                {
+                    dict->release();
+                    return fail("bad key");
+                }
+                OSObject* object = value();
+                if (!object)
+                {
+                    dict->release();
+                    return NULL;
+                }
+                dict->setObject(body.c_str(), object);
+                object->release();
+            }
+            return dict;
+        }
+        if (tag == "array")
+        {
+            OSArray* array = OSArray::withCapacity(8);
+            while (!empty)
+            {
+                skipSpace();
+                if (!strncmp(p, "</array>", 8))
+                {
+                    p += 8;
+                    break;
+                }
+                OSObject* object = value();
+                if (!object)
+                {
+                    array->release();
+                    return NULL;
+                }
+                array->setObject(object);
+                object->release();
+            }
+            return array;
+        }
+        if (tag == "true" || tag == "false")
+            return tag == "true" ? kOSBooleanTrue : kOSBooleanFalse;
+        if (!empty && (!text(&body) || !closeTag(tag.c_str())))
+            return fail("bad element");
+        if (tag == "string")
+            return OSString::withCString(body.c_str());
+        if (tag == "integer")
+            return OSNumber::withNumber(strtoull(body.c_str(), NULL, 0), 64);
+        if (tag == "data")
+        {
+            OSData* data = OSData::withCapacity((unsigned)body.size() * 3 / 4 + 1);
+            UInt32 v = 0;
+            int bits = 0;
+            for (size_t i = 0; i < body.size(); i++)
+            {
+                const char* c = strchr(base64Chars, body[i]);
+                if (!c || !body[i])
+                    continue;   // padding and whitespace
+                v = (v << 6) | (UInt32)(c - base64Chars);
+                bits += 6;
+                if (bits >= 8)
+                {
+                    bits -= 8;
+                    UInt8 byte = (UInt8)(v >> bits);
+                    data->appendBytes(&byte, 1);
+                }
+            }
+            return data;
+        }
+        return fail("unknown element");
+    }
+};
+
+}
+
+OSObject* OSUnserializeXML(const char* buffer, OSString** errorString)
+{
+    XMLParser parser = { buffer, NULL };
+    OSObject* object = NULL;
+    if (buffer)
+    {
+        // plist files: skip the prolog, doctype and <plist> wrapper
+        for (;;)
+        {
+            parser.skipSpace();
+            if (strncmp(parser.p, "<?", 2) && strncmp(parser.p, "<!", 2) && strncmp(parser.p, "<plist", 6))
+                break;
+            const char* end = strchr(parser.p, '>');
+            if (!end)
+                break;
+            parser.p = end + 1;
+        }
+        object = parser.value();
+    }
+    if (!object && errorString)
+        *errorString = OSString::withCString(parser.error ? parser.error : "no buffer");
+    return object;
+}
+
+////////////////////////////////////////////////////////////////
+// registry
+
+static const IORegistryPlane gDTPlane = { "IODeviceTree" };
+static const IORegistryPlane gACPIPlane = { "IOACPIPlane" };
+static const IORegistryPlane gServicePlane = { "IOService" };
+const IORegistryPlane* gIODTPlane = &gDTPlane;
+const IORegistryPlane* gIOACPIPlane = &gACPIPlane;
+const IORegistryPlane* gIOServicePlane = &gServicePlane;
+
+const OSSymbol* gIOGeneralInterest = OSSymbol::withCString("IOGeneralInterest");
+const OSSymbol* gIOPriorityPowerStateInterest = OSSymbol::withCString("IOPriorityPowerStateInterest");
+const OSSymbol* gIOFirstPublishNotification = OSSymbol::withCString("IOServiceFirstPublish");
+const OSSymbol* gIOPublishNotification = OSSymbol::withCString("IOServicePublish");
+const OSSymbol* gIOTerminatedNotification = OSSymbol::withCString("IOServiceTerminate");
+const OSSymbol* gIODisplayParametersKey = OSSymbol::withCString("IODisplayParameters");
+const OSSymbol* gIODisplayBrightnessKey = OSSymbol::withCString("brightness");
+const OSSymbol* gIODisplayLinearBrightnessKey = OSSymbol::withCString("linear-brightness");
+const OSSymbol* gIODisplayParametersCommitKey = OSSymbol::withCString("commit");
+
+struct HostEntryImpl
+{
+    std::mutex lock;        // property table
+    std::string name;
+    std::map<const IORegistryPlane*, IORegistryEntry*> parents;
+    std::map<const IORegistryPlane*, std::vector<IORegistryEntry*> > children;
+};
+
+// one lock for everything global: planes, paths, services, notifications
+static std::mutex gRegistryLock;
+static std::condition_variable gRegistryChanged;
+static std::map<const IORegistryPlane*, std::vector<IORegistryEntry*> > gPlaneMembers;
+static std::map<std::string, IORegistryEntry*> gPaths;
+static std::vector<IOService*> gServices;
+
+static std::string pathKey(const IORegistryPlane* plane, const char* path)
+{
+    return std::string(plane ? plane->name : "") + ":" + path;
+}
+
+void hostRegisterPath(const IORegistryPlane* plane, const char* path, IORegistryEntry* entry)
+{
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    entry->retain();
+    IORegistryEntry*& slot = gPaths[pathKey(plane, path)];
+    if (slot)
+        slot->release();
+    slot = entry;
+}
+
+void hostUnregisterPath(const IORegistryPlane* plane, const char* path)
+{
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    std::map<std::string, IORegistryEntry*>::iterator it = gPaths.find(pathKey(plane, path));
+    if (it != gPaths.end())
+    {
+        it->second->release();
+        gPaths.erase(it);
+    }
+}
+
+OSDefineMetaClassAndStructors(IORegistryEntry, OSObject)
+
+bool IORegistryEntry::init(OSDictionary* dictionary)
+{
+    if (!OSObject::init())
+        return false;
+    _impl = new HostEntryImpl;
+    _properties = dictionary ? OSDictionary::withDictionary(dictionary) : OSDictionary::withCapacity(16);
+    return NULL != _properties;
+}
+
+void IORegistryEntry::free()
+{
+    OSSafeReleaseNULL(_properties);
+    delete _impl;
+    _impl = NULL;
+    OSObject::free();
+}
+
+OSObject* IORegistryEntry::getProperty(const char* key) const
+{
+    std::lock_guard<std::mutex> lock(_impl->lock);
+    return _properties->getObject(key);
+}
+
+OSObject* IORegistryEntry::getProperty(const OSSymbol* key) const
+{
+    return key ? getProperty(key->getCStringNoCopy()) : NULL;
+}
+
+OSObject* IORegistryEntry::copyProperty(const char* key) const
+{
+    std::lock_guard<std::mutex> lock(_impl->lock);
+    OSObject* object = _properties->getObject(key);
+    if (object)
+        object->retain();
+    return object;
+}
+
+OSObject* IORegistryEntry::copyProperty(const OSSymbol* key) const
+{
+    return key ? copyProperty(key->getCStringNoCopy()) : NULL;
+}
+
+bool IORegistryEntry::setProperty(const char* key, OSObject* object)
+{
+    std::lock_guard<std::mutex> lock(_impl->lock);
+    return _properties->setObject(key, object);
+}
+
+bool IORegistryEntry::setProperty(const OSSymbol* key, OSObject* object)
+{
+    return key && setProperty(key->getCStringNoCopy(), object);
+}
+
+bool IORegistryEntry::setProperty(const char* key, const char* string)
+{
+    OSString* object = OSString::withCString(string);
+    bool result = object && setProperty(key, object);
+    OSSafeRelease(object);
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const char* key, bool value)
+{
+    return setProperty(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IORegistryEntry::setProperty(const char* key, unsigned long long value, unsigned numberOfBits)
+{
+    OSNumber* number = OSNumber::withNumber(value, numberOfBits);
+    bool result = number && setProperty(key, number);
+    OSSafeRelease(number);
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const OSSymbol* key, unsigned long long value, unsigned numberOfBits)
+{
+    return key && setProperty(key->getCStringNoCopy(), value, numberOfBits);
+}
+
+void IORegistryEntry::removeProperty(const char* key)
+{
+    std::lock_guard<std::mutex> lock(_impl->lock);
+    _properties->removeObject(key);
+}
+
+void IORegistryEntry::removeProperty(const OSSymbol* key)
+{
+    if (key)
+        removeProperty(key->getCStringNoCopy());
+}
+
+IOReturn IORegistryEntry::setProperties(OSObject*)
+{
+    return kIOReturnUnsupported;
+}
+
+bool IORegistryEntry::serializeProperties(OSSerialize* s) const
+{
+    std::lock_guard<std::mutex> lock(_impl->lock);
+    return _properties->serialize(s);
+}
+
+OSDictionary* IORegistryEntry::dictionaryWithProperties() const
+{
+    std::lock_guard<std::mutex> lock(_impl->lock);
+    return OSDictionary::withDictionary(_properties);
+}
+
+const char* IORegistryEntry::getName(const IORegistryPlane*) const
+{
+    // the kext names itself in DbgLog before init, the class name is all there is then
+    if (!_impl || _impl->name.empty())
+        return getMetaClass()->getClassName();
+    return _impl->name.c_str();
+}
+
+const OSSymbol* IORegistryEntry::copyName(const IORegistryPlane* plane) const
+{
+    return OSSymbol::withCString(getName(plane));
+}
+
+void IORegistryEntry::setName(const char* name, const IORegistryPlane*)
+{
+    _impl->name = name;
+}
+
+bool IORegistryEntry::attachToParent(IORegistryEntry* parent, const IORegistryPlane* plane)
+{
+    // links are not retained: the harness owns the entries it builds
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    _impl->parents[plane] = parent;
+    parent->_impl->children[plane].push_back(this);
+    std::vector<IORegistryEntry*>& members = gPlaneMembers[plane];
+    if (std::find(members.begin(), members.end(), parent) == members.end())
+        members.push_back(parent);
+    if (std::find(members.begin(), members.end(), this) == members.end())
+        members.push_back(this);
+    return true;
+}
+
+IORegistryEntry* IORegistryEntry::getParentEntry(const IORegistryPlane* plane) const
+{
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    std::map<const IORegistryPlane*, IORegistryEntry*>::const_iterator it = _impl->parents.find(plane);
+    return it == _impl->parents.end() ? NULL : it->second;
+}
+
+IORegistryEntry* IORegistryEntry::getChildEntry(const IORegistryPlane* plane) const
+{
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    std::map<const IORegistryPlane*, std::vector<IORegistryEntry*> >::const_iterator it = _impl->children.find(plane);
+    return it == _impl->children.end() || it->second.empty() ? NULL : it->second[0];
+}
+
+namespace {
+
+// iterates a retained snapshot
+class HostArrayIterator : public OSIterator
+{
+    OSDeclareDefaultStructors(HostArrayIterator)
+public:
+    OSArray* array;
+    unsigned index;
+    static HostArrayIterator* withArray(OSArray* array)
+    {
+        HostArrayIterator* iter = new HostArrayIterator;
+        iter->array = array;
+        iter->index = 0;
+        return iter;
+    }
+    virtual void free()
+    {
+        OSSafeRelease(array);
+        OSIterator::free();
+    }
+    virtual OSObject* getNextObject()
+    {
+        return array->getObject(index++);
+    }
+};
+
+OSDefineMetaClassAndStructors(HostArrayIterator, OSIterator)
+
+}
+
+OSIterator* IORegistryEntry::getChildIterator(const IORegistryPlane* plane) const
+{
+    OSArray* array = OSArray::withCapacity(4);
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    std::map<const IORegistryPlane*, std::vector<IORegistryEntry*> >::const_iterator it = _impl->children.find(plane);
+    if (it != _impl->children.end())
+    {
+        for (size_t i = 0; i < it->second.size(); i++)
+            array->setObject(it->second[i]);
+    }
+    return HostArrayIterator::withArray(array);
+}
+
+IORegistryEntry* IORegistryEntry::fromPath(const char* path, const IORegistryPlane* plane)
+{
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    std::map<std::string, IORegistryEntry*>::iterator it = gPaths.find(pathKey(plane, path));
+    if (it == gPaths.end())
+        return NULL;
+    it->second->retain();
+    return it->second;
+}
+
+OSDefineMetaClassAndStructors(IORegistryIterator, OSIterator)
+
+IORegistryIterator* IORegistryIterator::iterateOver(const IORegistryPlane* plane, IOOptionBits options)
+{
+    // every entry in the plane, in the order they were attached
+    IORegistryIterator* iter = new IORegistryIterator;
+    iter->_entries = OSArray::withCapacity(16);
+    iter->_index = 0;
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    std::vector<IORegistryEntry*>& members = gPlaneMembers[plane];
+    for (size_t i = 0; i < members.size(); i++)
+        iter->_entries->setObject(members[i]);
+    return iter;
+}
+
+IORegistryIterator* IORegistryIterator::iterateOver(IORegistryEntry* start, const IORegistryPlane* plane, IOOptionBits options)
+{
+    IORegistryIterator* iter = new IORegistryIterator;
+    iter->_entries = OSArray::withCapacity(16);
+    iter->_index = 0;
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    if (options & kIORegistryIterateParents)
+    {
+        // parent chain up to the root
+        for (IORegistryEntry* entry = start; entry; )
+        {
+            std::map<const IORegistryPlane*, IORegistryEntry*>::iterator it = entry->_impl->parents.find(plane);
+            entry = it == entry->_impl->parents.end() ? NULL : it->second;
+            if (entry)
+                iter->_entries->setObject(entry);
+            if (!(options & kIORegistryIterateRecursively))
+                break;
+        }
+    }
+    else
+    {
+        // children, depth first if recursive
+        std::vector<IORegistryEntry*> stack(1, start);
+        while (!stack.empty())
+        {
+            IORegistryEntry* entry = stack.back();
+            stack.pop_back();
+            std::vector<IORegistryEntry*>& children = entry->_impl->children[plane];
+            for (size_t i = children.size(); i-- > 0; )
+            {
+                iter->_entries->setObject(children[i]);
+                if (options & kIORegistryIterateRecursively)
+                    stack.push_back(children[i]);
+            }
+        }
+    }
+    return iter;
+}
+
+void IORegistryIterator::free()
+{
+    OSSafeRelease(_entries);
+    OSIterator::free();
+}
+
+IORegistryEntry* IORegistryIterator::getNextObject()
+{
+    return OSDynamicCast(IORegistryEntry, _entries->getObject(_index++));
+}
+
+////////////////////////////////////////////////////////////////
+// services, matching and interest
+
+namespace {
+
+enum { kNotifyMatching, kNotifyInterest, kNotifySleepWake };
+
+class HostNotifier : public IONotifier
+{
+    OSDeclareDefaultStructors(HostNotifier)
+public:
+    int kind;
+    IOServiceMatchingNotificationHandler matchingHandler;
+    IOServiceInterestHandler interestHandler;
+    void* target;
+    void* refCon;
+    OSDictionary* matching;
+    IOService* service;
+    bool removed;
+    virtual void free()
+    {
+        OSSafeRelease(matching);
+        IONotifier::free();
+    }
+    virtual void remove();
+};
+
+OSDefineMetaClassAndStructors(HostNotifier, IONotifier)
+
+std::vector<HostNotifier*> gNotifiers;
+
+bool matches(IOService* service, OSDictionary* matching)
+{
+    if (OSString* className = OSDynamicCast(OSString, matching->getObject("IOProviderClass")))
+    {
+        if (!service->metaCast(className->getCStringNoCopy()))
+            return false;
+    }
+    if (OSString* name = OSDynamicCast(OSString, matching->getObject("IONameMatch")))
+    {
+        if (strcmp(service->getName(), name->getCStringNoCopy()))
+            return false;
+    }
+    return true;
+}
+
+void HostNotifier::remove()
+{
+    {
+        std::lock_guard<std::mutex> lock(gRegistryLock);
+        std::vector<HostNotifier*>::iterator it = std::find(gNotifiers.begin(), gNotifiers.end(), this);
+        if (it == gNotifiers.end())
+            return;
+        gNotifiers.erase(it);
+        removed = true;
+    }
+    release();
+}
+
+// retained snapshot of the notifiers of one kind (and service), called outside the lock
+std::vector<HostNotifier*> collectNotifiers(int kind, IOService* service)
+{
+    std::vector<HostNotifier*> list;
+    for (size_t i = 0; i < gNotifiers.size(); i++)
+    {
+        HostNotifier* notifier = gNotifiers[i];
+        if (notifier->kind != kind)
+            continue;
+        if (kNotifyMatching == kind && !matches(service, notifier->matching))
+            continue;
+        if (kNotifyInterest == kind && notifier->service != service)
+            continue;
+        notifier->retain();
+        list.push_back(notifier);
+    }
+    return list;
+}
+
+HostNotifier* addNotifier(int kind, void* target, void* refCon)
+{
+    HostNotifier* notifier = new HostNotifier;
+    notifier->kind = kind;
+    notifier->matchingHandler = NULL;
+    notifier->interestHandler = NULL;
+    notifier->target = target;
+    notifier->refCon = refCon;
+    notifier->matching = NULL;
+    notifier->service = NULL;
+    notifier->removed = false;
+    return notifier;
+}
+
+IOWorkLoop* gDefaultWorkLoop;
+
+}
+
+OSDefineMetaClassAndStructors(IONotifier, OSObject)
+
+void IONotifier::remove()
+{
+}
+
+OSDefineMetaClassAndStructors(IOService, IORegistryEntry)
+
+bool IOService::init(OSDictionary* dictionary)
+{
+    _provider = NULL;
+    return IORegistryEntry::init(dictionary);
+}
+
+void IOService::free()
+{
+    OSSafeReleaseNULL(_provider);
+    IORegistryEntry::free();
+}
+
+IOService* IOService::probe(IOService*, SInt32*)
+{
+    return this;
+}
+
+bool IOService::start(IOService*)
+{
+    return true;
+}
+
+void IOService::stop(IOService*)
+{
+}
+
+IOReturn IOService::message(UInt32, IOService*, void*)
+{
+    return kIOReturnUnsupported;
+}
+
+void IOService::systemWillShutdown(IOOptionBits)
+{
+}
+
+IOWorkLoop* IOService::getWorkLoop() const
+{
+    if (_provider)
+        return _provider->getWorkLoop();
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    if (!gDefaultWorkLoop)
+        gDefaultWorkLoop = IOWorkLoop::workLoop();
+    return gDefaultWorkLoop;
+}
+
+bool IOService::attach(IOService* provider)
+{
+    if (provider)
+        provider->retain();
+    OSSafeRelease(_provider);
+    _provider = provider;
+    return true;
+}
+
+void IOService::registerService(IOOptionBits)
+{
+    std::vector<HostNotifier*> notify;
+    {
+        std::lock_guard<std::mutex> lock(gRegistryLock);
+        if (std::find(gServices.begin(), gServices.end(), this) != gServices.end())
+            return;
+        retain();
+        gServices.push_back(this);
+        notify = collectNotifiers(kNotifyMatching, this);
+    }
+    gRegistryChanged.notify_all();
+    for (size_t i = 0; i < notify.size(); i++)
+    {
+        HostNotifier* notifier = notify[i];
+        if (!notifier->removed)
+            notifier->matchingHandler(notifier->target, notifier->refCon, this, notifier);
+        notifier->release();
+    }
+}
+
+void hostUnregisterService(IOService* service)
+{
+    {
+        std::lock_guard<std::mutex> lock(gRegistryLock);
+        std::vector<IOService*>::iterator it = std::find(gServices.begin(), gServices.end(), service);
+        if (it == gServices.end())
+            return;
+        gServices.erase(it);
+    }
+    service->release();
+}
+
+OSDictionary* IOService::serviceMatching(const char* className, OSDictionary* table)
+{
+    OSDictionary* dict = table ? table : OSDictionary::withCapacity(2);
+    OSString* str = OSString::withCString(className);
+    dict->setObject("IOProviderClass", str);
+    str->release();
+    if (table)
+        table->retain();
+    return dict;
+}
+
+OSDictionary* IOService::nameMatching(const char* name, OSDictionary* table)
+{
+    OSDictionary* dict = table ? table : OSDictionary::withCapacity(2);
+    OSString* str = OSString::withCString(name);
+    dict->setObject("IONameMatch", str);
+    str->release();
+    if (table)
+        table->retain();
+    return dict;
+}
+
+IOService* IOService::waitForMatchingService(OSDictionary* matching, UInt64 timeout)
+{
+    std::unique_lock<std::mutex> lock(gRegistryLock);
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+        std::chrono::nanoseconds(timeout == ~0ULL ? 1000000000000000ULL : timeout);
+    for (;;)
+    {
+        for (size_t i = 0; i < gServices.size(); i++)
+        {
+            if (matches(gServices[i], matching))
+            {
+                gServices[i]->retain();
+                return gServices[i];
+            }
+        }
+        if (std::cv_status::timeout == gRegistryChanged.wait_until(lock, deadline))
+            return NULL;
+    }
+}
+
+IOService* IOService::waitForService(OSDictionary* matching, void*)
+{
+    IOService* service = waitForMatchingService(matching);
+    // consumes matching, the service is not retained
+    matching->release();
+    if (service)
+        service->release();
+    return service;
+}
+
+OSIterator* IOService::getMatchingServices(OSDictionary* matching)
+{
+    OSArray* array = OSArray::withCapacity(4);
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    for (size_t i = 0; i < gServices.size(); i++)
+    {
+        if (matches(gServices[i], matching))
+            array->setObject(gServices[i]);
+    }
+    return HostArrayIterator::withArray(array);
+}
+
+IONotifier* IOService::addMatchingNotification(const OSSymbol* type, OSDictionary* matching,
+    IOServiceMatchingNotificationHandler handler, void* target, void* refCon, SInt32)
+{
+    HostNotifier* notifier = addNotifier(kNotifyMatching, target, refCon);
+    notifier->matchingHandler = handler;
+    notifier->matching = matching;
+    matching->retain();
+    std::vector<IOService*> existing;
+    {
+        std::lock_guard<std::mutex> lock(gRegistryLock);
+        gNotifiers.push_back(notifier);
+        notifier->retain();     // the list's reference, this one is held across the handlers
+        for (size_t i = 0; i < gServices.size(); i++)
+        {
+            if (matches(gServices[i], matching))
+            {
+                gServices[i]->retain();
+                existing.push_back(gServices[i]);
+            }
+        }
+    }
+    // already published services are reported right away
+    for (size_t i = 0; i < existing.size(); i++)
+    {
+        if (!notifier->removed)
+            handler(target, refCon, existing[i], notifier);
+        existing[i]->release();
+    }
+    notifier->release();
+    return notifier;
+}
+
+IONotifier* IOService::registerInterest(const OSSymbol*, IOServiceInterestHandler handler, void* target, void* refCon)
+{
+    HostNotifier* notifier = addNotifier(kNotifyInterest, target, refCon);
+    notifier->interestHandler = handler;
+    notifier->service = this;
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    gNotifiers.push_back(notifier);
+    return notifier;
+}
+
+IOReturn IOService::messageClients(UInt32 type, void* argument, vm_size_t argSize)
+{
+    std::vector<HostNotifier*> notify;
+    {
+        std::lock_guard<std::mutex> lock(gRegistryLock);
+        notify = collectNotifiers(kNotifyInterest, this);
+    }
+    for (size_t i = 0; i < notify.size(); i++)
+    {
+        if (!notify[i]->removed)
+            notify[i]->interestHandler(notify[i]->target, notify[i]->refCon, type, this, argument, argSize);
+        notify[i]->release();
+    }
+    return kIOReturnSuccess;
+}
+
+IONotifier* IOService::registerPrioritySleepWakeInterest(IOServiceInterestHandler handler, void* target, void* refCon)
+{
+    HostNotifier* notifier = addNotifier(kNotifySleepWake, target, refCon);
+    notifier->interestHandler = handler;
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    gNotifiers.push_back(notifier);
+    return notifier;
+}
+
+void hostSystemPower(UInt32 messageType)
+{
+    std::vector<HostNotifier*> notify;
+    {
+        std::lock_guard<std::mutex> lock(gRegistryLock);
+        notify = collectNotifiers(kNotifySleepWake, NULL);
+    }
+    for (size_t i = 0; i < notify.size(); i++)
+    {
+        if (!notify[i]->removed)
+            notify[i]->interestHandler(notify[i]->target, notify[i]->refCon, messageType, IOService::getPMRootDomain(), NULL, 0);
+        notify[i]->release();
+    }
+}
+
+void hostResetRegistry()
+{
+    std::vector<OSObject*> drop;
+    {
+        std::lock_guard<std::mutex> lock(gRegistryLock);
+        for (size_t i = 0; i < gServices.size(); i++)
+            drop.push_back(gServices[i]);
+        gServices.clear();
+        for (std::map<std::string, IORegistryEntry*>::iterator it = gPaths.begin(); it != gPaths.end(); ++it)
+            drop.push_back(it->second);
+        gPaths.clear();
+        for (size_t i = 0; i < gNotifiers.size(); i++)
+        {
+            gNotifiers[i]->removed = true;
+            drop.push_back(gNotifiers[i]);
+        }
+        gNotifiers.clear();
+        gPlaneMembers.clear();
+    }
+    for (size_t i = 0; i < drop.size(); i++)
+        drop[i]->release();
+}
+
+OSDefineMetaClassAndStructors(IOPMrootDomain, IOService)
+
+IOPMrootDomain* IOService::getPMRootDomain()
+{
+    static IOPMrootDomain* root;
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    if (!root)
+    {
+        root = new IOPMrootDomain;
+        root->init();
+    }
+    return root;
+}
+
+IOPMrootDomain* getPMRootDomain()
+{
+    return IOService::getPMRootDomain();
+}
+
+OSDefineMetaClassAndStructors(IOPMPowerSource, IOService)
+
+OSDefineMetaClassAndStructors(IOMemoryMap, OSObject)
+
+IOMemoryMap* IOMemoryMap::hostWithAddress(IOVirtualAddress address, UInt64 length)
+{
+    IOMemoryMap* map = new IOMemoryMap;
+    map->_address = address;
+    map->_length = length;
+    return map;
+}
+
+////////////////////////////////////////////////////////////////
+// workloop
+
+struct HostWorkLoopImpl
+{
+    std::recursive_mutex gate;
+    std::atomic<std::thread::id> gateOwner;
+    int gateDepth;                      // only touched by the owner
+
+    std::mutex signalLock;
+    std::condition_variable signal;
+    bool workPending;
+    bool quit;
+
+    std::thread thread;
+    std::thread::id threadID;
+    std::vector<IOEventSource*> sources;    // gate held
+
+    std::atomic<UInt64> acquisitions, contended, waitNS, maxWaitNS;
+};
+
+void hostWorkLoopThread(IOWorkLoop* workLoop)
+{
+    HostWorkLoopImpl* impl = workLoop->_impl;
+    for (;;)
+    {
+        {
+            // cleared before the scan, so work signaled during it runs another pass
+            std::lock_guard<std::mutex> lock(impl->signalLock);
+            if (impl->quit)
+                break;
+            impl->workPending = false;
+        }
+        workLoop->closeGate();
+        bool more;
+        do
+        {
+            more = false;
+            for (size_t i = 0; i < impl->sources.size(); i++)
+            {
+                IOEventSource* source = impl->sources[i];
+                if (source->enabled)
+                    more |= source->checkForWork();
+            }
+        } while (more);
+        UInt64 next = 0;
+        for (size_t i = 0; i < impl->sources.size(); i++)
+        {
+            UInt64 deadline = impl->sources[i]->enabled ? impl->sources[i]->hostNextDeadline() : 0;
+            if (deadline && (!next || deadline < next))
+                next = deadline;
+        }
+        workLoop->openGate();
+
+        std::unique_lock<std::mutex> lock(impl->signalLock);
+        if (impl->quit)
+            break;
+        if (!impl->workPending)
+        {
+            // virtual time only moves when a harness says so (hostRunNextTimer)
+            if (next && !gVirtualClock)
+                impl->signal.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(next)));
+            else
+                impl->signal.wait(lock);
+        }
+    }
+}
+
+OSDefineMetaClassAndStructors(IOWorkLoop, OSObject)
+
+IOWorkLoop* IOWorkLoop::workLoop()
+{
+    return workLoopWithOptions(0);
+}
+
+IOWorkLoop* IOWorkLoop::workLoopWithOptions(IOOptionBits)
+{
+    IOWorkLoop* workLoop = new IOWorkLoop;
+    if (!workLoop->init())
+    {
+        workLoop->release();
+        return NULL;
+    }
+    return workLoop;
+}
+
+bool IOWorkLoop::init()
+{
+    if (!OSObject::init())
+        return false;
+    _impl = new HostWorkLoopImpl;
+    _impl->gateDepth = 0;
+    _impl->workPending = false;
+    _impl->quit = false;
+    _impl->acquisitions = _impl->contended = _impl->waitNS = _impl->maxWaitNS = 0;
+    _impl->thread = std::thread(hostWorkLoopThread, this);
+    _impl->threadID = _impl->thread.get_id();
+    return true;
+}
+
+void IOWorkLoop::free()
+{
+    if (_impl)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_impl->signalLock);
+            _impl->quit = true;
+        }
+        _impl->signal.notify_all();
+        if (std::this_thread::get_id() == _impl->threadID)
+            _impl->thread.detach();
+        else
+            _impl->thread.join();
+        for (size_t i = 0; i < _impl->sources.size(); i++)
+        {
+            __atomic_store_n(&_impl->sources[i]->workLoop, (IOWorkLoop*)NULL, __ATOMIC_RELEASE);
+            _impl->sources[i]->release();
+        }
+        delete _impl;
+        _impl = NULL;
+    }
+    OSObject::free();
+}
+
+void IOWorkLoop::closeGate()
+{
+    if (inGate())
+    {
+        _impl->gate.lock();
+        ++_impl->gateDepth;
+        return;
+    }
+    if (!_impl->gate.try_lock())
+    {
+        UInt64 start = hostUptimeNS();
+        _impl->gate.lock();
+        UInt64 wait = hostUptimeNS() - start;
+        ++_impl->contended;
+        _impl->waitNS += wait;
+        UInt64 max = _impl->maxWaitNS;
+        while (wait > max && !_impl->maxWaitNS.compare_exchange_weak(max, wait))
+            ;
+    }
+    ++_impl->acquisitions;
+    _impl->gateOwner = std::this_thread::get_id();
+    _impl->gateDepth = 1;
+}
+
+bool IOWorkLoop::tryCloseGate()
+{
+    if (!_impl->gate.try_lock())
+        return false;
+    if (_impl->gateOwner.load() == std::this_thread::get_id())
+        ++_impl->gateDepth;
+    else
+    {
+        ++_impl->acquisitions;
+        _impl->gateOwner = std::this_thread::get_id();
+        _impl->gateDepth = 1;
+    }
+    return true;
+}
+
+void IOWorkLoop::openGate()
+{
+    if (0 == --_impl->gateDepth)
+        _impl->gateOwner = std::thread::id();
+    _impl->gate.unlock();
+}
+
+bool IOWorkLoop::inGate() const
+{
+    return _impl->gateOwner.load() == std::this_thread::get_id();
+}
+
+bool IOWorkLoop::onThread() const
+{
+    return std::this_thread::get_id() == _impl->threadID;
+}
+
+thread_t IOWorkLoop::getThread() const
+{
+    return (thread_t)_impl;
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource* source)
+{
+    closeGate();
+    source->retain();
+    _impl->sources.push_back(source);
+    __atomic_store_n(&source->workLoop, this, __ATOMIC_RELEASE);
+    openGate();
+    source->signalWorkAvailable();
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource* source)
+{
+    closeGate();
+    std::vector<IOEventSource*>::iterator it = std::find(_impl->sources.begin(), _impl->sources.end(), source);
+    bool found = it != _impl->sources.end();
+    if (found)
+    {
+        _impl->sources.erase(it);
+        __atomic_store_n(&source->workLoop, (IOWorkLoop*)NULL, __ATOMIC_RELEASE);
+    }
+    openGate();
+    if (!found)
+        return kIOReturnBadArgument;
+    source->release();
+    return kIOReturnSuccess;
+}
+
+HostGateStats hostGateStats(IOWorkLoop* workLoop)
+{
+    HostGateStats stats;
+    HostWorkLoopImpl* impl = workLoop->hostImpl();
+    stats.acquisitions = impl->acquisitions;
+    stats.contended = impl->contended;
+    stats.waitNS = impl->waitNS;
+    stats.maxWaitNS = impl->maxWaitNS;
+    return stats;
+}
+
+bool hostRunNextTimer(IOWorkLoop* workLoop)
+{
+    HostWorkLoopImpl* impl = workLoop->hostImpl();
+    workLoop->closeGate();
+    UInt64 next = 0;
+    for (size_t i = 0; i < impl->sources.size(); i++)
+    {
+        UInt64 deadline = impl->sources[i]->enabled ? impl->sources[i]->hostNextDeadline() : 0;
+        if (deadline && (!next || deadline < next))
+            next = deadline;
+    }
+    if (next)
+    {
+        if (next > gVirtualNS)
+            gVirtualNS = next;
+        bool more;
+        do
+        {
+            more = false;
+            for (size_t i = 0; i < impl->sources.size(); i++)
+            {
+                IOEventSource* source = impl->sources[i];
+                if (source->enabled)
+                    more |= source->checkForWork();
+            }
+        } while (more);
+    }
+    workLoop->openGate();
+    return next != 0;
+}
+
+OSDefineMetaClassAndStructors(IOEventSource, OSObject)
+
+bool IOEventSource::init(OSObject* inOwner, void* inAction)
+{
+    if (!OSObject::init())
+        return false;
+    owner = inOwner;
+    action = inAction;
+    workLoop = NULL;
+    enabled = true;
+    return true;
+}
+
+bool IOEventSource::checkForWork()
+{
+    return false;
+}
+
+void IOEventSource::signalWorkAvailable()
+{
+    IOWorkLoop* wl = __atomic_load_n(&workLoop, __ATOMIC_ACQUIRE);
+    if (!wl)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(wl->_impl->signalLock);
+        wl->_impl->workPending = true;
+    }
+    wl->_impl->signal.notify_one();
+}
+
+void IOEventSource::enable()
+{
+    enabled = true;
+    signalWorkAvailable();
+}
+
+void IOEventSource::disable()
+{
+    enabled = false;
+}
+
+OSDefineMetaClassAndStructors(IOInterruptEventSource, IOEventSource)
+
+static std::atomic<UInt64> gConcurrentSignals(0);
+
+UInt64 hostConcurrentSignals()
+{
+    return gConcurrentSignals;
+}
+
+IOInterruptEventSource* IOInterruptEventSource::interruptEventSource(OSObject* owner, Action action, IOService*, int)
+{
+    IOInterruptEventSource* source = new IOInterruptEventSource;
+    if (!source->init(owner, (void*)action))
+    {
+        source->release();
+        return NULL;
+    }
+    source->_producerCount = source->_consumerCount = 0;
+    source->_signaling = 0;
+    return source;
+}
+
+void IOInterruptEventSource::interruptOccurred(void*, IOService*, int)
+{
+    // the kernel's producer count is a plain increment: overlapping callers lose
+    // counts, and with them the wakeup; counted here instead of raced on
+    if (__sync_fetch_and_add(&_signaling, 1))
+        ++gConcurrentSignals;
+    UInt32 count = __atomic_load_n(&_producerCount, __ATOMIC_RELAXED);
+    __atomic_store_n(&_producerCount, count + 1, __ATOMIC_RELEASE);
+    __sync_fetch_and_sub(&_signaling, 1);
+    signalWorkAvailable();
+}
+
+bool IOInterruptEventSource::checkForWork()
+{
+    UInt32 count = __atomic_load_n(&_producerCount, __ATOMIC_ACQUIRE);
+    if (count == _consumerCount)
+        return false;
+    int pending = (int)(count - _consumerCount);
+    _consumerCount = count;
+    ((Action)action)(owner, this, pending);
+    return false;
+}
+
+OSDefineMetaClassAndStructors(IOTimerEventSource, IOEventSource)
+
+IOTimerEventSource* IOTimerEventSource::timerEventSource(OSObject* owner, Action action)
+{
+    return timerEventSource(kIOTimerEventSourceOptionsDefault, owner, action);
+}
+
+IOTimerEventSource* IOTimerEventSource::timerEventSource(UInt32, OSObject* owner, Action action)
+{
+    IOTimerEventSource* source = new IOTimerEventSource;
+    if (!source->init(owner, (void*)action))
+    {
+        source->release();
+        return NULL;
+    }
+    source->_deadline = 0;
+    return source;
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 us)
+{
+    return wakeAtTime(hostUptimeNS() + us * 1000ULL);
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms)
+{
+    return wakeAtTime(hostUptimeNS() + ms * 1000000ULL);
+}
+
+IOReturn IOTimerEventSource::setTimeout(UInt32 interval, UInt32 scale)
+{
+    return wakeAtTime(hostUptimeNS() + (UInt64)interval * scale);
+}
+
+IOReturn IOTimerEventSource::wakeAtTime(UInt64 deadline)
+{
+    __atomic_store_n(&_deadline, deadline ? deadline : 1, __ATOMIC_RELEASE);
+    signalWorkAvailable();
+    return kIOReturnSuccess;
+}
+
+IOReturn IOTimerEventSource::wakeAtTime(UInt64 deadline, UInt64, UInt32)
+{
+    return wakeAtTime(deadline);
+}
+
+void IOTimerEventSource::cancelTimeout()
+{
+    __atomic_store_n(&_deadline, 0ULL, __ATOMIC_RELEASE);
+}
+
+UInt64 IOTimerEventSource::hostNextDeadline() const
+{
+    return __atomic_load_n(&_deadline, __ATOMIC_ACQUIRE);
+}
+
+bool IOTimerEventSource::checkForWork()
+{
+    UInt64 deadline = __atomic_load_n(&_deadline, __ATOMIC_ACQUIRE);
+    if (!deadline || deadline > hostUptimeNS())
+        return false;
+    __atomic_store_n(&_deadline, 0ULL, __ATOMIC_RELEASE);
+    if (action)
+        ((Action)action)(owner, this);
+    return false;
+}
+
+OSDefineMetaClassAndStructors(IOCommandGate, IOEventSource)
+
+IOCommandGate* IOCommandGate::commandGate(OSObject* owner, Action action)
+{
+    IOCommandGate* gate = new IOCommandGate;
+    if (!gate->init(owner, (void*)action))
+    {
+        gate->release();
+        return NULL;
+    }
+    return gate;
+}
+
+IOReturn IOCommandGate::runAction(Action inAction, void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    IOWorkLoop* wl = __atomic_load_n(&workLoop, __ATOMIC_ACQUIRE);
+    if (!inAction)
+        return kIOReturnBadArgument;
+    if (!wl)
+        return kIOReturnNotPermitted;
+    wl->closeGate();
+    IOReturn result = inAction(owner, arg0, arg1, arg2, arg3);
+    wl->openGate();
+    return result;
+}
+
+IOReturn IOCommandGate::attemptAction(Action inAction, void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    IOWorkLoop* wl = __atomic_load_n(&workLoop, __ATOMIC_ACQUIRE);
+    if (!inAction)
+        return kIOReturnBadArgument;
+    if (!wl)
+        return kIOReturnNotPermitted;
+    if (!wl->tryCloseGate())
+        return kIOReturnCannotLock;
+    IOReturn result = inAction(owner, arg0, arg1, arg2, arg3);
+    wl->openGate();
+    return result;
+}
+
+IOReturn IOCommandGate::runCommand(void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    return runAction((Action)action, arg0, arg1, arg2, arg3);
+}
+
+////////////////////////////////////////////////////////////////
+// families
+
+OSDefineMetaClassAndStructors(IOACPIPlatformDevice, IOService)
+
+IOReturn IOACPIPlatformDevice::validateObject(const char*)
+{
+    return kIOReturnNoDevice;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateInteger(const char*, UInt32*, OSObject**, IOOptionBits)
+{
+    return kIOReturnNoDevice;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateObject(const char*, OSObject**, OSObject**, IOOptionBits, IOOptionBits)
+{
+    return kIOReturnNoDevice;
+}
+
+OSDefineMetaClassAndStructors(IOPCIDevice, IOService)
+
+IOMemoryMap* IOPCIDevice::mapDeviceMemoryWithRegister(UInt8, IOOptionBits)
+{
+    return NULL;
+}
+
+UInt32 IOPCIDevice::configRead32(UInt8)
+{
+    return 0xFFFFFFFF;
+}
+
+UInt16 IOPCIDevice::configRead16(UInt8)
+{
+    return 0xFFFF;
+}
+
+OSDefineMetaClassAndStructors(IODTNVRAM, IOService)
+
+OSDefineMetaClassAndStructors(IODisplay, IOService)
+
+bool IODisplay::addParameter(OSDictionary* params, const OSSymbol* paramName, SInt32 min, SInt32 max)
+{
+    OSDictionary* param = OSDictionary::withCapacity(3);
+    OSNumber* num = OSNumber::withNumber(min, 32);
+    param->setObject("min", num);
+    num->release();
+    num = OSNumber::withNumber(max, 32);
+    param->setObject("max", num);
+    num->release();
+    bool result = params->setObject(paramName, param);
+    param->release();
+    return result;
+}
+
+bool IODisplay::setParameter(OSDictionary* params, const OSSymbol* paramName, SInt32 value)
+{
+    OSDictionary* param = OSDynamicCast(OSDictionary, params->getObject(paramName));
+    if (!param)
+        return false;
+    OSNumber* num = OSNumber::withNumber(value, 32);
+    param->setObject("value", num);
+    num->release();
+    return true;
+}
+
+OSDefineMetaClassAndStructors(IODisplayParameterHandler, IOService)
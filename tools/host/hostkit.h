@@ -0,0 +1,687 @@
+//
+//  hostkit.h
+//  ACPIBacklight
+//
+//  Just enough of libkern/IOKit to build ACPIBacklight.cpp unchanged on a
+//  Linux (or any POSIX) host, so the host tools run the real panel and
+//  handler code: reference counted OS containers, a registry with matching
+//  and notifications, and workloops with their gate, interrupt and timer
+//  event sources on real threads.  The IOKit/libkern headers next to this
+//  one all include it.
+//
+//  Included by the kext source, so C++98 only; hostkit.cpp and the tools are
+//  built as C++11.  Anything that exists only for the host (devices,
+//  simulated hardware, statistics) lives in hostmock.h.
+//
+
+#ifndef ACPIBacklight_hostkit_h
+#define ACPIBacklight_hostkit_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef unsigned long long UInt64;    // as on Darwin, for %llu
+typedef int8_t SInt8;
+typedef int16_t SInt16;
+typedef int32_t SInt32;
+typedef long long SInt64;
+typedef int IOReturn;
+typedef UInt32 IOOptionBits;
+typedef UInt64 AbsoluteTime;
+typedef uintptr_t IOVirtualAddress;
+typedef unsigned long vm_size_t;
+
+enum
+{
+    kIOReturnSuccess = 0,
+    kIOReturnError = (int)0xe00002bc,
+    kIOReturnNoMemory = (int)0xe00002bd,
+    kIOReturnNoResources = (int)0xe00002be,
+    kIOReturnBadArgument = (int)0xe00002c2,
+    kIOReturnUnsupported = (int)0xe00002c7,
+    kIOReturnNotPermitted = (int)0xe00002e2,
+    kIOReturnNoDevice = (int)0xe00002c0,
+    kIOReturnNotReady = (int)0xe00002d8,
+    kIOReturnTimeout = (int)0xe00002d6,
+    kIOReturnCannotLock = (int)0xe00002cc,
+};
+
+#define kNanosecondScale    1
+#define kMicrosecondScale   1000
+#define kMillisecondScale   1000000
+#define kSecondScale        1000000000
+
+// kernel services, uptime is CLOCK_MONOTONIC in ns (absolute time == ns)
+void IOLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void IOSleep(unsigned ms);
+void IODelay(unsigned us);
+void* IOMalloc(vm_size_t size);
+void IOFree(void* address, vm_size_t size);
+void clock_get_uptime(UInt64* result);
+void absolutetime_to_nanoseconds(UInt64 abstime, UInt64* result);
+void nanoseconds_to_absolutetime(UInt64 ns, UInt64* result);
+void clock_interval_to_deadline(UInt32 interval, UInt32 scale, UInt64* result);
+
+// register access of the native handler, routed to the simulated BAR that owns
+// the address (see HostBAR)
+UInt32 hostMMIORead32(volatile void* address);
+void hostMMIOWrite32(volatile void* address, UInt32 value);
+#define MMIO_READ32(address)            hostMMIORead32(address)
+#define MMIO_WRITE32(address, value)    hostMMIOWrite32(address, value)
+
+////////////////////////////////////////////////////////////////
+// libkern
+
+class OSObject;
+class OSString;
+class OSSymbol;
+class OSSerialize;
+
+class OSMetaClass
+{
+    const char* _name;
+    const OSMetaClass* _super;
+public:
+    OSMetaClass(const char* name, const OSMetaClass* super);
+    const char* getClassName() const { return _name; }
+    const OSMetaClass* getSuperClass() const { return _super; }
+    bool isKindOf(const char* name) const;
+};
+
+// every class gets a metaclass (for metaCast and getClassName) and public
+// default construction, the harnesses create services with new + init
+#define OSDeclareDefaultStructors(className) \
+    public: \
+        static const OSMetaClass gMetaClass; \
+        virtual const OSMetaClass* getMetaClass() const { return &gMetaClass; } \
+        className(); \
+        virtual ~className(); \
+    private:
+
+#define OSDefineMetaClassAndStructors(className, superName) \
+    const OSMetaClass className::gMetaClass(#className, &superName::gMetaClass); \
+    className::className() {} \
+    className::~className() {}
+
+class OSObject
+{
+public:
+    static const OSMetaClass gMetaClass;
+    virtual const OSMetaClass* getMetaClass() const { return &gMetaClass; }
+    OSObject();
+    virtual ~OSObject();
+
+    virtual void retain() const;
+    virtual void release() const;
+    int getRetainCount() const;
+    virtual bool init();
+    virtual void free();
+    OSObject* metaCast(const char* className) const;
+    virtual bool serialize(OSSerialize* s) const;
+    virtual bool isEqualTo(const OSObject* other) const;
+
+    // zero filled, as the kernel allocates them
+    static void* operator new(size_t size);
+    static void operator delete(void* mem);
+
+private:
+    mutable volatile int _retainCount;
+    OSObject(const OSObject&);
+    OSObject& operator=(const OSObject&);
+};
+
+template <class T> inline T* hostDynamicCast(const OSObject* object)
+{
+    return dynamic_cast<T*>(const_cast<OSObject*>(object));
+}
+
+#define OSDynamicCast(type, object)     hostDynamicCast<type>(object)
+#define OSSafeRelease(object)           do { if (object) (object)->release(); } while (0)
+#define OSSafeReleaseNULL(object)       do { if (object) (object)->release(); (object) = NULL; } while (0)
+
+// bound member function to plain function pointer (GCC extension, like the
+// kernel's OSMemberFunctionCast): the object is passed as the first argument
+#define OSMemberFunctionCast(cptrtype, self, func) ((cptrtype)((self)->*(func)))
+
+class OSString : public OSObject
+{
+    OSDeclareDefaultStructors(OSString)
+protected:
+    char* _string;
+    unsigned _length;
+public:
+    static OSString* withCString(const char* cString);
+    static OSString* withCStringNoCopy(const char* cString);
+    virtual bool initWithCString(const char* cString);
+    virtual void free();
+    const char* getCStringNoCopy() const { return _string; }
+    unsigned getLength() const { return _length; }
+    bool isEqualTo(const char* cString) const;
+    virtual bool isEqualTo(const OSObject* other) const;
+    virtual bool serialize(OSSerialize* s) const;
+};
+
+// not interned: keys compare by contents
+class OSSymbol : public OSString
+{
+    OSDeclareDefaultStructors(OSSymbol)
+public:
+    static const OSSymbol* withCString(const char* cString);
+    static const OSSymbol* withCStringNoCopy(const char* cString);
+};
+
+class OSNumber : public OSObject
+{
+    OSDeclareDefaultStructors(OSNumber)
+    unsigned long long _value;
+    unsigned _size;
+public:
+    static OSNumber* withNumber(unsigned long long value, unsigned numberOfBits);
+    UInt32 unsigned32BitValue() const { return (UInt32)_value; }
+    UInt64 unsigned64BitValue() const { return _value; }
+    unsigned numberOfBits() const { return _size; }
+    void setValue(unsigned long long value);
+    virtual bool isEqualTo(const OSObject* other) const;
+    virtual bool serialize(OSSerialize* s) const;
+};
+
+class OSBoolean : public OSObject
+{
+    OSDeclareDefaultStructors(OSBoolean)
+    bool _value;
+public:
+    static OSBoolean* hostWithValue(bool value);
+    bool isTrue() const { return _value; }
+    bool isFalse() const { return !_value; }
+    bool getValue() const { return _value; }
+    virtual void release() const {}
+    virtual void retain() const {}
+    virtual bool serialize(OSSerialize* s) const;
+};
+
+extern OSBoolean* kOSBooleanTrue;
+extern OSBoolean* kOSBooleanFalse;
+
+class OSData : public OSObject
+{
+    OSDeclareDefaultStructors(OSData)
+    UInt8* _bytes;
+    unsigned _length, _capacity;
+public:
+    static OSData* withBytes(const void* bytes, unsigned length);
+    static OSData* withCapacity(unsigned capacity);
+    virtual void free();
+    unsigned getLength() const { return _length; }
+    const void* getBytesNoCopy() const { return _length ? _bytes : NULL; }
+    const void* getBytesNoCopy(unsigned start, unsigned length) const;
+    bool appendBytes(const void* bytes, unsigned length);
+    virtual bool isEqualTo(const OSObject* other) const;
+    virtual bool serialize(OSSerialize* s) const;
+};
+
+class OSCollection : public OSObject
+{
+    OSDeclareDefaultStructors(OSCollection)
+};
+
+class OSIterator : public OSObject
+{
+    OSDeclareDefaultStructors(OSIterator)
+public:
+    virtual OSObject* getNextObject();
+};
+
+class OSArray : public OSCollection
+{
+    OSDeclareDefaultStructors(OSArray)
+    OSObject** _array;
+    unsigned _count, _capacity;
+public:
+    static OSArray* withCapacity(unsigned capacity);
+    virtual void free();
+    unsigned getCount() const { return _count; }
+    OSObject* getObject(unsigned index) const { return index < _count ? _array[index] : NULL; }
+    OSObject* getLastObject() const { return _count ? _array[_count-1] : NULL; }
+    bool setObject(const OSObject* object);
+    virtual bool serialize(OSSerialize* s) const;
+};
+
+class OSDictionary : public OSCollection
+{
+    OSDeclareDefaultStructors(OSDictionary)
+    struct Entry
+    {
+        const OSSymbol* key;
+        OSObject* value;
+    };
+    Entry* _entries;
+    unsigned _count, _capacity;
+    int find(const char* key) const;
+public:
+    static OSDictionary* withCapacity(unsigned capacity);
+    static OSDictionary* withDictionary(const OSDictionary* dict, unsigned capacity = 0);
+    virtual void free();
+    unsigned getCount() const { return _count; }
+    OSObject* getObject(const char* key) const;
+    OSObject* getObject(const OSString* key) const;
+    bool setObject(const char* key, const OSObject* object);
+    bool setObject(const OSString* key, const OSObject* object);
+    void removeObject(const char* key);
+    bool merge(const OSDictionary* other);
+    // host only, in insertion order
+    const OSSymbol* hostKey(unsigned index) const { return index < _count ? _entries[index].key : NULL; }
+    OSObject* hostValue(unsigned index) const { return index < _count ? _entries[index].value : NULL; }
+    virtual bool serialize(OSSerialize* s) const;
+};
+
+// XML in the kernel's plist dialect (dict/key/string/integer/data/true/false/array)
+class OSSerialize : public OSObject
+{
+    OSDeclareDefaultStructors(OSSerialize)
+    char* _text;
+    unsigned _length, _capacity;
+public:
+    static OSSerialize* withCapacity(unsigned capacity);
+    virtual void free();
+    const char* text() const { return _text ? _text : ""; }
+    unsigned getLength() const { return _length; }
+    bool addString(const char* s);
+    bool addBytes(const char* s, unsigned length);
+    bool addXMLEscaped(const char* s, unsigned length);
+    void hostTruncate(unsigned length) { if (length < _length) _text[_length = length] = 0; }
+};
+
+OSObject* OSUnserializeXML(const char* buffer, OSString** errorString = NULL);
+
+// libkern/OSAtomic.h
+SInt32 OSAddAtomic(SInt32 amount, volatile SInt32* address);
+SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64* address);
+SInt32 OSIncrementAtomic(volatile SInt32* address);
+SInt32 OSDecrementAtomic(volatile SInt32* address);
+bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32* address);
+bool OSCompareAndSwapPtr(void* oldValue, void* newValue, void* volatile* address);
+UInt32 OSBitOrAtomic(UInt32 mask, volatile UInt32* address);
+UInt32 OSBitAndAtomic(UInt32 mask, volatile UInt32* address);
+void OSMemoryBarrier();
+
+// libkern/version.h, the kernel the kext believes it runs on (15 = 10.11)
+extern const int version_major;
+extern const int version_minor;
+
+// libkern/OSKextLib.h
+struct kmod_info_t
+{
+    char name[64];
+    char version[64];
+};
+const char* OSKextGetCurrentIdentifier();
+UInt32 OSKextGetCurrentLoadTag();
+const char* OSKextGetCurrentVersionString();
+
+// mach/thread_policy.h
+typedef int kern_return_t;
+typedef void* thread_t;
+typedef unsigned thread_policy_flavor_t;
+typedef int* thread_policy_t;
+typedef unsigned mach_msg_type_number_t;
+struct thread_precedence_policy
+{
+    int importance;
+};
+typedef struct thread_precedence_policy thread_precedence_policy_data_t;
+#define THREAD_PRECEDENCE_POLICY        3
+#define THREAD_PRECEDENCE_POLICY_COUNT  1
+#define KERN_SUCCESS                    0
+
+////////////////////////////////////////////////////////////////
+// IOKit locks
+
+struct IOLock;
+IOLock* IOLockAlloc();
+void IOLockFree(IOLock* lock);
+void IOLockLock(IOLock* lock);
+void IOLockUnlock(IOLock* lock);
+bool IOLockTryLock(IOLock* lock);
+
+struct IORecursiveLock;
+IORecursiveLock* IORecursiveLockAlloc();
+void IORecursiveLockFree(IORecursiveLock* lock);
+void IORecursiveLockLock(IORecursiveLock* lock);
+void IORecursiveLockUnlock(IORecursiveLock* lock);
+bool IORecursiveLockTryLock(IORecursiveLock* lock);
+
+typedef IOLock IOSimpleLock;
+inline IOSimpleLock* IOSimpleLockAlloc() { return IOLockAlloc(); }
+inline void IOSimpleLockFree(IOSimpleLock* lock) { IOLockFree(lock); }
+inline void IOSimpleLockLock(IOSimpleLock* lock) { IOLockLock(lock); }
+inline void IOSimpleLockUnlock(IOSimpleLock* lock) { IOLockUnlock(lock); }
+
+////////////////////////////////////////////////////////////////
+// registry
+
+struct IORegistryPlane
+{
+    const char* name;
+};
+extern const IORegistryPlane* gIODTPlane;
+extern const IORegistryPlane* gIOACPIPlane;
+extern const IORegistryPlane* gIOServicePlane;
+
+enum
+{
+    kIORegistryIterateRecursively = 0x00000001,
+    kIORegistryIterateParents = 0x00000002,
+};
+
+class IORegistryEntry : public OSObject
+{
+    OSDeclareDefaultStructors(IORegistryEntry)
+    OSDictionary* _properties;
+    struct HostEntryImpl* _impl;    // name, planes, property lock
+    friend class IORegistryIterator;
+public:
+    virtual bool init(OSDictionary* dictionary = NULL);
+    virtual void free();
+
+    // property table, locked per entry
+    virtual OSObject* getProperty(const char* key) const;
+    virtual OSObject* getProperty(const OSSymbol* key) const;
+    virtual OSObject* copyProperty(const char* key) const;
+    virtual OSObject* copyProperty(const OSSymbol* key) const;
+    virtual bool setProperty(const char* key, OSObject* object);
+    virtual bool setProperty(const OSSymbol* key, OSObject* object);
+    bool setProperty(const char* key, const char* string);
+    bool setProperty(const char* key, bool value);
+    bool setProperty(const char* key, unsigned long long value, unsigned numberOfBits);
+    bool setProperty(const OSSymbol* key, unsigned long long value, unsigned numberOfBits);
+    virtual void removeProperty(const char* key);
+    virtual void removeProperty(const OSSymbol* key);
+    virtual IOReturn setProperties(OSObject* properties);
+    virtual bool serializeProperties(OSSerialize* s) const;
+    OSDictionary* getPropertyTable() const { return _properties; }
+    OSDictionary* dictionaryWithProperties() const;
+
+    const char* getName(const IORegistryPlane* plane = NULL) const;
+    const OSSymbol* copyName(const IORegistryPlane* plane = NULL) const;
+    void setName(const char* name, const IORegistryPlane* plane = NULL);
+
+    // planes: one parent per plane is all the kext walks
+    bool attachToParent(IORegistryEntry* parent, const IORegistryPlane* plane);
+    IORegistryEntry* getParentEntry(const IORegistryPlane* plane) const;
+    IORegistryEntry* getChildEntry(const IORegistryPlane* plane) const;
+    OSIterator* getChildIterator(const IORegistryPlane* plane) const;
+
+    // paths are registered by the harness (hostRegisterPath), returned retained
+    static IORegistryEntry* fromPath(const char* path, const IORegistryPlane* plane = NULL);
+};
+
+class IORegistryIterator : public OSIterator
+{
+    OSDeclareDefaultStructors(IORegistryIterator)
+    OSArray* _entries;
+    unsigned _index;
+public:
+    static IORegistryIterator* iterateOver(const IORegistryPlane* plane, IOOptionBits options = 0);
+    static IORegistryIterator* iterateOver(IORegistryEntry* start, const IORegistryPlane* plane, IOOptionBits options = 0);
+    virtual void free();
+    virtual IORegistryEntry* getNextObject();
+};
+
+////////////////////////////////////////////////////////////////
+// services
+
+class IOService;
+class IOWorkLoop;
+class IONotifier;
+void hostWorkLoopThread(IOWorkLoop* workLoop);
+bool hostRunNextTimer(IOWorkLoop* workLoop);
+class IOPMrootDomain;
+
+typedef IOReturn (*IOServiceInterestHandler)(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize);
+typedef bool (*IOServiceMatchingNotificationHandler)(void* target, void* refCon, IOService* newService, IONotifier* notifier);
+
+extern const OSSymbol* gIOGeneralInterest;
+extern const OSSymbol* gIOPriorityPowerStateInterest;
+extern const OSSymbol* gIOFirstPublishNotification;
+extern const OSSymbol* gIOPublishNotification;
+extern const OSSymbol* gIOTerminatedNotification;
+
+#define kIOMessageSystemWillSleep       0xe0000280
+#define kIOMessageSystemWillPowerOff    0xe0000250
+#define kIOMessageSystemHasPoweredOn    0xe0000300
+#define kIOMessageSystemWillRestart     0xe0000310
+#define kIOMessageSystemWillPowerOn     0xe0000320
+#define kIOPMMessageBatteryStatusHasChanged 0xe0024100
+
+struct IOPMPowerState
+{
+    unsigned long version, capabilityFlags, outputPowerCharacter, inputPowerRequirement,
+        staticPower, unbudgetedPower, powerToAttain, timeToAttain, settleUpTime,
+        timeToLower, settleDownTime, powerDomainBudget;
+};
+enum { kIOPMPowerStateVersion1 = 1, kIOPMDeviceUsable = 0x8000, kIOPMPowerOn = 2, kIOPMAckImplied = 0 };
+
+class IONotifier : public OSObject
+{
+    OSDeclareDefaultStructors(IONotifier)
+public:
+    virtual void remove();
+};
+
+class IOService : public IORegistryEntry
+{
+    OSDeclareDefaultStructors(IOService)
+    IOService* _provider;
+public:
+    virtual bool init(OSDictionary* dictionary = NULL);
+    virtual void free();
+    virtual IOService* probe(IOService* provider, SInt32* score);
+    virtual bool start(IOService* provider);
+    virtual void stop(IOService* provider);
+    virtual IOReturn message(UInt32 type, IOService* provider, void* argument = NULL);
+    virtual IOWorkLoop* getWorkLoop() const;
+    virtual void systemWillShutdown(IOOptionBits specifier);
+
+    bool attach(IOService* provider);
+    IOService* getProvider() const { return _provider; }
+
+    // registered services take part in matching, waiters and notifications
+    void registerService(IOOptionBits options = 0);
+    static OSDictionary* serviceMatching(const char* className, OSDictionary* table = NULL);
+    static OSDictionary* nameMatching(const char* name, OSDictionary* table = NULL);
+    IOService* waitForService(OSDictionary* matching, void* timeout = NULL);   // consumes matching
+    static IOService* waitForMatchingService(OSDictionary* matching, UInt64 timeout = ~0ULL);
+    static OSIterator* getMatchingServices(OSDictionary* matching);
+    static IONotifier* addMatchingNotification(const OSSymbol* type, OSDictionary* matching,
+        IOServiceMatchingNotificationHandler handler, void* target, void* refCon = NULL, SInt32 priority = 0);
+
+    IONotifier* registerInterest(const OSSymbol* typeOfInterest, IOServiceInterestHandler handler, void* target, void* refCon = NULL);
+    IOReturn messageClients(UInt32 type, void* argument = NULL, vm_size_t argSize = 0);
+    static IONotifier* registerPrioritySleepWakeInterest(IOServiceInterestHandler handler, void* target, void* refCon = NULL);
+
+    static IOPMrootDomain* getPMRootDomain();
+    void PMinit() {}
+    void PMstop() {}
+    void joinPMtree(IOService*) {}
+    IOReturn registerPowerDriver(IOService*, IOPMPowerState*, unsigned long) { return kIOReturnSuccess; }
+    virtual IOReturn setPowerState(unsigned long, IOService*) { return kIOPMAckImplied; }
+};
+
+class IOPMrootDomain : public IOService
+{
+    OSDeclareDefaultStructors(IOPMrootDomain)
+};
+IOPMrootDomain* getPMRootDomain();
+
+class IOPMPowerSource : public IOService
+{
+    OSDeclareDefaultStructors(IOPMPowerSource)
+};
+
+class IOMemoryMap : public OSObject
+{
+    OSDeclareDefaultStructors(IOMemoryMap)
+    IOVirtualAddress _address;
+    UInt64 _length;
+public:
+    static IOMemoryMap* hostWithAddress(IOVirtualAddress address, UInt64 length);
+    IOVirtualAddress getVirtualAddress() { return _address; }
+    UInt64 getLength() { return _length; }
+};
+
+////////////////////////////////////////////////////////////////
+// workloop and event sources
+
+class IOEventSource : public OSObject
+{
+    OSDeclareDefaultStructors(IOEventSource)
+    friend class IOWorkLoop;
+    friend void hostWorkLoopThread(IOWorkLoop*);
+    friend bool hostRunNextTimer(IOWorkLoop*);
+protected:
+    OSObject* owner;
+    void* action;
+    IOWorkLoop* workLoop;
+    bool enabled;
+    virtual bool init(OSObject* owner, void* action);
+    // called with the gate held on the workloop thread, true if there may be more
+    virtual bool checkForWork();
+    // host: earliest pending deadline, 0 for none
+    virtual UInt64 hostNextDeadline() const { return 0; }
+    void signalWorkAvailable();
+public:
+    void enable();
+    void disable();
+    bool isEnabled() const { return enabled; }
+    IOWorkLoop* getWorkLoop() const { return workLoop; }
+};
+
+class IOWorkLoop : public OSObject
+{
+    OSDeclareDefaultStructors(IOWorkLoop)
+    struct HostWorkLoopImpl* _impl;
+    friend class IOEventSource;
+    friend class IOCommandGate;
+    friend void hostWorkLoopThread(IOWorkLoop*);
+public:
+    static IOWorkLoop* workLoop();
+    static IOWorkLoop* workLoopWithOptions(IOOptionBits options);
+    virtual bool init();
+    virtual void free();
+    IOReturn addEventSource(IOEventSource* source);
+    IOReturn removeEventSource(IOEventSource* source);
+    void closeGate();
+    bool tryCloseGate();
+    void openGate();
+    bool inGate() const;
+    bool onThread() const;
+    thread_t getThread() const;
+    struct HostWorkLoopImpl* hostImpl() const { return _impl; }
+};
+
+class IOInterruptEventSource : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOInterruptEventSource)
+public:
+    typedef void (*Action)(OSObject* owner, IOInterruptEventSource* sender, int count);
+    static IOInterruptEventSource* interruptEventSource(OSObject* owner, Action action, IOService* provider = NULL, int intIndex = 0);
+    void interruptOccurred(void* refCon, IOService* nub, int source);
+protected:
+    virtual bool checkForWork();
+private:
+    volatile UInt32 _producerCount;
+    UInt32 _consumerCount;
+    volatile UInt32 _signaling;     // interruptOccurred callers inside, see hostmock.h
+};
+typedef IOInterruptEventSource::Action IOInterruptEventAction;
+
+class IOTimerEventSource : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOTimerEventSource)
+public:
+    typedef void (*Action)(OSObject* owner, IOTimerEventSource* sender);
+    enum { kIOTimerEventSourceOptionsDefault = 0, kIOTimeOptionsWithLeeway = 0x00000020 };
+    static IOTimerEventSource* timerEventSource(OSObject* owner, Action action = NULL);
+    static IOTimerEventSource* timerEventSource(UInt32 options, OSObject* owner, Action action = NULL);
+    IOReturn setTimeoutUS(UInt32 us);
+    IOReturn setTimeoutMS(UInt32 ms);
+    IOReturn setTimeout(UInt32 interval, UInt32 scale);
+    IOReturn wakeAtTime(UInt64 deadline);
+    IOReturn wakeAtTime(UInt64 deadline, UInt64 leeway, UInt32 options = 0);
+    void cancelTimeout();
+protected:
+    virtual bool checkForWork();
+    virtual UInt64 hostNextDeadline() const;
+private:
+    volatile UInt64 _deadline;      // uptime ns, 0 when not armed
+};
+
+class IOCommandGate : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOCommandGate)
+public:
+    typedef IOReturn (*Action)(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3);
+    static IOCommandGate* commandGate(OSObject* owner, Action action = NULL);
+    IOReturn runAction(Action action, void* arg0 = NULL, void* arg1 = NULL, void* arg2 = NULL, void* arg3 = NULL);
+    IOReturn attemptAction(Action action, void* arg0 = NULL, void* arg1 = NULL, void* arg2 = NULL, void* arg3 = NULL);
+    IOReturn runCommand(void* arg0 = NULL, void* arg1 = NULL, void* arg2 = NULL, void* arg3 = NULL);
+};
+
+////////////////////////////////////////////////////////////////
+// families
+
+class IOACPIPlatformDevice : public IOService
+{
+    OSDeclareDefaultStructors(IOACPIPlatformDevice)
+public:
+    virtual IOReturn validateObject(const char* objectName);
+    virtual IOReturn evaluateInteger(const char* objectName, UInt32* resultInt32, OSObject* params[] = NULL, IOOptionBits paramCount = 0);
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result = NULL, OSObject* params[] = NULL, IOOptionBits paramCount = 0, IOOptionBits options = 0);
+};
+
+enum { kIOPCIConfigVendorID = 0x00, kIOPCIConfigDeviceID = 0x02, kIOPCIConfigBaseAddress0 = 0x10 };
+
+class IOPCIDevice : public IOService
+{
+    OSDeclareDefaultStructors(IOPCIDevice)
+public:
+    virtual IOMemoryMap* mapDeviceMemoryWithRegister(UInt8 reg, IOOptionBits options = 0);
+    virtual UInt32 configRead32(UInt8 offset);
+    virtual UInt16 configRead16(UInt8 offset);
+};
+
+class IODTNVRAM : public IOService
+{
+    OSDeclareDefaultStructors(IODTNVRAM)
+};
+
+extern const OSSymbol* gIODisplayParametersKey;
+extern const OSSymbol* gIODisplayBrightnessKey;
+extern const OSSymbol* gIODisplayLinearBrightnessKey;
+extern const OSSymbol* gIODisplayParametersCommitKey;
+
+class IODisplay : public IOService
+{
+    OSDeclareDefaultStructors(IODisplay)
+public:
+    static bool addParameter(OSDictionary* params, const OSSymbol* paramName, SInt32 min, SInt32 max);
+    static bool setParameter(OSDictionary* params, const OSSymbol* paramName, SInt32 value);
+};
+
+class IODisplayParameterHandler : public IOService
+{
+    OSDeclareDefaultStructors(IODisplayParameterHandler)
+public:
+    virtual bool setDisplay(IODisplay* display) = 0;
+    virtual bool doIntegerSet(OSDictionary* params, const OSSymbol* paramName, UInt32 value) = 0;
+    virtual bool doDataSet(const OSSymbol* paramName, OSData* value) = 0;
+    virtual bool doUpdate() = 0;
+};
+
+#endif
@@ -0,0 +1,259 @@
+//
+//  hostmock.cpp
+//  ACPIBacklight
+//
+//  Devices for host builds, see hostmock.h.
+//
+
+#include "hostmock.h"
+
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+
+////////////////////////////////////////////////////////////////
+// simulated BARs
+
+static std::mutex gBARLock;
+static std::vector<HostBAR*> gBARs;
+
+HostBAR::HostBAR(UInt32 size) : _regs((size + 3) / 4, 0)
+{
+    std::lock_guard<std::mutex> lock(gBARLock);
+    gBARs.push_back(this);
+}
+
+HostBAR::~HostBAR()
+{
+    std::lock_guard<std::mutex> lock(gBARLock);
+    gBARs.erase(std::find(gBARs.begin(), gBARs.end(), this));
+}
+
+static HostBAR* findBAR(volatile void* address, UInt32* offset)
+{
+    IOVirtualAddress a = (IOVirtualAddress)address;
+    std::lock_guard<std::mutex> lock(gBARLock);
+    for (size_t i = 0; i < gBARs.size(); i++)
+    {
+        HostBAR* bar = gBARs[i];
+        if (a >= bar->base() && a + 4 <= bar->base() + bar->size())
+        {
+            *offset = (UInt32)(a - bar->base());
+            return bar;
+        }
+    }
+    fprintf(stderr, "hostkit: MMIO access to %p outside any BAR\n", (void*)address);
+    abort();
+}
+
+UInt32 hostMMIORead32(volatile void* address)
+{
+    UInt32 offset;
+    HostBAR* bar = findBAR(address, &offset);
+    return bar->read32(offset);
+}
+
+void hostMMIOWrite32(volatile void* address, UInt32 value)
+{
+    UInt32 offset;
+    HostBAR* bar = findBAR(address, &offset);
+    bar->write32(offset, value);
+}
+
+////////////////////////////////////////////////////////////////
+// PCI display device
+
+OSDefineMetaClassAndStructors(HostPCIDevice, IOPCIDevice)
+
+IOMemoryMap* HostPCIDevice::mapDeviceMemoryWithRegister(UInt8 reg, IOOptionBits)
+{
+    if (kIOPCIConfigBaseAddress0 != reg || !bar0)
+        return NULL;
+    return IOMemoryMap::hostWithAddress(bar0->base(), bar0->size());
+}
+
+UInt32 HostPCIDevice::configRead32(UInt8 offset)
+{
+    if (kIOPCIConfigVendorID == offset)
+        return (UInt32)deviceID << 16 | vendorID;
+    return 0;
+}
+
+UInt16 HostPCIDevice::configRead16(UInt8 offset)
+{
+    if (kIOPCIConfigVendorID == offset)
+        return vendorID;
+    if (kIOPCIConfigDeviceID == offset)
+        return deviceID;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////
+// PNLF
+
+OSDefineMetaClassAndStructors(HostACPIDevice, IOACPIPlatformDevice)
+
+bool HostACPIDevice::init(OSDictionary* dictionary)
+{
+    if (!IOACPIPlatformDevice::init(dictionary))
+        return false;
+    extended = false;
+    hasSave = false;
+    setLatencyNS = getLatencyNS = 0;
+    latencySleeps = false;
+    level = saved = 0;
+    sets = gets = saves = 0;
+    inside = 0;
+    overlapped = 0;
+    return true;
+}
+
+void HostACPIDevice::setInteger(const char* name, UInt32 value)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    for (size_t i = 0; i < _integers.size(); i++)
+    {
+        if (_integers[i].first == name)
+        {
+            _integers[i].second = value;
+            return;
+        }
+    }
+    _integers.push_back(std::make_pair(std::string(name), value));
+}
+
+bool HostACPIDevice::findInteger(const char* name, UInt32* value)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    for (size_t i = 0; i < _integers.size(); i++)
+    {
+        if (_integers[i].first == name)
+        {
+            *value = _integers[i].second;
+            return true;
+        }
+    }
+    return false;
+}
+
+void HostACPIDevice::wait(UInt64 ns)
+{
+    if (hostVirtualClock())
+        hostAdvanceClock(ns);
+    else if (latencySleeps && ns)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+    else
+        hostSpinNS(ns);
+}
+
+void HostACPIDevice::enter()
+{
+    if (inside++)
+        ++overlapped;
+}
+
+void HostACPIDevice::leave()
+{
+    --inside;
+}
+
+static bool isSet(const char* name, bool extended)
+{
+    return !strcmp(name, extended ? "XBCM" : "_BCM");
+}
+
+static bool isGet(const char* name, bool extended)
+{
+    return !strcmp(name, extended ? "XBQC" : "_BQC");
+}
+
+IOReturn HostACPIDevice::validateObject(const char* objectName)
+{
+    UInt32 value;
+    if (!strcmp(objectName, "_BCL") || !strcmp(objectName, "_DOS") ||
+        isSet(objectName, extended) || isGet(objectName, extended) ||
+        (hasSave && !strcmp(objectName, "SAVE")) || findInteger(objectName, &value))
+        return kIOReturnSuccess;
+    return kIOReturnNoDevice;
+}
+
+IOReturn HostACPIDevice::evaluateInteger(const char* objectName, UInt32* resultInt32, OSObject* params[], IOOptionBits paramCount)
+{
+    if (isGet(objectName, extended))
+    {
+        enter();
+        wait(getLatencyNS);
+        *resultInt32 = level;
+        ++gets;
+        leave();
+        return kIOReturnSuccess;
+    }
+    if (findInteger(objectName, resultInt32))
+        return kIOReturnSuccess;
+    // methods with no useful result evaluate to 0
+    OSObject* result = NULL;
+    IOReturn ret = evaluateObject(objectName, &result, params, paramCount);
+    OSSafeRelease(result);
+    if (kIOReturnSuccess == ret)
+        *resultInt32 = 0;
+    return ret;
+}
+
+IOReturn HostACPIDevice::evaluateObject(const char* objectName, OSObject** result, OSObject* params[], IOOptionBits paramCount, IOOptionBits)
+{
+    if (result)
+        *result = NULL;
+    OSNumber* arg = paramCount ? OSDynamicCast(OSNumber, params[0]) : NULL;
+    if (isSet(objectName, extended))
+    {
+        if (!arg)
+            return kIOReturnBadArgument;
+        enter();
+        wait(setLatencyNS);
+        level = arg->unsigned32BitValue();
+        ++sets;
+        levelWritten(arg->unsigned32BitValue(), hostUptimeNS());
+        leave();
+        return kIOReturnSuccess;
+    }
+    if (isGet(objectName, extended))
+    {
+        UInt32 value;
+        evaluateInteger(objectName, &value);
+        if (result)
+            *result = OSNumber::withNumber(value, 32);
+        return kIOReturnSuccess;
+    }
+    if (!strcmp(objectName, "_BCL"))
+    {
+        if (result)
+        {
+            OSArray* array = OSArray::withCapacity((unsigned)bcl.size());
+            for (size_t i = 0; i < bcl.size(); i++)
+            {
+                OSNumber* number = OSNumber::withNumber(bcl[i], 32);
+                array->setObject(number);
+                number->release();
+            }
+            *result = array;
+        }
+        return kIOReturnSuccess;
+    }
+    if (!strcmp(objectName, "_DOS"))
+        return kIOReturnSuccess;
+    if (hasSave && !strcmp(objectName, "SAVE"))
+    {
+        if (arg)
+            saved = arg->unsigned32BitValue();
+        ++saves;
+        return kIOReturnSuccess;
+    }
+    UInt32 value;
+    if (findInteger(objectName, &value))
+    {
+        if (result)
+            *result = OSNumber::withNumber(value, 32);
+        return kIOReturnSuccess;
+    }
+    return kIOReturnNoDevice;
+}
@@ -0,0 +1,151 @@
+//
+//  hostmock.h
+//  ACPIBacklight
+//
+//  Host-only side of hostkit: the devices the kext talks to (a PNLF ACPI
+//  device with configurable AML latency, a PCI display device with a
+//  simulated BAR) and the knobs and counters harnesses use to drive and
+//  observe it (registry paths, system power messages, gate contention).
+//
+
+#ifndef ACPIBacklight_hostmock_h
+#define ACPIBacklight_hostmock_h
+
+#include "hostkit.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// IOLog goes to stderr unless silenced; returns the previous setting
+bool hostSetLogging(bool enabled);
+
+// uptime in ns, what the kext sees
+UInt64 hostUptimeNS();
+
+// busy wait, for latencies shorter than a scheduler tick
+void hostSpinNS(UInt64 ns);
+
+// virtual uptime: it stands still until advanced, so timer driven code runs as
+// fast as the host can go.  AML latency advances it instead of being waited out,
+// and workloops stop firing timers on their own (hostRunNextTimer does)
+void hostUseVirtualClock(bool enabled);
+bool hostVirtualClock();
+void hostAdvanceClock(UInt64 ns);
+
+// virtual clock only: move it to the earliest timer armed on the workloop and
+// run what is due, on the caller's thread inside the gate; false if none is armed
+bool hostRunNextTimer(IOWorkLoop* workLoop);
+
+// fromPath() lookups, eg. hostRegisterPath(gIODTPlane, "/options", nvram)
+void hostRegisterPath(const IORegistryPlane* plane, const char* path, IORegistryEntry* entry);
+void hostUnregisterPath(const IORegistryPlane* plane, const char* path);
+
+// take a registered service out of matching (the kernel's terminate)
+void hostUnregisterService(IOService* service);
+
+// send a system power message to everything registered with
+// registerPrioritySleepWakeInterest, as the root domain does
+void hostSystemPower(UInt32 messageType);
+
+// remove every registered service, path and interest (between scenarios)
+void hostResetRegistry();
+
+// gate acquisitions per workloop: contended means the gate was held by another
+// thread when asked for, wait is the time until it was granted
+struct HostGateStats
+{
+    UInt64 acquisitions;
+    UInt64 contended;
+    UInt64 waitNS;
+    UInt64 maxWaitNS;
+};
+HostGateStats hostGateStats(IOWorkLoop* workLoop);
+// the same over every IORecursiveLock, since start
+HostGateStats hostRecursiveLockStats();
+
+// interruptOccurred is only safe from one context at a time (the kernel's
+// version loses producer counts otherwise); counts callers that overlapped
+UInt64 hostConcurrentSignals();
+
+////////////////////////////////////////////////////////////////
+
+// simulated BAR: a register file the MMIO_READ32/MMIO_WRITE32 accesses of the
+// kext are routed to; subclasses give registers their semantics
+class HostBAR
+{
+public:
+    explicit HostBAR(UInt32 size);
+    virtual ~HostBAR();
+    IOVirtualAddress base() const { return (IOVirtualAddress)_regs.data(); }
+    UInt32 size() const { return (UInt32)(_regs.size() * sizeof(UInt32)); }
+
+    // kext side
+    virtual UInt32 read32(UInt32 offset) { return peek(offset); }
+    virtual void write32(UInt32 offset, UInt32 value) { poke(offset, value); }
+
+    // simulator side, no side effects
+    UInt32 peek(UInt32 offset) const { return _regs[offset/4]; }
+    void poke(UInt32 offset, UInt32 value) { _regs[offset/4] = value; }
+    void clear() { std::fill(_regs.begin(), _regs.end(), 0); }
+
+private:
+    std::vector<UInt32> _regs;
+    HostBAR(const HostBAR&);
+    HostBAR& operator=(const HostBAR&);
+};
+
+// PCI display device with a simulated BAR0
+class HostPCIDevice : public IOPCIDevice
+{
+    OSDeclareDefaultStructors(HostPCIDevice)
+public:
+    HostBAR* bar0;
+    UInt16 vendorID, deviceID;
+    virtual IOMemoryMap* mapDeviceMemoryWithRegister(UInt8 reg, IOOptionBits options = 0);
+    virtual UInt32 configRead32(UInt8 offset);
+    virtual UInt16 configRead16(UInt8 offset);
+};
+
+// PNLF: _BCL/_BCM/_BQC (or XBCM/XBQC), _DOS, SAVE and the XOPT/XRGL/... integers,
+// evaluated on the caller's thread with a fixed cost, like AML on the EC
+class HostACPIDevice : public IOACPIPlatformDevice
+{
+    OSDeclareDefaultStructors(HostACPIDevice)
+public:
+    virtual bool init(OSDictionary* dictionary = NULL);
+
+    // configuration, before the panel starts
+    std::vector<UInt32> bcl;            // full _BCL package, AC/battery entries first
+    bool extended;                      // XBCM/XBQC instead of _BCM/_BQC
+    bool hasSave;
+    // per _BCM/XBCM and _BQC/XBQC; may be changed while the panel runs
+    std::atomic<UInt64> setLatencyNS, getLatencyNS;
+    std::atomic<bool> latencySleeps;    // wait it out asleep (an EC transaction) instead of spinning
+    void setInteger(const char* name, UInt32 value);    // XOPT, XRGL, XRGH, KLVX, LMAX, KPCH
+
+    // state
+    std::atomic<UInt32> level;          // last raw level written
+    std::atomic<UInt32> saved;          // last SAVE argument
+    std::atomic<UInt64> sets, gets, saves;
+    std::atomic<int> inside;            // evaluations running right now
+    std::atomic<UInt64> overlapped;     // evaluations that started while another ran
+
+    // every _BCM/XBCM: raw level and uptime, for harnesses that look at timing
+    virtual void levelWritten(UInt32 raw, UInt64 when) {}
+
+    virtual IOReturn validateObject(const char* objectName);
+    virtual IOReturn evaluateInteger(const char* objectName, UInt32* resultInt32, OSObject* params[] = NULL, IOOptionBits paramCount = 0);
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result = NULL, OSObject* params[] = NULL, IOOptionBits paramCount = 0, IOOptionBits options = 0);
+
+private:
+    std::mutex _lock;
+    std::vector<std::pair<std::string, UInt32> > _integers;
+    bool findInteger(const char* name, UInt32* value);
+    void wait(UInt64 ns);
+    void enter();
+    void leave();
+};
+
+#endif
@@ -0,0 +1,288 @@
+//
+//  hostrig.cpp
+//  ACPIBacklight
+//
+//  Services for host runs of the kext, see hostrig.h.
+//
+
+#include "hostrig.h"
+
+#include <stdlib.h>
+#include <thread>
+
+OSDictionary* hostLoadPersonalities(const char* infoPlist)
+{
+    FILE* f = fopen(infoPlist, "rb");
+    if (!f)
+        return NULL;
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        text.append(buf, n);
+    fclose(f);
+
+    OSString* error = NULL;
+    OSDictionary* plist = OSDynamicCast(OSDictionary, OSUnserializeXML(text.c_str(), &error));
+    if (!plist)
+    {
+        fprintf(stderr, "%s: %s\n", infoPlist, error ? error->getCStringNoCopy() : "not a dictionary");
+        OSSafeRelease(error);
+        return NULL;
+    }
+    OSDictionary* personalities = OSDynamicCast(OSDictionary, plist->getObject("IOKitPersonalities"));
+    if (personalities)
+        personalities->retain();
+    plist->release();
+    return personalities;
+}
+
+OSDictionary* hostPersonalityForClass(OSDictionary* personalities, const char* className)
+{
+    for (unsigned i = 0; personalities && i < personalities->getCount(); i++)
+    {
+        OSDictionary* personality = OSDynamicCast(OSDictionary, personalities->hostValue(i));
+        OSString* ioclass = personality ? OSDynamicCast(OSString, personality->getObject("IOClass")) : NULL;
+        if (ioclass && ioclass->isEqualTo(className))
+            return personality;
+    }
+    return NULL;
+}
+
+OSDictionary* hostPersonalityForPCI(OSDictionary* personalities, UInt16 vendorID, UInt16 deviceID)
+{
+    // IOPCIPrimaryMatch is a list of device<<16|vendor
+    UInt32 id = (UInt32)deviceID << 16 | vendorID;
+    for (unsigned i = 0; personalities && i < personalities->getCount(); i++)
+    {
+        OSDictionary* personality = OSDynamicCast(OSDictionary, personalities->hostValue(i));
+        OSString* match = personality ? OSDynamicCast(OSString, personality->getObject("IOPCIPrimaryMatch")) : NULL;
+        if (!match)
+            continue;
+        for (const char* p = match->getCStringNoCopy(); *p; )
+        {
+            char* end;
+            unsigned long value = strtoul(p, &end, 0);
+            if (end == p)
+                break;
+            if (value == id)
+                return personality;
+            p = end;
+        }
+    }
+    return NULL;
+}
+
+static void mergeProperties(IORegistryEntry* entry, OSDictionary* properties)
+{
+    for (unsigned i = 0; properties && i < properties->getCount(); i++)
+        entry->setProperty(properties->hostKey(i)->getCStringNoCopy(), properties->hostValue(i));
+}
+
+HostRig::HostRig(HostACPIDevice* pnlf) : acpi(pnlf), panel(NULL), pci(NULL), handler(NULL), display(NULL),
+    _posted(0), _framebuffer(NULL), _connect(NULL), _started(false)
+{
+    if (!acpi)
+        acpi = new HostACPIDevice;
+    acpi->init();
+    acpi->setName("PNLF");
+    nvram = new IODTNVRAM;
+    nvram->init();
+    nvram->setName("options");
+    _params = newParams();
+}
+
+HostRig::~HostRig()
+{
+    stop();
+    OSSafeRelease(_params);
+    OSSafeRelease(nvram);
+    OSSafeRelease(acpi);
+}
+
+OSDictionary* HostRig::newParams()
+{
+    OSDictionary* params = OSDictionary::withCapacity(2);
+    IODisplay::addParameter(params, gIODisplayBrightnessKey, 0, 0x400);
+    return params;
+}
+
+bool HostRig::start(const char* infoPlist, OSDictionary* properties, HostBAR* bar, UInt16 vendorID, UInt16 deviceID)
+{
+    OSDictionary* personalities = hostLoadPersonalities(infoPlist);
+    OSDictionary* personality = hostPersonalityForClass(personalities, "ACPIBacklightPanel");
+    if (!personality)
+    {
+        fprintf(stderr, "HostRig: no ACPIBacklightPanel personality in %s\n", infoPlist);
+        OSSafeRelease(personalities);
+        return false;
+    }
+
+    // what the platform publishes before the kext loads
+    hostRegisterPath(gIODTPlane, "/options", nvram);
+    nvram->registerService();
+    acpi->registerService();
+
+    panel = new ACPIBacklightPanel;
+    panel->init();
+    mergeProperties(panel, personality);
+    mergeProperties(panel, properties);
+    panel->attach(acpi);
+    SInt32 score = 0;
+    if (!panel->probe(acpi, &score))
+    {
+        fprintf(stderr, "HostRig: panel probe failed\n");
+        OSSafeReleaseNULL(panel);
+        personalities->release();
+        return false;
+    }
+
+    // the panel waits for the handler (kWaitForHandler), the handler for the panel
+    bool started = false;
+    std::thread starter([&] { started = panel->start(acpi); });
+
+    if (bar)
+    {
+        pci = new HostPCIDevice;
+        pci->init();
+        pci->setName("IGPU");
+        pci->bar0 = bar;
+        pci->vendorID = vendorID;
+        pci->deviceID = deviceID;
+        pci->registerService();
+        if (OSDictionary* match = hostPersonalityForPCI(personalities, vendorID, deviceID))
+        {
+            handler = new IntelBacklightHandler;
+            handler->init();
+            mergeProperties(handler, match);
+            handler->attach(pci);
+            if (!handler->start(pci))
+            {
+                fprintf(stderr, "HostRig: handler start failed\n");
+                OSSafeReleaseNULL(handler);
+            }
+        }
+        else
+            fprintf(stderr, "HostRig: no handler personality for %04x:%04x\n", vendorID, deviceID);
+    }
+    starter.join();
+    personalities->release();
+    if (!started)
+    {
+        fprintf(stderr, "HostRig: panel start failed\n");
+        OSSafeReleaseNULL(panel);
+        return false;
+    }
+    _started = true;
+    return true;
+}
+
+void HostRig::stop()
+{
+    if (!_started)
+        return;
+    detachDisplay();
+    // drain what is still queued first, so stop sees a quiet panel
+    settle(1000000000ULL);
+    panel->stop(acpi);
+    if (handler)
+    {
+        handler->stop(pci);
+        OSSafeReleaseNULL(handler);
+    }
+    OSSafeReleaseNULL(pci);
+    hostResetRegistry();
+    OSSafeReleaseNULL(panel);
+    _started = false;
+}
+
+void HostRig::attachDisplay(UInt64 pixelClock, UInt64 pixelCount)
+{
+    detachDisplay();
+    // IODisplay -> IODisplayConnect -> IOFramebuffer
+    _framebuffer = new IOService;
+    _framebuffer->init();
+    _framebuffer->setName("IOFramebuffer");
+    if (pixelClock && pixelCount)
+    {
+        _framebuffer->setProperty("IOFBCurrentPixelClock", pixelClock, 64);
+        _framebuffer->setProperty("IOFBCurrentPixelCount", pixelCount, 64);
+    }
+    _connect = new IOService;
+    _connect->init();
+    _connect->setName("IODisplayConnect");
+    _connect->attach(_framebuffer);
+    display = new IODisplay;
+    display->init();
+    display->attach(_connect);
+    OSDictionary* params = newParams();
+    display->setProperty(gIODisplayParametersKey, params);
+    params->release();
+    panel->setDisplay(display);
+}
+
+void HostRig::detachDisplay()
+{
+    if (!display)
+        return;
+    panel->setDisplay(NULL);
+    settle(1000000000ULL);
+    OSSafeReleaseNULL(display);
+    OSSafeReleaseNULL(_connect);
+    OSSafeReleaseNULL(_framebuffer);
+}
+
+bool HostRig::post(UInt32 level, OSDictionary* params)
+{
+    ++_posted;
+    return panel->doIntegerSet(params ? params : _params, gIODisplayBrightnessKey, level);
+}
+
+bool HostRig::commit(OSDictionary* params)
+{
+    return panel->doIntegerSet(params ? params : _params, gIODisplayParametersCommitKey, 0);
+}
+
+bool HostRig::settle(UInt64 timeoutNS)
+{
+    UInt64 end = hostUptimeNS() + timeoutNS;
+#ifdef HOST_LEGACY_PANEL
+    // no state published: settled once the backend has been quiet for a while
+    for (;;)
+    {
+        UInt64 sets = acpi->sets;
+        IOSleep(100);
+        if (acpi->sets == sets)
+            return true;
+        if (hostUptimeNS() > end)
+            return false;
+    }
+#else
+    for (;;)
+    {
+        PanelState state;
+        panel->readState(&state);
+        if (state.applied == (UInt32)_posted && state.current == state.target)
+            return true;
+        if (hostUptimeNS() > end)
+            return false;
+        // virtual time: run the transition's timers, or let the workloop take the posts
+        if (!hostVirtualClock())
+            IOSleep(1);
+        else if (state.applied != (UInt32)_posted)
+            std::this_thread::yield();
+        else if (!hostRunNextTimer(panel->getWorkLoop()))
+            hostAdvanceClock(1000000);  // nothing armed, still count towards the timeout
+    }
+#endif
+}
+
+void HostRig::sleep()
+{
+    hostSystemPower(kIOMessageSystemWillSleep);
+}
+
+void HostRig::wake()
+{
+    hostSystemPower(kIOMessageSystemHasPoweredOn);
+}
@@ -0,0 +1,90 @@
+//
+//  hostrig.h
+//  ACPIBacklight
+//
+//  The kext's services wired up the way the registry would on a laptop: a PNLF
+//  ACPI device, NVRAM, optionally a display PCI device with a simulated BAR
+//  for the native handler, and a display to hand to setDisplay.  Personalities
+//  (panel properties, handler kFrameBufferType) come from the kext's own
+//  Info.plist, matched by IOClass and IOPCIPrimaryMatch.
+//
+//  Usage:
+//      HostRig rig;
+//      rig.acpi->bcl = ...;                // and latencies, XOPT, XRGL, ...
+//      rig.start("ACPIBacklight/ACPIBacklight-Info.plist");
+//      rig.post(512);
+//      rig.settle();
+//
+//  Built with HOST_LEGACY_PANEL, the rig drives panel sources from before the
+//  workloop command queue (no PanelState), for old/new comparisons.
+//
+
+#ifndef ACPIBacklight_hostrig_h
+#define ACPIBacklight_hostrig_h
+
+#include "hostmock.h"
+#include "ACPIBacklight.h"
+
+// IOKitPersonalities of an Info.plist, retained; NULL if it can't be read
+OSDictionary* hostLoadPersonalities(const char* infoPlist);
+
+// the personality that would match, not retained: by IOClass, or for the
+// handler, the one whose IOPCIPrimaryMatch lists the PCI device
+OSDictionary* hostPersonalityForClass(OSDictionary* personalities, const char* className);
+OSDictionary* hostPersonalityForPCI(OSDictionary* personalities, UInt16 vendorID, UInt16 deviceID);
+
+class HostRig
+{
+public:
+    // acpi: a HostACPIDevice subclass to use as PNLF (the rig takes the reference)
+    explicit HostRig(HostACPIDevice* acpi = NULL);
+    ~HostRig();
+
+    // created with the rig, configure before start
+    HostACPIDevice* acpi;
+    IODTNVRAM* nvram;
+
+    // after start
+    ACPIBacklightPanel* panel;
+    HostPCIDevice* pci;                 // with a BAR only
+    IntelBacklightHandler* handler;     // with a BAR only, NULL if no personality matched
+    IODisplay* display;                 // after attachDisplay
+
+    // probe and start the panel with its Info.plist personality (properties
+    // merged over it); with a BAR, also the handler personality matching the
+    // device (XOPT needs kWaitForHandler then, start waits for the handler)
+    bool start(const char* infoPlist, OSDictionary* properties = NULL,
+               HostBAR* bar = NULL, UInt16 vendorID = 0x8086, UInt16 deviceID = 0);
+    void stop();
+
+    // IODisplay behind a framebuffer with the given timing (0 for none), as setDisplay
+    void attachDisplay(UInt64 pixelClock = 0, UInt64 pixelCount = 0);
+    void detachDisplay();
+
+    // IODisplay's calls; params is the caller's parameter dictionary (the rig's
+    // own when NULL, single threaded callers only)
+    bool post(UInt32 level, OSDictionary* params = NULL);
+    bool commit(OSDictionary* params = NULL);
+    OSDictionary* newParams();          // for callers on other threads
+
+    // every posted level applied and no transition running; on the virtual
+    // clock (hostUseVirtualClock) settle runs the panel's timers itself
+    bool settle(UInt64 timeoutNS = 5000000000ULL);
+#ifndef HOST_LEGACY_PANEL
+    void readState(PanelState* state) { panel->readState(state); }
+#endif
+    UInt64 posted() const { return _posted; }
+
+    // whole system sleep/wake, as the root domain sends it
+    void sleep();
+    void wake();
+
+private:
+    std::atomic<UInt64> _posted;
+    OSDictionary* _params;
+    IOService* _framebuffer;
+    IOService* _connect;
+    bool _started;
+};
+
+#endif
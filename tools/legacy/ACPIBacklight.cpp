@@ -0,0 +1,2583 @@
+/*
+ * Copyright (c) 1998-2000 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ * 
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <IOKit/IOService.h>
+#include <IOKit/pci/IOPCIDevice.h>
+#include <libkern/version.h>
+
+#include <IOKit/IONVRAM.h>
+#include <IOKit/IOLib.h>
+#include <IOKit/pwr_mgt/IOPM.h>
+#include "ACPIBacklight.h"
+#include "Debug.h"
+
+//REVIEW: avoids problem with Xcode 5.1.0 where -dead_strip eliminates these required symbols
+#include <libkern/OSKextLib.h>
+void* _org_rehabman_dontstrip_[] =
+{
+    (void*)&OSKextGetCurrentIdentifier,
+    (void*)&OSKextGetCurrentLoadTag,
+    (void*)&OSKextGetCurrentVersionString,
+};
+
+OSDefineMetaClassAndStructors(ACPIBacklightPanel, IODisplayParameterHandler)
+
+#define kACPIBacklightLevel "acpi-backlight-level"
+#define kRawBrightness "RawBrightness"
+
+#define kBacklightLevelMin  0
+#define kBacklightLevelMax  0x400
+
+#define kSmoothDelta "SmoothDelta%d"
+#define kSmoothStep "SmoothStep%d"
+#define kSmoothTimeout "SmoothTimeout%d"
+#define kSmoothBufSize 16
+#define kSmoothEasing "SmoothEasing"
+#define kSmoothLeeway "SmoothLeeway"
+#define kSmoothMode "SmoothMode"
+#define kSpringOmega "SpringOmega"
+#define kSmoothPacing "SmoothPacing"
+#define kFramePeriod "FramePeriod"
+
+#define kBrightnessTarget "BrightnessTarget"
+
+#define kProfileUp "Profile%sUp"
+#define kProfileDown "Profile%sDown"
+#define kProfileMin "Profile%sMin"
+#define kProfileEasing "Profile%sEasing"
+#define kProfileBufSize 32
+#define kEasingDefault 0xFF
+
+// requests closer than this are a slider drag, and requests within kWakeWindow after wake use the wake profile
+#define kSliderInterval 150000000ULL    // ns
+#define kWakeWindow 2000000000ULL       // ns
+
+// spring limits: omega keeps omega*dt small enough for stable integration at 10ms,
+// and a transition is forced to its target after kSpringMaxTime
+#define kSpringOmegaMin 1
+#define kSpringOmegaMax 50
+#define kSpringMaxTime 2000000      // us
+
+#define kBackendProbe "Backend Probe"
+#define kProbeIterations 4
+
+#define countof(x) (sizeof(x)/sizeof(x[0]))
+#define abs(x) ((x) < 0 ? -(x) : (x));
+
+// easing curves, t and result are 16.16 fixed point in [0,1]
+static UInt32 ease(UInt32 easing, UInt32 t)
+{
+    switch (easing)
+    {
+        case 1: // ease-in-out (smoothstep)
+            return (UInt32)(((UInt64)t * t * (3*0x10000 - 2*t)) >> 32);
+
+        case 2: // exponential ease-out: (1 - 2^(-10t)) / (1 - 2^-10)
+        {
+            // 2^(-i/16) for i = 0..16, 16.16
+            static const UInt32 pow2[] =
+            {
+                0x10000, 0xf525, 0xeac1, 0xe0cd, 0xd745, 0xce25, 0xc567, 0xbd09,
+                0xb505, 0xad58, 0xa5ff, 0x9ef5, 0x9838, 0x91c4, 0x8b96, 0x85ab, 0x8000,
+            };
+            UInt32 x = 10 * t;  // exponent, 16.16
+            UInt32 i = x >> 16, f = x & 0xFFFF;
+            UInt32 j = f >> 12, r = f & 0xFFF;
+            UInt32 p = pow2[j] - (((pow2[j] - pow2[j+1]) * r) >> 12);
+            p >>= i;
+            return (UInt32)(((UInt64)(0x10000 - p) << 16) / (0x10000 - (0x10000 >> 10)));
+        }
+    }
+    return t; // linear
+}
+
+static inline UInt64 uptimeNS()
+{
+    UInt64 abstime, ns;
+    clock_get_uptime(&abstime);
+    absolutetime_to_nanoseconds(abstime, &ns);
+    return ns;
+}
+
+struct SmoothData
+{
+    int delta;
+    int step;
+    int timeout;
+};
+
+struct SmoothData smoothData[] =
+{
+    0x10,   1,  10000,
+    0x40,   4,  10000,
+    0xFFFF, 16, 10000,
+};
+
+// indexed by ACPIBacklightPanel::kProfile*
+static const char* profileNames[] = { "Key", "Slider", "Restore", "Wake", "Power", };
+
+static const SmoothProfile defaultProfiles[] =
+{
+    { 1000, 1600, 100, kEasingDefault },    // Key: quick, but dimming slower than brightening
+    { 300,  300,  0,   0 },                 // Slider: follow the drag closely (linear)
+    { 0,    0,    0,   kEasingDefault },    // Restore: original smoothData tiers
+    { 50,   50,   0,   kEasingDefault },    // Wake: near-instant
+    { 2000, 2000, 500, 1 },                 // Power: long ease-in-out fade
+};
+
+#pragma mark -
+#pragma mark IOService functions override
+#pragma mark -
+
+
+bool ACPIBacklightPanel::init()
+{
+	DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+    backLightDevice = NULL;
+    BCLlevels = NULL;
+    gpuDevice = NULL;
+    _display = NULL;
+#if 0
+    _provider = NULL;
+#endif
+
+    _workSource = NULL;
+    _smoothTimer = NULL;
+    _cmdGate = NULL;
+
+    _extended = false;
+    _options = 0;
+    _lock = NULL;
+    _easing = kEasingLinear;
+    _trajectoryCount = _trajectoryIndex = 0;
+    _smoothLeeway = 0;
+    _smoothWakeups = _smoothWrites = _smoothRetargets = 0;
+    _smoothMode = kSmoothModeCurve;
+    _springOmega = 20;
+    _springPos = _springVel = 0;
+    _springTicks = 0;
+    _pacing = kPacingTimer;
+    _framePeriodDefault = 16667;
+    _framePeriod = _framePeriodDefault * 1000ULL;
+    _lastWriteFrame = 0;
+    _frameDoubles = _frameGaps = 0;
+    for (int i = 0; i < kProfileCount; i++)
+        _profiles[i] = defaultProfiles[i];
+    _activeProfile = kProfileKey;
+    _lastRequest = _wakeTime = 0;
+    _sleepWakeNotifier = NULL;
+    _powerSourceNotifier = NULL;
+    _powerSourceInterest = NULL;
+    _onAC = -1;
+    _sourceLevels[0] = _sourceLevels[1] = -1;
+    _writeCost = 0;
+    _deadline = 0;
+    _deadlinesMet = _deadlinesMissed = 0;
+    _deadlineLateness = 0;
+
+    _backlightHandler = NULL;
+    _backend = kBackendHandler;
+
+	return super::init();
+}
+
+
+IOService * ACPIBacklightPanel::probe( IOService * provider, SInt32 * score )
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+    bool hasFound = findDevices(provider);
+    DbgLog("%s: probe(devices found : %s)\n", this->getName(), (hasFound ? "true" : "false") );
+    
+    if (!hasFound)
+        return NULL;
+    
+    DbgLog("%s: %s has backlight Methods\n", this->getName(), backLightDevice->getName());
+    
+    return super::probe(provider, score);
+}
+
+bool ACPIBacklightPanel::start( IOService * provider )
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+#if 0
+    if (!provider)
+        return false;
+
+    _provider = provider;
+    _provider->retain();
+#endif
+
+    _lock = IORecursiveLockAlloc();
+    if (!_lock)
+        return false;
+    
+    findDevices(provider);
+
+    getDeviceControl();
+    hasSaveMethod = hasSAVEMethod(backLightDevice);
+    min = 0;
+    max = setupIndexedLevels();
+    if (min == max)
+    {
+        IOLog("ACPIBacklight: setupIndexedLevels failed (min==max)... aborting");
+        return false;
+    }
+
+    // add interrupt source for delayed actions...
+    _workSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &ACPIBacklightPanel::processWorkQueue));
+    if (!_workSource)
+        return false;
+    IOWorkLoop* workLoop = getWorkLoop();
+    if (!workLoop)
+    {
+        _workSource->release();
+        _workSource = NULL;
+        return false;
+    }
+    workLoop->addEventSource(_workSource);
+    _workPending = 0;
+
+    // add timer for smooth fade ins
+    // (_BCM only panels step through the _BCL levels, paced by the measured _BCM cost)
+    if (!(_options & kDisableSmooth))
+    {
+        _smoothTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ACPIBacklightPanel::onSmoothTimer));
+        if (_smoothTimer)
+            workLoop->addEventSource(_smoothTimer);
+    }
+
+    _cmdGate = IOCommandGate::commandGate(this);
+    if (_cmdGate)
+        workLoop->addEventSource(_cmdGate);
+
+    // initialize from properties
+    OSDictionary* dict = getPropertyTable();
+    setPropertiesGated(dict);
+
+    // write current values from smoothData
+    for (int i = 0; i < countof(smoothData); i++)
+    {
+        char buf[kSmoothBufSize];
+        snprintf(buf, sizeof(buf), kSmoothDelta, i);
+        setProperty(buf, smoothData[i].delta, 32);
+        snprintf(buf, sizeof(buf), kSmoothStep, i);
+        setProperty(buf, smoothData[i].step, 32);
+        snprintf(buf, sizeof(buf), kSmoothTimeout, i);
+        setProperty(buf, smoothData[i].timeout, 32);
+    }
+    setProperty(kSmoothEasing, _easing, 32);
+    setProperty(kSmoothLeeway, _smoothLeeway, 32);
+    setProperty(kSmoothMode, _smoothMode, 32);
+    setProperty(kSpringOmega, _springOmega, 32);
+    setProperty(kSmoothPacing, _pacing, 32);
+    setProperty(kFramePeriod, _framePeriodDefault, 32);
+    for (int i = 0; i < kProfileCount; i++)
+    {
+        char buf[kProfileBufSize];
+        snprintf(buf, sizeof(buf), kProfileUp, profileNames[i]);
+        setProperty(buf, _profiles[i].up, 32);
+        snprintf(buf, sizeof(buf), kProfileDown, profileNames[i]);
+        setProperty(buf, _profiles[i].down, 32);
+        snprintf(buf, sizeof(buf), kProfileMin, profileNames[i]);
+        setProperty(buf, _profiles[i].min, 32);
+        snprintf(buf, sizeof(buf), kProfileEasing, profileNames[i]);
+        setProperty(buf, _profiles[i].easing, 32);
+    }
+#ifdef DEBUG
+    setProperty("CycleTest", 1, 32);
+    setProperty("KLVX", 1, 32);
+#endif
+
+    IORecursiveLockLock(_lock);
+
+    // make the service available for clients like 'ioio'...
+    registerService();
+
+    // load and set default brightness level
+    UInt32 value = loadFromNVRAM();
+    DbgLog("%s: loadFromNVRAM returns %d\n", this->getName(), value);
+
+    // registerService above must be called before we wait for the BacklightHandler
+    if (useBacklightHandler())
+    {
+        DbgLog("%s: Waiting for BacklightHandler\n", this->getName());
+        waitForService(serviceMatching("BacklightHandler"));
+        // with both XBCM and native handler available, pick the faster one
+        probeBackends();
+    }
+
+    // after backlight handler is in place, now we can manipulate backlight level
+    UInt32 current = queryACPICurentBrightnessLevel();
+    setProperty(kRawBrightness, current, 32);
+#if 0
+    _provider->setProperty("AppleBacklightAtBoot", current, 32);
+    _provider->setProperty("AppleMaxBrightness", BCLlevels[BCLlevelsCount-1], 32);
+#endif
+
+    _committed_value = _value = _from_value = levelForValue(current);
+    DbgLog("%s: current brightness: %d (%d)\n", this->getName(), _from_value, current);
+    if (-1 != value)
+    {
+        _committed_value = value;
+        DbgLog("%s: setting to value from nvram %d\n", this->getName(), value);
+        setBrightnessLevelSmooth(value, kProfileRestore);
+    }
+    _saved_value = _committed_value;
+
+    IORecursiveLockUnlock(_lock);
+
+    // wake and power source changes select their own transition profiles
+    _sleepWakeNotifier = registerPrioritySleepWakeInterest(&ACPIBacklightPanel::powerInterest, this);
+    if (OSDictionary* matching = serviceMatching("IOPMPowerSource"))
+    {
+        _powerSourceNotifier = addMatchingNotification(gIOFirstPublishNotification, matching, &ACPIBacklightPanel::powerSourcePublished, this);
+        matching->release();
+    }
+
+    DbgLog("%s: min = %u, max = %u\n", this->getName(), min, max);
+
+    // announce version
+    extern kmod_info_t kmod_info;
+    IOLog("ACPIBacklight: Version %s starting on OS X Darwin %d.%d.\n", kmod_info.version, version_major, version_minor);
+
+    // place version/build info in ioreg properties RM,Build and RM,Version
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s %s", kmod_info.name, kmod_info.version);
+    setProperty("RM,Version", buf);
+#ifdef DEBUG
+    setProperty("RM,Build", "Debug-" LOGNAME);
+#else
+    setProperty("RM,Build", "Release-" LOGNAME);
+#endif
+
+	return true;
+}
+
+void ACPIBacklightPanel::stop( IOService * provider )
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    if (_sleepWakeNotifier)
+    {
+        _sleepWakeNotifier->remove();
+        _sleepWakeNotifier = NULL;
+    }
+    if (_powerSourceNotifier)
+    {
+        _powerSourceNotifier->remove();
+        _powerSourceNotifier = NULL;
+    }
+    if (_powerSourceInterest)
+    {
+        _powerSourceInterest->remove();
+        _powerSourceInterest = NULL;
+    }
+
+    IOWorkLoop* workLoop = getWorkLoop();
+    if (workLoop)
+    {
+        if (_workSource)
+        {
+            workLoop->removeEventSource(_workSource);
+            _workSource->release();
+            _workSource = NULL;
+        }
+        if (_smoothTimer)
+        {
+            workLoop->removeEventSource(_smoothTimer);
+            _smoothTimer->release();
+            _smoothTimer = NULL;
+        }
+        if (_cmdGate)
+        {
+            workLoop->removeEventSource(_cmdGate);
+            _cmdGate->release();
+            _cmdGate = NULL;
+        }
+    }
+    _extended = false;
+
+    if (_lock)
+    {
+        IORecursiveLockFree(_lock);
+        _lock = NULL;
+    }
+
+#if 0
+    OSSafeReleaseNULL(_provider);
+#endif
+
+    _backlightHandler = NULL;
+
+    super::stop(provider);
+}
+
+void ACPIBacklightPanel::free()
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+	
+	if (gpuDevice)
+    {
+		gpuDevice->release();
+        gpuDevice = NULL;
+    }
+    
+	if (backLightDevice)
+    {
+        backLightDevice->release();
+        backLightDevice = NULL;
+    }
+    
+	if (BCLlevels)
+    {
+		delete[] BCLlevels;
+        BCLlevels = NULL;
+    }
+	
+    if (_display)
+    {
+        _display->release();
+        _display = NULL;
+    }
+    
+    super::free();
+}
+
+bool ACPIBacklightPanel::setBacklightHandler(BacklightHandler *handler, BacklightHandlerParams* params)
+{
+    if (!useBacklightHandler())
+        return false;
+
+    _backlightHandler = handler;
+    if (params)
+        *params = _handlerParams;
+
+    return true;
+}
+
+bool ACPIBacklightPanel::useBacklightHandler()
+{
+    // do not allow setBacklightHandler with old PNLF patches
+    if (!(_options & kWaitForHandler))
+        return false;
+
+    // do not allow setBacklightHandler on versions prior to 10.11 unless kForceUseHandler is set
+    if (version_major < 15 && !(_options & kForceUseHandler))
+        return false;
+
+    return true;
+}
+
+UInt64 ACPIBacklightPanel::probeBackend(UInt32 backend, UInt32 level, bool* correct)
+{
+    // write the level back several times and keep the best time
+    UInt64 best = ~0ULL;
+    *correct = true;
+    for (int i = 0; i < kProbeIterations; i++)
+    {
+        UInt64 start = uptimeNS();
+        bool ok = setBackendLevel(backend, level);
+        UInt64 elapsed = uptimeNS() - start;
+        if (elapsed < best)
+            best = elapsed;
+        // read-back must reflect what was written
+        if (!ok || queryBackendLevel(backend) != level)
+            *correct = false;
+    }
+    return best;
+}
+
+void ACPIBacklightPanel::probeBackends()
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    // only meaningful when XBCM and the native handler can both set the level
+    if (!_extended || !_backlightHandler || (_options & kDisableProbe))
+        return;
+
+    // current level is written back through each backend, so no visible change
+    UInt32 level = queryBackendLevel(kBackendHandler);
+    bool acpiOk, handlerOk;
+    UInt64 acpiTime = probeBackend(kBackendACPI, level, &acpiOk);
+    UInt64 handlerTime = probeBackend(kBackendHandler, level, &handlerOk);
+
+    // prefer a correct backend, then the faster one (handler if neither is correct)
+    if (acpiOk && (!handlerOk || acpiTime < handlerTime))
+        _backend = kBackendACPI;
+    else
+        _backend = kBackendHandler;
+    _writeCost = kBackendACPI == _backend ? acpiTime : handlerTime;
+
+    if (OSDictionary* dict = OSDictionary::withCapacity(5))
+    {
+        if (OSNumber* num = OSNumber::withNumber(acpiTime, 64))
+        {
+            dict->setObject("ACPI ns", num);
+            num->release();
+        }
+        dict->setObject("ACPI correct", acpiOk ? kOSBooleanTrue : kOSBooleanFalse);
+        if (OSNumber* num = OSNumber::withNumber(handlerTime, 64))
+        {
+            dict->setObject("Handler ns", num);
+            num->release();
+        }
+        dict->setObject("Handler correct", handlerOk ? kOSBooleanTrue : kOSBooleanFalse);
+        if (OSString* str = OSString::withCString(kBackendACPI == _backend ? "ACPI" : "Handler"))
+        {
+            dict->setObject("Selected", str);
+            str->release();
+        }
+        setProperty(kBackendProbe, dict);
+        dict->release();
+    }
+    IOLog("ACPIBacklight: using %s backend (ACPI %lluns%s, Handler %lluns%s)\n",
+          kBackendACPI == _backend ? "ACPI" : "Handler",
+          acpiTime, acpiOk ? "" : " incorrect", handlerTime, handlerOk ? "" : " incorrect");
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#pragma mark -
+#pragma mark IODisplayParameterHandler functions override
+#pragma mark -
+
+UInt32 ACPIBacklightPanel::indexForLevel(UInt32 value, UInt32* rem)
+{
+    UInt32 index = value * (max-min);
+    if (rem)
+        *rem = index % kBacklightLevelMax;
+    index = index / kBacklightLevelMax + min;
+    return index;
+}
+
+UInt32 ACPIBacklightPanel::levelForIndex(UInt32 index)
+{
+    UInt32 value = ((index-min) * kBacklightLevelMax + (max-min)/2) / (max-min);
+    return value;
+}
+
+UInt32 ACPIBacklightPanel::levelForValue(UInt32 value)
+{
+    // return approx. OS X level for ACPI value
+    UInt32 index = findIndexForLevel(value);
+    UInt32 level = levelForIndex(index);
+    if (index < BCLlevelsCount-1)
+    {
+        // pro-rate between levels
+        int diff = levelForIndex(index+1) - level;
+        if (BCLlevels[index+1] != BCLlevels[index])
+        {
+            // now pro-rate diff for value as between BCLLevels[index] and BCLLevels[index+1]
+            diff *= value - BCLlevels[index];
+            diff /= BCLlevels[index+1] - BCLlevels[index];
+            level += diff;
+        }
+    }
+    return level;
+}
+
+bool ACPIBacklightPanel::setDisplay( IODisplay * display )
+{    
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    IORecursiveLockLock(_lock);
+
+    // retain new display (also allow setting to same instance as previous)
+    if (display)
+        display->retain();
+    OSSafeRelease(_display);
+    _display = display;
+    updateFramePeriod();
+    if (_display)
+    {
+        // automatically commit a non-zero value on display change
+        if (_value)
+            _saved_value = _committed_value = _value;
+        // update brightness levels
+        doUpdate();
+    }
+
+    IORecursiveLockUnlock(_lock);
+
+    return true;
+}
+
+
+bool ACPIBacklightPanel::doIntegerSet( OSDictionary * params, const OSSymbol * paramName, UInt32 value)
+{
+    bool result = true;
+
+    IORecursiveLockLock(_lock);
+    
+    DbgLog("%s::%s(\"%s\", %d)\n", this->getName(), __FUNCTION__, paramName->getCStringNoCopy(), value);
+    if ( gIODisplayBrightnessKey->isEqualTo(paramName))
+    {   
+        //DbgLog("%s::%s(%s) map %d -> %d\n", this->getName(),__FUNCTION__, paramName->getCStringNoCopy(), value, indexForLevel(value));
+        //REVIEW: workaround for Yosemite DP...
+        if (value < 5 && _value > 5)
+        {
+            //REVIEW: copied from commit case below...
+            // setting to zero automatically commits prior value
+            UInt32 index = indexForLevel(_value);
+            _committed_value = _value;
+            // save to NVRAM in work loop
+            scheduleWork(kWorkSave|kWorkSetBrightness);
+            // save to BIOS nvram via ACPI
+            if (hasSaveMethod)
+                saveACPIBrightnessLevel(BCLlevels[index]);
+        }
+        UInt32 profile = profileForRequest();
+        if (0xFF == value)
+        {
+            setBrightnessLevelSmooth(_saved_value, kProfileRestore);
+            result = false;
+        }
+        else
+        {
+            //REVIEW: end workaround...
+            setBrightnessLevelSmooth(value, profile);
+            if (value > 5) // more hacks for Yosemite (don't save really low values)
+                _saved_value = value;
+        }
+    }
+    else if (gIODisplayParametersCommitKey->isEqualTo(paramName))
+    {
+        UInt32 index = indexForLevel(_value);
+        //DbgLog("%s::%s(%s) map %d -> %d\n", this->getName(),__FUNCTION__, paramName->getCStringNoCopy(), value, index);
+        _committed_value = _value;
+        IODisplay::setParameter(params, gIODisplayBrightnessKey, _committed_value);
+        // save to NVRAM in work loop
+        scheduleWork(kWorkSave|kWorkSetBrightness);
+        // save to BIOS nvram via ACPI
+        if (hasSaveMethod)
+            saveACPIBrightnessLevel(BCLlevels[index]);
+    }
+
+    IORecursiveLockUnlock(_lock);
+
+    return result;
+}
+
+
+bool ACPIBacklightPanel::doDataSet( const OSSymbol * paramName, OSData * value )
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    return true;
+}
+
+
+bool ACPIBacklightPanel::doUpdate( void )
+{
+    DbgLog("enter %s::%s()\n", this->getName(),__FUNCTION__);
+    bool result = false;
+
+    IORecursiveLockLock(_lock);
+
+    OSDictionary* newDict = 0;
+	OSDictionary* allParams = OSDynamicCast(OSDictionary, _display->copyProperty(gIODisplayParametersKey));
+    if (allParams)
+    {
+        newDict = OSDictionary::withDictionary(allParams);
+        allParams->release();
+    }
+    
+    OSDictionary* backlightParams = OSDictionary::withCapacity(2);
+    ////OSDictionary* linearParams = OSDictionary::withCapacity(2);
+
+    //REVIEW_REHABMAN: myParams is not used...
+    OSDictionary* myParams  = OSDynamicCast(OSDictionary, copyProperty(gIODisplayParametersKey));
+    if (/*linearParams && */backlightParams && myParams)
+	{				
+		//DbgLog("%s: ACPILevel min %d, max %d, value %d\n", this->getName(), min, max, _value);
+		
+        IODisplay::addParameter(backlightParams, gIODisplayBrightnessKey, kBacklightLevelMin, kBacklightLevelMax);
+        IODisplay::setParameter(backlightParams, gIODisplayBrightnessKey, _committed_value);
+
+        ////IODisplay::addParameter(linearParams, gIODisplayLinearBrightnessKey, 0, 0x710);
+        ////IODisplay::setParameter(linearParams, gIODisplayLinearBrightnessKey, ((_index-min) * 0x710 + (max-min)/2) / (max-min));
+
+        OSNumber * num = OSNumber::withNumber(0ULL, 32);
+        OSDictionary * commitParams = OSDictionary::withCapacity(1);
+        commitParams->setObject("reg", num);
+        backlightParams->setObject(gIODisplayParametersCommitKey, commitParams);
+        num->release();
+        commitParams->release();
+                
+        if (newDict)
+        {
+            newDict->merge(backlightParams);
+            ////newDict->merge(linearParams);
+            _display->setProperty(gIODisplayParametersKey, newDict);
+            newDict->release();
+        }
+        else
+            _display->setProperty(gIODisplayParametersKey, backlightParams);
+
+        //refresh properties here too
+        setProperty(gIODisplayParametersKey, backlightParams);
+        
+        backlightParams->release();
+        myParams->release();
+        ////linearParams->release();
+
+        result = true;
+	}
+
+    IORecursiveLockUnlock(_lock);
+
+    DbgLog("exit %s::%s()\n", this->getName(),__FUNCTION__);
+    return result;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#pragma mark -
+#pragma mark ACPI related functions
+#pragma mark -
+
+
+bool ACPIBacklightPanel::findDevices(IOService * provider)
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+    if (!gpuDevice || !backLightDevice)
+    {
+        IOACPIPlatformDevice * dev = OSDynamicCast(IOACPIPlatformDevice, provider);
+        if (hasBacklightMethods(dev))
+        {
+            DbgLog("%s: PNLF has backlight Methods\n", this->getName());
+            backLightDevice = dev;
+            gpuDevice = dev;
+            gpuDevice->retain();
+            backLightDevice->retain();
+        }
+        else
+        {            
+            gpuDevice = getGPU();
+            
+            if (NULL == gpuDevice)
+                return false;
+            
+            gpuDevice->retain();
+            
+            if (hasBacklightMethods(gpuDevice))
+            {
+                backLightDevice = gpuDevice;
+            }
+            else
+            {
+                backLightDevice = getChildWithBacklightMethods(gpuDevice);
+            }
+            
+            if (backLightDevice == NULL)
+                return false;
+            
+            backLightDevice->retain();
+        }
+
+#ifdef DEBUG
+        if (gpuDevice != backLightDevice)
+        {
+            OSArray * devicePaths = OSArray::withCapacity(2);
+            OSString* path = getACPIPath(gpuDevice);
+            IOLog("ACPIBacklight: ACPI Method _DOS found. Device path: %s\n", path->getCStringNoCopy());
+            devicePaths->setObject(path);
+            path->release();
+            path = getACPIPath(backLightDevice);
+            IOLog("ACPIBacklight: ACPI Methods _BCL _BCM _BQC found. Device path: %s\n", path->getCStringNoCopy());
+            devicePaths->setObject(path);
+            path->release();
+            setProperty("ACPI Devices Paths", devicePaths);
+            devicePaths->release();
+        }
+        else
+        {
+            OSString* path = getACPIPath(backLightDevice);
+            IOLog("ACPIBacklight: ACPI Methods _DOS _BCL _BCM _BQC found. Device path: %s\n", path->getCStringNoCopy());
+            setProperty("ACPI Device Path", path);
+            path->release();
+        }
+#endif
+    }
+    return true;
+}
+
+
+OSString * ACPIBacklightPanel::getACPIPath(IOACPIPlatformDevice * acpiDevice)
+{
+    OSString * separator = OSString::withCStringNoCopy(".");
+    OSArray * array = OSArray::withCapacity(10);
+    
+    char devicePath[512];
+    bzero(devicePath, sizeof(devicePath));
+    IOACPIPlatformDevice * parent = acpiDevice;
+    
+    IORegistryIterator * iter = IORegistryIterator::iterateOver(acpiDevice, gIOACPIPlane, kIORegistryIterateParents | kIORegistryIterateRecursively);
+    if (iter)
+    {
+        do {
+            array->setObject(parent->copyName(gIOACPIPlane));
+            array->setObject(separator);
+            parent = OSDynamicCast(IOACPIPlatformDevice, iter->getNextObject());
+        } while (parent);
+        iter->release();
+        
+        int offset = 0;
+        OSString * str = OSDynamicCast(OSString, array->getLastObject());
+        for (int i = array->getCount()-2; ((i>=0) || ((offset + str->getLength()) > sizeof(devicePath))) ; i--)
+        {
+            str = OSDynamicCast(OSString, array->getObject(i));
+            strncpy(devicePath + offset, str->getCStringNoCopy(), str->getLength());
+            offset += str->getLength();
+        }
+    }
+    return OSString::withCString(devicePath);
+}
+
+
+IOACPIPlatformDevice *  ACPIBacklightPanel::getGPU()
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+    IORegistryIterator * iter = IORegistryIterator::iterateOver(gIOACPIPlane, kIORegistryIterateRecursively);
+    IOACPIPlatformDevice * look = NULL, * ret = NULL;
+    IORegistryEntry * entry;
+    
+    if (iter)
+    {
+        do
+        {
+            entry = iter->getNextObject();
+            look = OSDynamicCast(IOACPIPlatformDevice, entry);
+            if (look)
+            {
+                DbgLog("%s: testing device: %s\n", this->getName(), look->getName());
+                if (hasDOSMethod(look))
+                {
+                    ret = look;
+                    break;
+                }
+            }
+        }
+        while (entry) ;
+        iter->release();
+    }
+    return ret;
+}
+
+bool ACPIBacklightPanel::hasBacklightMethods(IOACPIPlatformDevice * acpiDevice)
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	bool ret = true;
+	if (kIOReturnSuccess == acpiDevice->validateObject("_BCL"))
+		DbgLog("%s: ACPI device %s has _BCL\n", this->getName(), acpiDevice->getName());
+	else
+		ret = false;
+
+    if (kIOReturnSuccess == acpiDevice->validateObject("XBCM") && kIOReturnSuccess == acpiDevice->validateObject("XBQC"))
+    {
+        DbgLog("%s: ACPI device %s has XBCM/XBQC\n", this->getName(), acpiDevice->getName());
+        _extended = true;
+
+        // get additional paramaters from ACPI PNLF device methods
+        _options = 0;
+        acpiDevice->evaluateInteger("XOPT", &_options);
+        _handlerParams._xrgl = -1;
+        acpiDevice->evaluateInteger("XRGL", &_handlerParams._xrgl);
+        _handlerParams._xrgh = -1;
+        acpiDevice->evaluateInteger("XRGH", &_handlerParams._xrgh);
+        _handlerParams._klvx = -1;
+        acpiDevice->evaluateInteger("KLVX", &_handlerParams._klvx);
+        _handlerParams._lmax = -1;
+        acpiDevice->evaluateInteger("LMAX", &_handlerParams._lmax);
+        _handlerParams._kpch = -1;
+        acpiDevice->evaluateInteger("KPCH", &_handlerParams._kpch);
+    }
+
+    if (!_extended)
+    {
+        if (kIOReturnSuccess == acpiDevice->validateObject("_BCM"))
+            DbgLog("%s: ACPI device %s has _BCM\n", this->getName(), acpiDevice->getName());
+        else
+            ret = false;
+        
+        if (kIOReturnSuccess == acpiDevice->validateObject("_BQC"))
+            DbgLog("%s: ACPI device %s has _BQC\n", this->getName(), acpiDevice->getName());	
+        else
+            ret = false;
+    }
+
+	return ret;
+}
+
+
+bool ACPIBacklightPanel::hasDOSMethod(IOACPIPlatformDevice * acpiDevice)
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	bool ret = true;
+	if (kIOReturnSuccess == acpiDevice->validateObject("_DOS"))
+		DbgLog("%s: ACPI device %s has _DOS\n", this->getName(), acpiDevice->getName());
+	else
+		ret = false;
+    	
+	return ret;
+}
+
+
+bool ACPIBacklightPanel::hasSAVEMethod(IOACPIPlatformDevice * acpiDevice)
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	bool ret = true;
+	if (kIOReturnSuccess == acpiDevice->validateObject("SAVE"))
+		DbgLog("%s: ACPI device %s has SAVE\n", this->getName(), acpiDevice->getName());
+	else
+		ret = false;
+    
+	return ret;
+}
+
+IOACPIPlatformDevice * ACPIBacklightPanel::getChildWithBacklightMethods(IOACPIPlatformDevice * GPUdevice)
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	OSIterator * 		iter = NULL;
+	OSObject *		entry;
+    
+	iter =  GPUdevice->getChildIterator(gIOACPIPlane);
+	if (iter)
+	{
+		while ( true )
+		{			
+			entry = iter->getNextObject();
+			if (NULL == entry)
+				break;
+			
+			if (entry->metaCast("IOACPIPlatformDevice"))
+			{
+				IOACPIPlatformDevice * device = (IOACPIPlatformDevice *) entry;
+				
+				if (hasBacklightMethods(device))
+				{
+					IOLog("ACPIBacklight: Found Backlight Device: %s\n", device->getName());
+					return device;
+				}
+			}
+			else {
+				DbgLog("%s: getChildWithBacklightMethods() Cast Error\n", this->getName());
+			}
+		} //end while
+		iter->release();
+		DbgLog("%s: getChildWithBacklightMethods() iterator end\n", this->getName());
+	}
+	return NULL;
+}
+
+
+OSArray * ACPIBacklightPanel::queryACPISupportedBrightnessLevels()
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	OSObject * ret;
+	backLightDevice->evaluateObject("_BCL", &ret);
+	OSArray * data = OSDynamicCast(OSArray, ret);
+	if (data)
+	{
+		DbgLog("%s: %s _BCL %d\n", this->getName(), backLightDevice->getName(), data->getCount() );
+		return data;
+	}
+	else
+    {
+		DbgLog("%s: Cast Error _BCL is %s\n", this->getName(), ret ? ret->getMetaClass()->getClassName() : "ret=NULL");
+	}
+	OSSafeRelease(ret);
+	return NULL;
+}
+
+
+void ACPIBacklightPanel::setACPIBrightnessLevel(UInt32 level)
+{
+    //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    UInt32 backend = _backlightHandler ? _backend : kBackendACPI;
+    UInt64 start = uptimeNS();
+    bool ok = setBackendLevel(backend, level);
+    // running average of write cost, used to pace deadline transitions
+    UInt64 elapsed = uptimeNS() - start;
+    _writeCost = _writeCost ? (_writeCost * 7 + elapsed) / 8 : elapsed;
+    if (ok)
+    {
+        // just FYI... set RawBrightness property to actual current level
+        UInt32 current = queryBackendLevel(backend);
+        setProperty(kRawBrightness, current, 32);
+#if 0
+        if (_provider)
+            _provider->setProperty("ApplePanelRawBrightness", current, 32);
+#endif
+    }
+}
+
+bool ACPIBacklightPanel::setBackendLevel(UInt32 backend, UInt32 level)
+{
+    if (kBackendHandler == backend)
+    {
+        //set backlight via native handler instead of ACPI...
+        _backlightHandler->setBacklightLevel(level);
+        return true;
+    }
+
+    bool result = false;
+	OSObject * ret = NULL;
+	OSNumber * number = OSNumber::withNumber(level, 32);
+    const char* method = _extended ? "XBCM" : "_BCM";
+
+	if (number && kIOReturnSuccess == backLightDevice->evaluateObject(method, &ret, (OSObject**)&number, 1))
+    {
+        OSSafeRelease(ret);
+        ////DbgLog("%s: setBackendLevel %s(%u)\n", this->getName(), method, level);
+        result = true;
+    }
+    else
+        IOLog("ACPIBacklight: Error in setACPIBrightnessLevel %s(%u)\n",  method, level);
+    OSSafeRelease(number);
+    return result;
+}
+
+void ACPIBacklightPanel::setBrightnessLevel(UInt32 level)
+{
+    //DbgLog("%s::%s(%d)\n", this->getName(), __FUNCTION__, level);
+
+    setACPIBrightnessLevel(rawForLevel(level));
+}
+
+UInt32 ACPIBacklightPanel::rawForLevel(UInt32 level)
+{
+    UInt32 rem;
+    UInt32 index = indexForLevel(level, &rem);
+    UInt32 value = BCLlevels[index];
+    //DbgLog("%s: level=%d, index=%d, value=%d\n", this->getName(), level, index, value);
+    if (_extended)
+    {
+        // can set "in between" level
+        UInt32 next = index+1;
+        if (next < BCLlevelsCount)
+        {
+            // prorate the difference...
+            UInt32 diff = BCLlevels[next] - value;
+            value += (diff * rem) / kBacklightLevelMax;
+            //DbgLog("%s: diff=%d, rem=%d, value=%d\n", this->getName(), diff, rem, value);
+        }
+    }
+    return value;
+}
+
+UInt64 ACPIBacklightPanel::smoothDuration(int from, int to)
+{
+    int diff = abs(to - from);
+
+    // profile with explicit timing: full range time scaled by distance
+    SmoothProfile* profile = &_profiles[_activeProfile];
+    UInt32 full = to > from ? profile->up : profile->down;
+    if (full)
+    {
+        UInt64 ms = (UInt64)full * diff / kBacklightLevelMax;
+        if (ms < profile->min)
+            ms = profile->min;
+        return ms * 1000000ULL;
+    }
+
+    // otherwise total time the smoothData tiers allot to move from -> to
+    int index = countof(smoothData)-1; // defensive
+    for (int i = 0; i < countof(smoothData); i++)
+    {
+        if (diff <= smoothData[i].delta)
+        {
+            index = i;
+            break;
+        }
+    }
+    UInt64 duration = 0;
+    for (; index >= 0 && diff > 0; index--)
+    {
+        // number of steps taken in this tier before dropping to the next
+        SmoothData* data = &smoothData[index];
+        int lower = index > 0 ? smoothData[index-1].delta : 0;
+        int step = data->step > 0 ? data->step : 1;
+        int steps = (diff - lower + step - 1) / step;
+        if (steps < 0)
+            steps = 0;
+        diff -= steps * step;
+        duration += (UInt64)steps * data->timeout * 1000;
+    }
+    return duration;
+}
+
+void ACPIBacklightPanel::buildTrajectory(UInt64 start, UInt64 duration)
+{
+    // sample the curve once per tick, but keep only points where the raw value changes
+    int from = _from_value;
+    UInt64 tick = smoothTick();
+    UInt64 spacing = tick;
+    if (_writeCost > spacing)
+    {
+        // no point sampling faster than the backend can write
+        spacing = (_writeCost + tick - 1) / tick * tick;
+    }
+    if (spacing * kTrajectoryMax < duration)
+    {
+        // whole number of ticks, so frame paced points still land one per frame
+        spacing = (duration + kTrajectoryMax - 1) / kTrajectoryMax;
+        spacing = (spacing + tick - 1) / tick * tick;
+    }
+    if (!spacing)
+        spacing = 1;
+    UInt64 leeway = _smoothLeeway * 1000ULL;
+    UInt32 easing = _profiles[_activeProfile].easing;
+    if (easing >= kEasingCount)
+        easing = _easing;
+
+    int count = 0;
+    UInt32 lastRaw = rawForLevel(from);
+    for (UInt64 t = spacing; count < kTrajectoryMax; t += spacing)
+    {
+        if (t > duration)
+            t = duration;
+        int level = _value;
+        if (t < duration)
+        {
+            SInt64 delta = (SInt64)(_value - from) * ease(easing, (UInt32)((t << 16) / duration));
+            level = from + (int)(delta / 0x10000);
+        }
+        UInt32 raw = rawForLevel(level);
+        if (raw != lastRaw)
+        {
+            // within leeway of the previous wakeup, fold into it instead of waking again
+            TrajectoryPoint* point = &_trajectory[count];
+            UInt64 deadline = alignToFrame(start + t);
+            if (count && deadline - _trajectory[count-1].deadline < leeway)
+                point = &_trajectory[count-1];
+            else
+            {
+                point->deadline = deadline;
+                ++count;
+            }
+            point->level = level;
+            point->raw = lastRaw = raw;
+        }
+        if (t >= duration)
+            break;
+    }
+    if (!count)
+    {
+        // no visible change on the way, still need to land on target
+        _trajectory[0].deadline = alignToFrame(start + spacing);
+        count = 1;
+    }
+    // make sure transition ends exactly at target
+    _trajectory[count-1].level = _value;
+    _trajectory[count-1].raw = rawForLevel(_value);
+    _trajectoryCount = count;
+    _trajectoryIndex = 0;
+}
+
+void ACPIBacklightPanel::armSmoothTimer()
+{
+    UInt64 now = uptimeNS();
+    UInt64 deadline = _trajectory[_trajectoryIndex].deadline;
+    _smoothTimer->setTimeoutUS(deadline > now ? (UInt32)((deadline - now) / 1000) : 0);
+}
+
+void ACPIBacklightPanel::setBrightnessLevelSmooth(UInt32 level, UInt32 profile)
+{
+    DbgLog("%s::%s(%d, %d)\n", this->getName(), __FUNCTION__, level, profile);
+
+    //DbgLog("%s: _from_value=%d, _value=%d\n", this->getName(), _from_value, _value);
+
+    if (_smoothTimer)
+    {
+        IORecursiveLockLock(_lock);
+
+        if (level != _value && kSmoothModeSpring == _smoothMode)
+        {
+            // retarget keeps position and velocity, so speed stays continuous
+            bool start = (_from_value == _value);
+            _value = level;
+            _springTicks = 0;
+            if (start)
+            {
+                startSmoothStats();
+                _springPos = (SInt64)_from_value << 16;
+                _springVel = 0;
+                onSmoothTimer();
+            }
+        }
+        else if (level != _value)
+        {
+            bool start = (_from_value == _value);
+            _value = level;
+            _activeProfile = profile;
+            if (_deadline)
+                finishDeadline(false); // superseded
+            UInt64 now = uptimeNS();
+            if (start)
+            {
+                startSmoothStats();
+                // first step is taken immediately, as if one tick had passed
+                buildTrajectory(now - smoothTick(), smoothDuration(_from_value, _value));
+                onSmoothTimer();
+            }
+            else
+            {
+                // retarget: rebuild from current position, dropping the superseded target
+                UInt64 pending = _trajectoryIndex < _trajectoryCount ? _trajectory[_trajectoryIndex].deadline : now;
+                ++_smoothRetargets;
+                buildTrajectory(now, smoothDuration(_from_value, _value));
+                // keep the wakeup already due, so a stream of retargets (slider drag) still writes
+                if (pending < _trajectory[0].deadline)
+                    _trajectory[0].deadline = pending;
+                _smoothTimer->cancelTimeout();
+                armSmoothTimer();
+            }
+        }
+        else if (_from_value == _value)
+        {
+            // in the case of already set to that value, set it for sure
+            setBrightnessLevel(_value);
+        }
+
+        IORecursiveLockUnlock(_lock);
+    }
+    else
+    {
+        _from_value = _value = level;
+        setBrightnessLevel(_value);
+    }
+}
+
+void ACPIBacklightPanel::onSmoothTimer()
+{
+    //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    IORecursiveLockLock(_lock);
+
+    if (kSmoothModeSpring == _smoothMode)
+        stepSpring();
+    else if (_trajectoryIndex < _trajectoryCount)
+    {
+        // a late timer skips ahead to the latest point already due
+        UInt64 now = uptimeNS();
+        while (_trajectoryIndex+1 < _trajectoryCount && _trajectory[_trajectoryIndex+1].deadline <= now)
+            ++_trajectoryIndex;
+
+        TrajectoryPoint* point = &_trajectory[_trajectoryIndex++];
+        ////DbgLog("%s::%s(): level=%d, raw=%d\n", this->getName(), __FUNCTION__, point->level, point->raw);
+        ++_smoothWakeups;
+        _from_value = point->level;
+        setACPIBrightnessLevel(point->raw);
+        noteSmoothWrite();
+        // set new timer if not reached desired brightness previously set
+        if (_trajectoryIndex < _trajectoryCount)
+            armSmoothTimer();
+        else
+        {
+            if (_deadline)
+            {
+                _deadlineLateness = (SInt64)(uptimeNS() - _deadline);
+                finishDeadline(_deadlineLateness <= 0);
+            }
+            publishSmoothStats();
+        }
+    }
+
+    IORecursiveLockUnlock(_lock);
+}
+
+IOReturn ACPIBacklightPanel::setBrightnessDeadline(UInt32 level, UInt64 deadline)
+{
+    DbgLog("%s::%s(%d, %llu)\n", this->getName(), __FUNCTION__, level, deadline);
+
+    if (level > kBacklightLevelMax)
+        return kIOReturnBadArgument;
+    // spring mode has no fixed completion time
+    if (kSmoothModeSpring == _smoothMode)
+        return kIOReturnUnsupported;
+
+    IORecursiveLockLock(_lock);
+
+    IOReturn result = kIOReturnSuccess;
+    UInt64 now = uptimeNS();
+    if (_deadline)
+        finishDeadline(false); // superseded
+    if (!_smoothTimer || (int)level == _from_value)
+    {
+        _trajectoryCount = _trajectoryIndex = 0;
+        if (_smoothTimer)
+            _smoothTimer->cancelTimeout();
+        _from_value = _value = level;
+        setBrightnessLevel(_value);
+        if (uptimeNS() > deadline)
+            result = kIOReturnTimeout;
+        finishDeadline(kIOReturnSuccess == result);
+    }
+    else
+    {
+        // last write has to start one write cost before the deadline
+        UInt64 cost = _writeCost;
+        if (deadline < now + cost)
+        {
+            // cannot be met, get there as soon as possible
+            result = kIOReturnTimeout;
+            deadline = now + cost;
+        }
+        bool start = (_from_value == _value);
+        _value = level;
+        _deadline = deadline;
+        if (start)
+            startSmoothStats();
+        buildTrajectory(now, deadline - cost - now);
+        _smoothTimer->cancelTimeout();
+        armSmoothTimer();
+    }
+
+    IORecursiveLockUnlock(_lock);
+    return result;
+}
+
+void ACPIBacklightPanel::finishDeadline(bool met)
+{
+    _deadline = 0;
+    if (met)
+        ++_deadlinesMet;
+    else
+        ++_deadlinesMissed;
+
+    if (OSDictionary* dict = OSDictionary::withCapacity(3))
+    {
+        if (OSNumber* num = OSNumber::withNumber(_deadlinesMet, 32))
+        {
+            dict->setObject("Met", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_deadlinesMissed, 32))
+        {
+            dict->setObject("Missed", num);
+            num->release();
+        }
+        UInt64 late = _deadlineLateness > 0 ? _deadlineLateness / 1000 : 0;
+        if (OSNumber* num = OSNumber::withNumber(late, 64))
+        {
+            dict->setObject("Last Late us", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_writeCost / 1000, 64))
+        {
+            dict->setObject("Write Cost us", num);
+            num->release();
+        }
+        setProperty("Deadline Stats", dict);
+        dict->release();
+    }
+}
+
+void ACPIBacklightPanel::stepSpring()
+{
+    // semi-implicit Euler: a = w^2 (target - x) - 2 w v, fixed dt of one tick
+    SInt64 dt = smoothTick() / 1000;
+    SInt64 w = _springOmega;
+    SInt64 target = (SInt64)_value << 16;
+    SInt64 accel = w * w * (target - _springPos) - 2 * w * _springVel;
+    _springVel += accel * dt / 1000000;
+    _springPos += _springVel * dt / 1000000;
+    ++_springTicks;
+
+    int level;
+    SInt64 dist = abs(target - _springPos);
+    SInt64 speed = abs(_springVel);
+    if ((dist < 0x8000 && speed < (8 << 16)) || _springTicks * dt >= kSpringMaxTime)
+    {
+        // settled (or out of time): land exactly on target
+        _springPos = target;
+        _springVel = 0;
+        level = _value;
+    }
+    else
+    {
+        level = (int)((_springPos + 0x8000) >> 16);
+        if (level < kBacklightLevelMin)
+            level = kBacklightLevelMin;
+        if (level > kBacklightLevelMax)
+            level = kBacklightLevelMax;
+    }
+
+    ++_smoothWakeups;
+    UInt32 raw = rawForLevel(level);
+    if (raw != rawForLevel(_from_value))
+    {
+        setACPIBrightnessLevel(raw);
+        noteSmoothWrite();
+    }
+    _from_value = level;
+    if (_from_value != _value)
+    {
+        UInt64 now = uptimeNS();
+        UInt64 next = alignToFrame(now + dt * 1000);
+        _smoothTimer->setTimeoutUS((UInt32)((next - now) / 1000));
+    }
+    else
+        publishSmoothStats();
+}
+
+void ACPIBacklightPanel::updateFramePeriod()
+{
+    // refresh period from the framebuffer behind the display (IODisplayConnect's provider)
+    _framePeriod = _framePeriodDefault * 1000ULL;
+    if (!_display || !_display->getProvider())
+        return;
+    IOService* fb = _display->getProvider()->getProvider();
+    if (!fb)
+        return;
+    OSNumber* clock = OSDynamicCast(OSNumber, fb->getProperty("IOFBCurrentPixelClock"));
+    OSNumber* pixels = OSDynamicCast(OSNumber, fb->getProperty("IOFBCurrentPixelCount"));
+    if (clock && pixels && clock->unsigned64BitValue())
+    {
+        _framePeriod = pixels->unsigned64BitValue() * 1000000000ULL / clock->unsigned64BitValue();
+        DbgLog("%s: frame period from framebuffer %lluns\n", this->getName(), _framePeriod);
+    }
+}
+
+UInt64 ACPIBacklightPanel::smoothTick()
+{
+    if (kPacingFrame == _pacing && _framePeriod)
+        return _framePeriod;
+    return smoothData[0].timeout * 1000ULL;
+}
+
+UInt64 ACPIBacklightPanel::alignToFrame(UInt64 t)
+{
+    // round up to the next frame boundary (uptime based grid)
+    if (kPacingFrame != _pacing || !_framePeriod)
+        return t;
+    return (t + _framePeriod - 1) / _framePeriod * _framePeriod;
+}
+
+void ACPIBacklightPanel::startSmoothStats()
+{
+    _smoothWakeups = _smoothWrites = _smoothRetargets = 0;
+    _frameDoubles = _frameGaps = 0;
+    _lastWriteFrame = 0;
+}
+
+void ACPIBacklightPanel::noteSmoothWrite()
+{
+    ++_smoothWrites;
+
+    // how evenly writes land per frame: more than one in a frame, or frames skipped
+    if (!_framePeriod)
+        return;
+    UInt64 frame = uptimeNS() / _framePeriod;
+    if (_lastWriteFrame)
+    {
+        if (frame == _lastWriteFrame)
+            ++_frameDoubles;
+        else if (frame > _lastWriteFrame+1)
+            _frameGaps += (UInt32)(frame - _lastWriteFrame - 1);
+    }
+    _lastWriteFrame = frame;
+}
+
+void ACPIBacklightPanel::publishSmoothStats()
+{
+    if (OSDictionary* dict = OSDictionary::withCapacity(4))
+    {
+        if (OSNumber* num = OSNumber::withNumber(_smoothWakeups, 32))
+        {
+            dict->setObject("Wakeups", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_smoothWrites, 32))
+        {
+            dict->setObject("Writes", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_smoothRetargets, 32))
+        {
+            dict->setObject("Retargets", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_frameDoubles, 32))
+        {
+            dict->setObject("Frame Doubles", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_frameGaps, 32))
+        {
+            dict->setObject("Frame Gaps", num);
+            num->release();
+        }
+        setProperty("Smooth Stats", dict);
+        dict->release();
+    }
+}
+
+void ACPIBacklightPanel::saveACPIBrightnessLevel(UInt32 level)
+{
+    //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	OSObject * ret = NULL;
+	OSNumber * number = OSNumber::withNumber(level, 32);
+    
+	if (number && kIOReturnSuccess == backLightDevice->evaluateObject("SAVE", &ret, (OSObject**)&number,1))
+    {
+        OSSafeRelease(ret);
+
+        //DbgLog("%s: saveACPIBrightnessLevel SAVE(%u)\n", this->getName(), (unsigned int) level);
+    }
+    else
+        IOLog("ACPIBacklight: Error in saveACPIBrightnessLevel SAVE(%u)\n", (unsigned int) level);
+    OSSafeRelease(number);
+}
+
+void ACPIBacklightPanel::saveACPIBrightnessLevelNVRAM(UInt32 level1)
+{
+    //DbgLog("%s::%s(): level=%d\n", this->getName(),__FUNCTION__, level1);
+
+    UInt16 level = (UInt16)level1;
+    if (IORegistryEntry *nvram = OSDynamicCast(IORegistryEntry, fromPath("/options", gIODTPlane)))
+    {
+        if (const OSSymbol* symbol = OSSymbol::withCString(kACPIBacklightLevel))
+        {
+            if (OSData* number = OSData::withBytes(&level, sizeof(level)))
+            {
+                //DbgLog("%s: saveACPIBrightnessLevelNVRAM got nvram %p\n", this->getName(), nvram);
+                if (!nvram->setProperty(symbol, number))
+                {
+                    DbgLog("%s: nvram->setProperty failed\n", this->getName());
+                }
+                number->release();
+            }
+            symbol->release();
+        }
+        nvram->release();
+    }
+}
+
+UInt32 ACPIBacklightPanel::loadFromNVRAM(void)
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    IORegistryEntry* nvram = IORegistryEntry::fromPath("/chosen/nvram", gIODTPlane);
+    if (!nvram)
+    {
+        DbgLog("%s: no /chosen/nvram, trying IODTNVRAM\n", this->getName());
+        // probably booting w/ Clover
+        if (OSDictionary* matching = serviceMatching("IODTNVRAM"))
+        {
+            nvram = waitForMatchingService(matching, 1000000000ULL * 15);
+            matching->release();
+        }
+    }
+    else DbgLog("%s: have nvram from /chosen/nvram\n", this->getName());
+    UInt32 val = -1;
+    if (nvram)
+    {
+        // need to serialize as getProperty on nvram does not work
+        if (OSSerialize* serial = OSSerialize::withCapacity(0))
+        {
+            nvram->serializeProperties(serial);
+            if (OSDictionary* props = OSDynamicCast(OSDictionary, OSUnserializeXML(serial->text())))
+            {
+                if (OSData* number = OSDynamicCast(OSData, props->getObject(kACPIBacklightLevel)))
+                {
+                    val = 0;
+                    unsigned l = number->getLength();
+                    if (l <= sizeof(val))
+                        memcpy(&val, number->getBytesNoCopy(), l);
+                    DbgLog("%s: read level from nvram = %d\n", this->getName(), val);
+                    //number->release();
+                }
+                else DbgLog("%s: no acpi-backlight-level in nvram\n", this->getName());
+                props->release();
+            }
+            serial->release();
+        }
+        nvram->release();
+    }
+    return val;
+}
+
+UInt32 ACPIBacklightPanel::queryACPICurentBrightnessLevel()
+{
+    //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    return queryBackendLevel(_backlightHandler ? _backend : kBackendACPI);
+}
+
+UInt32 ACPIBacklightPanel::queryBackendLevel(UInt32 backend)
+{
+    if (kBackendHandler == backend)
+        return _backlightHandler->getBacklightLevel();
+
+    UInt32 level = minAC;
+    const char* method = _extended ? "XBQC" : "_BQC";
+	if (kIOReturnSuccess == backLightDevice->evaluateInteger(method, &level))
+	{
+		//DbgLog("%s: queryBackendLevel %s = %d\n", this->getName(), method, level);
+        
+        OSBoolean * useIdx = OSDynamicCast(OSBoolean, getProperty("BQC use index"));
+        if (useIdx && useIdx->isTrue())
+        {
+            OSArray * levels = queryACPISupportedBrightnessLevels();
+            if (levels)
+            {
+                OSNumber *num = OSDynamicCast(OSNumber, levels->getObject(level));
+                if (num)
+                    level = num->unsigned32BitValue();
+                levels->release();
+            }
+        }
+        //DbgLog("%s: queryBackendLevel returning %d\n", this->getName(), level);
+	}
+	else {
+		IOLog("ACPIBacklight: Error in queryACPICurentBrightnessLevel %s\n", method);
+	}
+    //some laptops didn't return anything on startup, return then max value (first entry in _BCL):
+	return level;
+}
+
+
+/*
+ * Switch from direct hardware controled to software controled mode
+ */
+void ACPIBacklightPanel::getDeviceControl()
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	OSNumber * number = OSNumber::withNumber(0x4, 32); //bit 2 = 1
+	OSObject * ret = NULL;
+	
+	if (number && kIOReturnSuccess == gpuDevice->evaluateObject("_DOS", &ret, (OSObject**)&number, 1))
+    {
+        OSSafeRelease(ret);
+        DbgLog("%s: BIOS control disabled: _DOS\n", this->getName());
+    }
+    else
+       IOLog("ACPIBacklight: Error in getDeviceControl _DOS\n");
+    OSSafeRelease(number);
+}
+
+
+UInt32 ACPIBacklightPanel::findIndexForLevel(UInt32 BCLvalue)
+{
+    for (int i = 0; i < BCLlevelsCount; i++)
+	{
+		if (BCLvalue < BCLlevels[i])
+		{
+			DbgLog("%s: findIndexForLevel(%d) is %d\n", this->getName(), BCLvalue, i-1);
+			return i-1;
+		}
+	}
+    DbgLog("%s: findIndexForLevel(%d) did not find\n", this->getName(), BCLvalue);
+	return BCLlevelsCount-1;
+}
+
+
+UInt32 ACPIBacklightPanel::setupIndexedLevels()
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	OSNumber * num;
+	OSArray * levels = queryACPISupportedBrightnessLevels();
+	if (levels)
+	{
+		BCLlevelsCount = levels->getCount();
+		
+		if (BCLlevelsCount < 3)
+			return 0;
+		
+		//verify the types of objects is good once for all
+		for (int i = 0; i< BCLlevelsCount; i++) {
+			if (!OSDynamicCast(OSNumber, levels->getObject(i)))
+				return 0;
+		}
+		
+        //TODO : manage the case when the list has no order! Linux do that
+		//test the order of the list
+		UInt32 min, max;
+		num = OSDynamicCast(OSNumber, levels->getObject(2));
+		min = num->unsigned32BitValue();
+		num = OSDynamicCast(OSNumber, levels->getObject(BCLlevelsCount-1));
+		max = num->unsigned32BitValue();
+		
+		if (max < min) //list is reverted !
+		{
+			BCLlevels = new UInt32[BCLlevelsCount];
+			for (int i = 0; i< BCLlevelsCount; i++) {
+				num = OSDynamicCast(OSNumber, levels->getObject(BCLlevelsCount -1 -i));
+				BCLlevels[i] = num->unsigned32BitValue();
+			}
+		}
+		else
+		{
+			BCLlevelsCount = BCLlevelsCount -2;
+			BCLlevels = new UInt32[BCLlevelsCount];
+			for (int i = 0; i< BCLlevelsCount; i++) {
+				num = OSDynamicCast(OSNumber, levels->getObject(i+2));
+				BCLlevels[i] = num->unsigned32BitValue();
+			}
+		}
+
+		//2 first items are min on ac and max on bat
+		num = OSDynamicCast(OSNumber, levels->getObject(0));
+		minAC = findIndexForLevel(num->unsigned32BitValue());
+		setDebugProperty("BCL: Min on AC", num);
+		num = OSDynamicCast(OSNumber, levels->getObject(1));
+		maxBat = findIndexForLevel(num->unsigned32BitValue());
+		setDebugProperty("BCL: Max on Bat", num);
+		setDebugProperty("Brightness Control Levels", levels);
+        levels->release();
+		
+		return BCLlevelsCount-1;
+	}
+	return 0;
+}
+
+
+#pragma mark -
+#pragma mark AC DC managment for init
+#pragma mark -
+
+
+IOService * ACPIBacklightPanel::getBatteryDevice()
+{
+	DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+    OSDictionary * matching = IOService::serviceMatching("IOPMPowerSource");
+	OSIterator *   iter = NULL;
+	IOService * bat = NULL;
+	
+	if (matching)
+	{
+		DbgLog("%s: getBatteryDevice() serviceMatching OK\n", this->getName());
+		iter = IOService::getMatchingServices(matching);
+		matching->release();
+	}
+	
+	if (iter)
+	{
+		DbgLog("%s: getBatteryDevice() iter OK\n", this->getName());
+		
+		bat = OSDynamicCast(IOService, iter->getNextObject());
+		if (bat)
+		{
+			DbgLog("%s: getBatteryDevice() bat is of class %s\n", this->getName(), bat->getMetaClass()->getClassName());	
+		}
+		
+		iter->release();
+	}
+	
+	return bat;
+}
+
+
+bool ACPIBacklightPanel::getACStatus()
+{
+    DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	IOService * batteryDevice = getBatteryDevice();
+	
+	if (NULL != batteryDevice)
+	{
+		OSObject * obj = batteryDevice->getProperty("ExternalConnected");
+		OSBoolean * status = OSDynamicCast(OSBoolean, obj);
+        if (status)
+        {
+            DbgLog("%s: getACStatus() AC is %d\n", this->getName(), status->getValue());
+            return status->getValue();
+        }
+        else
+            DbgLog("%s: getACStatus() unable to get \"ExternalConnected\" property\n", this->getName());
+	}
+    return true;
+}
+
+
+UInt32 ACPIBacklightPanel::profileForRequest()
+{
+    // shortly after wake, or requests arriving in quick succession (slider drag)
+    UInt64 now = uptimeNS();
+    UInt32 profile = kProfileKey;
+    if (_wakeTime && now - _wakeTime < kWakeWindow)
+        profile = kProfileWake;
+    else if (_lastRequest && now - _lastRequest < kSliderInterval)
+        profile = kProfileSlider;
+    _lastRequest = now;
+    return profile;
+}
+
+IOReturn ACPIBacklightPanel::powerInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize)
+{
+    ACPIBacklightPanel* self = OSDynamicCast(ACPIBacklightPanel, (OSObject*)target);
+    if (self && kIOMessageSystemHasPoweredOn == messageType)
+        self->_wakeTime = uptimeNS();
+    return kIOReturnSuccess;
+}
+
+bool ACPIBacklightPanel::powerSourcePublished(void* target, void* refCon, IOService* newService, IONotifier* notifier)
+{
+    ACPIBacklightPanel* self = OSDynamicCast(ACPIBacklightPanel, (OSObject*)target);
+    if (self && !self->_powerSourceInterest)
+    {
+        self->_powerSourceInterest = newService->registerInterest(gIOGeneralInterest, &ACPIBacklightPanel::powerSourceInterest, self);
+        self->powerSourceChanged();
+    }
+    return true;
+}
+
+IOReturn ACPIBacklightPanel::powerSourceInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize)
+{
+    ACPIBacklightPanel* self = OSDynamicCast(ACPIBacklightPanel, (OSObject*)target);
+    if (self && kIOPMMessageBatteryStatusHasChanged == messageType)
+        self->powerSourceChanged();
+    return kIOReturnSuccess;
+}
+
+void ACPIBacklightPanel::powerSourceChanged()
+{
+    IORecursiveLockLock(_lock);
+
+    int onAC = getACStatus() ? 1 : 0;
+    if (onAC != _onAC)
+    {
+        DbgLog("%s: power source changed, AC=%d\n", this->getName(), onAC);
+        if (-1 != _onAC && (_options & kPerSourceLevels))
+        {
+            // remember level for the old source, fade to the one for the new source
+            _sourceLevels[_onAC] = _committed_value;
+            if (-1 != _sourceLevels[onAC])
+            {
+                _saved_value = _committed_value = _sourceLevels[onAC];
+                setBrightnessLevelSmooth(_committed_value, kProfilePower);
+                scheduleWork(kWorkSave);
+                if (_display)
+                    doUpdate();
+            }
+        }
+        _onAC = onAC;
+    }
+
+    IORecursiveLockUnlock(_lock);
+}
+
+void ACPIBacklightPanel::processWorkQueue(IOInterruptEventSource *, int)
+{
+    DbgLog("%s::%s() _workPending=%x\n", this->getName(),__FUNCTION__, _workPending);
+    
+    IORecursiveLockLock(_lock);
+    if (_workPending & kWorkSave)
+        saveACPIBrightnessLevelNVRAM(_committed_value);
+    if (_workPending & kWorkSetBrightness)
+        setBrightnessLevel(_committed_value);
+    _workPending = 0;
+    IORecursiveLockUnlock(_lock);
+}
+
+void ACPIBacklightPanel::scheduleWork(unsigned newWork)
+{
+    IORecursiveLockLock(_lock);
+    _workPending |= newWork;
+    _workSource->interruptOccurred(0, 0, 0);
+    IORecursiveLockUnlock(_lock);
+}
+
+IOReturn ACPIBacklightPanel::setPropertiesGated(OSObject* props)
+{
+    //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    OSDictionary* dict = OSDynamicCast(OSDictionary, props);
+    if (!dict)
+        return kIOReturnSuccess;
+
+    // set brightness
+	if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kRawBrightness)))
+    {
+		UInt32 raw = (int)num->unsigned32BitValue();
+        setACPIBrightnessLevel(raw);
+        setProperty(kRawBrightness, queryACPICurentBrightnessLevel(), 32);
+    }
+
+    for (int i = 0; i < countof(smoothData); i++)
+    {
+        char buf[kSmoothBufSize];
+        snprintf(buf, sizeof(buf), kSmoothDelta, i);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            smoothData[i].delta = (int)num->unsigned32BitValue();
+            setProperty(buf, smoothData[i].delta, 32);
+        }
+        snprintf(buf, sizeof(buf), kSmoothStep, i);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            smoothData[i].step = (int)num->unsigned32BitValue();
+            setProperty(buf, smoothData[i].step, 32);
+        }
+        snprintf(buf, sizeof(buf), kSmoothTimeout, i);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            smoothData[i].timeout = (int)num->unsigned32BitValue();
+            setProperty(buf, smoothData[i].timeout, 32);
+        }
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSmoothEasing)))
+    {
+        UInt32 easing = num->unsigned32BitValue();
+        if (easing < kEasingCount)
+            _easing = easing;
+        setProperty(kSmoothEasing, _easing, 32);
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSmoothLeeway)))
+    {
+        _smoothLeeway = num->unsigned32BitValue();
+        setProperty(kSmoothLeeway, _smoothLeeway, 32);
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSmoothMode)))
+    {
+        UInt32 mode = num->unsigned32BitValue();
+        if (mode < kSmoothModeCount && mode != _smoothMode)
+        {
+            // transition in flight continues in the new mode from where it is
+            IORecursiveLockLock(_lock);
+            _smoothMode = mode;
+            _trajectoryCount = _trajectoryIndex = 0;
+            _springPos = (SInt64)_from_value << 16;
+            _springVel = 0;
+            _springTicks = 0;
+            if (kSmoothModeCurve == _smoothMode && _smoothTimer && _from_value != _value)
+            {
+                buildTrajectory(uptimeNS(), smoothDuration(_from_value, _value));
+                _smoothTimer->cancelTimeout();
+                armSmoothTimer();
+            }
+            IORecursiveLockUnlock(_lock);
+        }
+        setProperty(kSmoothMode, _smoothMode, 32);
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSpringOmega)))
+    {
+        UInt32 omega = num->unsigned32BitValue();
+        if (omega >= kSpringOmegaMin && omega <= kSpringOmegaMax)
+            _springOmega = omega;
+        setProperty(kSpringOmega, _springOmega, 32);
+    }
+    for (int i = 0; i < kProfileCount; i++)
+    {
+        char buf[kProfileBufSize];
+        snprintf(buf, sizeof(buf), kProfileUp, profileNames[i]);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            _profiles[i].up = num->unsigned32BitValue();
+            setProperty(buf, _profiles[i].up, 32);
+        }
+        snprintf(buf, sizeof(buf), kProfileDown, profileNames[i]);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            _profiles[i].down = num->unsigned32BitValue();
+            setProperty(buf, _profiles[i].down, 32);
+        }
+        snprintf(buf, sizeof(buf), kProfileMin, profileNames[i]);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            _profiles[i].min = num->unsigned32BitValue();
+            setProperty(buf, _profiles[i].min, 32);
+        }
+        snprintf(buf, sizeof(buf), kProfileEasing, profileNames[i]);
+        if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(buf)))
+        {
+            UInt32 easing = num->unsigned32BitValue();
+            _profiles[i].easing = easing < kEasingCount ? easing : kEasingDefault;
+            setProperty(buf, _profiles[i].easing, 32);
+        }
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSmoothPacing)))
+    {
+        UInt32 pacing = num->unsigned32BitValue();
+        if (pacing < kPacingCount)
+            _pacing = pacing;
+        setProperty(kSmoothPacing, _pacing, 32);
+    }
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kFramePeriod)))
+    {
+        UInt32 period = num->unsigned32BitValue();
+        if (period)
+            _framePeriodDefault = period;
+        setProperty(kFramePeriod, _framePeriodDefault, 32);
+        updateFramePeriod();
+    }
+
+    // deadline request: { Level, WithinMS | AtMS (uptime), Commit }
+    IOReturn result = kIOReturnSuccess;
+    if (OSDictionary* target = OSDynamicCast(OSDictionary, dict->getObject(kBrightnessTarget)))
+    {
+        OSNumber* level = OSDynamicCast(OSNumber, target->getObject("Level"));
+        OSNumber* within = OSDynamicCast(OSNumber, target->getObject("WithinMS"));
+        OSNumber* at = OSDynamicCast(OSNumber, target->getObject("AtMS"));
+        if (level && (within || at))
+        {
+            UInt64 deadline = at ? at->unsigned64BitValue() * 1000000ULL : uptimeNS() + within->unsigned64BitValue() * 1000000ULL;
+            result = setBrightnessDeadline(level->unsigned32BitValue(), deadline);
+            OSBoolean* commit = OSDynamicCast(OSBoolean, target->getObject("Commit"));
+            if (commit && commit->isTrue() && kIOReturnBadArgument != result && kIOReturnUnsupported != result)
+            {
+                IORecursiveLockLock(_lock);
+                _saved_value = _committed_value = level->unsigned32BitValue();
+                scheduleWork(kWorkSave);
+                if (_display)
+                    doUpdate();
+                IORecursiveLockUnlock(_lock);
+            }
+        }
+        else
+            result = kIOReturnBadArgument;
+    }
+    
+#ifdef DEBUG
+    // special cycle test
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject("CycleTest")))
+    {
+        IOLog("%s: CycleTest UP\n", this->getName());
+		UInt32 raw = (int)num->unsigned32BitValue();
+        for (int i = 1; i <= raw; i++)
+        {
+            setACPIBrightnessLevel(i);
+            IOSleep(16);
+        }
+        IOSleep(500);
+        IOLog("%s: CycleTest DOWN\n", this->getName());
+        for (int i = raw; i > 0; i--)
+        {
+            setACPIBrightnessLevel(i);
+            IOSleep(16);
+        }
+    }
+    // allow setting of KLVX at runtime
+	if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject("KLVX")))
+    {
+		UInt32 raw = (int)num->unsigned32BitValue();
+        setKLVX(raw);
+        setProperty("KLVX", raw, 32);
+    }
+#endif
+    return result;
+}
+
+#ifdef DEBUG
+void ACPIBacklightPanel::setKLVX(UInt32 levx)
+{
+    //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+    
+	OSObject * ret = NULL;
+	OSNumber * number = OSNumber::withNumber(levx, 32);
+    const char* method = "DEB1";
+    
+	if (number && kIOReturnSuccess == backLightDevice->evaluateObject(method, &ret, (OSObject**)&number, 1))
+    {
+        OSSafeRelease(ret);
+    }
+    else
+        IOLog("ACPIBacklight: Error in setKLVX %s(%u)\n",  method, levx);
+    OSSafeRelease(number);
+}
+#endif
+
+IOReturn ACPIBacklightPanel::setProperties(OSObject* props)
+{
+    //DbgLog("%s::%s()\n", this->getName(),__FUNCTION__);
+
+    if (_cmdGate)
+    {
+        // syncronize through workloop...
+        IOReturn result = _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ACPIBacklightPanel::setPropertiesGated), props);
+        if (kIOReturnSuccess != result)
+            return result;
+    }
+    return kIOReturnSuccess;
+}
+
+////////////////////////////////////////////////////////////////
+
+OSDefineMetaClassAndStructors(BacklightHandler, IOService)
+
+void BacklightHandler::setBacklightLevel(UInt32 level)
+{
+    // no implementation
+}
+
+UInt32 BacklightHandler::getBacklightLevel()
+{
+    // no implementation
+    return -1;
+}
+
+OSDefineMetaClassAndStructors(IntelBacklightHandler, BacklightHandler)
+
+#ifdef DEBUG
+#define REG32_READ(offset)          (++_mmioReads, *(volatile UInt32*)((UInt8*)_baseAddr+(offset)))
+#define REG32_WRITE(offset,value)   (++_mmioWrites, (*(volatile UInt32*)((UInt8*)_baseAddr+(offset))) = (value))
+#else
+#define REG32_READ(offset)          (*(volatile UInt32*)((UInt8*)_baseAddr+(offset)))
+#define REG32_WRITE(offset,value)   ((*(volatile UInt32*)((UInt8*)_baseAddr+(offset))) = (value))
+#endif
+
+#define LEV2 0x48250
+#define LEVL 0x48254
+#define LEVW 0xc8250
+#define LEVX 0xc8254
+#define PCHL 0xe1180
+#define LEVD 0xc8258    // PCH PWM duty cycle (Coffee Lake and later)
+
+// enable bit in kEnableReg, cleared to gate the PWM output at zero level
+#define kPWMEnable 0x80000000
+
+// re-read the drift register every so many writes to catch external changes (eg. after sleep)
+#define kDriftCheckInterval 32
+
+// register initialization step, value comes from BacklightHandlerParams unless kParamNone
+enum { kParamNone, kParamKLVX, kParamKPCH, kParamLMAX, };
+
+struct RegInit
+{
+    UInt32 offset;
+    UInt32 value;
+    int param;
+    bool optional;  // skip if the param was not provided by PNLF (-1)
+};
+
+static inline UInt32 initValue(const RegInit& reg, const BacklightHandlerParams& params)
+{
+    switch (reg.param)
+    {
+        case kParamKLVX: return params._klvx;
+        case kParamKPCH: return params._kpch;
+        case kParamLMAX: return params._lmax;
+    }
+    return reg.value;
+}
+
+// Register layout per framebuffer generation.  kLevelReg holds the level as
+// packed by pack(), init[] is replayed after sleep, and init[kDriftInit] is
+// the register re-read to detect external changes (-1 for none).  kDefaultMax
+// is the PWM max used when PNLF does not provide LMAX (0 to leave as is), and
+// kEnableReg holds the PWM output enable bit.
+
+struct IvySandyRegs
+{
+    enum { kLevelReg = LEVL, kEnableReg = LEV2, kInitCount = 4, kDriftInit = 2, kDefaultMax = 0, };
+    static const RegInit init[kInitCount];
+    static inline UInt32 pack(const BacklightHandlerParams&, UInt32 level) { return level; }
+    static inline UInt32 unpack(UInt32 reg) { return reg; }
+};
+
+const RegInit IvySandyRegs::init[kInitCount] =
+{
+    { PCHL, 0, kParamKPCH, true },
+    { LEVW, 0x80000000, kParamNone, false },
+    { LEVX, 0, kParamKLVX, false },
+    { LEV2, 0x80000000, kParamNone, false },
+};
+
+struct HaswellBroadwellRegs
+{
+    enum { kLevelReg = LEVX, kEnableReg = LEVW, kInitCount = 0, kDriftInit = -1, kDefaultMax = 0, };
+    static const RegInit* const init;
+    // store new backlight level and restore max
+    static inline UInt32 pack(const BacklightHandlerParams& params, UInt32 level) { return (params._lmax<<16) | level; }
+    static inline UInt32 unpack(UInt32 reg) { return reg & 0xFFFF; }
+};
+
+const RegInit* const HaswellBroadwellRegs::init = NULL;
+
+// Skylake/Kaby Lake (SPT PCH): frequency and duty share LEVX, LEVW must be enabled
+struct SkylakeKabyLakeRegs
+{
+    enum { kLevelReg = LEVX, kEnableReg = LEVW, kInitCount = 1, kDriftInit = 0, kDefaultMax = 0x56c, };
+    static const RegInit init[kInitCount];
+    static inline UInt32 pack(const BacklightHandlerParams& params, UInt32 level) { return (params._lmax<<16) | level; }
+    static inline UInt32 unpack(UInt32 reg) { return reg & 0xFFFF; }
+};
+
+const RegInit SkylakeKabyLakeRegs::init[kInitCount] =
+{
+    { LEVW, 0x80000000, kParamNone, false },
+};
+
+// Coffee Lake (CNP PCH): frequency in LEVX, duty cycle in its own register
+struct CoffeeLakeRegs
+{
+    enum { kLevelReg = LEVD, kEnableReg = LEVW, kInitCount = 2, kDriftInit = 0, kDefaultMax = 0xffff, };
+    static const RegInit init[kInitCount];
+    static inline UInt32 pack(const BacklightHandlerParams&, UInt32 level) { return level; }
+    static inline UInt32 unpack(UInt32 reg) { return reg; }
+};
+
+const RegInit CoffeeLakeRegs::init[kInitCount] =
+{
+    { LEVX, 0, kParamLMAX, false },
+    { LEVW, 0x80000000, kParamNone, false },
+};
+
+bool IntelBacklightHandler::init()
+{
+    if (!super::init())
+        return false;
+
+    _baseMap = NULL;
+    _baseAddr = NULL;
+    _panel = NULL;
+    _fbtype = 0;
+    _setLevel = NULL;
+    _getLevel = NULL;
+    memset(&_params, 0, sizeof(_params));
+    _shadowValid = 0;
+    _driftTicks = 0;
+    _sleepWakeNotifier = NULL;
+    _gated = false;
+    _gatedSince = _gatedNS = 0;
+    _gatedCount = 0;
+#ifdef DEBUG
+    _mmioReads = _mmioWrites = _levelChanges = 0;
+    _levelChangeNS = 0;
+#endif
+
+    return true;
+}
+
+bool IntelBacklightHandler::start(IOService *provider)
+{
+    if (!super::start(provider))
+        return false;
+
+    IOPCIDevice* pci = OSDynamicCast(IOPCIDevice, provider);
+    if (!pci)
+    {
+        IOLog("IntelBacklightHandler is not an IOPCIDevice... aborting\n");
+        return false;
+    }
+
+    // setup for direct access
+    IOService* service = waitForMatchingService(serviceMatching("ACPIBacklightPanel"), 2000UL*1000UL*1000UL);
+    if (!service)
+    {
+        IOLog("ACPIBacklightPanel not found... aborting\n");
+        return false;
+    }
+    ACPIBacklightPanel* panel = OSDynamicCast(ACPIBacklightPanel, service);
+    if (!panel)
+    {
+        IOLog("Backlight service was not ACPIBacklightPanel\n");
+        return false;
+    }
+
+    // setup BAR1 address...
+    _baseMap = pci->mapDeviceMemoryWithRegister(kIOPCIConfigBaseAddress0);
+    if (!_baseMap)
+    {
+        IOLog("unable to map BAR1... aborting\n");
+        return false;
+    }
+    _baseAddr = reinterpret_cast<volatile void *>(_baseMap->getVirtualAddress());
+    if (!_baseAddr)
+    {
+        IOLog("unable to get virtual address for BAR1... aborting\n");
+        return false;
+    }
+
+    OSNumber* num = OSDynamicCast(OSNumber, getProperty("kFrameBufferType"));
+    if (num == NULL)
+    {
+        IOLog("unable to get framebuffer type\n");
+        return false;
+    }
+    _fbtype = num->unsigned32BitValue();
+
+    // select register access for this generation once, instead of per call
+    UInt32 defaultMax = 0;
+    switch (_fbtype)
+    {
+        case kFBTypeIvySandy:
+            _setLevel = &IntelBacklightHandler::setLevel<IvySandyRegs>;
+            _getLevel = &IntelBacklightHandler::getLevel<IvySandyRegs>;
+            defaultMax = IvySandyRegs::kDefaultMax;
+            break;
+
+        case kFBTypeHaswellBroadwell:
+            _setLevel = &IntelBacklightHandler::setLevel<HaswellBroadwellRegs>;
+            _getLevel = &IntelBacklightHandler::getLevel<HaswellBroadwellRegs>;
+            defaultMax = HaswellBroadwellRegs::kDefaultMax;
+            break;
+
+        case kFBTypeSkylakeKabyLake:
+            _setLevel = &IntelBacklightHandler::setLevel<SkylakeKabyLakeRegs>;
+            _getLevel = &IntelBacklightHandler::getLevel<SkylakeKabyLakeRegs>;
+            defaultMax = SkylakeKabyLakeRegs::kDefaultMax;
+            break;
+
+        case kFBTypeCoffeeLake:
+            _setLevel = &IntelBacklightHandler::setLevel<CoffeeLakeRegs>;
+            _getLevel = &IntelBacklightHandler::getLevel<CoffeeLakeRegs>;
+            defaultMax = CoffeeLakeRegs::kDefaultMax;
+            break;
+
+        default:
+            IOLog("unsupported framebuffer type %u\n", _fbtype);
+            return false;
+    }
+
+    // now register with ACPIBacklight
+    if (!panel->setBacklightHandler(this, &_params))
+    {
+        // setBacklightHandler will return false for old PNLF patches
+        _baseMap->release();
+        return false;
+    }
+    _panel = panel;
+    panel->retain();
+
+    // PWM frequency must be programmed on newer generations, even without LMAX
+    if (defaultMax && -1 == _params._lmax)
+        _params._lmax = defaultMax;
+
+    // registers are clobbered across sleep, so shadow must be revalidated after
+    _sleepWakeNotifier = registerPrioritySleepWakeInterest(&IntelBacklightHandler::powerInterest, this);
+
+    // register service so ACPIBacklightPanel can proceed...
+    registerService();
+
+    return true;
+}
+
+void IntelBacklightHandler::stop(IOService * provider)
+{
+    if (_sleepWakeNotifier)
+    {
+        _sleepWakeNotifier->remove();
+        _sleepWakeNotifier = NULL;
+    }
+    if (_panel)
+    {
+        _panel->setBacklightHandler(NULL, NULL);
+        _panel->release();
+        _panel = NULL;
+    }
+    OSSafeReleaseNULL(_baseMap);
+    _baseAddr = NULL;
+
+    super::stop(provider);
+}
+
+#ifdef DEBUG
+#define kStatsInterval 16
+
+void IntelBacklightHandler::publishStats()
+{
+    if (OSDictionary* dict = OSDictionary::withCapacity(4))
+    {
+        UInt64 values[] = { _mmioReads, _mmioWrites, _levelChanges, _levelChangeNS };
+        const char* keys[] = { "Reads", "Writes", "Level Changes", "Level Change ns" };
+        for (int i = 0; i < countof(values); i++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(values[i], 64))
+            {
+                dict->setObject(keys[i], num);
+                num->release();
+            }
+        }
+        setProperty("MMIO Stats", dict);
+        dict->release();
+    }
+}
+#endif
+
+IOReturn IntelBacklightHandler::powerInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize)
+{
+    IntelBacklightHandler* self = OSDynamicCast(IntelBacklightHandler, (OSObject*)target);
+    if (!self)
+        return kIOReturnSuccess;
+
+    switch (messageType)
+    {
+        case kIOMessageSystemWillSleep:
+        case kIOMessageSystemHasPoweredOn:
+            self->invalidateShadow();
+            // PWM enable state is unknown after wake, next zero level gates again
+            if (self->_gated)
+                self->endGating();
+            break;
+    }
+    return kIOReturnSuccess;
+}
+
+template <class Regs>
+void IntelBacklightHandler::initRegisters()
+{
+    // initialize for consistent backlight level before/after sleep
+    for (int i = 0; i < Regs::kInitCount; i++)
+    {
+        if (_shadowValid & (1<<i))
+            continue;
+        const RegInit& reg = Regs::init[i];
+        UInt32 value = initValue(reg, _params);
+        if (reg.optional && value == -1)
+            continue;
+        if (REG32_READ(reg.offset) != value)
+            REG32_WRITE(reg.offset, value);
+    }
+    _shadowValid = (1<<Regs::kInitCount)-1;
+    _driftTicks = 0;
+}
+
+void IntelBacklightHandler::endGating()
+{
+    _gated = false;
+    _gatedNS += uptimeNS() - _gatedSince;
+    ++_gatedCount;
+
+    if (OSDictionary* dict = OSDictionary::withCapacity(2))
+    {
+        if (OSNumber* num = OSNumber::withNumber(_gatedCount, 32))
+        {
+            dict->setObject("Count", num);
+            num->release();
+        }
+        if (OSNumber* num = OSNumber::withNumber(_gatedNS / 1000000, 64))
+        {
+            dict->setObject("Total ms", num);
+            num->release();
+        }
+        setProperty("PWM Gating", dict);
+        dict->release();
+    }
+}
+
+template <class Regs>
+void IntelBacklightHandler::gatePWM()
+{
+    // zero duty cycle, then turn off PWM output
+    REG32_WRITE(Regs::kLevelReg, Regs::pack(_params, 0));
+    REG32_WRITE(Regs::kEnableReg, REG32_READ(Regs::kEnableReg) & ~kPWMEnable);
+    _gated = true;
+    _gatedSince = uptimeNS();
+}
+
+template <class Regs>
+void IntelBacklightHandler::ungatePWM(UInt32 level)
+{
+    // latch new duty cycle before PWM output is enabled again, so no flash
+    REG32_WRITE(Regs::kLevelReg, Regs::pack(_params, level));
+    if (Regs::kInitCount > 0 && !_shadowValid)
+        initRegisters<Regs>();
+    REG32_WRITE(Regs::kEnableReg, REG32_READ(Regs::kEnableReg) | kPWMEnable);
+    endGating();
+}
+
+template <class Regs>
+void IntelBacklightHandler::setLevel(UInt32 level)
+{
+    // adjust level to within limits set by XRGL and XRGH
+    if (level > _params._xrgh)
+        level = _params._xrgh;
+    if (level && level < _params._xrgl)
+        level = _params._xrgl;
+
+    if (!level)
+    {
+        if (!_gated)
+            gatePWM<Regs>();
+        return;
+    }
+    if (_gated)
+    {
+        ungatePWM<Regs>(level);
+        return;
+    }
+
+    if (Regs::kDriftInit >= 0)
+    {
+        // low-rate drift check: replay init only if something overwrote the register
+        if (_shadowValid && ++_driftTicks >= kDriftCheckInterval)
+        {
+            _driftTicks = 0;
+            const RegInit& reg = Regs::init[Regs::kDriftInit];
+            if (REG32_READ(reg.offset) != initValue(reg, _params))
+                invalidateShadow();
+        }
+    }
+    if (Regs::kInitCount > 0 && !_shadowValid)
+        initRegisters<Regs>();
+
+    // store new backlight level
+    REG32_WRITE(Regs::kLevelReg, Regs::pack(_params, level));
+}
+
+template <class Regs>
+UInt32 IntelBacklightHandler::getLevel()
+{
+    // read backlight level
+    UInt32 result = Regs::unpack(REG32_READ(Regs::kLevelReg));
+
+    // adjust result to be within limits set by XRGL and XRGH
+    if (result > _params._xrgh)
+        result = _params._xrgh;
+    if (result && result < _params._xrgl)
+        result = _params._xrgl;
+
+    return result;
+}
+
+void IntelBacklightHandler::setBacklightLevel(UInt32 level)
+{
+    if (!_baseAddr)
+        return;
+
+#ifdef DEBUG
+    UInt64 start = uptimeNS();
+#endif
+
+    (this->*_setLevel)(level);
+
+#ifdef DEBUG
+    _levelChangeNS += uptimeNS() - start;
+    if (0 == ++_levelChanges % kStatsInterval)
+        publishStats();
+#endif
+}
+
+UInt32 IntelBacklightHandler::getBacklightLevel()
+{
+    if (!_baseAddr)
+        return -1;
+
+    return (this->*_getLevel)();
+}
+
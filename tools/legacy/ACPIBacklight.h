@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 1998-2000 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ * 
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef ACPIBacklightDisplay_ACPIBacklightDevice_h
+#define ACPIBacklightDisplay_ACPIBacklightDevice_h
+
+#include <IOKit/IOService.h>
+#include <IOKit/graphics/IODisplay.h>
+#include <IOKit/acpi/IOACPIPlatformDevice.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOLocks.h>
+
+#define NOINLINE __attribute__((noinline))
+#define EXPORT __attribute__((visibility("default")))
+#define PRIVATE __attribute__((visibility("hidden"))) NOINLINE
+
+class ACPIBacklightPanel;
+
+struct BacklightHandlerParams
+{
+    UInt32 _xrgl, _xrgh, _klvx, _lmax, _kpch;
+};
+
+struct SmoothProfile
+{
+    UInt32 up, down;    // ms for a full range change, 0 to use the SmoothDelta/Step/Timeout tiers
+    UInt32 min;         // ms, lower bound for short changes
+    UInt32 easing;      // SmoothEasing value, or kEasingDefault to use SmoothEasing
+};
+
+class EXPORT BacklightHandler : public IOService
+{
+    OSDeclareDefaultStructors(BacklightHandler)
+    typedef IOService super;
+
+public:
+    // BacklightHandler
+    virtual void setBacklightLevel(UInt32 level);
+    virtual UInt32 getBacklightLevel();
+};
+
+class EXPORT IntelBacklightHandler : public BacklightHandler
+{
+    OSDeclareDefaultStructors(IntelBacklightHandler)
+    typedef BacklightHandler super;
+
+private:
+    IOMemoryMap *_baseMap;
+    volatile void *_baseAddr;
+    ACPIBacklightPanel* _panel;
+    UInt32 _fbtype;
+    BacklightHandlerParams _params;
+
+    enum { kFBTypeIvySandy = 1, kFBTypeHaswellBroadwell = 2, kFBTypeSkylakeKabyLake = 3, kFBTypeCoffeeLake = 4, };
+
+    // per generation register access, selected once in start()
+    void (IntelBacklightHandler::*_setLevel)(UInt32 level);
+    UInt32 (IntelBacklightHandler::*_getLevel)();
+    template <class Regs> PRIVATE void setLevel(UInt32 level);
+    template <class Regs> PRIVATE UInt32 getLevel();
+
+    // registers that only need to be (re)initialized after sleep (one valid bit each)
+    UInt32 _shadowValid;
+    UInt32 _driftTicks;
+    IONotifier* _sleepWakeNotifier;
+    template <class Regs> PRIVATE void initRegisters();
+    PRIVATE void invalidateShadow() { _shadowValid = 0; }
+    // PWM output is disabled while the level is zero
+    bool _gated;
+    UInt64 _gatedSince, _gatedNS;
+    UInt32 _gatedCount;
+    template <class Regs> PRIVATE void gatePWM();
+    template <class Regs> PRIVATE void ungatePWM(UInt32 level);
+    PRIVATE void endGating();
+
+    static IOReturn powerInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize);
+
+#ifdef DEBUG
+    // MMIO access accounting, published as "MMIO Stats"
+    UInt32 _mmioReads, _mmioWrites, _levelChanges;
+    UInt64 _levelChangeNS;
+    PRIVATE void publishStats();
+#endif
+
+public:
+    // IOService
+    virtual bool init();
+    virtual bool start(IOService * provider);
+    virtual void stop(IOService * provider);
+
+    // BacklightHandler
+    virtual void setBacklightLevel(UInt32 level);
+    virtual UInt32 getBacklightLevel();
+};
+
+class EXPORT ACPIBacklightPanel : public IODisplayParameterHandler
+{
+    OSDeclareDefaultStructors(ACPIBacklightPanel)
+    typedef IODisplayParameterHandler super;
+
+public:
+	// IOService
+    virtual bool init();
+    virtual IOService * probe( IOService * provider, SInt32 * score );
+	virtual bool start( IOService * provider );
+    virtual void stop( IOService * provider );
+    virtual void free();
+    virtual IOReturn setProperties(OSObject* props);
+
+    // IODisplayParameterHandler
+    virtual bool setDisplay( IODisplay * display );
+    virtual bool doIntegerSet( OSDictionary * params,
+                              const OSSymbol * paramName, UInt32 value );
+    virtual bool doDataSet( const OSSymbol * paramName, OSData * value );
+    virtual bool doUpdate( void );
+
+    // ACPIBacklightPanel
+    virtual bool setBacklightHandler(BacklightHandler* handler, BacklightHandlerParams* params);
+    
+private:
+    BacklightHandler* _backlightHandler;
+    IODisplay * _display;
+#if 0 //REVIEW: experimental stuff
+    IOService * _provider;
+#endif
+
+    IOACPIPlatformDevice *  gpuDevice, * backLightDevice;
+
+    IOInterruptEventSource* _workSource;
+    enum { kWorkSave = 0x01, kWorkSetBrightness = 0x02 };
+    unsigned _workPending;
+    PRIVATE void scheduleWork(unsigned newWork);
+    
+    IOTimerEventSource* _smoothTimer;
+    IOCommandGate* _cmdGate;
+    IORecursiveLock* _lock;
+    bool _extended;
+
+    // time based transition from _from_value to _value
+    enum { kEasingLinear = 0, kEasingInOut = 1, kEasingExponential = 2, kEasingCount };
+    UInt32 _easing;
+    PRIVATE UInt64 smoothDuration(int from, int to);
+
+    // transition precomputed when a new target is accepted, timer just walks it
+    struct TrajectoryPoint
+    {
+        UInt64 deadline;    // uptime ns
+        UInt32 raw;         // value for setACPIBrightnessLevel
+        int level;          // OS X level, becomes _from_value
+    };
+    enum { kTrajectoryMax = 128 };
+    TrajectoryPoint _trajectory[kTrajectoryMax];
+    int _trajectoryCount;
+    int _trajectoryIndex;
+    UInt32 _smoothLeeway;       // us, points closer than this share one wakeup
+    UInt32 _smoothWakeups, _smoothWrites, _smoothRetargets;
+    PRIVATE void buildTrajectory(UInt64 start, UInt64 duration);
+    PRIVATE void armSmoothTimer();
+    PRIVATE void publishSmoothStats();
+
+    // optional critically damped spring, integrated per tick (16.16 levels, levels/s)
+    enum { kSmoothModeCurve = 0, kSmoothModeSpring = 1, kSmoothModeCount };
+    UInt32 _smoothMode;
+    UInt32 _springOmega;        // rad/s
+    SInt64 _springPos, _springVel;
+    UInt32 _springTicks;        // since last retarget
+    PRIVATE void stepSpring();
+
+    // optional pacing of transition ticks to the display refresh
+    enum { kPacingTimer = 0, kPacingFrame = 1, kPacingCount };
+    UInt32 _pacing;
+    UInt32 _framePeriodDefault; // us, when the framebuffer does not tell
+    UInt64 _framePeriod;        // ns
+    UInt64 _lastWriteFrame;
+    UInt32 _frameDoubles, _frameGaps;
+    PRIVATE void updateFramePeriod();
+    PRIVATE UInt64 smoothTick();
+    PRIVATE UInt64 alignToFrame(UInt64 t);
+    PRIVATE void startSmoothStats();
+    PRIVATE void noteSmoothWrite();
+
+    // deadline requests: reach a level by a given uptime, paced by measured write cost
+    UInt64 _writeCost;          // ns, running average of one backend write
+    UInt64 _deadline;           // ns, 0 when no deadline transition is active
+    UInt32 _deadlinesMet, _deadlinesMissed;
+    SInt64 _deadlineLateness;   // ns, last completed deadline (negative if early)
+    PRIVATE IOReturn setBrightnessDeadline(UInt32 level, UInt64 deadline);
+    PRIVATE void finishDeadline(bool met);
+
+    // transition profiles, selected by the source of the request
+    enum { kProfileKey, kProfileSlider, kProfileRestore, kProfileWake, kProfilePower, kProfileCount };
+    SmoothProfile _profiles[kProfileCount];
+    UInt32 _activeProfile;
+    UInt64 _lastRequest, _wakeTime;     // uptime ns
+    PRIVATE UInt32 profileForRequest();
+
+    // sleep/wake and power source tracking
+    IONotifier* _sleepWakeNotifier;
+    IONotifier* _powerSourceNotifier;
+    IONotifier* _powerSourceInterest;
+    int _onAC;                          // -1 until known
+    int _sourceLevels[2];               // last level on [battery, AC], -1 for none
+    PRIVATE void powerSourceChanged();
+    static IOReturn powerInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize);
+    static bool powerSourcePublished(void* target, void* refCon, IOService* newService, IONotifier* notifier);
+    static IOReturn powerSourceInterest(void* target, void* refCon, UInt32 messageType, IOService* provider, void* messageArgument, vm_size_t argSize);
+
+    PRIVATE bool findDevices(IOService * provider);
+    PRIVATE IOACPIPlatformDevice *  getGPU();
+    //IOACPIPlatformDevice *  getGPUACPIDevice(IOService *provider);
+	PRIVATE bool hasBacklightMethods(IOACPIPlatformDevice * acpiDevice);
+    PRIVATE bool hasDOSMethod(IOACPIPlatformDevice * acpiDevice);
+    PRIVATE bool hasSAVEMethod(IOACPIPlatformDevice * acpiDevice);
+    
+	PRIVATE IOACPIPlatformDevice * getChildWithBacklightMethods(IOACPIPlatformDevice * GPUdevice);
+    
+    PRIVATE OSString * getACPIPath(IOACPIPlatformDevice * acpiDevice);
+    
+	PRIVATE OSArray * queryACPISupportedBrightnessLevels();
+	PRIVATE void setACPIBrightnessLevel(UInt32 level);
+    PRIVATE void saveACPIBrightnessLevel(UInt32 level);
+	PRIVATE UInt32 queryACPICurentBrightnessLevel();
+    PRIVATE UInt32 rawForLevel(UInt32 level);
+    PRIVATE void setBrightnessLevel(UInt32 level);
+    PRIVATE void setBrightnessLevelSmooth(UInt32 level, UInt32 profile = kProfileKey);
+	
+	PRIVATE UInt32 setupIndexedLevels();
+	PRIVATE UInt32 findIndexForLevel(UInt32 BCLvalue);
+    
+	UInt32* BCLlevels;
+	UInt32 BCLlevelsCount;
+	UInt32 minAC, maxBat, min, max;
+    
+    UInt32 _options;
+    enum { kDisableSmooth = 0x01, kWaitForHandler = 0x02, kForceUseHandler = 0x04, kDisableProbe = 0x08, kPerSourceLevels = 0x10, };
+    BacklightHandlerParams _handlerParams;
+    PRIVATE bool useBacklightHandler();
+
+    enum { kBackendACPI = 0, kBackendHandler = 1, };
+    UInt32 _backend;
+    PRIVATE void probeBackends();
+    PRIVATE UInt64 probeBackend(UInt32 backend, UInt32 level, bool* correct);
+    PRIVATE bool setBackendLevel(UInt32 backend, UInt32 level);
+    PRIVATE UInt32 queryBackendLevel(UInt32 backend);
+
+	bool hasSaveMethod;
+    int _value;  // osx value
+    int _from_value; // current value working towards _value
+    int _committed_value;
+    int _saved_value;
+    
+	PRIVATE void getDeviceControl();
+    
+	PRIVATE IOService * getBatteryDevice();
+	PRIVATE bool getACStatus();
+
+    PRIVATE void  processWorkQueue(IOInterruptEventSource *, int);
+    PRIVATE void  onSmoothTimer(void);
+    PRIVATE void saveACPIBrightnessLevelNVRAM(UInt32 level);
+    PRIVATE UInt32 loadFromNVRAM(void);
+    PRIVATE NOINLINE UInt32 indexForLevel(UInt32 value, UInt32* rem = NULL);
+    PRIVATE NOINLINE UInt32 levelForIndex(UInt32 level);
+    PRIVATE UInt32 levelForValue(UInt32 value);
+
+    PRIVATE IOReturn setPropertiesGated(OSObject* props);
+#ifdef DEBUG
+    PRIVATE void setKLVX(UInt32 levx);
+#endif
+};
+
+#endif //ACPIBacklightDisplay_ACPIBacklightDevice_h
@@ -0,0 +1,677 @@
+//
+//  mmiosim.cpp
+//  ACPIBacklight
+//
+//  Host tool that runs the real IntelBacklightHandler (and the panel driving
+//  it) against a simulated display BAR.  The BAR implements the backlight PWM
+//  registers of each framebuffer generation the way the hardware uses them:
+//
+//      Ivy/Sandy       LEV2 bit 31 and LEVW bit 31 enable the output, duty
+//                      cycle in LEVL, period in LEVX[31:16], PCHL from KPCH
+//      Haswell/Bdw     LEVW bit 31 enables, LEVX = period<<16 | duty
+//      Skylake/KBL     same as Haswell (SPT PCH)
+//      Coffee Lake     LEVW bit 31 enables, period in LEVX, duty in LEVD (CNP PCH)
+//
+//  Registers read back what was written and drop to 0 on power loss.  Every
+//  access costs a configurable simulated latency and is counted.  The tool
+//  first checks the handler's behaviour per generation (levels, gating at 0,
+//  no flash when ungating, sleep with register loss, firmware turning the
+//  output on behind the handler, drift recovery, display change), then
+//  checks that every device ID in the Info.plist handler personalities gets
+//  the kFrameBufferType of its family and drives the backlight, that a
+//  backend restored from NVRAM is still timed, then
+//  benchmarks MMIO operations and simulated bus time per level change and
+//  per full smooth transition.
+//
+//  Build: make mmiosim
+//  Usage: mmiosim [-r read_ns] [-w write_ns] [-s] [-v]
+//      -r  simulated cost of one MMIO read (default 500)
+//      -w  simulated cost of one MMIO write, posted (default 100)
+//      -s  spin for the simulated cost, so the panel sees it in its timing
+//      -v  show the kext's IOLog output
+//
+
+#include "hostrig.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LEV2 0x48250
+#define LEVL 0x48254
+#define LEVW 0xc8250
+#define LEVX 0xc8254
+#define PCHL 0xe1180
+#define LEVD 0xc8258
+#define kPWMEnable 0x80000000
+
+#define kInfoPlist "ACPIBacklight/ACPIBacklight-Info.plist"
+
+// XOPT: wait for the native handler, no XBCM/handler probe; functional runs
+// also disable smoothing so every request is one level change
+#define kXOPTHandler    0x0a
+#define kXOPTNoSmooth   0x01
+#define kXOPTProbe      0x02    // wait for the handler, XBCM/handler probe on
+
+enum { kIvySandy = 1, kHaswellBroadwell = 2, kSkylakeKabyLake = 3, kCoffeeLake = 4, };
+
+struct Generation
+{
+    int type;               // kFrameBufferType it must match
+    const char* name;
+    UInt16 deviceID;        // representative, must be in the Info.plist personality
+    UInt32 lmax;            // LMAX from PNLF, 0 for none
+    UInt32 klvx;            // KLVX from PNLF, 0 for none
+    UInt32 kpch;            // KPCH from PNLF, 0 for none
+    UInt32 period;          // PWM period the handler must end up programming
+};
+
+static const Generation generations[] =
+{
+    { kIvySandy, "Ivy/Sandy", 0x0166, 0x0710, 0x07100000, 0x0, 0x0710 },
+    { kHaswellBroadwell, "Haswell/Broadwell", 0x0a16, 0x056c, 0, 0, 0x056c },
+    // no LMAX from PNLF: the handler's default max
+    { kSkylakeKabyLake, "Skylake/Kaby Lake", 0x5916, 0, 0, 0, 0x056c },
+    { kCoffeeLake, "Coffee Lake", 0x3e9b, 0, 0, 0, 0xffff },
+    // and with one
+    { kCoffeeLake, "Coffee Lake (LMAX)", 0x3e9b, 0x1388, 0, 0, 0x1388 },
+};
+
+// kFrameBufferType by device ID family (high byte of the device ID)
+static int familyType(UInt16 deviceID)
+{
+    switch (deviceID >> 8)
+    {
+        case 0x00: case 0x01:
+            return kIvySandy;
+        case 0x04: case 0x0a: case 0x0b: case 0x0d: case 0x16:
+            return kHaswellBroadwell;
+        case 0x19: case 0x59:
+            return kSkylakeKabyLake;
+        case 0x3e: case 0x9b:
+            return kCoffeeLake;
+    }
+    return 0;
+}
+
+static UInt64 readNS = 500, writeNS = 100;
+static bool spin;
+
+////////////////////////////////////////////////////////////////
+// simulated BAR
+
+class SimBAR : public HostBAR
+{
+public:
+    explicit SimBAR(int type) : HostBAR(0x100000), _type(type) { reset(); }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        reads = writes = dutyWrites = 0;
+        enables = 0;
+        enableDuty = 0;
+        unprogrammed = overrange = 0;
+    }
+
+    // all PWM registers back to their reset value (0), output off
+    void powerLoss()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        clear();
+    }
+
+    // firmware (or the framebuffer) bringing the PWM up behind the handler's back
+    void firmwareOn(UInt32 period, UInt32 duty)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        switch (_type)
+        {
+            case kIvySandy:
+                poke(LEVX, period << 16);
+                poke(LEVL, duty);
+                poke(LEVW, kPWMEnable);
+                poke(LEV2, kPWMEnable);
+                break;
+            case kCoffeeLake:
+                poke(LEVX, period);
+                poke(LEVD, duty);
+                poke(LEVW, kPWMEnable);
+                break;
+            default:
+                poke(LEVX, period << 16 | duty);
+                poke(LEVW, kPWMEnable);
+                break;
+        }
+    }
+
+    // something else resetting the PWM block (a mode set), no notification
+    void externalDisable()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        poke(_type == kIvySandy ? LEV2 : LEVW, 0);
+    }
+
+    bool lit() { std::lock_guard<std::mutex> lock(_lock); return litLocked(); }
+    UInt32 duty() { std::lock_guard<std::mutex> lock(_lock); return dutyLocked(); }
+    UInt32 period() { std::lock_guard<std::mutex> lock(_lock); return periodLocked(); }
+    UInt32 reg(UInt32 offset) { std::lock_guard<std::mutex> lock(_lock); return peek(offset); }
+
+    // counters since reset()
+    UInt64 reads, writes;
+    UInt64 dutyWrites;      // level changes that reached the hardware
+    UInt64 busNS() { return reads * readNS + writes * writeNS; }
+    UInt32 enables;         // output off -> on
+    UInt32 enableDuty;      // duty cycle when it last came on (no flash: already the new level)
+    UInt32 unprogrammed;    // writes leaving the output on without a period
+    UInt32 overrange;       // writes leaving the output on with duty > period
+
+    virtual UInt32 read32(UInt32 offset)
+    {
+        if (spin)
+            hostSpinNS(readNS);
+        std::lock_guard<std::mutex> lock(_lock);
+        ++reads;
+        return peek(offset);
+    }
+
+    virtual void write32(UInt32 offset, UInt32 value)
+    {
+        if (spin)
+            hostSpinNS(writeNS);
+        std::lock_guard<std::mutex> lock(_lock);
+        ++writes;
+        if (offset == dutyReg())
+            ++dutyWrites;
+        bool was = litLocked();
+        poke(offset, value);
+        if (!litLocked())
+            return;
+        if (!was)
+        {
+            ++enables;
+            enableDuty = dutyLocked();
+        }
+        if (!periodLocked())
+            ++unprogrammed;
+        else if (dutyLocked() > periodLocked())
+            ++overrange;
+    }
+
+private:
+    int _type;
+    std::mutex _lock;
+
+    UInt32 dutyReg()
+    {
+        switch (_type)
+        {
+            case kIvySandy: return LEVL;
+            case kCoffeeLake: return LEVD;
+            default: return LEVX;
+        }
+    }
+    bool litLocked()
+    {
+        switch (_type)
+        {
+            case kIvySandy:
+                return (peek(LEV2) & kPWMEnable) && (peek(LEVW) & kPWMEnable);
+            default:
+                return peek(LEVW) & kPWMEnable;
+        }
+    }
+    UInt32 dutyLocked()
+    {
+        return peek(dutyReg()) & 0xFFFF;
+    }
+    UInt32 periodLocked()
+    {
+        if (kCoffeeLake == _type)
+            return peek(LEVX) & 0xFFFF;
+        return peek(LEVX) >> 16;
+    }
+};
+
+////////////////////////////////////////////////////////////////
+
+static int failures;
+
+static void check(bool ok, const char* gen, const char* what)
+{
+    printf("  %-4s %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok)
+    {
+        ++failures;
+        fprintf(stderr, "mmiosim: %s: %s failed\n", gen, what);
+    }
+}
+
+// PNLF for the generation: _BCL over the PWM range, XBCM/XBQC, handler params
+static void setupPNLF(HostRig& rig, const Generation& gen, UInt32 xopt)
+{
+    UInt32 top = gen.period;
+    rig.acpi->bcl.clear();
+    rig.acpi->bcl.push_back(top);
+    rig.acpi->bcl.push_back(top / 2);
+    for (int i = 0; i <= 16; i++)
+        rig.acpi->bcl.push_back(top * i / 16);
+    rig.acpi->extended = true;
+    rig.acpi->setInteger("XOPT", xopt);
+    if (gen.lmax)
+        rig.acpi->setInteger("LMAX", gen.lmax);
+    if (gen.klvx)
+        rig.acpi->setInteger("KLVX", gen.klvx);
+    if (gen.kpch)
+        rig.acpi->setInteger("KPCH", gen.kpch);
+}
+
+// post a level and wait until it is on the hardware; returns the raw level written
+static UInt32 setLevel(HostRig& rig, UInt32 level)
+{
+    rig.post(level);
+    rig.settle();
+    PanelState state;
+    rig.readState(&state);
+    return state.raw;
+}
+
+// straight to the handler, on the panel's gate like every backend write
+static void handlerLevel(HostRig& rig, UInt32 raw)
+{
+    IOWorkLoop* workLoop = rig.panel->getWorkLoop();
+    workLoop->closeGate();
+    rig.handler->setBacklightLevel(raw);
+    workLoop->openGate();
+}
+
+static bool gated(HostRig& rig)
+{
+    OSDictionary* dict = OSDynamicCast(OSDictionary, rig.handler->getProperty("PWM Gating"));
+    OSBoolean* value = dict ? OSDynamicCast(OSBoolean, dict->getObject("Gated")) : NULL;
+    return value && value->isTrue();
+}
+
+static void functional(const Generation& gen)
+{
+    printf("%s (%04x, kFrameBufferType %d)\n", gen.name, gen.deviceID, gen.type);
+
+    SimBAR bar(gen.type);
+    // firmware handed over a lit panel at half duty
+    UInt32 period = gen.period;
+    bar.firmwareOn(period, period / 2);
+
+    HostRig rig;
+    setupPNLF(rig, gen, kXOPTHandler | kXOPTNoSmooth);
+    if (!rig.start(kInfoPlist, NULL, &bar, 0x8086, gen.deviceID) || !rig.handler)
+    {
+        check(false, gen.name, "panel and handler start");
+        return;
+    }
+    OSNumber* type = OSDynamicCast(OSNumber, rig.handler->getProperty("kFrameBufferType"));
+    check(type && (int)type->unsigned32BitValue() == gen.type, gen.name, "Info.plist personality matches the generation");
+
+    // plain level changes
+    bool levels = true, readback = true;
+    IOWorkLoop* workLoop = rig.panel->getWorkLoop();
+    for (UInt32 level = 64; level <= 1024; level += 96)
+    {
+        UInt32 raw = setLevel(rig, level);
+        levels &= bar.lit() && bar.duty() == raw && bar.period() == period;
+        workLoop->closeGate();
+        readback &= rig.handler->getBacklightLevel() == raw;
+        workLoop->openGate();
+    }
+    check(levels, gen.name, "level changes reach the duty cycle, period programmed");
+    check(readback, gen.name, "getBacklightLevel reads back the level written");
+    if (kIvySandy == gen.type)
+        check(bar.reg(LEVX) == gen.klvx, gen.name, "LEVX initialized from KLVX");
+
+    // zero gates the output, the next level comes on at its own duty cycle
+    // (brightness 0 posted to the panel restores the committed level right away,
+    // the old Yosemite workaround, so 0 is written to the handler directly)
+    handlerLevel(rig, 0);
+    check(!bar.lit() && 0 == bar.duty() && gated(rig), gen.name, "level 0 gates the PWM output");
+    bar.reset();
+    UInt32 raw = setLevel(rig, 700);
+    check(bar.lit() && 1 == bar.enables && raw == bar.enableDuty, gen.name, "ungating latches the level before enabling (no flash)");
+    check(!gated(rig), gen.name, "PWM Gating reports ungated");
+
+    // sleep loses every register, the first level after wake replays init
+    rig.sleep();
+    bar.powerLoss();
+    rig.wake();
+    raw = setLevel(rig, 500);
+    check(bar.lit() && bar.duty() == raw && bar.period() == period, gen.name, "after sleep with register loss, the next level restores the output");
+    if (kIvySandy == gen.type)
+        check(bar.reg(LEVX) == gen.klvx && (bar.reg(LEV2) & kPWMEnable) && (bar.reg(LEVW) & kPWMEnable), gen.name, "after sleep, Ivy/Sandy init registers replayed");
+
+    // gated across sleep, firmware turns the output back on at its own duty: 0 must gate again
+    handlerLevel(rig, 0);
+    rig.sleep();
+    bar.powerLoss();
+    bar.firmwareOn(period, period);
+    rig.wake();
+    rig.settle();
+    handlerLevel(rig, 0);
+    check(!bar.lit(), gen.name, "gated across sleep, firmware re-enable is gated again");
+    bar.reset();
+    raw = setLevel(rig, 300);
+    check(bar.lit() && bar.duty() == raw && bar.enableDuty == raw, gen.name, "first level after that ungates without flash");
+
+    // something turns the output off behind the handler: the drift check notices
+    bar.externalDisable();
+    int writesToRecover = -1;
+    for (int i = 0; i < 40; i++)
+    {
+        setLevel(rig, 400 + (i & 1) * 100);
+        if (bar.lit())
+        {
+            writesToRecover = i + 1;
+            break;
+        }
+    }
+    char buf[128];
+    snprintf(buf, sizeof(buf), "output disabled behind the handler recovers by the drift check (%d writes)", writesToRecover);
+    check(writesToRecover > 0 && writesToRecover <= 32, gen.name, buf);
+
+    // display change (mode set) resets the PWM block: invalidated, next level restores
+    bar.powerLoss();
+    rig.attachDisplay();
+    rig.settle();
+    raw = setLevel(rig, 800);
+    check(bar.lit() && bar.duty() == raw && bar.period() == period, gen.name, "display change invalidates, the next level restores the output");
+
+    check(0 == bar.unprogrammed, gen.name, "output never on without a PWM period");
+    check(0 == bar.overrange, gen.name, "duty cycle never above the period");
+    rig.stop();
+}
+
+// "Backend Probe" entry, 0/false when missing
+static UInt64 probeNS(HostRig& rig, const char* key, const char** selected = NULL, bool* restored = NULL)
+{
+    OSObject* obj = rig.panel->copyProperty("Backend Probe");
+    OSDictionary* dict = OSDynamicCast(OSDictionary, obj);
+    OSNumber* num = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : NULL;
+    UInt64 value = num ? num->unsigned64BitValue() : 0;
+    if (selected)
+    {
+        OSString* str = dict ? OSDynamicCast(OSString, dict->getObject("Selected")) : NULL;
+        *selected = !str ? "" : str->isEqualTo("ACPI") ? "ACPI" : "Handler";
+    }
+    if (restored)
+        *restored = dict && dict->getObject("From NVRAM") == kOSBooleanTrue;
+    OSSafeRelease(obj);
+    return value;
+}
+
+// the backend chosen at one boot is reused from the state record at the next,
+// and still timed, so transitions are paced by its write cost
+static void restoredBackend(const Generation& gen)
+{
+    printf("%s backend restored from NVRAM\n", gen.name);
+
+    SimBAR bar(gen.type);
+    bar.firmwareOn(gen.period, gen.period / 2);
+    OSData* record = NULL;
+    const char* probed = "";
+    {
+        HostRig rig;
+        setupPNLF(rig, gen, kXOPTProbe | kXOPTNoSmooth);
+        if (!rig.start(kInfoPlist, NULL, &bar, 0x8086, gen.deviceID) || !rig.handler)
+        {
+            check(false, gen.name, "panel and handler start");
+            return;
+        }
+        bool restored = true;
+        check(probeNS(rig, "ACPI ns") && probeNS(rig, "Handler ns", &probed, &restored) && !restored, gen.name,
+              "first boot probes both backends");
+        setLevel(rig, 600);
+        rig.commit();
+        rig.settle();
+        rig.stop();
+        record = OSDynamicCast(OSData, rig.nvram->copyProperty("acpi-backlight-state"));
+    }
+    check(record, gen.name, "state record written at stop");
+    if (!record)
+        return;
+
+    HostRig rig;
+    setupPNLF(rig, gen, kXOPTProbe | kXOPTNoSmooth);
+    rig.nvram->setProperty("acpi-backlight-state", record);
+    record->release();
+    if (!rig.start(kInfoPlist, NULL, &bar, 0x8086, gen.deviceID) || !rig.handler)
+    {
+        check(false, gen.name, "panel and handler start");
+        return;
+    }
+    const char* selected = "";
+    bool restored = false;
+    UInt64 cost = probeNS(rig, !strcmp(probed, "ACPI") ? "ACPI ns" : "Handler ns", &selected, &restored);
+    check(restored && !strcmp(selected, probed), gen.name, "second boot reuses the recorded backend");
+    check(cost > 0, gen.name, "restored backend is timed and published");
+    rig.stop();
+}
+
+////////////////////////////////////////////////////////////////
+// Info.plist device IDs
+
+static std::vector<UInt16> listedDevices(OSDictionary* personality)
+{
+    std::vector<UInt16> ids;
+    OSString* match = OSDynamicCast(OSString, personality->getObject("IOPCIPrimaryMatch"));
+    for (const char* p = match ? match->getCStringNoCopy() : ""; *p; )
+    {
+        char* end;
+        unsigned long value = strtoul(p, &end, 0);
+        if (end == p)
+            break;
+        if ((value & 0xFFFF) == 0x8086)
+            ids.push_back((UInt16)(value >> 16));
+        p = end;
+    }
+    return ids;
+}
+
+static void devices()
+{
+    printf("Info.plist handler personalities\n");
+    OSDictionary* personalities = hostLoadPersonalities(kInfoPlist);
+    if (!personalities)
+    {
+        check(false, "Info.plist", "personalities load");
+        return;
+    }
+    int listed = 0, typed = 0, driven = 0;
+    for (unsigned i = 0; i < personalities->getCount(); i++)
+    {
+        OSDictionary* personality = OSDynamicCast(OSDictionary, personalities->hostValue(i));
+        OSString* ioclass = personality ? OSDynamicCast(OSString, personality->getObject("IOClass")) : NULL;
+        if (!ioclass || !ioclass->isEqualTo("IntelBacklightHandler"))
+            continue;
+        std::vector<UInt16> ids = listedDevices(personality);
+        for (size_t j = 0; j < ids.size(); j++)
+        {
+            ++listed;
+            char what[128];
+            OSNumber* num = OSDynamicCast(OSNumber, hostPersonalityForPCI(personalities, 0x8086, ids[j])->getObject("kFrameBufferType"));
+            int type = num ? (int)num->unsigned32BitValue() : 0;
+            if (type != familyType(ids[j]))
+            {
+                snprintf(what, sizeof(what), "%04x: kFrameBufferType %d, family is %d", ids[j], type, familyType(ids[j]));
+                check(false, "Info.plist", what);
+                continue;
+            }
+            ++typed;
+
+            // start on that device, one level must reach the duty cycle
+            const Generation* gen = NULL;
+            for (size_t k = 0; k < sizeof(generations)/sizeof(generations[0]) && !gen; k++)
+                if (generations[k].type == type)
+                    gen = &generations[k];
+            SimBAR bar(type);
+            bar.firmwareOn(gen->period, gen->period / 2);
+            HostRig rig;
+            setupPNLF(rig, *gen, kXOPTHandler | kXOPTNoSmooth);
+            bool ok = rig.start(kInfoPlist, NULL, &bar, 0x8086, ids[j]) && rig.handler;
+            if (ok)
+            {
+                UInt32 raw = setLevel(rig, 600);
+                ok = bar.lit() && bar.duty() == raw && bar.period() == gen->period;
+                rig.stop();
+            }
+            if (ok)
+                ++driven;
+            else
+            {
+                snprintf(what, sizeof(what), "%04x (type %d) drives the backlight", ids[j], type);
+                check(false, "Info.plist", what);
+            }
+        }
+    }
+    personalities->release();
+    char what[128];
+    snprintf(what, sizeof(what), "%d device IDs listed, %d typed by family, %d drive the backlight", listed, typed, driven);
+    check(listed && typed == listed && driven == listed, "Info.plist", what);
+}
+
+////////////////////////////////////////////////////////////////
+// benchmark
+
+static void benchmark(const Generation& gen)
+{
+    printf("%s\n", gen.name);
+
+    SimBAR bar(gen.type);
+    UInt32 period = gen.period;
+    bar.firmwareOn(period, period / 2);
+
+    // level changes: the handler called directly, inside the panel's gate like the workloop does
+    {
+        HostRig rig;
+        setupPNLF(rig, gen, kXOPTHandler | kXOPTNoSmooth);
+        if (!rig.start(kInfoPlist, NULL, &bar, 0x8086, gen.deviceID) || !rig.handler)
+        {
+            check(false, gen.name, "panel and handler start");
+            return;
+        }
+        IOWorkLoop* workLoop = rig.panel->getWorkLoop();
+        const int n = 20000;
+        workLoop->closeGate();
+        rig.handler->setBacklightLevel(period / 2);
+
+        struct { const char* name; int kind; } rows[] =
+        {
+            { "level change", 0 },
+            { "level change after invalidate (sleep, display)", 1 },
+            { "level read", 2 },
+            { "gate (level 0) + ungate", 3 },
+        };
+        printf("  %-48s %8s %8s %10s %10s\n", "", "reads", "writes", "bus ns", "host ns");
+        for (size_t r = 0; r < sizeof(rows)/sizeof(rows[0]); r++)
+        {
+            bar.reset();
+            UInt64 start = hostUptimeNS();
+            for (int i = 0; i < n; i++)
+            {
+                UInt32 level = period / 4 + (i & 63) * (period / 128);
+                switch (rows[r].kind)
+                {
+                    case 0:
+                        rig.handler->setBacklightLevel(level);
+                        break;
+                    case 1:
+                        rig.handler->invalidateState();
+                        rig.handler->setBacklightLevel(level);
+                        break;
+                    case 2:
+                        rig.handler->getBacklightLevel();
+                        break;
+                    case 3:
+                        rig.handler->setBacklightLevel(0);
+                        rig.handler->setBacklightLevel(level);
+                        break;
+                }
+            }
+            UInt64 host = hostUptimeNS() - start;
+            printf("  %-48s %8.2f %8.2f %10.0f %10.0f\n", rows[r].name,
+                   (double)bar.reads / n, (double)bar.writes / n, (double)bar.busNS() / n, (double)host / n);
+        }
+        workLoop->openGate();
+        rig.stop();
+    }
+
+    // full transitions through the panel, smoothing on (default tiers, timer pacing)
+    {
+        HostRig rig;
+        setupPNLF(rig, gen, kXOPTHandler);
+        bar.firmwareOn(period, period / 2);
+        if (!rig.start(kInfoPlist, NULL, &bar, 0x8086, gen.deviceID) || !rig.handler)
+        {
+            check(false, gen.name, "panel and handler start");
+            return;
+        }
+        setLevel(rig, 16);
+        struct { const char* name; UInt32 from, to; } rows[] =
+        {
+            { "transition 16 -> 1024 (full range up)", 16, 1024 },
+            { "transition 1024 -> 16 (full range down)", 1024, 16 },
+            { "transition 400 -> 600", 400, 600 },
+        };
+        printf("  %-48s %8s %8s %10s %10s %8s\n", "", "reads", "writes", "bus ns", "ms", "levels");
+        const int n = 5;
+        for (size_t r = 0; r < sizeof(rows)/sizeof(rows[0]); r++)
+        {
+            UInt64 reads = 0, writes = 0, bus = 0, wall = 0, changes = 0;
+            for (int i = 0; i < n; i++)
+            {
+                setLevel(rig, rows[r].from);
+                bar.reset();
+                UInt64 start = hostUptimeNS();
+                setLevel(rig, rows[r].to);
+                wall += hostUptimeNS() - start;
+                reads += bar.reads;
+                writes += bar.writes;
+                bus += bar.busNS();
+                changes += bar.dutyWrites;
+            }
+            printf("  %-48s %8.1f %8.1f %10.0f %10.1f %8.1f\n", rows[r].name,
+                   (double)reads / n, (double)writes / n, (double)bus / n, (double)wall / n / 1e6, (double)changes / n);
+        }
+        rig.stop();
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    bool verbose = false;
+    int c;
+    while ((c = getopt(argc, argv, "r:w:sv")) != -1)
+    {
+        switch (c)
+        {
+            case 'r': readNS = strtoull(optarg, NULL, 0); break;
+            case 'w': writeNS = strtoull(optarg, NULL, 0); break;
+            case 's': spin = true; break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: mmiosim [-r read_ns] [-w write_ns] [-s] [-v]\n");
+                return 2;
+        }
+    }
+    hostSetLogging(verbose);
+
+    printf("== handler against the simulated BAR ==\n");
+    for (size_t i = 0; i < sizeof(generations)/sizeof(generations[0]); i++)
+        functional(generations[i]);
+    restoredBackend(generations[0]);
+    devices();
+
+    printf("\n== MMIO cost (read %lluns, write %lluns%s) ==\n", readNS, writeNS, spin ? ", spinning" : "");
+    for (size_t i = 0; i < sizeof(generations)/sizeof(generations[0]); i++)
+        benchmark(generations[i]);
+
+    if (failures)
+        printf("\n%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,226 @@
+//
+//  nvrambench.cpp
+//  ACPIBacklight
+//
+//  Host benchmark for reading the saved level from NVRAM at boot.  The real
+//  panel starts over synthetic NVRAM of increasing size (boot-args, Bluetooth
+//  link keys, panic log chunks, ... around the acpi-backlight-level key), in
+//  two setups:
+//
+//      direct      IODTNVRAM answers copyProperty by key (what loadFromNVRAM
+//                  finds when booting with Clover)
+//      serialized  a /chosen/nvram entry whose properties can't be read by key,
+//                  so the kext serializes all of it to XML and parses it back
+//
+//  Times are the kext's own, from its "NVRAM Read" property: acpi-backlight-state
+//  is not there (a miss), acpi-backlight-level is (a hit, and the level read
+//  must be the one stored).  Each row is the median and p90 over several starts.
+//
+//  Build: make nvrambench
+//  Usage: nvrambench [-r starts] [-v]
+//
+
+#include "hostrig.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+
+#define kInfoPlist "ACPIBacklight/ACPIBacklight-Info.plist"
+#define kXOPTNoSmooth 0x09  // no smoothing, no backend probe
+#define kStoredLevel 700
+
+// /chosen/nvram as some loaders publish it: properties only come out serialized
+class SerializedNVRAM : public IORegistryEntry
+{
+public:
+    using IORegistryEntry::copyProperty;
+    virtual OSObject* copyProperty(const char* key) const { return NULL; }
+};
+
+// NVRAM contents of roughly the given size, the level key somewhere in the middle
+static void fill(IORegistryEntry* nvram, UInt32 bytes)
+{
+    std::vector<UInt8> blob(4096);
+    for (size_t i = 0; i < blob.size(); i++)
+        blob[i] = (UInt8)(i * 131 + 7);
+
+    UInt32 level = kStoredLevel, total = 0;
+    bool stored = false;
+    for (unsigned i = 0; total < bytes; i++)
+    {
+        char key[64];
+        OSObject* value;
+        switch (i % 4)
+        {
+            case 0:
+                snprintf(key, sizeof(key), "boot-args-%u", i);
+                value = OSString::withCString("-v keepsyms=1 debug=0x100 darkwake=0 kext-dev-mode=1");
+                total += 52;
+                break;
+            case 1:
+                snprintf(key, sizeof(key), "BT-LinkKey-%02x:%02x:%02x", i & 0xff, (i >> 8) & 0xff, 0x5a);
+                value = OSData::withBytes(blob.data(), 16);
+                total += 16;
+                break;
+            case 2:
+                snprintf(key, sizeof(key), "csr-active-config-%u", i);
+                value = OSNumber::withNumber(0x67, 32);
+                total += 4;
+                break;
+            default:
+            {
+                // panic logs and the like: a few large values make most of the bytes
+                UInt32 length = std::min<UInt32>((UInt32)blob.size(), std::max<UInt32>(bytes / 8, 64));
+                snprintf(key, sizeof(key), "aapl,panic-info-%u", i);
+                value = OSData::withBytes(blob.data(), length);
+                total += length;
+                break;
+            }
+        }
+        total += (UInt32)strlen(key);
+        nvram->setProperty(key, value);
+        value->release();
+        if (!stored && total >= bytes / 2)
+        {
+            OSData* data = OSData::withBytes(&level, sizeof(level));
+            nvram->setProperty("acpi-backlight-level", data);
+            data->release();
+            stored = true;
+        }
+    }
+}
+
+struct Sample
+{
+    UInt64 missNS, hitNS;
+    std::string path;
+    bool levelOK;
+};
+
+static UInt64 readTime(OSDictionary* reads, const char* key, std::string* path)
+{
+    OSDictionary* dict = reads ? OSDynamicCast(OSDictionary, reads->getObject(key)) : NULL;
+    if (!dict)
+        return 0;
+    if (OSString* str = OSDynamicCast(OSString, dict->getObject("Path")))
+        *path = str->getCStringNoCopy();
+    OSNumber* time = OSDynamicCast(OSNumber, dict->getObject("Time"));
+    return time ? time->unsigned64BitValue() : 0;
+}
+
+static Sample startOnce(bool serialized, UInt32 bytes, UInt32* xmlBytes)
+{
+    HostRig rig;
+    rig.acpi->bcl.push_back(100);
+    rig.acpi->bcl.push_back(50);
+    for (int i = 0; i <= 100; i += 10)
+        rig.acpi->bcl.push_back(i);
+    rig.acpi->setInteger("XOPT", kXOPTNoSmooth);
+
+    SerializedNVRAM* chosen = NULL;
+    if (serialized)
+    {
+        chosen = new SerializedNVRAM;
+        chosen->init();
+        chosen->setName("nvram");
+        fill(chosen, bytes);
+        hostRegisterPath(gIODTPlane, "/chosen/nvram", chosen);
+    }
+    else
+        fill(rig.nvram, bytes);
+
+    // what the serialize path allocates and parses
+    if (OSSerialize* serial = OSSerialize::withCapacity(0))
+    {
+        (serialized ? (IORegistryEntry*)chosen : (IORegistryEntry*)rig.nvram)->serializeProperties(serial);
+        *xmlBytes = (UInt32)strlen(serial->text());
+        serial->release();
+    }
+
+    if (!rig.start(kInfoPlist))
+    {
+        fprintf(stderr, "nvrambench: panel start failed\n");
+        exit(1);
+    }
+    Sample sample;
+    OSObject* obj = rig.panel->copyProperty("NVRAM Read");
+    OSDictionary* reads = OSDynamicCast(OSDictionary, obj);
+    std::string missPath;
+    sample.missNS = readTime(reads, "acpi-backlight-state", &missPath);
+    sample.hitNS = readTime(reads, "acpi-backlight-level", &sample.path);
+    OSSafeRelease(obj);
+    rig.settle();
+    PanelState state;
+    rig.readState(&state);
+    sample.levelOK = kStoredLevel == state.committed;
+    rig.stop();
+    OSSafeRelease(chosen);
+    return sample;
+}
+
+static double percentile(std::vector<UInt64> v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return (double)v[(size_t)(p * (v.size() - 1))] / 1000.0;
+}
+
+int main(int argc, char* argv[])
+{
+    int starts = 9;
+    bool verbose = false;
+    int c;
+    while ((c = getopt(argc, argv, "r:v")) != -1)
+    {
+        switch (c)
+        {
+            case 'r': starts = std::max(1, atoi(optarg)); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: nvrambench [-r starts] [-v]\n");
+                return 2;
+        }
+    }
+    hostSetLogging(verbose);
+
+    static const UInt32 sizes[] = { 1024, 8192, 65536, 262144, 1048576 };
+    static const struct { const char* name; bool serialized; } setups[] =
+    {
+        { "direct", false },
+        { "serialized", true },
+    };
+    printf("%d starts per row, times in us (median / p90)\n\n", starts);
+    printf("  %-10s %9s %9s %-10s %19s %19s %8s\n", "setup", "nvram", "xml", "path", "miss (state)", "hit (level)", "level");
+    int failures = 0;
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+    {
+        for (size_t k = 0; k < sizeof(setups)/sizeof(setups[0]); k++)
+        {
+            std::vector<UInt64> miss, hit;
+            UInt32 xml = 0;
+            std::string path;
+            bool levelOK = true;
+            for (int i = 0; i < starts; i++)
+            {
+                Sample sample = startOnce(setups[k].serialized, sizes[s], &xml);
+                miss.push_back(sample.missNS);
+                hit.push_back(sample.hitNS);
+                path = sample.path;
+                levelOK = levelOK && sample.levelOK;
+            }
+            char missText[32], hitText[32];
+            snprintf(missText, sizeof(missText), "%.1f / %.1f", percentile(miss, 0.5), percentile(miss, 0.9));
+            snprintf(hitText, sizeof(hitText), "%.1f / %.1f", percentile(hit, 0.5), percentile(hit, 0.9));
+            printf("  %-10s %8uK %8uK %-10s %19s %19s %8s\n", setups[k].name, sizes[s] / 1024, xml / 1024, path.c_str(),
+                   missText, hitText, levelOK ? "ok" : "WRONG");
+            failures += !levelOK;
+        }
+    }
+    if (failures)
+        printf("\n%d row(s) where the panel did not come up at the stored level\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,436 @@
+//
+//  panelstress.cpp
+//  ACPIBacklight
+//
+//  Multithreaded host stress harness for the panel state machine.  The real
+//  ACPIBacklightPanel runs over a PNLF mock whose _BCM/_BQC take a configurable
+//  time, and every entry point the kext exposes is driven from several threads
+//  at randomized rates:
+//
+//      doIntegerSet    brightness requests and commits, as IODisplay sends them
+//      setProperties   smoothing/profile/pacing tuning, BrightnessTarget deadlines,
+//                      RawBrightness
+//      setDisplay      displays coming and going (mode sets, display sleep)
+//      power           system sleep/wake as the root domain sends it
+//
+//  Timer fires and work queue passes happen on the panel's workloop as a
+//  result; their holds come from the kext's own "Gate Stats".  An observer
+//  thread reads the published state (readState) the whole time and checks every
+//  snapshot: levels in range, requests applied never ahead of requests posted
+//  and never going backwards.  At the end the panel must settle with the
+//  hardware at the published raw level.
+//
+//  Reported: throughput and caller latency per entry point, workloop hold
+//  times per site, gate and lock contention, overlapping work source signals,
+//  observer findings and the kext's "Invariant Violations" (_from_value
+//  overshooting _value on a curve, out of range levels, broken trajectories).
+//  Those are only checked in the Debug configuration, so the harness links
+//  the kext built with DEBUG.
+//
+//  Build: make panelstress        (or panelstress-tsan, under ThreadSanitizer)
+//  Usage: panelstress [-t seconds] [-n threads] [-l latency_us] [-s seed] [-v]
+//      -t  run time (default 5)
+//      -n  threads per entry point (default 2)
+//      -l  _BCM/_BQC latency, slept like an EC transaction (default 500)
+//      -s  random seed
+//
+
+#include "hostrig.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#define kInfoPlist "ACPIBacklight/ACPIBacklight-Info.plist"
+
+enum { kEntryIntegerSet, kEntryCommit, kEntryProperties, kEntryDisplay, kEntryPower, kEntryCount };
+static const char* entryNames[] = { "doIntegerSet", "commit", "setProperties", "setDisplay", "power", };
+
+static UInt64 runNS = 5000000000ULL;
+static int threadsPerEntry = 2;
+static UInt64 latencyUS = 500;
+
+struct Sampler
+{
+    std::mutex lock;
+    std::vector<UInt64> latency[kEntryCount];
+
+    void add(int entry, UInt64 ns)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        latency[entry].push_back(ns);
+    }
+};
+
+static Sampler samples;
+static std::atomic<bool> running;
+
+struct Random
+{
+    UInt32 state;
+    explicit Random(UInt32 seed) : state(seed ? seed : 1) {}
+    UInt32 next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+    UInt32 below(UInt32 n) { return next() % n; }
+};
+
+static void pause(Random& random, UInt32 maxUS)
+{
+    if (maxUS)
+        usleep(random.below(maxUS));
+}
+
+////////////////////////////////////////////////////////////////
+// callers
+
+static void integerSetThread(HostRig* rig, UInt32 seed)
+{
+    Random random(seed);
+    OSDictionary* params = rig->newParams();
+    while (running)
+    {
+        UInt64 start = hostUptimeNS();
+        if (random.below(10))
+        {
+            rig->post(random.below(1025), params);
+            samples.add(kEntryIntegerSet, hostUptimeNS() - start);
+        }
+        else
+        {
+            rig->commit(params);
+            samples.add(kEntryCommit, hostUptimeNS() - start);
+        }
+        pause(random, 2000);
+    }
+    params->release();
+}
+
+static void setNumber(OSDictionary* dict, const char* key, UInt32 value)
+{
+    OSNumber* num = OSNumber::withNumber(value, 32);
+    dict->setObject(key, num);
+    num->release();
+}
+
+static void propertiesThread(HostRig* rig, UInt32 seed)
+{
+    Random random(seed);
+    static const char* profiles[] = { "Key", "Slider", "Restore", "Wake", "Power", };
+    while (running)
+    {
+        OSDictionary* dict = OSDictionary::withCapacity(4);
+        char key[32];
+        switch (random.below(8))
+        {
+            case 0: setNumber(dict, "SmoothMode", random.below(2)); break;
+            case 1: setNumber(dict, "SmoothEasing", random.below(3)); break;
+            case 2: setNumber(dict, "SmoothPacing", random.below(2)); break;
+            case 3:
+                setNumber(dict, "SmoothTimeout0", 2000 + random.below(30000));
+                setNumber(dict, "SpringOmega", 1 + random.below(50));
+                break;
+            case 4:
+                snprintf(key, sizeof(key), "Profile%sUp", profiles[random.below(5)]);
+                setNumber(dict, key, random.below(2000));
+                snprintf(key, sizeof(key), "Profile%sDown", profiles[random.below(5)]);
+                setNumber(dict, key, random.below(2000));
+                break;
+            case 5: case 6:
+            {
+                OSDictionary* target = OSDictionary::withCapacity(3);
+                setNumber(target, "Level", random.below(1025));
+                setNumber(target, "WithinMS", random.below(500));
+                if (random.below(2))
+                    target->setObject("Commit", kOSBooleanTrue);
+                dict->setObject("BrightnessTarget", target);
+                target->release();
+                break;
+            }
+            case 7: setNumber(dict, "RawBrightness", random.below(1001)); break;
+        }
+        UInt64 start = hostUptimeNS();
+        rig->panel->setProperties(dict);
+        samples.add(kEntryProperties, hostUptimeNS() - start);
+        dict->release();
+        pause(random, 20000);
+    }
+}
+
+// IODisplay -> IODisplayConnect -> IOFramebuffer, as HostRig::attachDisplay
+struct DisplayChain
+{
+    IOService* framebuffer;
+    IOService* connect;
+    IODisplay* display;
+};
+
+static DisplayChain newDisplay(HostRig* rig, Random& random)
+{
+    DisplayChain chain;
+    chain.framebuffer = new IOService;
+    chain.framebuffer->init();
+    chain.framebuffer->setName("IOFramebuffer");
+    if (random.below(2))
+    {
+        chain.framebuffer->setProperty("IOFBCurrentPixelClock", 148500000ULL + random.below(2) * 148500000ULL, 64);
+        chain.framebuffer->setProperty("IOFBCurrentPixelCount", 2475000ULL, 64);
+    }
+    chain.connect = new IOService;
+    chain.connect->init();
+    chain.connect->setName("IODisplayConnect");
+    chain.connect->attach(chain.framebuffer);
+    chain.display = new IODisplay;
+    chain.display->init();
+    chain.display->attach(chain.connect);
+    OSDictionary* params = rig->newParams();
+    chain.display->setProperty(gIODisplayParametersKey, params);
+    params->release();
+    return chain;
+}
+
+static void displayThread(HostRig* rig, UInt32 seed)
+{
+    Random random(seed);
+    std::vector<DisplayChain> chains;
+    for (int i = 0; i < 2; i++)
+        chains.push_back(newDisplay(rig, random));
+    while (running)
+    {
+        IODisplay* display = random.below(4) ? chains[random.below(2)].display : NULL;
+        UInt64 start = hostUptimeNS();
+        rig->panel->setDisplay(display);
+        samples.add(kEntryDisplay, hostUptimeNS() - start);
+        pause(random, 50000);
+    }
+    // chains stay alive until the panel has let go of them (after stop)
+    static std::mutex keepLock;
+    static std::vector<DisplayChain> keep;
+    std::lock_guard<std::mutex> guard(keepLock);
+    keep.insert(keep.end(), chains.begin(), chains.end());
+}
+
+static void powerThread(HostRig* rig, UInt32 seed)
+{
+    Random random(seed);
+    while (running)
+    {
+        UInt64 start = hostUptimeNS();
+        rig->sleep();
+        samples.add(kEntryPower, hostUptimeNS() - start);
+        pause(random, 30000);
+        start = hostUptimeNS();
+        rig->wake();
+        samples.add(kEntryPower, hostUptimeNS() - start);
+        pause(random, 300000);
+    }
+}
+
+////////////////////////////////////////////////////////////////
+// observer
+
+struct Findings
+{
+    UInt64 snapshots;
+    UInt64 range;           // a level outside 0..kBacklightLevelMax
+    UInt64 ahead;           // more requests applied than posted
+    UInt64 backwards;       // applied count went down
+};
+
+static void observerThread(HostRig* rig, Findings* findings)
+{
+    UInt32 lastApplied = 0;
+    while (running)
+    {
+        PanelState state;
+        rig->readState(&state);
+        UInt64 posted = rig->posted();
+        ++findings->snapshots;
+        if (state.target > 0x400 || state.current > 0x400 || state.committed > 0x400)
+            ++findings->range;
+        if (state.applied > posted)
+            ++findings->ahead;
+        if (state.applied < lastApplied)
+            ++findings->backwards;
+        lastApplied = state.applied;
+        std::this_thread::yield();
+    }
+}
+
+////////////////////////////////////////////////////////////////
+// report
+
+static double percentile(std::vector<UInt64>& v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return (double)v[(size_t)(p * (v.size() - 1))] / 1000.0;
+}
+
+static UInt64 number(OSDictionary* dict, const char* key)
+{
+    OSNumber* num = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : NULL;
+    return num ? num->unsigned64BitValue() : 0;
+}
+
+// kext histograms are power of two us buckets: upper edge of the bucket holding p
+static UInt64 histPercentile(OSArray* hist, double p, UInt64* count)
+{
+    *count = 0;
+    for (unsigned i = 0; hist && i < hist->getCount(); i++)
+        *count += OSDynamicCast(OSNumber, hist->getObject(i))->unsigned64BitValue();
+    UInt64 seen = 0;
+    for (unsigned i = 0; hist && i < hist->getCount(); i++)
+    {
+        seen += OSDynamicCast(OSNumber, hist->getObject(i))->unsigned64BitValue();
+        if (*count && seen >= (UInt64)(p * *count))
+            return 2ULL << i;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    bool verbose = false;
+    UInt32 seed = (UInt32)time(NULL);
+    int c;
+    while ((c = getopt(argc, argv, "t:n:l:s:v")) != -1)
+    {
+        switch (c)
+        {
+            case 't': runNS = (UInt64)(atof(optarg) * 1e9); break;
+            case 'n': threadsPerEntry = atoi(optarg); break;
+            case 'l': latencyUS = strtoull(optarg, NULL, 0); break;
+            case 's': seed = (UInt32)strtoul(optarg, NULL, 0); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: panelstress [-t seconds] [-n threads] [-l latency_us] [-s seed] [-v]\n");
+                return 2;
+        }
+    }
+    hostSetLogging(verbose);
+
+    HostRig rig;
+    rig.acpi->extended = true;
+    rig.acpi->hasSave = true;
+    rig.acpi->bcl.push_back(1000);
+    rig.acpi->bcl.push_back(500);
+    for (int i = 0; i <= 100; i++)
+        rig.acpi->bcl.push_back(i * 10);
+    rig.acpi->setInteger("XOPT", 0x08);
+    if (!rig.start(kInfoPlist))
+    {
+        fprintf(stderr, "panelstress: panel start failed\n");
+        return 1;
+    }
+    rig.attachDisplay();
+    rig.post(512);
+    rig.settle();
+    rig.acpi->setLatencyNS = rig.acpi->getLatencyNS = latencyUS * 1000;
+    rig.acpi->latencySleeps = true;
+
+    printf("%d thread(s) per entry point, %.1fs, _BCM/_BQC %lluus, seed %u\n",
+           threadsPerEntry, runNS / 1e9, latencyUS, seed);
+    HostGateStats lock0 = hostRecursiveLockStats();
+    HostGateStats gate0 = hostGateStats(rig.panel->getWorkLoop());
+    UInt64 signals0 = hostConcurrentSignals();
+    UInt64 overlapped0 = rig.acpi->overlapped;
+
+    Findings findings = { 0, 0, 0, 0 };
+    std::vector<std::thread> threads;
+    running = true;
+    Random seeds(seed);
+    for (int i = 0; i < threadsPerEntry; i++)
+    {
+        threads.push_back(std::thread(integerSetThread, &rig, seeds.next()));
+        threads.push_back(std::thread(propertiesThread, &rig, seeds.next()));
+        threads.push_back(std::thread(displayThread, &rig, seeds.next()));
+    }
+    threads.push_back(std::thread(powerThread, &rig, seeds.next()));
+    threads.push_back(std::thread(observerThread, &rig, &findings));
+    usleep((useconds_t)(runNS / 1000));
+    running = false;
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    // quiet now: everything applied, the hardware where the snapshot says
+    rig.acpi->setLatencyNS = rig.acpi->getLatencyNS = 0;
+    rig.panel->setDisplay(NULL);
+    bool settled = rig.settle(10000000000ULL);
+    PanelState state;
+    rig.readState(&state);
+    bool hardware = state.raw == rig.acpi->level;
+
+    printf("\n  %-16s %10s %10s %10s %10s %10s\n", "caller", "calls", "calls/s", "p50 us", "p99 us", "max us");
+    for (int e = 0; e < kEntryCount; e++)
+    {
+        std::vector<UInt64>& v = samples.latency[e];
+        printf("  %-16s %10zu %10.0f %10.1f %10.1f %10.1f\n", entryNames[e], v.size(), v.size() / (runNS / 1e9),
+               percentile(v, 0.5), percentile(v, 0.99), percentile(v, 1.0));
+    }
+
+    // the kext publishes site stats at most once a second, and on the next hold
+    IOSleep(1100);
+    rig.post(state.target);
+    rig.settle();
+    // copied: the workloop replaces (and frees) the published dictionaries as it runs
+    OSObject* sitesObj = rig.panel->copyProperty("Gate Stats");
+    OSDictionary* sites = OSDynamicCast(OSDictionary, sitesObj);
+    printf("\n  %-26s %10s %12s %12s %12s\n", "workloop site", "holds", "p99 hold us", "max hold us", "p99 wait us");
+    for (unsigned i = 0; sites && i < sites->getCount(); i++)
+    {
+        OSDictionary* site = OSDynamicCast(OSDictionary, sites->hostValue(i));
+        UInt64 holds, waits;
+        UInt64 hold = histPercentile(site ? OSDynamicCast(OSArray, site->getObject("Hold")) : NULL, 0.99, &holds);
+        UInt64 wait = histPercentile(site ? OSDynamicCast(OSArray, site->getObject("Wait")) : NULL, 0.99, &waits);
+        if (!holds)
+            continue;
+        printf("  %-26s %10llu %12llu %12llu %12s\n", sites->hostKey(i)->getCStringNoCopy(), holds, hold,
+               number(site, "Max Hold us"), waits ? std::to_string(wait).c_str() : "-");
+    }
+
+    OSSafeRelease(sitesObj);
+
+    HostGateStats gate = hostGateStats(rig.panel->getWorkLoop());
+    HostGateStats lock = hostRecursiveLockStats();
+    printf("\n  workloop gate: %llu acquisitions, %llu contended, %.1fms waited, max %.1fms\n",
+           gate.acquisitions - gate0.acquisitions, gate.contended - gate0.contended,
+           (gate.waitNS - gate0.waitNS) / 1e6, gate.maxWaitNS / 1e6);
+    printf("  recursive locks: %llu acquisitions, %llu contended\n",
+           lock.acquisitions - lock0.acquisitions, lock.contended - lock0.contended);
+    printf("  overlapping work source signals: %llu\n", hostConcurrentSignals() - signals0);
+    printf("  overlapping AML evaluations: %llu\n", (UInt64)rig.acpi->overlapped - overlapped0);
+
+    int failures = 0;
+    printf("\n  observer: %llu snapshots, %llu out of range, %llu applied ahead of posted, %llu applied went backwards\n",
+           findings.snapshots, findings.range, findings.ahead, findings.backwards);
+    failures += findings.range || findings.ahead || findings.backwards;
+    printf("  settled: %s, hardware at published raw: %s\n", settled ? "yes" : "NO", hardware ? "yes" : "NO");
+    failures += !settled || !hardware;
+
+    OSObject* violationsObj = rig.panel->copyProperty("Invariant Violations");
+    OSDictionary* violations = OSDynamicCast(OSDictionary, violationsObj);
+    printf("  Invariant Violations:");
+    for (unsigned i = 0; violations && i < violations->getCount(); i++)
+    {
+        UInt64 count = OSDynamicCast(OSNumber, violations->hostValue(i))->unsigned64BitValue();
+        printf(" %s %llu%s", violations->hostKey(i)->getCStringNoCopy(), count, i + 1 < violations->getCount() ? "," : "");
+        failures += count != 0;
+    }
+    printf("%s\n", violations ? "" : " none published");
+    failures += !violations;
+    OSSafeRelease(violationsObj);
+
+    rig.stop();
+    if (failures)
+        printf("\nFAILED\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,356 @@
+//
+//  smoothopt.cpp
+//  ACPIBacklight
+//
+//  Host tool to search SmoothDelta%d/SmoothStep%d/SmoothTimeout%d for a given
+//  _BCL table.  Each candidate is run through the kext itself: the real panel
+//  over a PNLF with the given _BCL and _BCM cost, the tiers set with
+//  setProperties, and test transitions posted the way IODisplay does.  Uptime
+//  is virtual, so a transition of seconds takes no longer than the kext's own
+//  code, and every write is timestamped where the mock _BCM/XBCM completes.
+//  The Pareto set over (transition time, hardware writes, largest raw jump
+//  within one frame) is printed as ioio commands, one block per candidate,
+//  ready to paste into a shell.
+//
+//  The tiers only time profiles whose Profile%sUp/Down are 0 (Restore, by
+//  default).  The candidates are run on the Key profile with its timing set to
+//  0, so the tiers time it.  The other profiles keep their own timing (read
+//  from the panel) and take only the tick (SmoothTimeout0, unless frame
+//  paced) from the tiers; each candidate lists what they come out as with it.
+//
+//  Build: make smoothopt
+//  Usage: smoothopt [-e] [-E easing] [-p] [-l latency_us] [-f frame_us] [-v] bcl0,bcl1,...
+//      -e  panel uses XBCM/XBQC (extended, "in between" levels)
+//      -E  SmoothEasing: 0 linear (default), 1 ease-in-out, 2 exponential
+//      -p  SmoothPacing 1: tick is the frame, points aligned to the frame grid
+//      -l  cost of one backend write (see "Backend Probe" in ioreg)
+//      -f  frame period in us (default 16667)
+//      bcl is the complete _BCL package, including the AC/battery entries
+//
+
+#include "hostrig.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+#define kInfoPlist "ACPIBacklight/ACPIBacklight-Info.plist"
+#define kLevelMax 0x400         // IODisplay brightness range
+#define kTiers 3
+#define kEasingDefault 0xFF     // profile follows SmoothEasing
+
+struct Tier
+{
+    int delta;
+    int step;
+    int timeout;
+};
+
+struct Candidate
+{
+    Tier tiers[kTiers];
+    UInt64 duration;    // us, worst case over the test transitions
+    unsigned writes;    // total over the test transitions
+    unsigned jump;      // largest raw change landing in one frame
+};
+
+struct Profile
+{
+    std::string name;
+    UInt32 up, down, min, easing;
+};
+
+class TimedPNLF : public HostACPIDevice
+{
+public:
+    std::mutex lock;
+    std::vector<std::pair<UInt32, UInt64> > writes;  // raw, uptime
+
+    virtual void levelWritten(UInt32 raw, UInt64 when)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        writes.push_back(std::make_pair(raw, when));
+    }
+};
+
+static HostRig* rig;
+static TimedPNLF* pnlf;
+static UInt64 frameNS = 16667000;
+
+static void setNumber(OSDictionary* dict, const char* key, UInt32 value)
+{
+    OSNumber* num = OSNumber::withNumber(value, 32);
+    dict->setObject(key, num);
+    num->release();
+}
+
+static UInt32 getNumber(OSDictionary* dict, const char* key)
+{
+    OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(key));
+    return num ? num->unsigned32BitValue() : 0;
+}
+
+// the panel's profiles, as published at start (Profile%sUp/Down/Min/Easing)
+static std::vector<Profile> readProfiles()
+{
+    std::vector<Profile> profiles;
+    OSDictionary* props = rig->panel->dictionaryWithProperties();
+    for (unsigned i = 0; i < props->getCount(); i++)
+    {
+        std::string key = props->hostKey(i)->getCStringNoCopy();
+        if (key.size() <= 9 || key.compare(0, 7, "Profile") || key.compare(key.size() - 2, 2, "Up"))
+            continue;
+        Profile p;
+        p.name = key.substr(7, key.size() - 9);
+        p.up = getNumber(props, key.c_str());
+        p.down = getNumber(props, ("Profile" + p.name + "Down").c_str());
+        p.min = getNumber(props, ("Profile" + p.name + "Min").c_str());
+        p.easing = getNumber(props, ("Profile" + p.name + "Easing").c_str());
+        profiles.push_back(p);
+    }
+    props->release();
+    return profiles;
+}
+
+// tiers, and the timing of the Key profile (what isolated requests use)
+static void configure(const Tier* tiers, const Profile& key)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(16);
+    char buf[32];
+    for (int t = 0; t < kTiers; t++)
+    {
+        snprintf(buf, sizeof(buf), "SmoothDelta%d", t);
+        setNumber(dict, buf, tiers[t].delta);
+        snprintf(buf, sizeof(buf), "SmoothStep%d", t);
+        setNumber(dict, buf, tiers[t].step);
+        snprintf(buf, sizeof(buf), "SmoothTimeout%d", t);
+        setNumber(dict, buf, tiers[t].timeout);
+    }
+    setNumber(dict, "ProfileKeyUp", key.up);
+    setNumber(dict, "ProfileKeyDown", key.down);
+    setNumber(dict, "ProfileKeyMin", key.min);
+    setNumber(dict, "ProfileKeyEasing", key.easing);
+    rig->panel->setProperties(dict);
+    dict->release();
+}
+
+// key press (1/16 of range), half range, full range; both directions
+static const int transitions[][2] =
+{
+    { 0x200, 0x240 }, { 0x240, 0x200 },
+    { 0x100, 0x300 }, { 0x300, 0x100 },
+    { 0, kLevelMax }, { kLevelMax, 0 },
+};
+
+static void evaluate(Candidate* c)
+{
+    c->duration = 0;
+    c->writes = 0;
+    c->jump = 0;
+    for (size_t i = 0; i < sizeof(transitions)/sizeof(transitions[0]); i++)
+    {
+        int from = transitions[i][0], to = transitions[i][1];
+        PanelState state;
+        rig->readState(&state);
+        if ((int)state.target != from)
+        {
+            rig->post(from);
+            rig->settle(60000000000ULL);
+        }
+
+        // an isolated request (not a slider drag) at an arbitrary point in a frame
+        UInt64 now = hostUptimeNS() + 1000000000ULL;
+        hostAdvanceClock((now / frameNS + 1) * frameNS + frameNS / 3 - hostUptimeNS());
+        {
+            std::lock_guard<std::mutex> guard(pnlf->lock);
+            pnlf->writes.clear();
+        }
+        UInt64 start = hostUptimeNS();
+        rig->post(to);
+        rig->settle(60000000000ULL);
+
+        std::lock_guard<std::mutex> guard(pnlf->lock);
+        const std::vector<std::pair<UInt32, UInt64> >& w = pnlf->writes;
+        // writes completing in the same frame show as one jump
+        UInt64 lastFrame = 0;
+        unsigned inFrame = 0;
+        UInt32 lastRaw = 0;
+        for (size_t j = 0; j < w.size(); j++)
+        {
+            if (j)
+            {
+                unsigned change = w[j].first > lastRaw ? w[j].first - lastRaw : lastRaw - w[j].first;
+                inFrame = w[j].second / frameNS == lastFrame ? inFrame + change : change;
+                c->jump = std::max(c->jump, inFrame);
+            }
+            lastRaw = w[j].first;
+            lastFrame = w[j].second / frameNS;
+        }
+        c->writes += (unsigned)w.size();
+        if (!w.empty())
+            c->duration = std::max(c->duration, (w.back().second - start) / 1000);
+    }
+}
+
+static bool dominates(const Candidate& a, const Candidate& b)
+{
+    if (a.duration > b.duration || a.writes > b.writes || a.jump > b.jump)
+        return false;
+    return a.duration < b.duration || a.writes < b.writes || a.jump < b.jump;
+}
+
+static bool byDuration(const Candidate& a, const Candidate& b)
+{
+    if (a.duration != b.duration)
+        return a.duration < b.duration;
+    if (a.writes != b.writes)
+        return a.writes < b.writes;
+    return a.jump < b.jump;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: smoothopt [-e] [-E easing] [-p] [-l latency_us] [-f frame_us] [-v] bcl0,bcl1,...\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    bool extended = false, pacing = false, verbose = false;
+    UInt32 easing = 0;
+    UInt64 latencyUS = 0, frameUS = 16667;
+    int c;
+    while ((c = getopt(argc, argv, "eE:pl:f:v")) != -1)
+    {
+        switch (c)
+        {
+            case 'e': extended = true; break;
+            case 'E': easing = (UInt32)strtoul(optarg, NULL, 0); break;
+            case 'p': pacing = true; break;
+            case 'l': latencyUS = strtoull(optarg, NULL, 0); break;
+            case 'f': frameUS = strtoull(optarg, NULL, 0); break;
+            case 'v': verbose = true; break;
+            default: usage();
+        }
+    }
+    if (optind + 1 != argc || !frameUS || easing > 2)
+        usage();
+    hostSetLogging(verbose);
+    frameNS = frameUS * 1000;
+
+    std::vector<UInt32> bcl;
+    for (const char* p = argv[optind]; *p; )
+    {
+        char* end;
+        bcl.push_back((UInt32)strtoul(p, &end, 0));
+        p = *end ? end+1 : end;
+    }
+    if (bcl.size() < 3)
+    {
+        fprintf(stderr, "smoothopt: _BCL needs at least 3 entries\n");
+        return 1;
+    }
+
+    pnlf = new TimedPNLF;
+    rig = new HostRig(pnlf);
+    rig->acpi->extended = extended;
+    rig->acpi->bcl = bcl;
+    rig->acpi->setInteger("XOPT", 0x08);   // smoothing on, no backend probe against a handler
+    rig->acpi->setLatencyNS = latencyUS * 1000;
+    OSDictionary* properties = OSDictionary::withCapacity(3);
+    setNumber(properties, "SmoothEasing", easing);
+    setNumber(properties, "SmoothPacing", pacing ? 1 : 0);
+    setNumber(properties, "FramePeriod", (UInt32)frameUS);
+    bool started = rig->start(kInfoPlist, properties);
+    properties->release();
+    if (!started)
+    {
+        fprintf(stderr, "smoothopt: panel start failed\n");
+        return 1;
+    }
+    rig->attachDisplay();
+    std::vector<Profile> profiles = readProfiles();
+    // from here on transitions run on virtual time
+    hostUseVirtualClock(true);
+
+    static const int deltas0[] = { 0x10, 0x20 };
+    static const int deltas1[] = { 0x40, 0x80 };
+    static const int steps0[] = { 1, 2 };
+    static const int steps1[] = { 2, 4, 8 };
+    static const int steps2[] = { 8, 16, 32, 64 };
+    static const int timeouts[] = { 5000, 8333, 10000, 16667, 20000, 33333 };
+    #define count(x) (sizeof(x)/sizeof(x[0]))
+
+    Profile tiered = { "Key", 0, 0, 0, kEasingDefault };
+    std::vector<Candidate> candidates;
+    for (size_t d0 = 0; d0 < count(deltas0); d0++)
+    for (size_t d1 = 0; d1 < count(deltas1); d1++)
+    for (size_t s0 = 0; s0 < count(steps0); s0++)
+    for (size_t s1 = 0; s1 < count(steps1); s1++)
+    for (size_t s2 = 0; s2 < count(steps2); s2++)
+    for (size_t t0 = 0; t0 < count(timeouts); t0++)
+    for (size_t t1 = 0; t1 < count(timeouts); t1++)
+    for (size_t t2 = 0; t2 < count(timeouts); t2++)
+    {
+        Candidate c;
+        Tier tiers[kTiers] =
+        {
+            { deltas0[d0], steps0[s0], timeouts[t0] },
+            { deltas1[d1], steps1[s1], timeouts[t1] },
+            { 0xFFFF, steps2[s2], timeouts[t2] },
+        };
+        memcpy(c.tiers, tiers, sizeof(tiers));
+        configure(c.tiers, tiered);
+        evaluate(&c);
+        candidates.push_back(c);
+    }
+
+    // sorted by duration, a candidate can only be dominated by an earlier one
+    std::sort(candidates.begin(), candidates.end(), byDuration);
+    std::vector<Candidate> pareto;
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        const Candidate& c = candidates[i];
+        bool dominated = false;
+        for (size_t j = 0; j < pareto.size() && !dominated; j++)
+            dominated = dominates(pareto[j], c) ||
+                (pareto[j].duration == c.duration && pareto[j].writes == c.writes && pareto[j].jump == c.jump);
+        if (!dominated)
+            pareto.push_back(c);
+    }
+
+    static const char* easings[] = { "linear", "ease-in-out", "exponential" };
+    printf("# %u _BCL entries (%s), write %lluus, frame %lluus, %s, %s paced: %u candidates, %u on Pareto front\n",
+           (unsigned)bcl.size() - 2, extended ? "extended" : "_BCM", latencyUS, frameUS, easings[easing],
+           pacing ? "frame" : "timer", (unsigned)candidates.size(), (unsigned)pareto.size());
+    printf("# tiers time only profiles with Profile%%sUp/Down 0 (by default Restore);\n"
+           "# the others keep their own timing and take only the tick from the tiers\n");
+    for (size_t i = 0; i < pareto.size(); i++)
+    {
+        const Candidate& c = pareto[i];
+        printf("# worst %llums, %u writes, max jump %u/frame\n", c.duration / 1000, c.writes, c.jump);
+        for (size_t p = 0; p < profiles.size(); p++)
+        {
+            if (!profiles[p].up && !profiles[p].down)
+                continue;
+            Candidate r;
+            configure(c.tiers, profiles[p]);
+            evaluate(&r);
+            printf("#   %-8s worst %llums, %u writes, max jump %u/frame\n", profiles[p].name.c_str(), r.duration / 1000, r.writes, r.jump);
+        }
+        for (int t = 0; t < kTiers; t++)
+        {
+            printf("ioio -s ACPIBacklightPanel SmoothDelta%d %d\n", t, c.tiers[t].delta);
+            printf("ioio -s ACPIBacklightPanel SmoothStep%d %d\n", t, c.tiers[t].step);
+            printf("ioio -s ACPIBacklightPanel SmoothTimeout%d %d\n", t, c.tiers[t].timeout);
+        }
+    }
+
+    configure(pareto.empty() ? candidates[0].tiers : pareto[0].tiers, tiered);
+    rig->stop();
+    delete rig;
+    hostUseVirtualClock(false);
+    return 0;
+}